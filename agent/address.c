@@ -284,6 +284,26 @@ xice_address_equal (const XiceAddress *a, const XiceAddress *b)
 }
 
 
+XICEAPI_EXPORT guint
+xice_address_hash (const XiceAddress *addr)
+{
+  const guint32 *ip6;
+
+  switch (addr->s.addr.sa_family)
+    {
+    case AF_INET:
+      return addr->s.ip4.sin_addr.s_addr * 31 + addr->s.ip4.sin_port;
+
+    case AF_INET6:
+      ip6 = (const guint32 *) &addr->s.ip6.sin6_addr;
+      return (ip6[0] ^ ip6[1] ^ ip6[2] ^ ip6[3]) * 31 +
+          addr->s.ip6.sin6_port + addr->s.ip6.sin6_scope_id;
+    }
+
+  return 0;
+}
+
+
 XICEAPI_EXPORT XiceAddress *
 xice_address_dup (const XiceAddress *a)
 {
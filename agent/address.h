@@ -241,6 +241,18 @@ xice_address_copy_to_sockaddr (const XiceAddress *addr, struct sockaddr *sin);
 gboolean
 xice_address_equal (const XiceAddress *a, const XiceAddress *b);
 
+/**
+ * xice_address_hash:
+ * @addr: The #XiceAddress to hash
+ *
+ * Hashes what xice_address_equal() compares, so that #XiceAddress can key a
+ * #GHashTable, without formatting the address as a string on every lookup
+ *
+ * Returns: The hash of @addr
+ */
+guint
+xice_address_hash (const XiceAddress *addr);
+
 /**
  * xice_address_to_string:
  * @addr: The #XiceAddress to query
@@ -110,7 +110,6 @@ struct _XiceAgent
   XiceTimer *conncheck_timer_source;
   XiceTimer *keepalive_timer_source;
 
-  GSList *refresh_list;         /* list of CandidateRefresh items */
   guint64 tie_breaker;            /* tie breaker (ICE sect 5.2
 				     "Determining Role" ID-19) */
   XiceCompatibility compatibility; /* property: Compatibility mode */
@@ -119,6 +118,13 @@ struct _XiceAgent
 
   gchar *software_attribute;       /* SOFTWARE attribute */
   gboolean reliable;               /* property: reliable */
+  guint reliable_sndbuf;           /* property: reliable-send-buffer-size */
+  guint reliable_rcvbuf;           /* property: reliable-receive-buffer-size */
+  gboolean reliable_pacing;        /* property: reliable-pacing */
+  guint turn_queue_size;           /* property: turn-queue-size */
+  XiceTurnQueueDropPolicy turn_queue_drop_policy; /* property: turn-queue-drop-policy */
+  guint turn_race_delay;           /* property: turn-race-delay */
+  XiceTurnPool *turn_pool;         /* allocations to relay from */
   /* XXX: add pointer to internal data struct for ABI-safe extensions */
 };
 
@@ -163,11 +169,21 @@ guint64 agent_candidate_pair_priority (XiceAgent *agent, XiceCandidate *local, X
 
 XiceTimer *agent_timeout_add_with_context (XiceAgent *agent, guint interval, XiceTimerFunc function, gpointer data);
 
+/* an allocation of a #XiceTurnPool, taken over by an agent */
+typedef struct _TurnPoolAllocation TurnPoolAllocation;
+
+TurnPoolAllocation *turn_pool_claim (XiceTurnPool *pool, XiceAgent *agent, Stream *stream, Component *component, TurnServer *turn);
+void turn_pool_adopt (TurnPoolAllocation *alloc);
+void turn_pool_release (TurnPoolAllocation *alloc);
+
 void agent_attach_stream_component_socket (XiceAgent *agent,
     Stream *stream,
     Component *component,
     XiceSocket *socket);
 
+void agent_detach_stream_component_socket (Component *component,
+    XiceSocket *socket);
+
 StunUsageIceCompatibility agent_to_ice_compatibility (XiceAgent *agent);
 StunUsageTurnCompatibility agent_to_turn_compatibility (XiceAgent *agent);
 XiceTurnSocketCompatibility agent_to_turn_socket_compatibility (XiceAgent *agent);
@@ -83,6 +83,7 @@
 #define DEFAULT_STUN_PORT  3478
 
 #define MAX_TCP_MTU 1400 /* Use 1400 because of VPNs and we assume IEE 802.3 */
+#define MIN_TCP_MTU 1280 /* The IPv6 minimum, to start from when probing */
 
 G_DEFINE_TYPE (XiceAgent, xice_agent, G_TYPE_OBJECT);
 
@@ -101,7 +102,14 @@ enum
   PROP_PROXY_PORT,
   PROP_PROXY_USERNAME,
   PROP_PROXY_PASSWORD,
-  PROP_RELIABLE
+  PROP_RELIABLE,
+  PROP_RELIABLE_SEND_BUFFER_SIZE,
+  PROP_RELIABLE_RECEIVE_BUFFER_SIZE,
+  PROP_RELIABLE_PACING,
+  PROP_PATH_MTU,
+  PROP_TURN_QUEUE_SIZE,
+  PROP_TURN_QUEUE_DROP_POLICY,
+  PROP_TURN_RACE_DELAY
 };
 
 
@@ -114,6 +122,9 @@ enum
   SIGNAL_NEW_REMOTE_CANDIDATE,
   SIGNAL_INITIAL_BINDING_REQUEST_RECEIVED,
   SIGNAL_RELIABLE_TRANSPORT_WRITABLE,
+  SIGNAL_RELIABLE_CHANNEL_WRITABLE,
+  SIGNAL_RELIABLE_CHANNEL_CLOSED,
+  SIGNAL_TRANSPORT_WRITABLE,
   N_SIGNALS,
 };
 
@@ -455,6 +466,140 @@ xice_agent_class_init (XiceAgentClass *klass)
 	FALSE,
         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 
+  /**
+   * XiceAgent:reliable-send-buffer-size:
+   *
+   * Size in bytes of the PseudoTcp send buffer of the components of streams
+   * added from now on, or 0 for the default
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class,
+      PROP_RELIABLE_SEND_BUFFER_SIZE,
+      g_param_spec_uint (
+        "reliable-send-buffer-size",
+        "Reliable send buffer size",
+        "Size of the PseudoTcp send buffer in reliable mode, 0 for the default",
+        0, G_MAXUINT32,
+	0,
+        G_PARAM_READWRITE));
+
+  /**
+   * XiceAgent:reliable-receive-buffer-size:
+   *
+   * Size in bytes of the PseudoTcp receive buffer of the components of
+   * streams added from now on, or 0 for the default. Sizes of 64 KB or more
+   * are only used in full if the peer supports window scaling.
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class,
+      PROP_RELIABLE_RECEIVE_BUFFER_SIZE,
+      g_param_spec_uint (
+        "reliable-receive-buffer-size",
+        "Reliable receive buffer size",
+        "Size of the PseudoTcp receive buffer in reliable mode, 0 for the "
+        "default",
+        0, G_MAXUINT32,
+	0,
+        G_PARAM_READWRITE));
+
+  /**
+   * XiceAgent:reliable-pacing:
+   *
+   * Whether the PseudoTcp sockets of the components of streams added from
+   * now on spread their segments over the round trip time, rather than
+   * sending a whole window to the socket at once
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class, PROP_RELIABLE_PACING,
+      g_param_spec_boolean (
+        "reliable-pacing",
+        "Reliable pacing",
+        "Whether to pace the PseudoTcp segments in reliable mode",
+	FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * XiceAgent:path-mtu:
+   *
+   * The smallest path MTU discovered by the PseudoTcp sockets of the
+   * components in reliable mode, IP and UDP headers included, or 0 while
+   * none is connected. Non-reliable components have no acknowledged data
+   * to probe the path with and are not counted. Probing stops at 1400 bytes,
+   * which is assumed to go through VPNs unfragmented.
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class, PROP_PATH_MTU,
+      g_param_spec_uint (
+        "path-mtu",
+        "Path MTU",
+        "The smallest path MTU of the reliable components, 0 if unknown",
+        0, G_MAXUINT32,
+	0,
+        G_PARAM_READABLE));
+
+  /**
+   * XiceAgent:turn-queue-size:
+   *
+   * Bytes a TURN relay allocated from now on queues for each peer while the
+   * permission for that peer is being installed, or 0 for the default of
+   * 64 KB. What does not fit is dropped as #XiceAgent:turn-queue-drop-policy
+   * says.
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class, PROP_TURN_QUEUE_SIZE,
+      g_param_spec_uint (
+        "turn-queue-size",
+        "TURN queue size",
+        "Bytes queued for each peer waiting for a TURN permission, 0 for the "
+        "default",
+        0, G_MAXUINT32,
+	0,
+        G_PARAM_READWRITE));
+
+  /**
+   * XiceAgent:turn-queue-drop-policy:
+   *
+   * The #XiceTurnQueueDropPolicy of the TURN relays allocated from now on
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class,
+      PROP_TURN_QUEUE_DROP_POLICY,
+      g_param_spec_uint (
+        "turn-queue-drop-policy",
+        "TURN queue drop policy",
+        "What to drop when a TURN permission queue is full",
+        XICE_TURN_QUEUE_DROP_NEWEST, XICE_TURN_QUEUE_DROP_OLDEST,
+	XICE_TURN_QUEUE_DROP_NEWEST,
+        G_PARAM_READWRITE));
+
+  /**
+   * XiceAgent:turn-race-delay:
+   *
+   * When not 0, the relays of a component race each other while gathering:
+   * those over TCP and TLS start this many milliseconds after those over
+   * UDP, or as soon as these have all failed, and the ones still going are
+   * cancelled once the component has a relayed candidate. UDP relays are
+   * left to finish, and rank above the others. When 0, all the relays are
+   * gathered at once.
+   *
+   * Since: 0.1.4
+   */
+   g_object_class_install_property (gobject_class, PROP_TURN_RACE_DELAY,
+      g_param_spec_uint (
+        "turn-race-delay",
+        "TURN race delay",
+        "Milliseconds TCP and TLS relays wait for UDP ones, 0 to not race "
+        "them",
+        0, G_MAXUINT32,
+	0,
+        G_PARAM_READWRITE));
+
   /* install signals */
 
   /**
@@ -480,6 +625,34 @@ xice_agent_class_init (XiceAgentClass *klass)
           G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT,
           G_TYPE_INVALID);
 
+  /**
+   * XiceAgent::transport-writable
+   * @agent: The #XiceAgent object
+   * @stream_id: The ID of the stream
+   * @component_id: The ID of the component
+   *
+   * This signal is fired on a non-reliable #XiceAgent when xice_agent_send()
+   * may be called again, after it returned -1 because the data waiting for a
+   * TURN permission had reached #XiceAgent:turn-queue-size. With
+   * %XICE_TURN_QUEUE_DROP_OLDEST, it is fired once a queue that dropped
+   * older data to make room has drained.
+   *
+   * Since: 0.1.4
+   */
+  signals[SIGNAL_TRANSPORT_WRITABLE] =
+      g_signal_new (
+          "transport-writable",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL,
+          NULL,
+          agent_marshal_VOID__UINT_UINT,
+          G_TYPE_NONE,
+          2,
+          G_TYPE_UINT, G_TYPE_UINT,
+          G_TYPE_INVALID);
+
   /**
    * XiceAgent::candidate-gathering-done:
    * @agent: The #XiceAgent object
@@ -624,6 +797,66 @@ xice_agent_class_init (XiceAgentClass *klass)
           G_TYPE_UINT, G_TYPE_UINT,
           G_TYPE_INVALID);
 
+  /**
+   * XiceAgent::reliable-channel-writable
+   * @agent: The #XiceAgent object
+   * @stream_id: The ID of the stream
+   * @component_id: The ID of the component
+   * @channel_id: The ID of the channel
+   *
+   * This signal is fired on the reliable #XiceAgent when a channel added with
+   * xice_agent_add_reliable_channel() becomes writable: once when the channel
+   * is established, and after xice_agent_send_channel() returned less bytes
+   * than requested to send (or -1).
+   *
+   * Since: 0.1.4
+   */
+  signals[SIGNAL_RELIABLE_CHANNEL_WRITABLE] =
+      g_signal_new (
+          "reliable-channel-writable",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL,
+          NULL,
+          agent_marshal_VOID__UINT_UINT_UINT,
+          G_TYPE_NONE,
+          3,
+          G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT,
+          G_TYPE_INVALID);
+
+  /**
+   * XiceAgent::reliable-channel-closed
+   * @agent: The #XiceAgent object
+   * @stream_id: The ID of the stream
+   * @component_id: The ID of the component
+   * @channel_id: The ID of the channel
+   * @error: 0 if the peer removed its channel, or the error that closed it:
+   * ECONNRESET when reset by the peer, ECONNABORTED when the peer stopped
+   * answering
+   *
+   * This signal is fired on the reliable #XiceAgent when a channel added with
+   * xice_agent_add_reliable_channel() closes without having been removed.
+   * The data received before can still be read, nothing can be sent on it
+   * anymore. The application removes it with
+   * xice_agent_remove_reliable_channel().
+   *
+   * Since: 0.1.4
+   */
+  signals[SIGNAL_RELIABLE_CHANNEL_CLOSED] =
+      g_signal_new (
+          "reliable-channel-closed",
+          G_OBJECT_CLASS_TYPE (klass),
+          G_SIGNAL_RUN_LAST,
+          0,
+          NULL,
+          NULL,
+          agent_marshal_VOID__UINT_UINT_UINT_UINT,
+          G_TYPE_NONE,
+          4,
+          G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT,
+          G_TYPE_INVALID);
+
 
   /* Init debug options depending on env variables */
   xice_debug_init ();
@@ -650,7 +883,6 @@ xice_agent_init (XiceAgent *agent)
   agent->discovery_timer_source = NULL;
   agent->conncheck_timer_source = NULL;
   agent->keepalive_timer_source = NULL;
-  agent->refresh_list = NULL;
   agent->media_after_tick = FALSE;
   agent->software_attribute = NULL;
 
@@ -763,6 +995,48 @@ xice_agent_get_property (
       g_value_set_boolean (value, agent->reliable);
       break;
 
+    case PROP_RELIABLE_SEND_BUFFER_SIZE:
+      g_value_set_uint (value, agent->reliable_sndbuf);
+      break;
+
+    case PROP_RELIABLE_RECEIVE_BUFFER_SIZE:
+      g_value_set_uint (value, agent->reliable_rcvbuf);
+      break;
+
+    case PROP_RELIABLE_PACING:
+      g_value_set_boolean (value, agent->reliable_pacing);
+      break;
+
+    case PROP_TURN_QUEUE_SIZE:
+      g_value_set_uint (value, agent->turn_queue_size);
+      break;
+
+    case PROP_TURN_QUEUE_DROP_POLICY:
+      g_value_set_uint (value, agent->turn_queue_drop_policy);
+      break;
+
+    case PROP_TURN_RACE_DELAY:
+      g_value_set_uint (value, agent->turn_race_delay);
+      break;
+
+    case PROP_PATH_MTU:
+      {
+        GSList *i, *j;
+        guint mtu = 0;
+
+        for (i = agent->streams; i; i = i->next) {
+          Stream *stream = i->data;
+          for (j = stream->components; j; j = j->next) {
+            Component *component = j->data;
+            if (component->tcp_mtu != 0 &&
+                (mtu == 0 || component->tcp_mtu < mtu))
+              mtu = component->tcp_mtu;
+          }
+        }
+        g_value_set_uint (value, mtu);
+      }
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -881,6 +1155,30 @@ xice_agent_set_property (
       agent->reliable = g_value_get_boolean (value);
       break;
 
+    case PROP_RELIABLE_SEND_BUFFER_SIZE:
+      agent->reliable_sndbuf = g_value_get_uint (value);
+      break;
+
+    case PROP_RELIABLE_RECEIVE_BUFFER_SIZE:
+      agent->reliable_rcvbuf = g_value_get_uint (value);
+      break;
+
+    case PROP_RELIABLE_PACING:
+      agent->reliable_pacing = g_value_get_boolean (value);
+      break;
+
+    case PROP_TURN_QUEUE_SIZE:
+      agent->turn_queue_size = g_value_get_uint (value);
+      break;
+
+    case PROP_TURN_QUEUE_DROP_POLICY:
+      agent->turn_queue_drop_policy = g_value_get_uint (value);
+      break;
+
+    case PROP_TURN_RACE_DELAY:
+      agent->turn_race_delay = g_value_get_uint (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -895,7 +1193,9 @@ static void priv_destroy_component_tcp (Component *component)
     if (component->tcp_clock) {
       xice_timer_destroy (component->tcp_clock);
       component->tcp_clock = NULL;
+      component->tcp_clock_deadline = 0;
     }
+    component->tcp_mtu = 0;
     if (component->tcp) {
       pseudo_tcp_socket_close (component->tcp, TRUE);
       g_object_unref (component->tcp);
@@ -905,6 +1205,9 @@ static void priv_destroy_component_tcp (Component *component)
       g_slice_free (TcpUserData, component->tcp_data);
       component->tcp_data = NULL;
     }
+    g_slist_free_full (component->tcp_channels,
+        (GDestroyNotify) component_free_tcp_channel);
+    component->tcp_channels = NULL;
 }
 
 static void priv_pseudo_tcp_error (XiceAgent *agent, Stream *stream,
@@ -921,6 +1224,12 @@ static void priv_pseudo_tcp_error (XiceAgent *agent, Stream *stream,
 static void
 adjust_tcp_clock (XiceAgent *agent, Stream *stream, Component *component);
 
+static void
+adjust_channel_clock (XiceAgent *agent, TcpChannel *channel);
+
+static gboolean
+priv_channel_done (TcpChannel *channel);
+
 
 static void
 pseudo_tcp_socket_opened (PseudoTcpSocket *sock, gpointer user_data)
@@ -932,8 +1241,12 @@ pseudo_tcp_socket_opened (PseudoTcpSocket *sock, gpointer user_data)
 
   xice_debug ("Agent %p: s%d:%d pseudo Tcp socket Opened", data->agent,
       stream->id, component->id);
-  g_signal_emit (agent, signals[SIGNAL_RELIABLE_TRANSPORT_WRITABLE], 0,
-      stream->id, component->id);
+  if (data->channel == NULL)
+    g_signal_emit (agent, signals[SIGNAL_RELIABLE_TRANSPORT_WRITABLE], 0,
+        stream->id, component->id);
+  else if (!data->channel->removed)
+    g_signal_emit (agent, signals[SIGNAL_RELIABLE_CHANNEL_WRITABLE], 0,
+        stream->id, component->id, data->channel->id);
 }
 
 static void
@@ -943,48 +1256,66 @@ pseudo_tcp_socket_readable (PseudoTcpSocket *sock, gpointer user_data)
   XiceAgent *agent = data->agent;
   Component *component = data->component;
   Stream *stream = data->stream;
-  gchar buf[MAX_BUFFER_SIZE];
-  gint len;
+  TcpChannel *channel = data->channel;
+  gboolean *readable = channel ? &channel->tcp_readable :
+      &component->tcp_readable;
+  const gchar *buf;
+  gsize len;
 
   xice_debug ("Agent %p: s%d:%d pseudo Tcp socket readable", agent,
       stream->id, component->id);
 
-  component->tcp_readable = TRUE;
+  /* A removed channel only finishes sending */
+  if (channel && channel->removed)
+    return;
+
+  *readable = TRUE;
 
   g_object_add_weak_pointer (G_OBJECT (sock), (gpointer *)&sock);
   g_object_add_weak_pointer (G_OBJECT (agent), (gpointer *)&agent);
 
+  /* The data is handed to the application in place, and only consumed
+   * once the callback returns */
   do {
-    if (component->g_source_io_cb)
-      len = pseudo_tcp_socket_recv (sock, buf, sizeof(buf));
+    XiceAgentRecvFunc callback = channel ? channel->recv_cb :
+        component->g_source_io_cb;
+
+    if (callback)
+      buf = pseudo_tcp_socket_peek (sock, &len);
     else
-      len = 0;
+      break;
 
-    if (len > 0) {
-      gpointer data = component->data;
+    if (buf != NULL) {
+      gpointer data = channel ? channel->recv_data : component->data;
       gint sid = stream->id;
       gint cid = component->id;
-      XiceAgentRecvFunc callback = component->g_source_io_cb;
-      /* Unlock the agent before calling the callback */
+      /* Unlock the agent before calling the callback, keeping the socket
+       * and so the data alive until it is consumed */
+      g_object_ref (sock);
       agent_unlock();
-      callback (agent, sid, cid, len, buf, data);
+      callback (agent, sid, cid, len, (gchar *) buf, data);
       agent_lock();
+      g_object_unref (sock);
       if (sock == NULL) {
         xice_debug ("PseudoTCP socket got destroyed in readable callback!");
         break;
       }
-    } else if (len < 0 &&
-        pseudo_tcp_socket_get_error (sock) != EWOULDBLOCK) {
-      /* Signal error */
-      priv_pseudo_tcp_error (agent, stream, component);
-    } else if (len < 0 &&
-        pseudo_tcp_socket_get_error (sock) == EWOULDBLOCK){
-      component->tcp_readable = FALSE;
+      pseudo_tcp_socket_consume (sock, len);
+    } else if (pseudo_tcp_socket_get_error (sock) != EWOULDBLOCK) {
+      /* Signal error, a closed channel is reported by its clock */
+      if (channel == NULL)
+        priv_pseudo_tcp_error (agent, stream, component);
+    } else {
+      *readable = FALSE;
     }
-  } while (len > 0);
+  } while (buf != NULL);
 
   if (agent) {
-    adjust_tcp_clock (agent, stream, component);
+    /* A channel removed by the callback took its socket along */
+    if (channel == NULL)
+      adjust_tcp_clock (agent, stream, component);
+    else if (sock != NULL)
+      adjust_channel_clock (agent, channel);
     g_object_remove_weak_pointer (G_OBJECT (agent), (gpointer *)&agent);
   } else {
     xice_debug ("Not calling adjust_tcp_clock.. agent got destroyed!");
@@ -1003,8 +1334,12 @@ pseudo_tcp_socket_writable (PseudoTcpSocket *sock, gpointer user_data)
 
   xice_debug ("Agent %p: s%d:%d pseudo Tcp socket writable", data->agent,
       data->stream->id, data->component->id);
-  g_signal_emit (agent, signals[SIGNAL_RELIABLE_TRANSPORT_WRITABLE], 0,
-      stream->id, component->id);
+  if (data->channel == NULL)
+    g_signal_emit (agent, signals[SIGNAL_RELIABLE_TRANSPORT_WRITABLE], 0,
+        stream->id, component->id);
+  else if (!data->channel->removed)
+    g_signal_emit (agent, signals[SIGNAL_RELIABLE_CHANNEL_WRITABLE], 0,
+        stream->id, component->id, data->channel->id);
 }
 
 static void
@@ -1018,7 +1353,13 @@ pseudo_tcp_socket_closed (PseudoTcpSocket *sock, guint32 err,
 
   xice_debug ("Agent %p: s%d:%d pseudo Tcp socket closed",  agent,
       stream->id, component->id);
-  priv_pseudo_tcp_error (agent, stream, component);
+  if (data->channel == NULL) {
+    priv_pseudo_tcp_error (agent, stream, component);
+  } else {
+    /* Reported once the socket returns, see adjust_channel_clock() */
+    data->channel->closed = TRUE;
+    data->channel->close_error = err;
+  }
 }
 
 
@@ -1053,6 +1394,14 @@ pseudo_tcp_socket_write_packet (PseudoTcpSocket *sock,
 }
 
 
+static guint32
+pseudo_tcp_socket_clock (PseudoTcpSocket *sock, gpointer user_data)
+{
+  TcpUserData *data = (TcpUserData *)user_data;
+
+  return (guint32) (xice_context_get_time (data->agent->main_context) / 1000);
+}
+
 static gboolean
 notify_pseudo_tcp_socket_clock (XiceTimer* timer, gpointer user_data)
 {
@@ -1060,35 +1409,86 @@ notify_pseudo_tcp_socket_clock (XiceTimer* timer, gpointer user_data)
   Component *component = data->component;
   Stream *stream = data->stream;
   XiceAgent *agent = data->agent;
+  TcpChannel *channel = data->channel;
 
   agent_lock();
 
-  if (component->tcp_clock) {
-    xice_timer_destroy (component->tcp_clock);
-    component->tcp_clock = NULL;
+  /* The timer is kept for the lifetime of the socket and rearmed below */
+  xice_timer_stop (timer);
+  if (channel && channel->removed && priv_channel_done (channel)) {
+    /* Freed here, out of the callbacks of its socket */
+    pseudo_tcp_socket_finish_close (channel->tcp);
+    component->tcp_channels = g_slist_remove (component->tcp_channels,
+        channel);
+    xice_debug ("Agent %p: s%d:%d: closed reliable channel %u", agent,
+        stream->id, component->id, channel->id);
+    component_free_tcp_channel (channel);
+  } else if (channel) {
+    channel->tcp_clock_deadline = 0;
+    pseudo_tcp_socket_notify_clock (channel->tcp);
+    adjust_channel_clock (agent, channel);
+  } else {
+    component->tcp_clock_deadline = 0;
+    pseudo_tcp_socket_notify_clock (component->tcp);
+    adjust_tcp_clock (agent, stream, component);
   }
 
-  pseudo_tcp_socket_notify_clock (component->tcp);
-  adjust_tcp_clock (agent, stream, component);
-
   agent_unlock();
 
   return FALSE;
 }
 
 static void
-adjust_tcp_clock (XiceAgent *agent, Stream *stream, Component *component)
+priv_update_path_mtu (XiceAgent *agent, Component *component)
+{
+  guint mtu = pseudo_tcp_socket_get_option (component->tcp,
+      PSEUDO_TCP_OPT_MTU);
+
+  if (mtu != component->tcp_mtu) {
+    component->tcp_mtu = mtu;
+    g_object_notify (G_OBJECT (agent), "path-mtu");
+  }
+}
+
+/* Called after every packet sent or received, so the timer is only
+ * rearmed when the next clock is due earlier than it would fire. Firing
+ * early is harmless, the callback asks for the next clock again. Returns
+ * FALSE once the socket is closed. */
+static gboolean
+priv_rearm_tcp_clock (XiceAgent *agent, PseudoTcpSocket *tcp,
+    XiceTimer **clock, gint64 *clock_deadline, TcpUserData *data)
 {
   long timeout = 0;
+  gint64 deadline;
+
+  if (!pseudo_tcp_socket_get_next_clock (tcp, &timeout))
+    return FALSE;
+
+  timeout = MAX (timeout, 0);
+  deadline = xice_context_get_time (agent->main_context) / 1000 + timeout;
+  if (*clock_deadline != 0 && *clock_deadline <= deadline)
+    return TRUE;
+
+  if (*clock == NULL) {
+    *clock = xice_create_timer (agent->main_context, timeout,
+        notify_pseudo_tcp_socket_clock, data);
+  } else {
+    xice_timer_stop (*clock);
+    (*clock)->interval = timeout;
+  }
+  xice_timer_start (*clock);
+  *clock_deadline = deadline;
+
+  return TRUE;
+}
+
+static void
+adjust_tcp_clock (XiceAgent *agent, Stream *stream, Component *component)
+{
   if (component->tcp) {
-    if (pseudo_tcp_socket_get_next_clock (component->tcp, &timeout)) {
-      if (component->tcp_clock) {
-        xice_timer_destroy (component->tcp_clock);
-        component->tcp_clock = NULL;
-      }
-      component->tcp_clock = agent_timeout_add_with_context (agent,
-          timeout, notify_pseudo_tcp_socket_clock, component->tcp_data);
-    } else {
+    priv_update_path_mtu (agent, component);
+    if (!priv_rearm_tcp_clock (agent, component->tcp, &component->tcp_clock,
+            &component->tcp_clock_deadline, component->tcp_data)) {
       xice_debug ("Agent %p: component %d pseudo tcp socket should be destroyed",
           agent, component->id);
       priv_pseudo_tcp_error (agent, stream, component);
@@ -1096,6 +1496,52 @@ adjust_tcp_clock (XiceAgent *agent, Stream *stream, Component *component)
   }
 }
 
+/* Whether a removed channel has nothing left to send, or cannot send it */
+static gboolean
+priv_channel_done (TcpChannel *channel)
+{
+  long timeout;
+
+  return channel->closed ||
+      !pseudo_tcp_socket_get_next_clock (channel->tcp, &timeout);
+}
+
+/* A removed channel is freed by its clock once done. Any other channel
+ * stops its clock when it closes and is reported, the application removes
+ * it. */
+static void
+adjust_channel_clock (XiceAgent *agent, TcpChannel *channel)
+{
+  Stream *stream = channel->tcp_data->stream;
+  Component *component = channel->tcp_data->component;
+
+  if (channel->removed && priv_channel_done (channel)) {
+    if (channel->tcp_clock == NULL) {
+      channel->tcp_clock = xice_create_timer (agent->main_context, 0,
+          notify_pseudo_tcp_socket_clock, channel->tcp_data);
+    } else {
+      xice_timer_stop (channel->tcp_clock);
+      channel->tcp_clock->interval = 0;
+    }
+    xice_timer_start (channel->tcp_clock);
+    channel->tcp_clock_deadline =
+        xice_context_get_time (agent->main_context) / 1000;
+  } else if (channel->closed ||
+      !priv_rearm_tcp_clock (agent, channel->tcp, &channel->tcp_clock,
+          &channel->tcp_clock_deadline, channel->tcp_data)) {
+    xice_debug ("Agent %p: channel %u pseudo tcp socket closed", agent,
+        channel->id);
+    if (channel->tcp_clock)
+      xice_timer_stop (channel->tcp_clock);
+    channel->tcp_clock_deadline = 0;
+    if (channel->closed && !channel->close_reported) {
+      channel->close_reported = TRUE;
+      g_signal_emit (agent, signals[SIGNAL_RELIABLE_CHANNEL_CLOSED], 0,
+          stream->id, component->id, channel->id, channel->close_error);
+    }
+  }
+}
+
 
 void agent_gathering_done (XiceAgent *agent)
 {
@@ -1160,6 +1606,46 @@ void agent_signal_initial_binding_request_received (XiceAgent *agent, Stream *st
   }
 }
 
+/* Bytes added to each PseudoTcp segment on its way to the peer of the
+ * selected pair: the IP and UDP headers, and the TURN framing of a relay
+ * at either end. Our relay knows whether it frames the data for the peer
+ * as ChannelData or in an indication. The framing of the peer's relay is
+ * unknown, so it is taken as the larger of the two. TCP relays segment the
+ * stream anyway and add nothing the peer would notice. */
+static guint
+priv_path_overhead (XiceAgent *agent, Component *component)
+{
+  XiceCandidate *local = component->selected_pair.local;
+  XiceCandidate *remote = component->selected_pair.remote;
+  gboolean ipv6 = xice_address_ip_version (&local->addr) == 6 ||
+      xice_address_ip_version (&remote->addr) == 6;
+  guint overhead = (ipv6 ? 40 : 20) + 8;
+
+  if (local->type == XICE_CANDIDATE_TYPE_RELAYED && local->turn &&
+      local->turn->type == XICE_RELAY_TYPE_TURN_UDP)
+    overhead += xice_turn_socket_get_overhead (local->sockptr, &remote->addr);
+  /* STUN header, XOR-PEER-ADDRESS and DATA of a Data indication */
+  if (remote->type == XICE_CANDIDATE_TYPE_RELAYED)
+    overhead += 20 + (ipv6 ? 24 : 12) + 4;
+
+  return overhead;
+}
+
+/* Connects a PseudoTcp socket of the component over its selected pair */
+static void
+priv_connect_tcp (XiceAgent *agent, Component *component,
+    PseudoTcpSocket *tcp)
+{
+  pseudo_tcp_socket_connect (tcp);
+  pseudo_tcp_socket_set_option (tcp, PSEUDO_TCP_OPT_OVERHEAD,
+      priv_path_overhead (agent, component));
+  /* No socket sets DF, so a probe larger than the path is fragmented
+   * rather than lost and would always succeed. Probing stops at the size
+   * known to be safe, and only finds paths that drop smaller packets. */
+  pseudo_tcp_socket_set_option (tcp, PSEUDO_TCP_OPT_MAX_MTU, MAX_TCP_MTU);
+  pseudo_tcp_socket_notify_mtu (tcp, MIN_TCP_MTU);
+}
+
 void agent_signal_new_selected_pair (XiceAgent *agent, guint stream_id, guint component_id, const gchar *local_foundation, const gchar *remote_foundation)
 {
   Component *component;
@@ -1177,9 +1663,16 @@ void agent_signal_new_selected_pair (XiceAgent *agent, guint stream_id, guint co
   }
 
   if (component->tcp) {
-    pseudo_tcp_socket_connect (component->tcp);
-    pseudo_tcp_socket_notify_mtu (component->tcp, MAX_TCP_MTU);
+    GSList *i;
+
+    priv_connect_tcp (agent, component, component->tcp);
     adjust_tcp_clock (agent, stream, component);
+    for (i = component->tcp_channels; i; i = i->next) {
+      TcpChannel *channel = i->data;
+
+      priv_connect_tcp (agent, component, channel->tcp);
+      adjust_channel_clock (agent, channel);
+    }
   } else if(agent->reliable) {
     xice_debug ("New selected pair received when pseudo tcp socket in error");
     return;
@@ -1384,6 +1877,11 @@ priv_add_new_candidate_discovery_turn (XiceAgent *agent,
   cdisco->component = stream_find_component_by_id (stream, component_id);
   cdisco->agent = agent;
 
+  /* racing, UDP relays get a head start over the others */
+  if (agent->turn_race_delay > 0 && turn->type != XICE_RELAY_TYPE_TURN_UDP)
+    cdisco->not_before = xice_context_get_time (agent->main_context) +
+        (gint64) agent->turn_race_delay * 1000;
+
   if (agent->compatibility == XICE_COMPATIBILITY_GOOGLE) {
     stun_agent_init (&cdisco->stun_agent, STUN_ALL_KNOWN_ATTRIBUTES,
         STUN_COMPATIBILITY_RFC3489,
@@ -1414,6 +1912,32 @@ priv_add_new_candidate_discovery_turn (XiceAgent *agent,
   ++agent->discovery_unsched_items;
 }
 
+/* Creates a PseudoTcp socket for the conversation, configured from the
+ * reliable-* properties */
+static PseudoTcpSocket *
+priv_create_tcp (XiceAgent *agent, TcpUserData *data, guint32 conversation)
+{
+  PseudoTcpCallbacks tcp_callbacks = {data,
+                                      pseudo_tcp_socket_opened,
+                                      pseudo_tcp_socket_readable,
+                                      pseudo_tcp_socket_writable,
+                                      pseudo_tcp_socket_closed,
+                                      pseudo_tcp_socket_write_packet};
+  PseudoTcpSocket *tcp = pseudo_tcp_socket_new (conversation, &tcp_callbacks);
+
+  pseudo_tcp_socket_set_clock (tcp, pseudo_tcp_socket_clock, data);
+  if (agent->reliable_sndbuf > 0)
+    pseudo_tcp_socket_set_option (tcp, PSEUDO_TCP_OPT_SNDBUF,
+        agent->reliable_sndbuf);
+  if (agent->reliable_rcvbuf > 0)
+    pseudo_tcp_socket_set_option (tcp, PSEUDO_TCP_OPT_RCVBUF,
+        agent->reliable_rcvbuf);
+  if (agent->reliable_pacing)
+    pseudo_tcp_socket_set_option (tcp, PSEUDO_TCP_OPT_PACING, 1);
+
+  return tcp;
+}
+
 XICEAPI_EXPORT guint
 xice_agent_add_stream (
   XiceAgent *agent,
@@ -1435,17 +1959,12 @@ xice_agent_add_stream (
       Component *component = stream_find_component_by_id (stream, i + 1);
       if (component) {
         TcpUserData *data = g_slice_new0 (TcpUserData);
-        PseudoTcpCallbacks tcp_callbacks = {data,
-                                            pseudo_tcp_socket_opened,
-                                            pseudo_tcp_socket_readable,
-                                            pseudo_tcp_socket_writable,
-                                            pseudo_tcp_socket_closed,
-                                            pseudo_tcp_socket_write_packet};
+
         data->agent = agent;
         data->stream = stream;
         data->component = component;
         component->tcp_data = data;
-        component->tcp = pseudo_tcp_socket_new (0, &tcp_callbacks);
+        component->tcp = priv_create_tcp (agent, data, 0);
         adjust_tcp_clock (agent, stream, component);
         xice_debug ("Agent %p: Create Pseudo Tcp Socket for component %d",
             agent, i+1);
@@ -1509,6 +2028,14 @@ xice_agent_set_relay_info(XiceAgent *agent,
   return TRUE;
 }
 
+XICEAPI_EXPORT void
+xice_agent_set_turn_pool (XiceAgent *agent, XiceTurnPool *pool)
+{
+  agent_lock();
+  agent->turn_pool = pool;
+  agent_unlock();
+}
+
 XICEAPI_EXPORT gboolean
 xice_agent_gather_candidates (
   XiceAgent *agent,
@@ -1518,6 +2045,7 @@ xice_agent_gather_candidates (
   GSList *i;
   Stream *stream;
   GSList *local_addresses = NULL;
+  GSList *pooled = NULL;
   gboolean ret = TRUE;
 
   agent_lock();
@@ -1619,6 +2147,16 @@ xice_agent_gather_candidates (
 
         for (item = component->turn_servers; item; item = item->next) {
           TurnServer *turn = item->data;
+          TurnPoolAllocation *alloc = NULL;
+
+          if (agent->turn_pool)
+            alloc = turn_pool_claim (agent->turn_pool, agent, stream,
+                component, turn);
+          if (alloc) {
+            /* taken over once the host candidates are signalled */
+            pooled = g_slist_append (pooled, alloc);
+            continue;
+          }
 
           priv_add_new_candidate_discovery_turn (agent,
               host_candidate->sockptr,
@@ -1643,6 +2181,12 @@ xice_agent_gather_candidates (
     }
   }
 
+  /* the pooled allocations signal their own candidates */
+  for (i = pooled; i; i = i->next)
+    turn_pool_adopt (i->data);
+  g_slist_free (pooled);
+  pooled = NULL;
+
   /* note: no async discoveries pending, signal that we are ready */
   if (agent->discovery_unsched_items == 0) {
     xice_debug ("Agent %p: Candidate gathering FINISHED, no scheduled items.",
@@ -1656,6 +2200,9 @@ xice_agent_gather_candidates (
   for (i = local_addresses; i; i = i->next)
     xice_address_free (i->data);
   g_slist_free (local_addresses);
+  for (i = pooled; i; i = i->next)
+    turn_pool_release (i->data);
+  g_slist_free (pooled);
 
   if (ret == FALSE) {
     for (n = 0; n < stream->n_components; n++) {
@@ -1711,7 +2258,6 @@ xice_agent_remove_stream (
   /* note: remove items with matching stream_ids from both lists */
   conn_check_prune_stream (agent, stream);
   discovery_prune_stream (agent, stream_id);
-  refresh_prune_stream (agent, stream_id);
 
   /* remove the stream itself */
   agent->streams = g_slist_remove (agent->streams, stream);
@@ -2027,9 +2573,12 @@ _xice_agent_received(
 #endif
       for (i = component->local_candidates; i; i = i->next) {
         XiceCandidate *cand = i->data;
+        /* only the relay on that socket: the server may be answering a
+         * relay still being allocated over another transport */
         if (cand->type == XICE_CANDIDATE_TYPE_RELAYED &&
             cand->stream_id == stream->id &&
-            cand->component_id == component->id) {
+            cand->component_id == component->id &&
+            xice_address_equal (&cand->base_addr, &socket->addr)) {
           len = xice_turn_socket_parse_recv (cand->sockptr, &socket,
               from, len, buf, from, buf, len);
         }
@@ -2116,6 +2665,45 @@ xice_agent_send (
 }
 
 
+XICEAPI_EXPORT gboolean
+xice_agent_get_turn_queue_stats (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  XiceTurnQueueStats *stats)
+{
+  Component *component;
+  GSList *i;
+  gboolean ret = FALSE;
+
+  agent_lock();
+
+  if (!agent_find_component (agent, stream_id, component_id, NULL,
+          &component))
+    goto done;
+
+  memset (stats, 0, sizeof (*stats));
+  for (i = component->local_candidates; i; i = i->next) {
+    XiceCandidate *cand = i->data;
+    guint64 queued, dropped, pending;
+
+    if (cand->type != XICE_CANDIDATE_TYPE_RELAYED)
+      continue;
+
+    xice_turn_socket_get_queue_stats (cand->sockptr, &queued, &dropped,
+        &pending);
+    stats->packets_queued += queued;
+    stats->packets_dropped += dropped;
+    stats->bytes_pending += pending;
+  }
+  ret = TRUE;
+
+ done:
+  agent_unlock();
+  return ret;
+}
+
+
 XICEAPI_EXPORT GSList *
 xice_agent_get_local_candidates (
   XiceAgent *agent,
@@ -2202,8 +2790,6 @@ xice_agent_dispose (GObject *object)
   /* step: free resources for the binding discovery timers */
   discovery_free (agent);
   g_assert (agent->discovery_list == NULL);
-  refresh_free (agent);
-  g_assert (agent->refresh_list == NULL);
 
   /* step: free resources for the connectivity check timers */
   conn_check_free (agent);
@@ -2294,6 +2880,24 @@ io_ctx_free (IOCtx *ctx)
   g_slice_free (IOCtx, ctx);
 }
 
+/* The channel a PseudoTcp packet belongs to, from the conversation id it
+ * starts with, or NULL for the component's own socket */
+static TcpChannel *
+priv_find_packet_channel (Component *component, const gchar *buf, guint len)
+{
+  guint32 conversation;
+
+  if (component->tcp_channels == NULL || len < sizeof (conversation))
+    return NULL;
+
+  memcpy (&conversation, buf, sizeof (conversation));
+  conversation = g_ntohl (conversation);
+  if (conversation == 0)
+    return NULL;
+
+  return component_find_tcp_channel (component, conversation);
+}
+
 static gboolean
 xice_agent_g_source_cb (
   XiceSocket *socket,
@@ -2311,12 +2915,38 @@ xice_agent_g_source_cb (
 
   agent_lock();
 
+  if (condition == XICE_SOCKET_WRITABLE) {
+    /* a TURN relay that refused data can take more */
+    if (component->tcp == NULL && !agent->reliable &&
+        component->selected_pair.local != NULL &&
+        component->selected_pair.local->sockptr == ctx->socket)
+      g_signal_emit (agent, signals[SIGNAL_TRANSPORT_WRITABLE], 0,
+          stream->id, component->id);
+    agent_unlock();
+    return TRUE;
+  }
+
   len = _xice_agent_received (agent, stream, component, ctx->socket,
 			  buf, len, from);
 
   if (len > 0 && component->tcp) {
+    TcpChannel *channel = priv_find_packet_channel (component, buf, len);
+
     g_object_add_weak_pointer (G_OBJECT (agent), (gpointer *)&agent);
-    pseudo_tcp_socket_notify_packet (component->tcp, buf, len);
+    if (channel) {
+      PseudoTcpSocket *tcp = channel->tcp;
+
+      /* The channel may be removed by its readable callback */
+      g_object_add_weak_pointer (G_OBJECT (tcp), (gpointer *)&tcp);
+      pseudo_tcp_socket_notify_packet (tcp, buf, len);
+      if (tcp) {
+        g_object_remove_weak_pointer (G_OBJECT (tcp), (gpointer *)&tcp);
+        if (agent)
+          adjust_channel_clock (agent, channel);
+      }
+    } else {
+      pseudo_tcp_socket_notify_packet (component->tcp, buf, len);
+    }
     if (agent) {
       adjust_tcp_clock (agent, stream, component);
       g_object_remove_weak_pointer (G_OBJECT (agent), (gpointer *)&agent);
@@ -2379,6 +3009,28 @@ agent_attach_stream_component_socket(XiceAgent *agent,
 	component->gctxs = g_slist_append(component->gctxs, ctx);
 }
 
+/*
+ * Detaches one socket handle from the main loop event context
+ */
+
+void
+agent_detach_stream_component_socket(Component *component,
+	XiceSocket *socket)
+{
+	GSList *i;
+
+	for (i = component->gctxs; i; i = i->next) {
+		IOCtx *ctx = i->data;
+
+		if (ctx->socket == socket) {
+			xice_socket_set_callback(socket, NULL, NULL);
+			component->gctxs = g_slist_delete_link(component->gctxs, i);
+			io_ctx_free(ctx);
+			return;
+		}
+	}
+}
+
 /*
  * Attaches socket handles of 'stream' to the main eventloop
  * context.
@@ -2477,6 +3129,186 @@ xice_agent_attach_recv (
   return ret;
 }
 
+/* The channel the application knows as @channel_id, not one that is still
+ * closing after being removed */
+static TcpChannel *
+priv_find_channel (Component *component, guint channel_id)
+{
+  TcpChannel *channel = component_find_tcp_channel (component, channel_id);
+
+  return channel && !channel->removed ? channel : NULL;
+}
+
+XICEAPI_EXPORT gboolean
+xice_agent_add_reliable_channel (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id)
+{
+  Component *component;
+  Stream *stream;
+  TcpChannel *channel;
+  gboolean ret = FALSE;
+
+  agent_lock();
+
+  if (!agent_find_component (agent, stream_id, component_id,
+          &stream, &component)) {
+    goto done;
+  }
+
+  if (component->tcp == NULL || channel_id == 0 ||
+      priv_find_channel (component, channel_id) != NULL) {
+    goto done;
+  }
+
+  /* The conversation id goes to the new channel, the old one stops */
+  channel = component_find_tcp_channel (component, channel_id);
+  if (channel != NULL) {
+    pseudo_tcp_socket_finish_close (channel->tcp);
+    component->tcp_channels = g_slist_remove (component->tcp_channels,
+        channel);
+    component_free_tcp_channel (channel);
+  }
+
+  channel = g_slice_new0 (TcpChannel);
+  channel->id = channel_id;
+  channel->tcp_data = g_slice_new0 (TcpUserData);
+  channel->tcp_data->agent = agent;
+  channel->tcp_data->stream = stream;
+  channel->tcp_data->component = component;
+  channel->tcp_data->channel = channel;
+  channel->tcp = priv_create_tcp (agent, channel->tcp_data, channel_id);
+  component->tcp_channels = g_slist_append (component->tcp_channels, channel);
+  xice_debug ("Agent %p: s%d:%d: added reliable channel %u", agent,
+      stream_id, component_id, channel_id);
+
+  if (component->selected_pair.local != NULL)
+    priv_connect_tcp (agent, component, channel->tcp);
+  adjust_channel_clock (agent, channel);
+
+  ret = TRUE;
+
+ done:
+  agent_unlock();
+  return ret;
+}
+
+XICEAPI_EXPORT gboolean
+xice_agent_remove_reliable_channel (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id)
+{
+  Component *component;
+  Stream *stream;
+  TcpChannel *channel;
+  gboolean ret = FALSE;
+
+  agent_lock();
+
+  if (!agent_find_component (agent, stream_id, component_id,
+          &stream, &component)) {
+    goto done;
+  }
+
+  channel = priv_find_channel (component, channel_id);
+  if (channel == NULL)
+    goto done;
+
+  /* The data already sent is still delivered, then the peer is told and
+   * the channel freed */
+  channel->removed = TRUE;
+  channel->recv_cb = NULL;
+  pseudo_tcp_socket_close (channel->tcp, FALSE);
+  adjust_channel_clock (agent, channel);
+  xice_debug ("Agent %p: s%d:%d: removed reliable channel %u", agent,
+      stream_id, component_id, channel_id);
+
+  ret = TRUE;
+
+ done:
+  agent_unlock();
+  return ret;
+}
+
+XICEAPI_EXPORT gint
+xice_agent_send_channel (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id,
+  guint len,
+  const gchar *buf)
+{
+  Component *component;
+  Stream *stream;
+  TcpChannel *channel;
+  gint ret = -1;
+
+  agent_lock();
+
+  if (!agent_find_component (agent, stream_id, component_id,
+          &stream, &component)) {
+    goto done;
+  }
+
+  channel = priv_find_channel (component, channel_id);
+  if (channel == NULL || channel->closed) {
+    ret = -2;
+    goto done;
+  }
+
+  /* In case of -1, the error is either EWOULDBLOCK or ENOTCONN, which both
+     need the user to wait for the reliable-channel-writable signal */
+  ret = pseudo_tcp_socket_send (channel->tcp, buf, len);
+  adjust_channel_clock (agent, channel);
+
+ done:
+  agent_unlock();
+  return ret;
+}
+
+XICEAPI_EXPORT gboolean
+xice_agent_attach_channel_recv (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id,
+  XiceAgentRecvFunc func,
+  gpointer data)
+{
+  Component *component;
+  Stream *stream;
+  TcpChannel *channel;
+  gboolean ret = FALSE;
+
+  agent_lock();
+
+  if (!agent_find_component (agent, stream_id, component_id,
+          &stream, &component)) {
+    goto done;
+  }
+
+  channel = priv_find_channel (component, channel_id);
+  if (channel == NULL)
+    goto done;
+
+  channel->recv_cb = func;
+  channel->recv_data = data;
+  ret = TRUE;
+
+  /* Hand over the data held while nothing was attached */
+  if (func && channel->tcp_readable)
+    pseudo_tcp_socket_readable (channel->tcp, channel->tcp_data);
+
+ done:
+  agent_unlock();
+  return ret;
+}
+
 XICEAPI_EXPORT gboolean
 xice_agent_set_selected_pair (
   XiceAgent *agent,
@@ -116,6 +116,7 @@ typedef struct _XiceAgent XiceAgent;
 #include "candidate.h"
 #include "debug.h"
 #include "contexts/xicecontext.h"
+#include "turnpool.h"
 
 G_BEGIN_DECLS
 
@@ -261,6 +262,43 @@ typedef enum
   XICE_PROXY_TYPE_LAST = XICE_PROXY_TYPE_HTTP,
 } XiceProxyType;
 
+/**
+ * XiceTurnQueueDropPolicy:
+ * @XICE_TURN_QUEUE_DROP_NEWEST: Refuse the data being sent: xice_agent_send()
+ * returns -1 and #XiceAgent::transport-writable is emitted once the queue
+ * drained
+ * @XICE_TURN_QUEUE_DROP_OLDEST: Drop the data queued first to make room;
+ * #XiceAgent::transport-writable is emitted once the queue drained too
+ *
+ * What to drop when the data sent to a peer while its TURN permission is
+ * being installed would exceed #XiceAgent:turn-queue-size.
+ *
+ * Since: 0.1.4
+ */
+typedef enum
+{
+  XICE_TURN_QUEUE_DROP_NEWEST = 0,
+  XICE_TURN_QUEUE_DROP_OLDEST,
+} XiceTurnQueueDropPolicy;
+
+/**
+ * XiceTurnQueueStats:
+ * @packets_queued: Packets queued while waiting for a TURN permission
+ * @packets_dropped: Packets dropped because their queue was full
+ * @bytes_pending: Bytes in the queues right now
+ *
+ * Counters of the data a component queued on its TURN relays, since they
+ * were allocated.
+ *
+ * Since: 0.1.4
+ */
+typedef struct
+{
+  guint64 packets_queued;
+  guint64 packets_dropped;
+  guint64 bytes_pending;
+} XiceTurnQueueStats;
+
 
 /**
  * XiceAgentRecvFunc:
@@ -411,6 +449,21 @@ gboolean xice_agent_set_relay_info(
     const gchar *password,
     XiceRelayType type);
 
+/**
+ * xice_agent_set_turn_pool:
+ * @agent: The #XiceAgent Object
+ * @pool: The #XiceTurnPool to take relayed candidates from, or %NULL
+ *
+ * Lets xice_agent_gather_candidates() take a ready allocation from @pool
+ * for each UDP relay set with xice_agent_set_relay_info() for which the
+ * pool has one with the same server and credentials, instead of making
+ * it then. The relayed candidates taken are there as soon as the gathering
+ * starts. The @pool must outlive the agent.
+ *
+ * Since: 0.1.4
+ */
+void xice_agent_set_turn_pool (XiceAgent *agent, XiceTurnPool *pool);
+
 /**
  * xice_agent_gather_candidates:
  * @agent: The #XiceAgent Object
@@ -552,7 +605,9 @@ xice_agent_set_remote_candidates (
    <para>
    In non-reliable mode, it will virtually never happen with UDP sockets, but
    it might happen if the active candidate is a TURN-TCP connection that got
-   disconnected.
+   disconnected, or if the data waiting for a TURN permission to be installed
+   reached #XiceAgent:turn-queue-size. In the latter case the
+   #XiceAgent::transport-writable signal tells when to send again.
    </para>
    <para>
    In both reliable and non-reliable mode, a -1 error code could also mean that
@@ -570,6 +625,28 @@ xice_agent_send (
   guint len,
   const gchar *buf);
 
+
+/**
+ * xice_agent_get_turn_queue_stats:
+ * @agent: The #XiceAgent Object
+ * @stream_id: The ID of the stream
+ * @component_id: The ID of the component
+ * @stats: The #XiceTurnQueueStats to fill
+ *
+ * Gets the counters of the data queued on the TURN relays of a component
+ * while their permissions were being installed.
+ *
+ * Returns: %FALSE if the stream or component could not be found
+ *
+ * Since: 0.1.4
+ */
+gboolean
+xice_agent_get_turn_queue_stats (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  XiceTurnQueueStats *stats);
+
 /**
  * xice_agent_get_local_candidates:
  * @agent: The #XiceAgent Object
@@ -667,6 +744,122 @@ xice_agent_attach_recv (
   gpointer data);
 
 
+/**
+ * xice_agent_add_reliable_channel:
+ * @agent: The #XiceAgent Object
+ * @stream_id: The ID of the stream
+ * @component_id: The ID of the component
+ * @channel_id: The ID of the channel, any value but 0
+ *
+ * Adds a reliable channel to a component of a reliable agent. Each channel
+ * is a connection of its own over the selected pair of the component, with
+ * its own flow control: a channel whose data is not read, or is being
+ * retransmitted, does not hold up the others or the data sent with
+ * xice_agent_send(). Channels need no connectivity checks of their own and
+ * connect as soon as both agents added the same channel ID, using the
+ * selected pair once there is one.
+ *
+ * <para>See also: xice_agent_send_channel() </para>
+ * <para>See also: xice_agent_attach_channel_recv() </para>
+ * <para>See also: #XiceAgent::reliable-channel-writable </para>
+ *
+ * Returns: %TRUE on success, %FALSE if the agent is not reliable, the stream
+ * or component IDs are invalid or the channel already exists
+ *
+ * Since: 0.1.4
+ */
+gboolean
+xice_agent_add_reliable_channel (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id);
+
+
+/**
+ * xice_agent_remove_reliable_channel:
+ * @agent: The #XiceAgent Object
+ * @stream_id: The ID of the stream
+ * @component_id: The ID of the component
+ * @channel_id: The ID of the channel
+ *
+ * Closes and removes a channel added with xice_agent_add_reliable_channel().
+ * The data already sent on it is still delivered, data not yet received is
+ * dropped. The peer is then told, and its channel closes with
+ * #XiceAgent::reliable-channel-closed and an error of 0. The same ID can be
+ * added again at once, which drops what was left to deliver.
+ *
+ * Returns: %TRUE on success, %FALSE if the channel does not exist
+ *
+ * Since: 0.1.4
+ */
+gboolean
+xice_agent_remove_reliable_channel (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id);
+
+
+/**
+ * xice_agent_send_channel:
+ * @agent: The #XiceAgent Object
+ * @stream_id: The ID of the stream to send to
+ * @component_id: The ID of the component to send to
+ * @channel_id: The ID of the channel to send to
+ * @len: The length of the buffer to send
+ * @buf: The buffer of data to send
+ *
+ * Sends data on a channel added with xice_agent_add_reliable_channel(). As
+ * with xice_agent_send() in reliable mode, -1 means that the channel is not
+ * connected yet or that its send buffer is full: wait for the
+ * #XiceAgent::reliable-channel-writable signal before sending again. -2
+ * means that the channel closed, see #XiceAgent::reliable-channel-closed,
+ * or does not exist: nothing will ever be sent on it.
+ *
+ * Returns: The number of bytes sent, -1 if the channel cannot take data
+ * yet, or -2 if it never will
+ *
+ * Since: 0.1.4
+ */
+gint
+xice_agent_send_channel (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id,
+  guint len,
+  const gchar *buf);
+
+
+/**
+ * xice_agent_attach_channel_recv:
+ * @agent: The #XiceAgent Object
+ * @stream_id: The ID of stream
+ * @component_id: The ID of the component
+ * @channel_id: The ID of the channel
+ * @func: The callback function to be called when data is received on the
+ * channel, or %NULL to stop receiving
+ * @data: user data associated with the callback
+ *
+ * Sets the function called with the data received on a channel added with
+ * xice_agent_add_reliable_channel(). Until one is set, the data is held and
+ * the peer stops sending on the channel once its receive window is full.
+ *
+ * Returns: %TRUE on success, %FALSE if the channel does not exist
+ *
+ * Since: 0.1.4
+ */
+gboolean
+xice_agent_attach_channel_recv (
+  XiceAgent *agent,
+  guint stream_id,
+  guint component_id,
+  guint channel_id,
+  XiceAgentRecvFunc func,
+  gpointer data);
+
+
 /**
  * xice_agent_set_selected_pair:
  * @agent: The #XiceAgent Object
@@ -88,6 +88,9 @@ component_free (Component *cmp)
     xice_candidate_free (cmp->restart_candidate),
       cmp->restart_candidate = NULL;
 
+  /* the relay sockets come after their base sockets, which they release
+   * their allocations through when freed */
+  cmp->sockets = g_slist_reverse (cmp->sockets);
   for (i = cmp->sockets; i; i = i->next) {
     XiceSocket *udpsocket = i->data;
     xice_socket_free (udpsocket);
@@ -136,6 +139,9 @@ component_free (Component *cmp)
     g_slice_free (TcpUserData, cmp->tcp_data);
     cmp->tcp_data = NULL;
   }
+  g_slist_free_full (cmp->tcp_channels,
+      (GDestroyNotify) component_free_tcp_channel);
+  cmp->tcp_channels = NULL;
 
   if (cmp->ctx != NULL) {
     //xice_context_unref (cmp->ctx);
@@ -329,3 +335,31 @@ component_set_selected_remote_candidate (XiceAgent *agent, Component *component,
 
   return local;
 }
+
+TcpChannel *
+component_find_tcp_channel (const Component *component, guint channel_id)
+{
+  GSList *i;
+
+  for (i = component->tcp_channels; i; i = i->next) {
+    TcpChannel *channel = i->data;
+
+    if (channel->id == channel_id)
+      return channel;
+  }
+
+  return NULL;
+}
+
+void
+component_free_tcp_channel (TcpChannel *channel)
+{
+  if (channel->tcp_clock)
+    xice_timer_destroy (channel->tcp_clock);
+  if (channel->tcp) {
+    pseudo_tcp_socket_close (channel->tcp, TRUE);
+    g_object_unref (channel->tcp);
+  }
+  g_slice_free (TcpUserData, channel->tcp_data);
+  g_slice_free (TcpChannel, channel);
+}
@@ -95,12 +95,34 @@ struct _IncomingCheck
   uint16_t username_len;
 };
 
+typedef struct _TcpChannel TcpChannel;
+
 typedef struct {
   XiceAgent *agent;
   Stream *stream;
   Component *component;
+  TcpChannel *channel;              /**< NULL for the component's own tcp */
 } TcpUserData;
 
+/* An extra reliable channel of a component: a PseudoTcp conversation of its
+ * own over the selected pair, so that channels neither share a window nor
+ * wait on each other's losses */
+struct _TcpChannel
+{
+  guint id;                         /**< conversation id, never 0 */
+  PseudoTcpSocket *tcp;
+  XiceTimer *tcp_clock;
+  gint64 tcp_clock_deadline;        /**< when tcp_clock fires in ms, 0 if stopped */
+  TcpUserData *tcp_data;
+  gboolean tcp_readable;
+  XiceAgentRecvFunc recv_cb;        /**< function called on received data */
+  gpointer recv_data;               /**< data passed to recv_cb */
+  gboolean closed;                  /**< the socket closed on its own */
+  guint32 close_error;              /**< why, 0 if closed by the peer */
+  gboolean close_reported;          /**< reliable-channel-closed emitted */
+  gboolean removed;                 /**< closing after being removed */
+};
+
 struct _Component
 {
   XiceComponentType type;
@@ -123,8 +145,11 @@ struct _Component
 
   PseudoTcpSocket *tcp;
   XiceTimer* tcp_clock;
+  gint64 tcp_clock_deadline;        /**< when tcp_clock fires in ms, 0 if stopped */
+  guint tcp_mtu;                    /**< path MTU last seen on tcp, 0 if unknown */
   TcpUserData *tcp_data;
   gboolean tcp_readable;
+  GSList *tcp_channels;             /**< list of TcpChannel objs */
   guint min_port;
   guint max_port;
 };
@@ -151,6 +176,12 @@ XiceCandidate *
 component_set_selected_remote_candidate (XiceAgent *agent, Component *component,
     XiceCandidate *candidate);
 
+TcpChannel *
+component_find_tcp_channel (const Component *component, guint channel_id);
+
+void
+component_free_tcp_channel (TcpChannel *channel);
+
 G_END_DECLS
 
 #endif /* _XICE_COMPONENT_H */
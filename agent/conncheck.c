@@ -72,11 +72,9 @@ static size_t priv_create_username(XiceAgent *agent, Stream *stream,
 static size_t priv_get_password(XiceAgent *agent, Stream *stream,
 	XiceCandidate *remote, uint8_t **password);
 
-static int priv_timer_expired(GTimeVal *timer, GTimeVal *now)
+static int priv_timer_expired(gint64 timer, gint64 now)
 {
-	return (now->tv_sec == timer->tv_sec) ?
-		now->tv_usec >= timer->tv_usec :
-		now->tv_sec >= timer->tv_sec;
+	return now >= timer;
 }
 
 /*
@@ -109,8 +107,8 @@ static gboolean priv_conn_check_initiate(XiceAgent *agent, CandidateCheckPair *p
 	 * immediately, but be put into the "triggered queue",
 	 * see  "7.2.1.4 Triggered Checks"
 	 */
-	g_get_current_time(&pair->next_tick);
-	g_time_val_add(&pair->next_tick, agent->timer_ta * 1000);
+	pair->next_tick = xice_context_get_time(agent->main_context) +
+		agent->timer_ta * 1000;
 	pair->state = XICE_CHECK_IN_PROGRESS;
 	xice_debug("Agent %p : pair %p state IN_PROGRESS", agent, pair);
 	conn_check_send(agent, pair);
@@ -247,7 +245,7 @@ static void priv_conn_check_unfreeze_related(XiceAgent *agent, Stream *stream, C
  *
  * @return will return FALSE when no more pending timers.
  */
-static gboolean priv_conn_check_tick_stream(Stream *stream, XiceAgent *agent, GTimeVal *now)
+static gboolean priv_conn_check_tick_stream(Stream *stream, XiceAgent *agent, gint64 now)
 {
 	gboolean keep_timer_going = FALSE;
 	guint s_inprogress = 0, s_succeeded = 0, s_discovered = 0,
@@ -264,7 +262,7 @@ static gboolean priv_conn_check_tick_stream(Stream *stream, XiceAgent *agent, GT
 				p->state = XICE_CHECK_FAILED;
 				xice_debug("Agent %p : pair %p state FAILED", agent, p);
 			}
-			else if (priv_timer_expired(&p->next_tick, now)) {
+			else if (priv_timer_expired(p->next_tick, now)) {
 				switch (stun_timer_refresh(&p->timer)) {
 				case STUN_USAGE_TIMER_RETURN_TIMEOUT:
 				{
@@ -296,9 +294,8 @@ static gboolean priv_conn_check_tick_stream(Stream *stream, XiceAgent *agent, GT
 						(gchar *)p->stun_buffer);
 
 
-					/* note: convert from milli to microseconds for g_time_val_add() */
-					p->next_tick = *now;
-					g_time_val_add(&p->next_tick, timeout * 1000);
+					/* note: convert from milli to microseconds */
+					p->next_tick = now + timeout * 1000;
 
 					keep_timer_going = TRUE;
 					break;
@@ -307,9 +304,8 @@ static gboolean priv_conn_check_tick_stream(Stream *stream, XiceAgent *agent, GT
 				{
 					unsigned int timeout = stun_timer_remainder(&p->timer);
 
-					/* note: convert from milli to microseconds for g_time_val_add() */
-					p->next_tick = *now;
-					g_time_val_add(&p->next_tick, timeout * 1000);
+					/* note: convert from milli to microseconds */
+					p->next_tick = now + timeout * 1000;
 
 					keep_timer_going = TRUE;
 					break;
@@ -392,10 +388,10 @@ static gboolean priv_conn_check_tick_unlocked(gpointer pointer)
 	XiceAgent *agent = pointer;
 	gboolean keep_timer_going = FALSE;
 	GSList *i, *j;
-	GTimeVal now;
+	gint64 now;
 
 	/* step: process ongoing STUN transactions */
-	g_get_current_time(&now);
+	now = xice_context_get_time(agent->main_context);
 
 	/* step: find the highest priority waiting check and send it */
 	for (i = agent->streams; i; i = i->next) {
@@ -417,7 +413,7 @@ static gboolean priv_conn_check_tick_unlocked(gpointer pointer)
 	for (j = agent->streams; j; j = j->next) {
 		Stream *stream = j->data;
 		gboolean res =
-			priv_conn_check_tick_stream(stream, agent, &now);
+			priv_conn_check_tick_stream(stream, agent, now);
 		if (res)
 			keep_timer_going = res;
 	}
@@ -584,7 +580,8 @@ static gboolean priv_conn_keepalive_tick_unlocked(XiceAgent *agent)
 							agent, buf_len, p->keepalive.stun_message.buffer);
 
 						if (buf_len > 0) {
-							stun_timer_start(&p->keepalive.timer, STUN_TIMER_DEFAULT_TIMEOUT,
+							xice_context_start_stun_timer(agent->main_context,
+								&p->keepalive.timer, STUN_TIMER_DEFAULT_TIMEOUT,
 								STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
 
 							agent->media_after_tick = FALSE;
@@ -700,127 +697,6 @@ static gboolean priv_conn_keepalive_tick(XiceTimer *timer, gpointer pointer)
 }
 
 
-static gboolean priv_turn_allocate_refresh_retransmissions_tick(XiceTimer* timer, gpointer pointer)
-{
-	CandidateRefresh *cand = (CandidateRefresh *)pointer;
-
-	agent_lock();
-
-	xice_timer_destroy(cand->tick_source);
-	cand->tick_source = NULL;
-
-	switch (stun_timer_refresh(&cand->timer)) {
-	case STUN_USAGE_TIMER_RETURN_TIMEOUT:
-	{
-		/* Time out */
-		StunTransactionId id;
-
-		stun_message_id(&cand->stun_message, id);
-		stun_agent_forget_transaction(&cand->stun_agent, id);
-
-		refresh_cancel(cand);
-		break;
-	}
-	case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
-		/* Retransmit */
-		xice_socket_send(cand->xicesock, &cand->server,
-			stun_message_length(&cand->stun_message), (gchar *)cand->stun_buffer);
-
-		cand->tick_source = agent_timeout_add_with_context(cand->agent,
-			stun_timer_remainder(&cand->timer),
-			priv_turn_allocate_refresh_retransmissions_tick, cand);
-		break;
-	case STUN_USAGE_TIMER_RETURN_SUCCESS:
-		cand->tick_source = agent_timeout_add_with_context(cand->agent,
-			stun_timer_remainder(&cand->timer),
-			priv_turn_allocate_refresh_retransmissions_tick, cand);
-		break;
-	}
-
-
-	agent_unlock();
-	return FALSE;
-}
-
-static void priv_turn_allocate_refresh_tick_unlocked(CandidateRefresh *cand)
-{
-	uint8_t *username;
-	size_t username_len;
-	uint8_t *password;
-	size_t password_len;
-	size_t buffer_len = 0;
-	StunUsageTurnCompatibility turn_compat =
-		agent_to_turn_compatibility(cand->agent);
-
-	username = (uint8_t *)cand->turn->username;
-	username_len = (size_t)strlen(cand->turn->username);
-	password = (uint8_t *)cand->turn->password;
-	password_len = (size_t)strlen(cand->turn->password);
-
-	if (turn_compat == STUN_USAGE_TURN_COMPATIBILITY_MSN ||
-		turn_compat == STUN_USAGE_TURN_COMPATIBILITY_OC2007) {
-		username = g_base64_decode((gchar *)username, &username_len);
-		password = g_base64_decode((gchar *)password, &password_len);
-	}
-
-	buffer_len = stun_usage_turn_create_refresh(&cand->stun_agent,
-		&cand->stun_message, cand->stun_buffer, sizeof(cand->stun_buffer),
-		cand->stun_resp_msg.buffer == NULL ? NULL : &cand->stun_resp_msg, -1,
-		username, username_len,
-		password, password_len,
-		turn_compat);
-
-	if (turn_compat == STUN_USAGE_TURN_COMPATIBILITY_MSN ||
-		turn_compat == STUN_USAGE_TURN_COMPATIBILITY_OC2007) {
-		g_free(cand->msn_turn_username);
-		g_free(cand->msn_turn_password);
-		cand->msn_turn_username = username;
-		cand->msn_turn_password = password;
-	}
-
-	xice_debug("Agent %p : Sending allocate Refresh %d", cand->agent, buffer_len);
-
-	if (cand->tick_source != NULL) {
-		xice_timer_destroy(cand->tick_source);
-		cand->tick_source = NULL;
-	}
-
-	if (buffer_len > 0) {
-		stun_timer_start(&cand->timer, STUN_TIMER_DEFAULT_TIMEOUT,
-			STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
-
-		/* send the refresh */
-		xice_socket_send(cand->xicesock, &cand->server,
-			buffer_len, (gchar *)cand->stun_buffer);
-
-		cand->tick_source = agent_timeout_add_with_context(cand->agent,
-			stun_timer_remainder(&cand->timer),
-			priv_turn_allocate_refresh_retransmissions_tick, cand);
-	}
-
-}
-
-
-/*
- * Timer callback that handles refreshing TURN allocations
- *
- * This function is designed for the g_timeout_add() interface.
- *
- * @return will return FALSE when no more pending timers.
- */
-static gboolean priv_turn_allocate_refresh_tick(XiceTimer* timer, gpointer pointer)
-{
-	CandidateRefresh *cand = (CandidateRefresh *)pointer;
-
-	agent_lock();
-
-	priv_turn_allocate_refresh_tick_unlocked(cand);
-	agent_unlock();
-
-	return FALSE;
-}
-
-
 /*
  * Initiates the next pending connectivity check.
  *
@@ -1653,17 +1529,17 @@ int conn_check_send(XiceAgent *agent, CandidateCheckPair *pair)
 		}
 
 		if (buffer_len > 0) {
-			stun_timer_start(&pair->timer, STUN_TIMER_DEFAULT_TIMEOUT,
-				STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
+			xice_context_start_stun_timer(agent->main_context, &pair->timer,
+				STUN_TIMER_DEFAULT_TIMEOUT, STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
 
 			/* send the conncheck */
 			xice_socket_send(pair->local->sockptr, &pair->remote->addr,
 				buffer_len, (gchar *)pair->stun_buffer);
 
 			timeout = stun_timer_remainder(&pair->timer);
-			/* note: convert from milli to microseconds for g_time_val_add() */
-			g_get_current_time(&pair->next_tick);
-			g_time_val_add(&pair->next_tick, timeout * 1000);
+			/* note: convert from milli to microseconds */
+			pair->next_tick = xice_context_get_time(agent->main_context) +
+				timeout * 1000;
 		}
 		else {
 			xice_debug("Agent %p: buffer is empty, cancelling conncheck", agent);
@@ -1781,7 +1657,8 @@ static gboolean priv_schedule_triggered_check(XiceAgent *agent, Stream *stream,
 					"restarting the timer again?: %s ..", agent,
 					p->timer_restarted ? "no" : "yes");
 				if (!p->timer_restarted) {
-					stun_timer_start(&p->timer, STUN_TIMER_DEFAULT_TIMEOUT,
+					xice_context_start_stun_timer(agent->main_context, &p->timer,
+						STUN_TIMER_DEFAULT_TIMEOUT,
 						STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
 					p->timer_restarted = TRUE;
 				}
@@ -2254,47 +2131,46 @@ static gboolean priv_map_reply_to_discovery_request(XiceAgent *agent, StunMessag
 }
 
 
-static CandidateRefresh *
-priv_add_new_turn_refresh(CandidateDiscovery *cdisco, XiceCandidate *relay_cand,
-	guint lifetime)
+/*
+ * Releases the allocation a relay discovery got after the race was won,
+ * with a Refresh of lifetime 0 on the connection it came on.
+ */
+static void priv_release_lost_relay(XiceAgent *agent, CandidateDiscovery *d)
 {
-	CandidateRefresh *cand;
-	XiceAgent *agent = cdisco->agent;
-
-	cand = g_slice_new0(CandidateRefresh);
-	agent->refresh_list = g_slist_append(agent->refresh_list, cand);
-
-	cand->xicesock = cdisco->xicesock;
-	cand->relay_socket = relay_cand->sockptr;
-	cand->server = cdisco->server;
-	cand->turn = cdisco->turn;
-	cand->stream = cdisco->stream;
-	cand->component = cdisco->component;
-	cand->agent = cdisco->agent;
-	memcpy(&cand->stun_agent, &cdisco->stun_agent, sizeof(StunAgent));
-
-	/* Use previous stun response for authentication credentials */
-	if (cdisco->stun_resp_msg.buffer != NULL) {
-		memcpy(cand->stun_resp_buffer, cdisco->stun_resp_buffer,
-			sizeof(cand->stun_resp_buffer));
-		memcpy(&cand->stun_resp_msg, &cdisco->stun_resp_msg, sizeof(StunMessage));
-		cand->stun_resp_msg.buffer = cand->stun_resp_buffer;
-		cand->stun_resp_msg.agent = NULL;
-		cand->stun_resp_msg.key = NULL;
-	}
-
-	xice_debug("Agent %p : Adding new refresh candidate %p with timeout %d",
-		agent, cand, (lifetime - 60) * 1000);
-
-	/* step: also start the refresh timer */
-	/* refresh should be sent 1 minute before it expires */
-	cand->timer_source =
-		agent_timeout_add_with_context(agent, (lifetime - 60) * 1000,
-			priv_turn_allocate_refresh_tick, cand);
-
-	xice_debug("timer source is : %d", cand->timer_source);
-
-	return cand;
+	StunMessage msg;
+	uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
+	uint8_t *username = (uint8_t *)d->turn->username;
+	size_t username_len = strlen(d->turn->username);
+	uint8_t *password = (uint8_t *)d->turn->password;
+	size_t password_len = strlen(d->turn->password);
+	StunUsageTurnCompatibility turn_compat = agent_to_turn_compatibility(agent);
+	StunTransactionId id;
+	size_t len;
+
+	if (turn_compat == STUN_USAGE_TURN_COMPATIBILITY_MSN ||
+		turn_compat == STUN_USAGE_TURN_COMPATIBILITY_OC2007) {
+		username = g_base64_decode((gchar *)username, &username_len);
+		password = g_base64_decode((gchar *)password, &password_len);
+	}
+
+	len = stun_usage_turn_create_refresh(&d->stun_agent, &msg,
+		buffer, sizeof(buffer),
+		d->stun_resp_msg.buffer != NULL ? &d->stun_resp_msg : NULL, 0,
+		username, username_len, password, password_len, turn_compat);
+	if (len > 0) {
+		xice_debug("Agent %p : releasing the allocation of lost relay %p.",
+			agent, d);
+		/* only TCP and TLS relays are cancelled: sent once, its answer is not waited for */
+		xice_socket_send(d->xicesock, &d->server, len, (gchar *)buffer);
+		stun_message_id(&msg, id);
+		stun_agent_forget_transaction(&d->stun_agent, id);
+	}
+
+	if (turn_compat == STUN_USAGE_TURN_COMPATIBILITY_MSN ||
+		turn_compat == STUN_USAGE_TURN_COMPATIBILITY_OC2007) {
+		g_free(username);
+		g_free(password);
+	}
 }
 
 /*
@@ -2336,7 +2212,19 @@ static gboolean priv_map_reply_to_relay_request(XiceAgent *agent, StunMessage *r
 				xice_debug("Agent %p : stun_turn_process/disc for %p res %d.",
 					agent, d, (int)res);
 
-				if (res == STUN_USAGE_TURN_RETURN_ALTERNATE_SERVER) {
+				if (d->cancelled) {
+					/* case: the race was lost meanwhile, an allocation got
+					 * is released, the discovery tick closes the socket */
+					if (res == STUN_USAGE_TURN_RETURN_RELAY_SUCCESS ||
+						res == STUN_USAGE_TURN_RETURN_MAPPED_SUCCESS)
+						priv_release_lost_relay(agent, d);
+
+					d->stun_message.buffer = NULL;
+					d->stun_message.buffer_len = 0;
+					d->done = TRUE;
+					trans_found = TRUE;
+				}
+				else if (res == STUN_USAGE_TURN_RETURN_ALTERNATE_SERVER) {
 					/* handle alternate server */
 					xice_address_set_from_sockaddr(&d->server,
 						(struct sockaddr *) &alternate);
@@ -2377,7 +2265,6 @@ static gboolean priv_map_reply_to_relay_request(XiceAgent *agent, StunMessage *r
 						d->turn);
 
 					if (relay_cand) {
-						priv_add_new_turn_refresh(d, relay_cand, lifetime);
 						if (agent->compatibility == XICE_COMPATIBILITY_OC2007 ||
 							agent->compatibility == XICE_COMPATIBILITY_OC2007R2) {
 							/* These data are needed on TURN socket when sending requests,
@@ -2389,12 +2276,23 @@ static gboolean priv_map_reply_to_relay_request(XiceAgent *agent, StunMessage *r
 							xice_turn_socket_set_ms_realm(relay_cand->sockptr, &d->stun_message);
 							xice_turn_socket_set_ms_connection_id(relay_cand->sockptr, resp);
 						}
+						/* The allocation was authenticated already, the first
+						 * ChannelBind and CreatePermission requests need not be
+						 * challenged again */
+						xice_turn_socket_set_realm_nonce(relay_cand->sockptr, &d->stun_message);
+						/* the socket refreshes the allocation from now on */
+						xice_turn_socket_refresh_allocation(relay_cand->sockptr,
+							d->stun_resp_msg.buffer != NULL ? &d->stun_resp_msg : NULL,
+							lifetime);
 					}
 
 					d->stun_message.buffer = NULL;
 					d->stun_message.buffer_len = 0;
 					d->done = TRUE;
 					trans_found = TRUE;
+
+					if (relay_cand)
+						discovery_relay_won(agent, d->stream, d->component);
 				}
 				else if (res == STUN_USAGE_TURN_RETURN_ERROR) {
 					int code = -1;
@@ -2452,92 +2350,6 @@ static gboolean priv_map_reply_to_relay_request(XiceAgent *agent, StunMessage *r
 }
 
 
-/*
- * Tries to match STUN reply in 'buf' to an existing STUN discovery
- * transaction. If found, a reply is sent.
- *
- * @return TRUE if a matching transaction is found
- */
-static gboolean priv_map_reply_to_relay_refresh(XiceAgent *agent, StunMessage *resp)
-{
-	uint32_t lifetime;
-	GSList *i;
-	StunUsageTurnReturn res;
-	gboolean trans_found = FALSE;
-	StunTransactionId refresh_id;
-	StunTransactionId response_id;
-	stun_message_id(resp, response_id);
-
-	for (i = agent->refresh_list; i && trans_found != TRUE; i = i->next) {
-		CandidateRefresh *cand = i->data;
-
-		if (cand->stun_message.buffer) {
-			stun_message_id(&cand->stun_message, refresh_id);
-
-			if (memcmp(refresh_id, response_id, sizeof(StunTransactionId)) == 0) {
-				res = stun_usage_turn_refresh_process(resp,
-					&lifetime, agent_to_turn_compatibility(cand->agent));
-				xice_debug("Agent %p : stun_turn_refresh_process for %p res %d.",
-					agent, cand, (int)res);
-				if (res == STUN_USAGE_TURN_RETURN_RELAY_SUCCESS) {
-					/* refresh should be sent 1 minute before it expires */
-					cand->timer_source =
-						agent_timeout_add_with_context(cand->agent, (lifetime - 60) * 1000,
-							priv_turn_allocate_refresh_tick, cand);
-
-					xice_timer_destroy(cand->tick_source);
-					cand->tick_source = NULL;
-				}
-				else if (res == STUN_USAGE_TURN_RETURN_ERROR) {
-					int code = -1;
-					uint8_t *sent_realm = NULL;
-					uint8_t *recv_realm = NULL;
-					uint16_t sent_realm_len = 0;
-					uint16_t recv_realm_len = 0;
-
-					sent_realm = (uint8_t *)stun_message_find(&cand->stun_message,
-						STUN_ATTRIBUTE_REALM, &sent_realm_len);
-					recv_realm = (uint8_t *)stun_message_find(resp,
-						STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-					/* check for unauthorized error response */
-					if (cand->agent->compatibility == XICE_COMPATIBILITY_RFC5245 &&
-						stun_message_get_class(resp) == STUN_ERROR &&
-						stun_message_find_error(resp, &code) ==
-						STUN_MESSAGE_RETURN_SUCCESS &&
-						recv_realm != NULL && recv_realm_len > 0) {
-
-						if (code == 438 ||
-							(code == 401 &&
-								!(recv_realm_len == sent_realm_len &&
-									sent_realm != NULL &&
-									memcmp(sent_realm, recv_realm, sent_realm_len) == 0))) {
-							cand->stun_resp_msg = *resp;
-							memcpy(cand->stun_resp_buffer, resp->buffer,
-								stun_message_length(resp));
-							cand->stun_resp_msg.buffer = cand->stun_resp_buffer;
-							cand->stun_resp_msg.buffer_len = sizeof(cand->stun_resp_buffer);
-							priv_turn_allocate_refresh_tick_unlocked(cand);
-						}
-						else {
-							/* case: a real unauthorized error */
-							refresh_cancel(cand);
-						}
-					}
-					else {
-						/* case: STUN error, the check STUN context was freed */
-						refresh_cancel(cand);
-					}
-					trans_found = TRUE;
-				}
-			}
-		}
-	}
-
-	return trans_found;
-}
-
-
 static gboolean priv_map_reply_to_keepalive_conncheck(XiceAgent *agent,
 	Component *component, StunMessage *resp)
 {
@@ -2721,25 +2533,6 @@ gboolean conn_check_handle_inbound_stun(XiceAgent *agent, Stream *stream,
 			}
 		}
 	}
-	/* Check for relay refresh stun agents */
-	if (valid == STUN_VALIDATION_BAD_REQUEST ||
-		valid == STUN_VALIDATION_UNMATCHED_RESPONSE) {
-		for (i = agent->refresh_list; i; i = i->next) {
-			CandidateRefresh *r = i->data;
-			xice_debug("Comparing %p to %p, %p to %p and %p and %p to %p", r->stream,
-				stream, r->component, component, r->xicesock, r->relay_socket, socket);
-			if (r->stream == stream && r->component == component &&
-				(r->xicesock == socket || r->relay_socket == socket)) {
-				valid = stun_agent_validate(&r->stun_agent, &req,
-					(uint8_t *)buf, len, conncheck_stun_validater, &validater_data);
-				xice_debug("Validating gave %d", valid);
-				if (valid == STUN_VALIDATION_UNMATCHED_RESPONSE)
-					continue;
-				discovery_msg = TRUE;
-				break;
-			}
-		}
-	}
 
 	g_free(validater_data.password);
 
@@ -2972,10 +2765,6 @@ gboolean conn_check_handle_inbound_stun(XiceAgent *agent, Stream *stream,
 		if (trans_found != TRUE)
 			trans_found = priv_map_reply_to_relay_request(agent, &req);
 
-		/* step: let's try to match the response to an existing turn refresh */
-		if (trans_found != TRUE)
-			trans_found = priv_map_reply_to_relay_refresh(agent, &req);
-
 		/* step: let's try to match the response to an existing keepalive conncheck */
 		if (trans_found != TRUE)
 			trans_found = priv_map_reply_to_keepalive_conncheck(agent, component,
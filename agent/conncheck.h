@@ -43,6 +43,7 @@
 /* note: this is a private header to libxice */
 
 #include "agent.h"
+#include "discovery.h"
 #include "stream.h"
 #include "stun/stunagent.h"
 #include "stun/usages/timer.h"
@@ -75,7 +76,7 @@ struct _CandidateCheckPair
   gboolean controlling;
   gboolean timer_restarted;
   guint64 priority;
-  GTimeVal next_tick;       /* next tick timestamp */
+  gint64 next_tick;         /* next tick timestamp (context clock, usecs) */
   StunTimer timer;
   uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE];
   StunMessage stun_message;
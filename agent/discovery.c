@@ -66,11 +66,9 @@
 #include "contexts/xicesocket.h"
 
 
-static inline int priv_timer_expired (GTimeVal *timer, GTimeVal *now)
+static inline int priv_timer_expired (gint64 timer, gint64 now)
 {
-  return (now->tv_sec == timer->tv_sec) ?
-    now->tv_usec >= timer->tv_usec :
-    now->tv_sec >= timer->tv_sec;
+  return now >= timer;
 }
 
 /*
@@ -131,118 +129,6 @@ void discovery_prune_stream (XiceAgent *agent, guint stream_id)
 }
 
 
-/*
- * Frees the CandidateDiscovery structure pointed to
- * by 'user data'. Compatible with g_slist_foreach().
- */
-void refresh_free_item (gpointer data, gpointer user_data)
-{
-  CandidateRefresh *cand = data;
-  XiceAgent *agent = cand->agent;
-  uint8_t *username;
-  size_t username_len;
-  uint8_t *password;
-  size_t password_len;
-  size_t buffer_len = 0;
-  StunUsageTurnCompatibility turn_compat = agent_to_turn_compatibility (agent);
-
-  g_assert (user_data == NULL);
-
-  if (cand->timer_source != NULL) {
-    xice_timer_destroy (cand->timer_source);
-    cand->timer_source = NULL;
-  }
-  if (cand->tick_source != NULL) {
-    xice_timer_destroy (cand->tick_source);
-    cand->tick_source = NULL;
-  }
-
-  username = (uint8_t *)cand->turn->username;
-  username_len = (size_t) strlen (cand->turn->username);
-  password = (uint8_t *)cand->turn->password;
-  password_len = (size_t) strlen (cand->turn->password);
-
-  if (turn_compat == STUN_USAGE_TURN_COMPATIBILITY_MSN ||
-      turn_compat == STUN_USAGE_TURN_COMPATIBILITY_OC2007) {
-    username = g_base64_decode ((gchar *)username, &username_len);
-    password = g_base64_decode ((gchar *)password, &password_len);
-  }
-
-  buffer_len = stun_usage_turn_create_refresh (&cand->stun_agent,
-      &cand->stun_message,  cand->stun_buffer, sizeof(cand->stun_buffer),
-      cand->stun_resp_msg.buffer == NULL ? NULL : &cand->stun_resp_msg, 0,
-      username, username_len,
-      password, password_len,
-      agent_to_turn_compatibility (agent));
-
-  if (buffer_len > 0) {
-    StunTransactionId id;
-
-    /* forget the transaction since we don't care about the result and
-     * we don't implement retransmissions/timeout */
-    stun_message_id (&cand->stun_message, id);
-    stun_agent_forget_transaction (&cand->stun_agent, id);
-
-    /* send the refresh twice since we won't do retransmissions */
-    xice_socket_send (cand->xicesock, &cand->server,
-        buffer_len, (gchar *)cand->stun_buffer);
-    if (!xice_socket_is_reliable (cand->xicesock)) {
-      xice_socket_send (cand->xicesock, &cand->server,
-          buffer_len, (gchar *)cand->stun_buffer);
-    }
-
-  }
-
-  if (turn_compat == STUN_USAGE_TURN_COMPATIBILITY_MSN ||
-      turn_compat == STUN_USAGE_TURN_COMPATIBILITY_OC2007) {
-    g_free (username);
-    g_free (password);
-  }
-
-  g_slice_free (CandidateRefresh, cand);
-}
-
-/*
- * Frees all discovery related resources for the agent.
- */
-void refresh_free (XiceAgent *agent)
-{
-  g_slist_foreach (agent->refresh_list, refresh_free_item, NULL);
-  g_slist_free (agent->refresh_list);
-  agent->refresh_list = NULL;
-}
-
-/*
- * Prunes the list of discovery processes for items related
- * to stream 'stream_id'. 
- *
- * @return TRUE on success, FALSE on a fatal error
- */
-void refresh_prune_stream (XiceAgent *agent, guint stream_id)
-{
-  GSList *i;
-
-  for (i = agent->refresh_list; i ;) {
-    CandidateRefresh *cand = i->data;
-    GSList *next = i->next;
-
-    if (cand->stream->id == stream_id) {
-      agent->refresh_list = g_slist_remove (agent->refresh_list, cand);
-      refresh_free_item (cand, NULL);
-    }
-
-    i = next;
-  }
-
-}
-
-void refresh_cancel (CandidateRefresh *refresh)
-{
-  refresh->agent->refresh_list = g_slist_remove (refresh->agent->refresh_list,
-      refresh);
-  refresh_free_item (refresh, NULL);
-}
-
 /*
  * Adds a new local candidate. Implements the candidate pruning
  * defined in ICE spec section 4.1.3 "Eliminating Redundant
@@ -591,8 +477,11 @@ discovery_add_relay_candidate (
              agent->compatibility == XICE_COMPATIBILITY_OC2007)  {
     candidate->priority = xice_candidate_msn_priority (candidate);
   } else {
+    /* racing, relays over UDP rank above the others */
     candidate->priority =  xice_candidate_ice_priority_full
-        (XICE_CANDIDATE_TYPE_PREF_RELAYED, 0, component_id);
+        (XICE_CANDIDATE_TYPE_PREF_RELAYED,
+         agent->turn_race_delay > 0 && turn->type == XICE_RELAY_TYPE_TURN_UDP,
+         component_id);
   }
   candidate->stream_id = stream_id;
   candidate->component_id = component_id;
@@ -606,6 +495,8 @@ discovery_add_relay_candidate (
       agent_to_turn_socket_compatibility (agent));
   if (!relay_socket)
     goto errors;
+  xice_turn_socket_set_queue_size (relay_socket, agent->turn_queue_size,
+      (XiceTurnSocketDropPolicy) agent->turn_queue_drop_policy);
 
   candidate->sockptr = relay_socket;
   candidate->base_addr = base_socket->addr;
@@ -623,6 +514,10 @@ discovery_add_relay_candidate (
   if (!priv_add_local_candidate_pruned (agent, stream_id, component, candidate))
     goto errors;
 
+  /* the relayed data, the checks through it and the writable notices of
+   * its permission queues come on this socket */
+  agent_attach_stream_component_socket (agent, stream, component,
+      relay_socket);
   component->sockets = g_slist_append (component->sockets, relay_socket);
   agent_signal_new_candidate (agent, candidate);
 
@@ -817,6 +712,48 @@ XiceCandidate *discovery_learn_remote_peer_reflexive_candidate (
   return candidate;
 }
 
+/*
+ * Whether a TCP or TLS relay discovery, racing, is still to give the UDP
+ * relays of its component their head start: its start time is not there
+ * yet, and one of them is still going.
+ */
+static gboolean priv_relay_race_waiting (XiceAgent *agent,
+    CandidateDiscovery *cand, gint64 now)
+{
+  GSList *i;
+
+  if (now >= cand->not_before)
+    return FALSE;
+
+  for (i = agent->discovery_list; i; i = i->next) {
+    CandidateDiscovery *d = i->data;
+
+    if (d->type == XICE_CANDIDATE_TYPE_RELAYED &&
+        d->stream == cand->stream && d->component == cand->component &&
+        d->turn->type == XICE_RELAY_TYPE_TURN_UDP && d->done != TRUE)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Closes the connection of a relay discovery cancelled by the race, out
+ * of the callbacks of its socket.
+ */
+static void priv_close_lost_relay (XiceAgent *agent, CandidateDiscovery *cand)
+{
+  Component *component = cand->component;
+
+  xice_debug ("Agent %p : closing the connection of lost relay %p.",
+      agent, cand);
+
+  agent_detach_stream_component_socket (component, cand->xicesock);
+  component->sockets = g_slist_remove (component->sockets, cand->xicesock);
+  xice_socket_free (cand->xicesock);
+  cand->xicesock = NULL;
+}
+
 /* 
  * Timer callback that handles scheduling new candidate discovery
  * processes (paced by the Ta timer), and handles running of the 
@@ -843,7 +780,19 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
   for (i = agent->discovery_list; i ; i = i->next) {
     cand = i->data;
 
+    if (cand->cancelled && cand->done == TRUE && cand->xicesock != NULL)
+      priv_close_lost_relay (agent, cand);
+
     if (cand->pending != TRUE) {
+      if (cand->not_before > 0) {
+        if (priv_relay_race_waiting (agent, cand,
+                xice_context_get_time (agent->main_context))) {
+          ++not_done; /* note: not started yet */
+          continue;
+        }
+        cand->not_before = 0;
+      }
+
       cand->pending = TRUE;
 
       if (agent->discovery_unsched_items)
@@ -901,11 +850,11 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
 
 	if (buffer_len > 0) {
           if (xice_socket_is_reliable (cand->xicesock)) {
-            stun_timer_start_reliable (&cand->timer,
-                STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT);
+            xice_context_start_stun_timer (agent->main_context, &cand->timer,
+                STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT, 0);
           } else {
-            stun_timer_start (&cand->timer, 200,
-                STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
+            xice_context_start_stun_timer (agent->main_context, &cand->timer,
+                200, STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
           }
 
           /* send the conncheck */
@@ -913,7 +862,7 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
               buffer_len, (gchar *)cand->stun_buffer);
 
 	  /* case: success, start waiting for the result */
-	  g_get_current_time (&cand->next_tick);
+	  cand->next_tick = xice_context_get_time (agent->main_context);
 
 	} else {
 	  /* case: error in starting discovery, start the next discovery */
@@ -931,15 +880,13 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
     }
 
     if (cand->done != TRUE) {
-      GTimeVal now;
-
-      g_get_current_time (&now);
+      gint64 now = xice_context_get_time (agent->main_context);
 
       if (cand->stun_message.buffer == NULL) {
 	xice_debug ("Agent %p : STUN discovery was cancelled, marking discovery done.", agent);
 	cand->done = TRUE;
       }
-      else if (priv_timer_expired (&cand->next_tick, &now)) {
+      else if (priv_timer_expired (cand->next_tick, now)) {
         switch (stun_timer_refresh (&cand->timer)) {
           case STUN_USAGE_TIMER_RETURN_TIMEOUT:
             {
@@ -969,9 +916,8 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
                   stun_message_length (&cand->stun_message),
                   (gchar *)cand->stun_buffer);
 
-              /* note: convert from milli to microseconds for g_time_val_add() */
-              cand->next_tick = now;
-              g_time_val_add (&cand->next_tick, timeout * 1000);
+              /* note: convert from milli to microseconds */
+              cand->next_tick = now + timeout * 1000;
 
               ++not_done; /* note: retry later */
               break;
@@ -980,8 +926,7 @@ static gboolean priv_discovery_tick_unlocked (gpointer pointer)
             {
               unsigned int timeout = stun_timer_remainder (&cand->timer);
 
-              cand->next_tick = now;
-              g_time_val_add (&cand->next_tick, timeout * 1000);
+              cand->next_tick = now + timeout * 1000;
 
               ++not_done; /* note: retry later */
               break;
@@ -1048,3 +993,44 @@ void discovery_schedule (XiceAgent *agent)
     }
   }
 }
+
+/*
+ * A component got a relayed candidate: when racing, its TCP and TLS relay
+ * discoveries not done yet are cancelled, and their connections closed
+ * by the next discovery tick. An Allocate in flight is let finish first,
+ * its allocation is then released. The UDP ones are left to finish.
+ */
+void discovery_relay_won (XiceAgent *agent, Stream *stream,
+    Component *component)
+{
+  GSList *i;
+
+  if (agent->turn_race_delay == 0)
+    return;
+
+  for (i = agent->discovery_list; i; i = i->next) {
+    CandidateDiscovery *d = i->data;
+
+    if (d->type != XICE_CANDIDATE_TYPE_RELAYED ||
+        d->stream != stream || d->component != component ||
+        d->turn->type == XICE_RELAY_TYPE_TURN_UDP || d->done == TRUE)
+      continue;
+
+    xice_debug ("Agent %p : cancelling relay discovery %p, the race is won.",
+        agent, d);
+
+    d->cancelled = TRUE;
+    if (d->pending != TRUE) {
+      /* never started, still counted as unscheduled */
+      if (agent->discovery_unsched_items)
+        --agent->discovery_unsched_items;
+      d->pending = TRUE;
+    } else if (d->stun_message.buffer != NULL) {
+      /* the Allocate is let finish, to release what it gets */
+      continue;
+    }
+    d->done = TRUE;
+    d->stun_message.buffer = NULL;
+    d->stun_message.buffer_len = 0;
+  }
+}
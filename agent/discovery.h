@@ -51,9 +51,11 @@ typedef struct
   XiceCandidateType type;   /**< candidate type STUN or TURN */
   XiceSocket *xicesock;  /**< XXX: should be taken from local cand: existing socket to use */
   XiceAddress server;       /**< STUN/TURN server address */
-  GTimeVal next_tick;       /**< next tick timestamp */
+  gint64 next_tick;         /**< next tick timestamp (context clock, usecs) */
   gboolean pending;         /**< is discovery in progress? */
   gboolean done;            /**< is discovery complete? */
+  gint64 not_before;        /**< when racing, start time of a TCP or TLS relay */
+  gboolean cancelled;       /**< the race is lost, its socket is to be closed */
   Stream *stream;
   Component *component;
   TurnServer *turn;
@@ -67,37 +69,12 @@ typedef struct
   StunMessage stun_resp_msg;
 } CandidateDiscovery;
 
-typedef struct
-{
-  XiceAgent *agent;         /**< back pointer to owner */
-  XiceSocket *xicesock;     /**< existing socket to use */
-  XiceSocket *relay_socket; /**< relay socket from which we receive */
-  XiceAddress server;       /**< STUN/TURN server address */
-  Stream *stream;
-  Component *component;
-  TurnServer *turn;
-  StunAgent stun_agent;
-  XiceTimer *timer_source;
-  XiceTimer *tick_source;
-  uint8_t *msn_turn_username;
-  uint8_t *msn_turn_password;
-  StunTimer timer;
-  uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE];
-  StunMessage stun_message;
-  uint8_t stun_resp_buffer[STUN_MAX_MESSAGE_SIZE];
-  StunMessage stun_resp_msg;
-} CandidateRefresh;
-
-void refresh_free_item (gpointer data, gpointer user_data);
-void refresh_free (XiceAgent *agent);
-void refresh_prune_stream (XiceAgent *agent, guint stream_id);
-void refresh_cancel (CandidateRefresh *refresh);
-
-
 void discovery_free_item (gpointer data, gpointer user_data);
 void discovery_free (XiceAgent *agent);
 void discovery_prune_stream (XiceAgent *agent, guint stream_id);
 void discovery_schedule (XiceAgent *agent);
+void discovery_relay_won (XiceAgent *agent, Stream *stream,
+    Component *component);
 
 XiceCandidate *
 discovery_add_local_host_candidate (
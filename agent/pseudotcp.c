@@ -141,13 +141,23 @@ const guint16 PACKET_MAXIMUMS[] = {
 // 24 |                             data                              |
 //    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 //
+// Once both sides agreed on it at connect time, the Control byte gives the
+// length in 32-bit words of options inserted between the header and the
+// data of non-control segments. Peers predating the options always send 0.
+//
 //////////////////////////////////////////////////////////////////////
 
 #define MAX_SEQ 0xFFFFFFFF
 #define HEADER_SIZE 24
 
-#define PACKET_OVERHEAD (HEADER_SIZE + UDP_HEADER_SIZE + \
-      IP_HEADER_SIZE + JINGLE_HEADER_SIZE)
+// What the path adds below our header, unless told otherwise
+#define DEFAULT_OVERHEAD (UDP_HEADER_SIZE + IP_HEADER_SIZE + JINGLE_HEADER_SIZE)
+
+// Path MTU discovery (RFC 4821): losses of a probe before its size is given
+// up, precision of the search, and how often to look for a larger MTU again
+#define PMTU_MAX_PROBES 3
+#define PMTU_SEARCH_DONE 16
+#define PMTU_RAISE_INTERVAL (10 * 60 * 1000)
 
 // MIN_RTO = 250 ms (RFC1122, Sec 4.2.3.1 "fractions of a second")
 #define MIN_RTO      250
@@ -163,14 +173,43 @@ const guint16 PACKET_MAXIMUMS[] = {
 
 #define FLAG_CTL 0x02
 #define FLAG_RST 0x04
+// Along with FLAG_RST, the sender closed once all its data was acknowledged.
+// Peers that do not know it take the segment as a reset.
+#define FLAG_FIN 0x01
 
 #define CTL_CONNECT  0
 //#define CTL_REDIRECT  1
 #define CTL_EXTRA 255
 
+// Options carried after the CTL_CONNECT code, encoded like TCP options:
+// kind, length of the whole option, then the value. Peers that do not know
+// about options ignore everything after the control code.
+#define TCP_OPT_EOL       0
+#define TCP_OPT_NOOP      1
+#define TCP_OPT_WND_SCALE 3
+#define TCP_OPT_SACK_PERMITTED 4
+#define TCP_OPT_SACK      5
+
+// RFC 1323: the window can be shifted by at most 14 bits
+#define MAX_WND_SCALE 14
+// RFC 2018: at most 4 SACK blocks fit in the 40 bytes of TCP options
+#define MAX_SACK_BLOCKS 4
+
 
 #define CTRL_BOUND 0x80000000
 
+// CUBIC (RFC 8312): window growth constant in segments per second cubed,
+// and multiplicative decrease factor
+#define CUBIC_C    0.4
+#define CUBIC_BETA 0.7
+
+// BBR: the bottleneck bandwidth is the best delivery rate of the last
+// BBR_BW_ROUNDS round trips, the propagation delay the lowest round trip
+// time of the last BBR_MIN_RTT_WINDOW milliseconds
+#define BBR_BW_ROUNDS 10
+#define BBR_MIN_RTT_WINDOW 10000
+#define BBR_CYCLE_LENGTH 8
+
 // If there are no pending clocks, wake up every 4 seconds
 #define DEFAULT_TIMEOUT 4000
 // If the connection is closed, once per minute
@@ -190,14 +229,6 @@ bound(guint32 lower, guint32 middle, guint32 upper)
    return min (max (lower, middle), upper);
 }
 
-static guint32
-get_current_time(void)
-{
-  GTimeVal tv;
-  g_get_current_time (&tv);
-  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
-}
-
 static gboolean
 time_is_between(guint32 later, guint32 middle, guint32 earlier)
 {
@@ -245,7 +276,8 @@ typedef enum {
 } SendFlags;
 
 enum {
-  // Note: can't go as high as 1024 * 64, because of uint16 precision
+  // Default sizes. Receive buffers of 64 KB or more need the window scale
+  // option, as the window field of the header is only 16 bits.
   kRcvBufSize = 1024 * 60,
   // Note: send buffer should be larger to make sure we can always fill the
   // receiver window
@@ -255,25 +287,407 @@ enum {
 typedef struct {
   guint32 conv, seq, ack;
   guint8 flags;
-  guint16 wnd;
+  guint32 wnd;
   const gchar * data;
   guint32 len;
   guint32 tsval, tsecr;
+  const guint8 *options;
+  guint32 options_len;
 } Segment;
 
 typedef struct {
   guint32 seq, len;
   guint8 xmit;
   gboolean bCtrl;
+  gboolean bSacked;
+  // snd_nxt when last retransmitted: once data above it is sacked, the
+  // retransmission was lost too
+  guint32 rxt_nxt;
 } SSegment;
 
 typedef struct {
   guint32 seq, len;
 } RSegment;
 
+/* Growable ring of fixed size elements, kept in order. Elements are removed
+ * from the front and inserted anywhere, usually at the back. The storage
+ * doubles when full and is kept until the socket is freed, so that a
+ * connection stops allocating once it reached its largest window. */
+typedef struct {
+  guint8 *elements;
+  guint32 element_size;
+  guint32 capacity;             // 0 or a power of two
+  guint32 first;
+  guint32 length;
+} PseudoTcpRing;
+
+#define RING_MIN_CAPACITY 16
+
+static void
+pseudo_tcp_ring_init (PseudoTcpRing *r, guint32 element_size)
+{
+  r->elements = NULL;
+  r->element_size = element_size;
+  r->capacity = 0;
+  r->first = 0;
+  r->length = 0;
+}
+
+static void
+pseudo_tcp_ring_clear (PseudoTcpRing *r)
+{
+  g_free (r->elements);
+  r->elements = NULL;
+  r->capacity = 0;
+  r->first = 0;
+  r->length = 0;
+}
+
+static guint32
+pseudo_tcp_ring_get_length (PseudoTcpRing *r)
+{
+  return r->length;
+}
+
+static gpointer
+pseudo_tcp_ring_nth (PseudoTcpRing *r, guint32 i)
+{
+  g_assert (i < r->length);
+
+  return r->elements + ((r->first + i) & (r->capacity - 1)) * r->element_size;
+}
+
+/* Inserts a zeroed element before the @i-th one, or at the back if @i is the
+ * length. Pointers to other elements are invalidated. */
+static gpointer
+pseudo_tcp_ring_insert (PseudoTcpRing *r, guint32 i)
+{
+  guint32 j;
+
+  g_assert (i <= r->length);
+
+  if (r->length == r->capacity) {
+    guint32 capacity = max (2 * r->capacity, RING_MIN_CAPACITY);
+    guint8 *elements = g_malloc (capacity * r->element_size);
+
+    for (j = 0; j < r->length; j++) {
+      memcpy (elements + j * r->element_size, pseudo_tcp_ring_nth (r, j),
+          r->element_size);
+    }
+    g_free (r->elements);
+    r->elements = elements;
+    r->capacity = capacity;
+    r->first = 0;
+  }
+
+  r->length++;
+  for (j = r->length - 1; j > i; j--) {
+    memcpy (pseudo_tcp_ring_nth (r, j), pseudo_tcp_ring_nth (r, j - 1),
+        r->element_size);
+  }
+  memset (pseudo_tcp_ring_nth (r, i), 0, r->element_size);
+
+  return pseudo_tcp_ring_nth (r, i);
+}
+
+static void
+pseudo_tcp_ring_remove_front (PseudoTcpRing *r, guint32 count)
+{
+  g_assert (count <= r->length);
+
+  r->first = (r->first + count) & (r->capacity - 1);
+  r->length -= count;
+}
+
+/* Storage of drained buffers, shared by all sockets. Blocks are powers of
+ * two from 4 KB to 1 MB, and a few of each size are kept for the next
+ * socket that needs one. Free blocks are chained through their first
+ * bytes. */
+#define POOL_MIN_SHIFT 12
+#define POOL_MAX_SHIFT 20
+#define POOL_MAX_BLOCKS 8
+
+static gpointer pool_blocks[POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1];
+static guint pool_counts[POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1];
+G_LOCK_DEFINE_STATIC (pool);
+
+static guint
+pool_shift (gsize size)
+{
+  guint shift = POOL_MIN_SHIFT;
+
+  while (((gsize) 1 << shift) < size)
+    shift++;
+  return shift;
+}
+
+static guint8 *
+pool_alloc (guint shift)
+{
+  guint8 *block = NULL;
+
+  if (shift <= POOL_MAX_SHIFT) {
+    G_LOCK (pool);
+    block = pool_blocks[shift - POOL_MIN_SHIFT];
+    if (block) {
+      pool_blocks[shift - POOL_MIN_SHIFT] = *(gpointer *) block;
+      pool_counts[shift - POOL_MIN_SHIFT]--;
+    }
+    G_UNLOCK (pool);
+  }
+
+  return block ? block : g_malloc ((gsize) 1 << shift);
+}
+
+static void
+pool_free (guint8 *block, guint shift)
+{
+  if (shift <= POOL_MAX_SHIFT) {
+    G_LOCK (pool);
+    if (pool_counts[shift - POOL_MIN_SHIFT] < POOL_MAX_BLOCKS) {
+      *(gpointer *) block = pool_blocks[shift - POOL_MIN_SHIFT];
+      pool_blocks[shift - POOL_MIN_SHIFT] = block;
+      pool_counts[shift - POOL_MIN_SHIFT]++;
+      block = NULL;
+    }
+    G_UNLOCK (pool);
+  }
+
+  g_free (block);
+}
+
+/* Ring buffer of up to buffer_length bytes. Data is consumed from the read
+ * position and appended after it, so neither side ever has to move the rest
+ * of the buffered data around. The storage is only allocated when data
+ * arrives, grows with the amount buffered, and can be released once the
+ * buffer is empty, so idle sockets hold no buffer memory. */
+typedef struct {
+  guint8 *buffer;
+  gsize buffer_length;
+  guint storage_shift;          // the storage holds 1 << storage_shift bytes
+  gsize data_length;
+  gsize read_position;
+} PseudoTcpFifo;
+
+static void
+pseudo_tcp_fifo_init (PseudoTcpFifo *b, gsize size)
+{
+  b->buffer = NULL;
+  b->buffer_length = size;
+  b->storage_shift = 0;
+  b->data_length = 0;
+  b->read_position = 0;
+}
+
+/* Gives the storage back to the pool if nothing is buffered */
+static void
+pseudo_tcp_fifo_release (PseudoTcpFifo *b)
+{
+  if (b->buffer == NULL || b->data_length > 0)
+    return;
+
+  pool_free (b->buffer, b->storage_shift);
+  b->buffer = NULL;
+  b->storage_shift = 0;
+  b->read_position = 0;
+}
+
+static void
+pseudo_tcp_fifo_clear (PseudoTcpFifo *b)
+{
+  b->data_length = 0;
+  pseudo_tcp_fifo_release (b);
+  b->buffer_length = 0;
+}
+
+static gsize
+pseudo_tcp_fifo_get_storage (PseudoTcpFifo *b)
+{
+  return b->buffer ? (gsize) 1 << b->storage_shift : 0;
+}
+
+static gsize
+pseudo_tcp_fifo_get_buffered (PseudoTcpFifo *b)
+{
+  return b->data_length;
+}
+
+static gsize
+pseudo_tcp_fifo_get_write_remaining (PseudoTcpFifo *b)
+{
+  return b->buffer_length - b->data_length;
+}
+
+static void
+pseudo_tcp_fifo_consume_read_data (PseudoTcpFifo *b, gsize size)
+{
+  g_assert (size <= b->data_length);
+
+  if (b->buffer)
+    b->read_position = (b->read_position + size) &
+        (pseudo_tcp_fifo_get_storage (b) - 1);
+  b->data_length -= size;
+}
+
+static void
+pseudo_tcp_fifo_consume_write_buffer (PseudoTcpFifo *b, gsize size)
+{
+  g_assert (size <= b->buffer_length - b->data_length);
+
+  b->data_length += size;
+}
+
+/* Makes room for @size bytes from the read position. The whole storage
+ * is moved, as data may have been written past the buffered data. */
+static void
+pseudo_tcp_fifo_grow (PseudoTcpFifo *b, gsize size)
+{
+  guint shift = pool_shift (size);
+  guint8 *buffer = pool_alloc (shift);
+  gsize storage = pseudo_tcp_fifo_get_storage (b);
+
+  if (b->buffer) {
+    gsize tail_copy = storage - b->read_position;
+
+    memcpy (buffer, &b->buffer[b->read_position], tail_copy);
+    memcpy (buffer + tail_copy, &b->buffer[0], b->read_position);
+    pool_free (b->buffer, b->storage_shift);
+  }
+  b->buffer = buffer;
+  b->storage_shift = shift;
+  b->read_position = 0;
+}
+
+/* Copies up to @bytes of buffered data, starting @offset bytes after the
+ * read position, without consuming it */
+static gsize
+pseudo_tcp_fifo_read_offset (PseudoTcpFifo *b, guint8 *buffer, gsize bytes,
+    gsize offset)
+{
+  gsize read_position, copy, tail_copy;
+
+  if (offset >= b->data_length)
+    return 0;
+
+  read_position = (b->read_position + offset) &
+      (pseudo_tcp_fifo_get_storage (b) - 1);
+  copy = min (bytes, b->data_length - offset);
+  tail_copy = min (copy, pseudo_tcp_fifo_get_storage (b) - read_position);
+
+  memcpy (buffer, &b->buffer[read_position], tail_copy);
+  memcpy (buffer + tail_copy, &b->buffer[0], copy - tail_copy);
+
+  return copy;
+}
+
+/* Copies up to @bytes into the free space, @offset bytes after the end of
+ * the buffered data, without making it readable */
+static gsize
+pseudo_tcp_fifo_write_offset (PseudoTcpFifo *b, const guint8 *buffer,
+    gsize bytes, gsize offset)
+{
+  gsize write_position, copy, tail_copy;
+
+  if (b->data_length + offset >= b->buffer_length)
+    return 0;
+
+  copy = min (bytes, b->buffer_length - b->data_length - offset);
+  if (b->data_length + offset + copy > pseudo_tcp_fifo_get_storage (b))
+    pseudo_tcp_fifo_grow (b, b->data_length + offset + copy);
+
+  write_position = (b->read_position + b->data_length + offset)
+      & (pseudo_tcp_fifo_get_storage (b) - 1);
+  tail_copy = min (copy, pseudo_tcp_fifo_get_storage (b) - write_position);
+
+  memcpy (&b->buffer[write_position], buffer, tail_copy);
+  memcpy (&b->buffer[0], buffer + tail_copy, copy - tail_copy);
+
+  return copy;
+}
+
+/* Changes the size of the buffer, keeping the buffered data. Fails if the
+ * data would not fit. */
+static gboolean
+pseudo_tcp_fifo_set_capacity (PseudoTcpFifo *b, gsize size)
+{
+  if (size < b->data_length)
+    return FALSE;
+
+  b->buffer_length = size;
+
+  return TRUE;
+}
+
+/* Returns the buffered data from the read position, up to the end of the
+ * storage if it wraps around. The storage is first grown to the full
+ * buffer length, so that data written while the region is in use cannot
+ * move it. */
+static const guint8 *
+pseudo_tcp_fifo_peek (PseudoTcpFifo *b, gsize *bytes)
+{
+  if (pseudo_tcp_fifo_get_storage (b) < b->buffer_length)
+    pseudo_tcp_fifo_grow (b, b->buffer_length);
+
+  *bytes = min (b->data_length,
+      pseudo_tcp_fifo_get_storage (b) - b->read_position);
+  return &b->buffer[b->read_position];
+}
+
+static gsize
+pseudo_tcp_fifo_write (PseudoTcpFifo *b, const guint8 *buffer, gsize bytes)
+{
+  gsize copy = pseudo_tcp_fifo_write_offset (b, buffer, bytes, 0);
+
+  pseudo_tcp_fifo_consume_write_buffer (b, copy);
+  return copy;
+}
+
+
+/* A congestion control algorithm. Loss recovery itself is shared: the
+ * algorithms only decide how the window grows and how far it shrinks. */
+typedef struct {
+  // Resets the state of the algorithm, keeping cwnd and ssthresh
+  void (*init) (PseudoTcpSocket *self, guint32 now);
+  // acked bytes of new data were acknowledged. rtt is the round trip time
+  // measured with this ack or -1, and recovering is set when the loss
+  // recovery is in charge of cwnd.
+  void (*on_ack) (PseudoTcpSocket *self, guint32 acked, long rtt,
+      gboolean recovering, guint32 now);
+  // Returns the slow start threshold after a loss
+  guint32 (*ssthresh) (PseudoTcpSocket *self, guint32 now);
+} CongestionOps;
+
+typedef struct {
+  guint32 w_max;                // window before the last reduction
+  guint32 origin;               // window the cubic function plateaus at
+  guint32 w_est;                // window Reno would have
+  guint32 epoch_start;          // start of the growth epoch, 0 if none
+  guint32 k;                    // time to reach origin, in milliseconds
+} CubicState;
+
+typedef enum {
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW
+} BbrMode;
+
+typedef struct {
+  BbrMode mode;
+  guint32 bw[BBR_BW_ROUNDS];    // delivery rates in bytes per second
+  guint32 round;
+  guint32 round_end;            // the round trip ends once this is acked
+  guint32 round_start;
+  guint64 delivered, round_delivered;
+  guint32 min_rtt, min_rtt_stamp;
+  guint32 full_bw;
+  guint full_bw_rounds;
+  guint cycle;
+} BbrState;
 
 struct _PseudoTcpSocketPrivate {
   PseudoTcpCallbacks callbacks;
+  PseudoTcpClockFunc clock;
+  gpointer clock_data;
 
   Shutdown shutdown;
   gint error;
@@ -285,31 +699,67 @@ struct _PseudoTcpSocketPrivate {
   guint32 last_traffic;
 
   // Incoming data
-  GList *rlist;
-  gchar rbuf[kRcvBufSize];
-  guint32 rcv_nxt, rcv_wnd, rlen, lastrecv;
+  PseudoTcpRing rlist;          // RSegments, by sequence number
+  PseudoTcpFifo rbuf;
+  guint32 rcv_nxt, rcv_wnd, lastrecv;
 
   // Outgoing data
-  GList *slist;
-  gchar sbuf[kSndBufSize];
-  guint32 snd_nxt, snd_wnd, slen, lastsend, snd_una;
+  PseudoTcpRing slist;          // SSegments, by sequence number
+  PseudoTcpFifo sbuf;
+  guint32 snd_nxt, snd_wnd, lastsend, snd_una;
   // Maximum segment size, estimated protocol level, largest segment sent
   guint32 mss, msslevel, largest, mtu_advise;
+  // Bytes the path adds below our header
+  guint32 overhead;
+
+  // Path MTU discovery: largest MTU to look for (0 not to probe), MTUs known
+  // to work and to fail, size and start of the probe in flight (0 if none),
+  // losses of probes of that size, and when to probe next
+  guint32 pmtu_max, pmtu_low, pmtu_high;
+  guint32 pmtu_probe, pmtu_probe_seq;
+  guint32 pmtu_failures;
+  guint32 pmtu_next;
   // Retransmit timer
   guint32 rto_base;
 
   // Timestamp tracking
   guint32 ts_recent, ts_lastack;
 
+  // Window scaling: shifts applied to the windows we advertise and to the
+  // windows the peer advertises, both 0 unless the peer supports it
+  gboolean wnd_scale_ok;
+  guint8 rwnd_scale, swnd_scale;
+
+  // Selective acknowledgements (RFC 2018), used if both sides enable them
+  gboolean sack_enabled, sack_ok;
+  // Start of the out of order data received last, reported first
+  guint32 sack_recent;
+  // Highest sequence number the peer selectively acknowledged, and the
+  // lowest one worth retransmitting during this recovery (RFC 6675 HighRxt)
+  guint32 sack_high, sack_rxt;
+
   // Round-trip calculation
   guint32 rx_rttvar, rx_srtt, rx_rto;
 
   // Congestion avoidance, Fast retransmit/recovery, Delayed ACKs
+  PseudoTcpCongestionControl cc_type;
+  const CongestionOps *cc;
+  union {
+    CubicState cubic;
+    BbrState bbr;
+  } cc_state;
   guint32 ssthresh, cwnd;
-  guint8 dup_acks;
+  guint32 dup_acks;
   guint32 recover;
   guint32 t_ack;
 
+  // Send pacing: bytes that may leave before the next segment has to wait,
+  // negative once the segments sent so far are ahead of the pacing rate
+  gboolean pacing;
+  gint32 pace_credit;
+  guint32 pace_last;
+
+  PseudoTcpStats stats;
 };
 
 
@@ -319,6 +769,7 @@ enum
   PROP_CONVERSATION = 1,
   PROP_CALLBACKS,
   PROP_STATE,
+  PROP_CONGESTION_CONTROL,
   LAST_PROPERTY
 };
 
@@ -333,14 +784,34 @@ static void pseudo_tcp_socket_finalize (GObject *object);
 static guint32 queue(PseudoTcpSocket *self, const gchar * data,
     guint32 len, gboolean bCtrl);
 static PseudoTcpWriteResult packet(PseudoTcpSocket *self, guint32 seq,
-    guint8 flags, const gchar * data, guint32 len);
+    guint8 flags, guint32 offset, guint32 len);
 static gboolean parse(PseudoTcpSocket *self,
     const guint8 * buffer, guint32 size);
 static gboolean process(PseudoTcpSocket *self, Segment *seg);
-static gboolean transmit(PseudoTcpSocket *self, const GList *seg, guint32 now);
+static gboolean transmit(PseudoTcpSocket *self, guint32 seg, guint32 now);
 static void attempt_send(PseudoTcpSocket *self, SendFlags sflags);
 static void closedown(PseudoTcpSocket *self, guint32 err);
 static void adjustMTU(PseudoTcpSocket *self);
+static void queue_connect_message(PseudoTcpSocket *self, gboolean reply);
+static void parse_options(PseudoTcpSocket *self, const guint8 *data,
+    guint32 len);
+static guint32 sack_option(PseudoTcpSocket *self, guint8 *buffer);
+static void update_scoreboard(PseudoTcpSocket *self, const guint8 *data,
+    guint32 len);
+static guint32 find_segment(PseudoTcpSocket *self, guint32 seq);
+static gboolean next_hole(PseudoTcpSocket *self, guint32 *hole);
+static gboolean early_retransmit(PseudoTcpSocket *self);
+static gboolean retransmit(PseudoTcpSocket *self, guint32 seg, guint32 now);
+static void set_congestion_control(PseudoTcpSocket *self,
+    PseudoTcpCongestionControl type);
+static guint32 pacing_rate(PseudoTcpSocket *self);
+static guint32 pmtu_probe_size(PseudoTcpSocket *self, guint32 now);
+static gboolean is_probe(PseudoTcpSocket *self, guint32 seg);
+static void pmtu_probe_acked(PseudoTcpSocket *self, guint32 now);
+static void pmtu_probe_lost(PseudoTcpSocket *self, gboolean definitive,
+    guint32 now);
+static gboolean pace(PseudoTcpSocket *self, guint32 rate, guint32 now);
+static gboolean pace_waiting(PseudoTcpSocket *self);
 
 
 // The following logging is for detailed (packet-level) pseudotcp analysis only.
@@ -367,6 +838,17 @@ pseudo_tcp_set_debug_level (PseudoTcpDebugLevel level)
   debug_level = level;
 }
 
+static guint32
+get_current_time(PseudoTcpSocket *socket)
+{
+  PseudoTcpSocketPrivate *priv = socket->priv;
+
+  if (priv->clock)
+    return priv->clock (socket, priv->clock_data);
+
+  return (guint32) (g_get_monotonic_time () / 1000);
+}
+
 static void
 pseudo_tcp_socket_class_init (PseudoTcpSocketClass *cls)
 {
@@ -393,6 +875,21 @@ pseudo_tcp_socket_class_init (PseudoTcpSocketClass *cls)
           XICE_TCP_LISTEN, XICE_TCP_CLOSED, XICE_TCP_LISTEN,
           G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
+  /**
+   * PseudoTcpSocket:congestion-control:
+   *
+   * The congestion control algorithm (enum PseudoTcpCongestionControl) of
+   * the socket. It can be changed at any time, the new algorithm starts
+   * from the current window.
+   *
+   * Since: 0.1.4
+   */
+  g_object_class_install_property (object_class, PROP_CONGESTION_CONTROL,
+      g_param_spec_uint ("congestion-control", "Congestion control",
+          "The congestion control algorithm (enum PseudoTcpCongestionControl)",
+          PSEUDO_TCP_CC_RENO, PSEUDO_TCP_CC_BBR, PSEUDO_TCP_CC_RENO,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 }
 
 
@@ -414,6 +911,9 @@ pseudo_tcp_socket_get_property (GObject *object,
     case PROP_STATE:
       g_value_set_uint (value, self->priv->state);
       break;
+    case PROP_CONGESTION_CONTROL:
+      g_value_set_uint (value, self->priv->cc_type);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -438,6 +938,9 @@ pseudo_tcp_socket_set_property (GObject *object,
         self->priv->callbacks = *c;
       }
       break;
+    case PROP_CONGESTION_CONTROL:
+      set_congestion_control (self, g_value_get_uint (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -449,23 +952,15 @@ pseudo_tcp_socket_finalize (GObject *object)
 {
   PseudoTcpSocket *self = PSEUDO_TCP_SOCKET (object);
   PseudoTcpSocketPrivate *priv = self->priv;
-  GList *i;
 
   if (priv == NULL)
     return;
 
-  for (i = priv->slist; i; i = i->next) {
-    SSegment *sseg = i->data;
-    g_slice_free (SSegment, sseg);
-  }
-  for (i = priv->rlist; i; i = i->next) {
-    RSegment *rseg = i->data;
-    g_slice_free (RSegment, rseg);
-  }
-  g_list_free (priv->slist);
-  priv->slist = NULL;
-  g_list_free (priv->rlist);
-  priv->rlist = NULL;
+  pseudo_tcp_ring_clear (&priv->slist);
+  pseudo_tcp_ring_clear (&priv->rlist);
+
+  pseudo_tcp_fifo_clear (&priv->rbuf);
+  pseudo_tcp_fifo_clear (&priv->sbuf);
 
   g_free (priv);
   self->priv = NULL;
@@ -478,42 +973,64 @@ pseudo_tcp_socket_finalize (GObject *object)
 static void
 pseudo_tcp_socket_init (PseudoTcpSocket *obj)
 {
-  /* Use g_new0, and do not use g_object_set_private because the size of
-   * our private data is too big (150KB+) and the g_slice_allow cannot allocate
-   * it. So we handle the private ourselves */
+  /* Use g_new0, and do not use g_object_set_private, so the private can be
+   * released early in finalize. The buffers are allocated separately, and
+   * only once there is data to hold */
   PseudoTcpSocketPrivate *priv = g_new0 (PseudoTcpSocketPrivate, 1);
-  guint32 now = get_current_time();
+  guint32 now;
 
   obj->priv = priv;
+  now = get_current_time (obj);
 
   priv->shutdown = SD_NONE;
   priv->error = 0;
 
   priv->state = XICE_TCP_LISTEN;
   priv->conv = 0;
-  priv->rcv_wnd = sizeof(priv->rbuf);
-  priv->snd_nxt = priv->slen = 0;
+  pseudo_tcp_fifo_init (&priv->rbuf, kRcvBufSize);
+  pseudo_tcp_fifo_init (&priv->sbuf, kSndBufSize);
+  pseudo_tcp_ring_init (&priv->rlist, sizeof (RSegment));
+  pseudo_tcp_ring_init (&priv->slist, sizeof (SSegment));
+  priv->rcv_wnd = kRcvBufSize;
+  priv->snd_nxt = 0;
   priv->snd_wnd = 1;
-  priv->snd_una = priv->rcv_nxt = priv->rlen = 0;
+  priv->snd_una = priv->rcv_nxt = 0;
   priv->bReadEnable = TRUE;
   priv->bWriteEnable = FALSE;
   priv->t_ack = 0;
 
   priv->msslevel = 0;
   priv->largest = 0;
-  priv->mss = MIN_PACKET - PACKET_OVERHEAD;
+  priv->overhead = DEFAULT_OVERHEAD;
+  priv->mss = MIN_PACKET - HEADER_SIZE - priv->overhead;
   priv->mtu_advise = MAX_PACKET;
+  priv->pmtu_max = 0;
+  priv->pmtu_low = priv->mtu_advise;
+  priv->pmtu_high = 0;
+  priv->pmtu_probe = priv->pmtu_probe_seq = 0;
+  priv->pmtu_failures = 0;
+  priv->pmtu_next = now;
 
   priv->rto_base = 0;
 
   priv->cwnd = 2 * priv->mss;
-  priv->ssthresh = sizeof(priv->rbuf);
+  priv->ssthresh = kRcvBufSize;
+  set_congestion_control(obj, PSEUDO_TCP_CC_RENO);
+  priv->wnd_scale_ok = FALSE;
+  priv->rwnd_scale = priv->swnd_scale = 0;
+  priv->sack_enabled = TRUE;
+  priv->sack_ok = FALSE;
+  priv->sack_recent = priv->sack_high = priv->sack_rxt = 0;
   priv->lastrecv = priv->lastsend = priv->last_traffic = now;
   priv->bOutgoing = FALSE;
 
   priv->dup_acks = 0;
   priv->recover = 0;
 
+  priv->pacing = FALSE;
+  priv->pace_credit = 0;
+  priv->pace_last = now;
+
   priv->ts_recent = priv->ts_lastack = 0;
 
   priv->rx_rto = DEF_RTO;
@@ -530,11 +1047,26 @@ PseudoTcpSocket *pseudo_tcp_socket_new (guint32 conversation,
       NULL);
 }
 
+void
+pseudo_tcp_socket_set_clock (PseudoTcpSocket *self, PseudoTcpClockFunc func,
+    gpointer user_data)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  priv->clock = func;
+  priv->clock_data = user_data;
+
+  /* Re-stamp the idle timestamps so they are expressed in the new time base */
+  if (priv->state == XICE_TCP_LISTEN) {
+    guint32 now = get_current_time (self);
+    priv->lastrecv = priv->lastsend = priv->last_traffic = now;
+  }
+}
+
 gboolean
 pseudo_tcp_socket_connect(PseudoTcpSocket *self)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  gchar buffer[1];
 
   if (priv->state != XICE_TCP_LISTEN) {
     priv->error = EINVAL;
@@ -544,8 +1076,7 @@ pseudo_tcp_socket_connect(PseudoTcpSocket *self)
   priv->state = XICE_TCP_SYN_SENT;
   DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "State: XICE_TCP_SYN_SENT");
 
-  buffer[0] = CTL_CONNECT;
-  queue(self, buffer, 1, TRUE);
+  queue_connect_message(self, FALSE);
   attempt_send(self, sfNone);
 
   return TRUE;
@@ -565,7 +1096,7 @@ void
 pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  guint32 now = get_current_time ();
+  guint32 now = get_current_time (self);
 
   if (priv->state == XICE_TCP_CLOSED)
     return;
@@ -573,26 +1104,26 @@ pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self)
   // Check if it's time to retransmit a segment
   if (priv->rto_base &&
       (time_diff(priv->rto_base + priv->rx_rto, now) <= 0)) {
-    if (g_list_length (priv->slist) == 0) {
+    if (pseudo_tcp_ring_get_length (&priv->slist) == 0) {
       g_assert_not_reached ();
     } else {
       // Note: (priv->slist.front().xmit == 0)) {
       // retransmit segments
-      guint32 nInFlight;
       guint32 rto_limit;
 
       DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "timeout retransmit (rto: %d) "
           "(rto_base: %d) (now: %d) (dup_acks: %d)",
           priv->rx_rto, priv->rto_base, now, (guint) priv->dup_acks);
 
-      if (!transmit(self, priv->slist, now)) {
+      priv->stats.timeouts++;
+      // Holes the peer did not report are worth resending again
+      priv->sack_rxt = priv->snd_una;
+      if (!retransmit(self, 0, now)) {
         closedown(self, ECONNABORTED);
         return;
       }
 
-      nInFlight = priv->snd_nxt - priv->snd_una;
-      priv->ssthresh = max(nInFlight / 2, 2 * priv->mss);
-      //LOG(LS_INFO) << "priv->ssthresh: " << priv->ssthresh << "  nInFlight: " << nInFlight << "  priv->mss: " << priv->mss;
+      priv->ssthresh = priv->cc->ssthresh(self, now);
       priv->cwnd = priv->mss;
 
       // Back off retransmit timer.  Note: the limit is lower when connecting.
@@ -605,7 +1136,10 @@ pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self)
   // Check if it's time to probe closed windows
   if ((priv->snd_wnd == 0)
         && (time_diff(priv->lastsend + priv->rx_rto, now) <= 0)) {
-    if (time_diff(now, priv->lastrecv) >= 15000) {
+    // A peer answering the probes only keeps its window closed, so give up
+    // only when the last probe went unanswered
+    if ((time_diff(now, priv->lastrecv) >= 15000)
+        && (time_diff(priv->lastsend, priv->lastrecv) > 0)) {
       closedown(self, ECONNABORTED);
       return;
     }
@@ -623,6 +1157,11 @@ pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self)
     packet(self, priv->snd_nxt, 0, 0, 0);
   }
 
+  // Check if it's time to release paced segments
+  if (pace_waiting(self)) {
+    attempt_send(self, sfNone);
+  }
+
 }
 
 gboolean
@@ -640,14 +1179,15 @@ gboolean
 pseudo_tcp_socket_get_next_clock(PseudoTcpSocket *self, long *timeout)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  guint32 now = get_current_time ();
+  guint32 now = get_current_time (self);
 
   if (priv->shutdown == SD_FORCEFUL)
     return FALSE;
 
   if ((priv->shutdown == SD_GRACEFUL)
       && ((priv->state != XICE_TCP_ESTABLISHED)
-          || ((priv->slen == 0) && (priv->t_ack == 0)))) {
+          || ((pseudo_tcp_fifo_get_buffered (&priv->sbuf) == 0)
+              && (priv->t_ack == 0)))) {
     return FALSE;
   }
 
@@ -667,49 +1207,98 @@ pseudo_tcp_socket_get_next_clock(PseudoTcpSocket *self, long *timeout)
   if (priv->snd_wnd == 0) {
     *timeout = min(*timeout, time_diff(priv->lastsend + priv->rx_rto, now));
   }
+  if (pace_waiting(self)) {
+    guint32 rate = pacing_rate(self);
+    *timeout = min(*timeout, (long) ((guint32) -priv->pace_credit / rate + 1));
+  }
 
   return TRUE;
 }
 
 
+// The data received before the connection closed can still be read
+static gboolean
+can_read(PseudoTcpSocketPrivate *priv)
+{
+  return priv->state == XICE_TCP_ESTABLISHED ||
+      (priv->state == XICE_TCP_CLOSED &&
+          pseudo_tcp_fifo_get_buffered (&priv->rbuf) > 0);
+}
+
 gint
 pseudo_tcp_socket_recv(PseudoTcpSocket *self, char * buffer, size_t len)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  guint32 read;
+  gsize read;
 
-  if (priv->state != XICE_TCP_ESTABLISHED) {
+  if (!can_read(priv)) {
     priv->error = ENOTCONN;
     return -1;
   }
 
-  if (priv->rlen == 0) {
+  if (pseudo_tcp_fifo_get_buffered (&priv->rbuf) == 0) {
+    priv->bReadEnable = TRUE;
+    priv->error = EWOULDBLOCK;
+    return -1;
+  }
+
+  read = pseudo_tcp_fifo_read_offset (&priv->rbuf, (guint8 *) buffer, len, 0);
+  return pseudo_tcp_socket_consume (self, read);
+}
+
+const gchar *
+pseudo_tcp_socket_peek(PseudoTcpSocket *self, gsize *len)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  *len = 0;
+
+  if (!can_read(priv)) {
+    priv->error = ENOTCONN;
+    return NULL;
+  }
+
+  if (pseudo_tcp_fifo_get_buffered (&priv->rbuf) == 0) {
     priv->bReadEnable = TRUE;
     priv->error = EWOULDBLOCK;
+    return NULL;
+  }
+
+  return (const gchar *) pseudo_tcp_fifo_peek (&priv->rbuf, len);
+}
+
+gint
+pseudo_tcp_socket_consume(PseudoTcpSocket *self, gsize len)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  gsize available_space;
+
+  if (!can_read(priv)) {
+    priv->error = ENOTCONN;
     return -1;
   }
 
-  read = min((guint32) len, priv->rlen);
-  memcpy(buffer, priv->rbuf, read);
-  priv->rlen -= read;
+  g_return_val_if_fail (len <= pseudo_tcp_fifo_get_buffered (&priv->rbuf),
+      -1);
 
-  /* !?! until we create a circular buffer, we need to move all of the rest
-     of the buffer up! */
-  memmove(priv->rbuf, priv->rbuf + read, sizeof(priv->rbuf) - read);
+  pseudo_tcp_fifo_consume_read_data (&priv->rbuf, len);
+  if (pseudo_tcp_ring_get_length (&priv->rlist) == 0)
+    pseudo_tcp_fifo_release (&priv->rbuf);
 
-  if ((sizeof(priv->rbuf) - priv->rlen - priv->rcv_wnd)
-      >= min(sizeof(priv->rbuf) / 2, priv->mss)) {
+  available_space = pseudo_tcp_fifo_get_write_remaining (&priv->rbuf);
+  if ((available_space - priv->rcv_wnd)
+      >= min(priv->rbuf.buffer_length / 2, priv->mss)) {
     // !?! Not sure about this was closed business
     gboolean bWasClosed = (priv->rcv_wnd == 0);
 
-    priv->rcv_wnd = sizeof(priv->rbuf) - priv->rlen;
+    priv->rcv_wnd = available_space;
 
-    if (bWasClosed) {
+    if (bWasClosed && priv->state == XICE_TCP_ESTABLISHED) {
       attempt_send(self, sfImmediateAck);
     }
   }
 
-  return read;
+  return len;
 }
 
 gint
@@ -723,7 +1312,7 @@ pseudo_tcp_socket_send(PseudoTcpSocket *self, const char * buffer, guint32 len)
     return -1;
   }
 
-  if (priv->slen == sizeof(priv->sbuf)) {
+  if (pseudo_tcp_fifo_get_write_remaining (&priv->sbuf) == 0) {
     priv->bWriteEnable = TRUE;
     priv->error = EWOULDBLOCK;
     return -1;
@@ -747,6 +1336,25 @@ pseudo_tcp_socket_close(PseudoTcpSocket *self, gboolean force)
   priv->shutdown = force ? SD_FORCEFUL : SD_GRACEFUL;
 }
 
+void
+pseudo_tcp_socket_finish_close(PseudoTcpSocket *self)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint8 flags = FLAG_RST;
+
+  if (priv->state == XICE_TCP_ESTABLISHED) {
+    if (priv->shutdown == SD_GRACEFUL &&
+        pseudo_tcp_fifo_get_buffered (&priv->sbuf) == 0)
+      flags |= FLAG_FIN;
+    packet(self, priv->snd_nxt, flags, 0, 0);
+  }
+
+  pseudo_tcp_fifo_consume_read_data (&priv->sbuf,
+      pseudo_tcp_fifo_get_buffered (&priv->sbuf));
+  priv->shutdown = SD_FORCEFUL;
+  priv->state = XICE_TCP_CLOSED;
+}
+
 int
 pseudo_tcp_socket_get_error(PseudoTcpSocket *self)
 {
@@ -754,6 +1362,88 @@ pseudo_tcp_socket_get_error(PseudoTcpSocket *self)
   return priv->error;
 }
 
+void
+pseudo_tcp_socket_get_stats(PseudoTcpSocket *self, PseudoTcpStats *stats)
+{
+  *stats = self->priv->stats;
+  stats->smoothed_rtt = self->priv->rx_srtt;
+}
+
+void
+pseudo_tcp_socket_set_option(PseudoTcpSocket *self, PseudoTcpOption option,
+    guint32 value)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  switch (option) {
+    case PSEUDO_TCP_OPT_SNDBUF:
+      g_return_if_fail (value > 0);
+      if (!pseudo_tcp_fifo_set_capacity (&priv->sbuf, value))
+        DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "send buffer holds more than %u bytes",
+            value);
+      break;
+    case PSEUDO_TCP_OPT_RCVBUF:
+      /* the window scale is negotiated from the receive buffer size */
+      g_return_if_fail (value > 0);
+      g_return_if_fail (priv->state == XICE_TCP_LISTEN);
+      pseudo_tcp_fifo_set_capacity (&priv->rbuf, value);
+      priv->rcv_wnd = value;
+      priv->ssthresh = value;
+      break;
+    case PSEUDO_TCP_OPT_SACK:
+      g_return_if_fail (priv->state == XICE_TCP_LISTEN);
+      priv->sack_enabled = (value != 0);
+      break;
+    case PSEUDO_TCP_OPT_PACING:
+      priv->pacing = (value != 0);
+      priv->pace_credit = 0;
+      priv->pace_last = get_current_time (self);
+      break;
+    case PSEUDO_TCP_OPT_OVERHEAD:
+      g_return_if_fail (HEADER_SIZE + value < MIN_PACKET);
+      priv->overhead = value;
+      if (priv->state == XICE_TCP_ESTABLISHED)
+        adjustMTU(self);
+      break;
+    case PSEUDO_TCP_OPT_MAX_MTU:
+      g_return_if_fail (value <= MAX_PACKET);
+      priv->pmtu_max = value;
+      priv->pmtu_high = value + 1;
+      priv->pmtu_failures = 0;
+      priv->pmtu_next = get_current_time (self);
+      break;
+    default:
+      g_return_if_reached ();
+  }
+}
+
+guint32
+pseudo_tcp_socket_get_option(PseudoTcpSocket *self, PseudoTcpOption option)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  switch (option) {
+    case PSEUDO_TCP_OPT_SNDBUF:
+      return priv->sbuf.buffer_length;
+    case PSEUDO_TCP_OPT_RCVBUF:
+      return priv->rbuf.buffer_length;
+    case PSEUDO_TCP_OPT_SACK:
+      return priv->sack_enabled;
+    case PSEUDO_TCP_OPT_PACING:
+      return priv->pacing;
+    case PSEUDO_TCP_OPT_OVERHEAD:
+      return priv->overhead;
+    case PSEUDO_TCP_OPT_MAX_MTU:
+      return priv->pmtu_max;
+    case PSEUDO_TCP_OPT_MTU:
+      if (priv->state != XICE_TCP_ESTABLISHED)
+        return 0;
+      return priv->mss + HEADER_SIZE + priv->overhead;
+    default:
+      g_return_val_if_reached (0);
+  }
+}
+
 //
 // Internal Implementation
 //
@@ -762,40 +1452,41 @@ static guint32
 queue(PseudoTcpSocket *self, const gchar * data, guint32 len, gboolean bCtrl)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
+  gsize available_space = pseudo_tcp_fifo_get_write_remaining (&priv->sbuf);
+  guint32 nSegments = pseudo_tcp_ring_get_length (&priv->slist);
+  SSegment *last = NULL;
 
-  if (len > sizeof(priv->sbuf) - priv->slen) {
+  if (len > available_space) {
     g_assert(!bCtrl);
-    len = sizeof(priv->sbuf) - priv->slen;
+    len = available_space;
   }
 
   // We can concatenate data if the last segment is the same type
   // (control v. regular data), and has not been transmitted yet
-  if (g_list_length (priv->slist) > 0 &&
-      (((SSegment *)g_list_last (priv->slist)->data)->bCtrl == bCtrl) &&
-      (((SSegment *)g_list_last (priv->slist)->data)->xmit == 0)) {
-    ((SSegment *)g_list_last (priv->slist)->data)->len += len;
+  if (nSegments > 0)
+    last = pseudo_tcp_ring_nth (&priv->slist, nSegments - 1);
+  if (last && last->bCtrl == bCtrl && last->xmit == 0) {
+    last->len += len;
   } else {
-    SSegment *sseg = g_slice_new0 (SSegment);
-    sseg->seq = priv->snd_una + priv->slen;
+    SSegment *sseg = pseudo_tcp_ring_insert (&priv->slist, nSegments);
+    sseg->seq = priv->snd_una + pseudo_tcp_fifo_get_buffered (&priv->sbuf);
     sseg->len = len;
     sseg->bCtrl = bCtrl;
-    priv->slist = g_list_append (priv->slist, sseg);
   }
 
-  memcpy(priv->sbuf + priv->slen, data, len);
-  priv->slen += len;
-  //LOG(LS_INFO) << "PseudoTcp::queue - priv->slen = " << priv->slen;
-  return len;
+  return pseudo_tcp_fifo_write (&priv->sbuf, (const guint8 *) data, len);
 }
 
 static PseudoTcpWriteResult
 packet(PseudoTcpSocket *self, guint32 seq, guint8 flags,
-    const gchar * data, guint32 len)
+    guint32 offset, guint32 len)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  guint32 now = get_current_time();
+  guint32 now = get_current_time (self);
   guint8 buffer[MAX_PACKET];
   PseudoTcpWriteResult wres = WR_SUCCESS;
+  guint32 wnd;
+  guint32 options_len = 0;
 
   g_assert(HEADER_SIZE + len <= MAX_PACKET);
 
@@ -804,28 +1495,48 @@ packet(PseudoTcpSocket *self, guint32 seq, guint8 flags,
   *((guint32 *) (buffer + 8)) = htonl(priv->rcv_nxt);
   buffer[12] = 0;
   buffer[13] = flags;
-  *((guint16 *) (buffer + 14)) = htons((guint16)priv->rcv_wnd);
+  // Windows are never scaled in control segments, as in TCP SYNs
+  if (flags & FLAG_CTL)
+    wnd = min(priv->rcv_wnd, 0xFFFF);
+  else
+    wnd = min(priv->rcv_wnd >> priv->rwnd_scale, 0xFFFF);
+  *((guint16 *) (buffer + 14)) = htons((guint16)wnd);
 
   // Timestamp computations
   *((guint32 *) (buffer + 16)) = htonl(now);
   *((guint32 *) (buffer + 20)) = htonl(priv->ts_recent);
   priv->ts_lastack = priv->rcv_nxt;
 
-  if (data != NULL)
-    memcpy(buffer + HEADER_SIZE, data, len);
+  // Pure acks report the out of order data, so that data segments never
+  // grow past the mss
+  if (len == 0 && !(flags & FLAG_CTL) && priv->sack_ok &&
+      pseudo_tcp_ring_get_length (&priv->rlist) > 0) {
+    options_len = sack_option(self, buffer + HEADER_SIZE);
+    buffer[12] = options_len / 4;
+  }
+
+  if (len) {
+    gsize bytes_read = pseudo_tcp_fifo_read_offset (&priv->sbuf,
+        buffer + HEADER_SIZE, len, offset);
+    g_assert (bytes_read == len);
+  }
 
   DEBUG (PSEUDO_TCP_DEBUG_VERBOSE, "<-- <CONV=%d><FLG=%d><SEQ=%d:%d><ACK=%d>"
       "<WND=%d><TS=%d><TSR=%d><LEN=%d>",
       priv->conv, (unsigned)flags, seq, seq + len, priv->rcv_nxt, priv->rcv_wnd,
       now % 10000, priv->ts_recent % 10000, len);
 
-  wres = priv->callbacks.WritePacket(self, (gchar *) buffer, len + HEADER_SIZE,
-                                     priv->callbacks.user_data);
-  /* Note: When data is NULL, this is an ACK packet.  We don't read the
+  wres = priv->callbacks.WritePacket(self, (gchar *) buffer,
+      len + HEADER_SIZE + options_len, priv->callbacks.user_data);
+  if (wres == WR_SUCCESS) {
+    priv->stats.packets_sent++;
+    priv->stats.bytes_sent += len;
+  }
+  /* Note: When len is 0, this is an ACK packet.  We don't read the
      return value for those, and thus we won't retry.  So go ahead and treat
      the packet as a success (basically simulate as if it were dropped),
      which will prevent our timers from being messed up. */
-  if ((wres != WR_SUCCESS) && (NULL != data))
+  if ((wres != WR_SUCCESS) && (0 != len))
     return wres;
 
   priv->t_ack = 0;
@@ -842,21 +1553,35 @@ static gboolean
 parse(PseudoTcpSocket *self, const guint8 * buffer, guint32 size)
 {
   Segment seg;
+  guint32 header_len = HEADER_SIZE;
 
   if (size < 12)
     return FALSE;
 
+  self->priv->stats.packets_received++;
+
   seg.conv = ntohl(*(guint32 *)buffer);
   seg.seq = ntohl(*(guint32 *)(buffer + 4));
   seg.ack = ntohl(*(guint32 *)(buffer + 8));
   seg.flags = buffer[13];
   seg.wnd = ntohs(*(guint16 *)(buffer + 14));
+  if ((seg.flags & FLAG_CTL) == 0)
+    seg.wnd <<= self->priv->swnd_scale;
 
   seg.tsval = ntohl(*(guint32 *)(buffer + 16));
   seg.tsecr = ntohl(*(guint32 *)(buffer + 20));
 
-  seg.data = ((gchar *)buffer) + HEADER_SIZE;
-  seg.len = size - HEADER_SIZE;
+  seg.options = buffer + HEADER_SIZE;
+  seg.options_len = 0;
+  if ((seg.flags & FLAG_CTL) == 0 && size > 12) {
+    seg.options_len = buffer[12] * 4;
+    header_len += seg.options_len;
+    if (size < header_len)
+      return FALSE;
+  }
+
+  seg.data = ((gchar *)buffer) + header_len;
+  seg.len = size - header_len;
 
   DEBUG (PSEUDO_TCP_DEBUG_VERBOSE, "--> <CONV=%d><FLG=%d><SEQ=%d:%d><ACK=%d>"
       "<WND=%d><TS=%d><TSR=%d><LEN=%d>",
@@ -875,7 +1600,9 @@ process(PseudoTcpSocket *self, Segment *seg)
   SendFlags sflags = sfNone;
   gboolean bIgnoreData;
   gboolean bNewData;
+  gboolean bWritable = FALSE;
   gboolean bConnect = FALSE;
+  gsize available_space;
 
   /* If this is the wrong conversation, send a reset!?!
      (with the correct conversation?) */
@@ -887,7 +1614,7 @@ process(PseudoTcpSocket *self, Segment *seg)
     return FALSE;
   }
 
-  now = get_current_time();
+  now = get_current_time (self);
   priv->last_traffic = priv->lastrecv = now;
   priv->bOutgoing = FALSE;
 
@@ -899,7 +1626,7 @@ process(PseudoTcpSocket *self, Segment *seg)
 
   // Check if this is a reset segment
   if (seg->flags & FLAG_RST) {
-    closedown(self, ECONNRESET);
+    closedown(self, (seg->flags & FLAG_FIN) ? 0 : ECONNRESET);
     return FALSE;
   }
 
@@ -912,11 +1639,11 @@ process(PseudoTcpSocket *self, Segment *seg)
     } else if (seg->data[0] == CTL_CONNECT) {
       bConnect = TRUE;
       if (priv->state == XICE_TCP_LISTEN) {
-        char buffer[1];
         priv->state = XICE_TCP_SYN_RECEIVED;
-        buffer[0] = CTL_CONNECT;
-        queue(self, buffer, 1, TRUE);
+        parse_options(self, (const guint8 *) seg->data + 1, seg->len - 1);
+        queue_connect_message(self, TRUE);
       } else if (priv->state == XICE_TCP_SYN_SENT) {
+        parse_options(self, (const guint8 *) seg->data + 1, seg->len - 1);
         priv->state = XICE_TCP_ESTABLISHED;
         DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "State: XICE_TCP_ESTABLISHED");
         adjustMTU(self);
@@ -930,6 +1657,9 @@ process(PseudoTcpSocket *self, Segment *seg)
     }
   }
 
+  if (seg->options_len > 0 && priv->sack_ok)
+    update_scoreboard(self, seg->options, seg->options_len);
+
   // Update timestamp
   if ((seg->seq <= priv->ts_lastack) &&
       (priv->ts_lastack < seg->seq + seg->len)) {
@@ -941,10 +1671,11 @@ process(PseudoTcpSocket *self, Segment *seg)
     guint32 nAcked;
     guint32 nFree;
     guint32 kIdealRefillSize;
+    long rtt = -1;
 
     // Calculate round-trip time
     if (seg->tsecr) {
-      long rtt = time_diff(now, seg->tsecr);
+      rtt = time_diff(now, seg->tsecr);
       if (rtt >= 0) {
         if (priv->rx_srtt == 0) {
           priv->rx_srtt = rtt;
@@ -971,15 +1702,16 @@ process(PseudoTcpSocket *self, Segment *seg)
 
     priv->rto_base = (priv->snd_una == priv->snd_nxt) ? 0 : now;
 
-    priv->slen -= nAcked;
-    memmove(priv->sbuf, priv->sbuf + nAcked, priv->slen);
-    //LOG(LS_INFO) << "PseudoTcp::process - priv->slen = " << priv->slen;
+    pseudo_tcp_fifo_consume_read_data (&priv->sbuf, nAcked);
+    pseudo_tcp_fifo_release (&priv->sbuf);
 
-    for (nFree = nAcked; nFree > 0; ) {
-      SSegment *data;
+    if (priv->pmtu_probe && (priv->snd_una >= priv->pmtu_probe_seq +
+            priv->pmtu_probe - HEADER_SIZE - priv->overhead)) {
+      pmtu_probe_acked(self, now);
+    }
 
-      g_assert(priv->slist != NULL);
-      data = (SSegment *) (priv->slist->data);
+    for (nFree = nAcked; nFree > 0; ) {
+      SSegment *data = pseudo_tcp_ring_nth (&priv->slist, 0);
 
       if (nFree < data->len) {
         data->len -= nFree;
@@ -989,8 +1721,7 @@ process(PseudoTcpSocket *self, Segment *seg)
           priv->largest = data->len;
         }
         nFree -= data->len;
-        g_slice_free (SSegment, priv->slist->data);
-        priv->slist = g_list_delete_link (priv->slist, priv->slist);
+        pseudo_tcp_ring_remove_front (&priv->slist, 1);
       }
     }
 
@@ -1001,22 +1732,24 @@ process(PseudoTcpSocket *self, Segment *seg)
         priv->cwnd = min(priv->ssthresh, nInFlight + priv->mss);
         DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "exit recovery");
         priv->dup_acks = 0;
+        priv->cc->on_ack(self, nAcked, rtt, TRUE, now);
       } else {
-        DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
-        if (!transmit(self, priv->slist, now)) {
-          closedown(self, ECONNABORTED);
-          return FALSE;
+        guint32 hole = 0;
+
+        if (!priv->sack_ok || next_hole(self, &hole)) {
+          DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
+          priv->stats.fast_retransmits++;
+          if (!retransmit(self, hole, now)) {
+            closedown(self, ECONNABORTED);
+            return FALSE;
+          }
         }
         priv->cwnd += priv->mss - min(nAcked, priv->cwnd);
+        priv->cc->on_ack(self, nAcked, rtt, TRUE, now);
       }
     } else {
       priv->dup_acks = 0;
-      // Slow start, congestion avoidance
-      if (priv->cwnd < priv->ssthresh) {
-        priv->cwnd += priv->mss;
-      } else {
-        priv->cwnd += max(1LU, priv->mss * priv->mss / priv->cwnd);
-      }
+      priv->cc->on_ack(self, nAcked, rtt, FALSE, now);
     }
 
     // !?! A bit hacky
@@ -1031,11 +1764,13 @@ process(PseudoTcpSocket *self, Segment *seg)
     // If we make room in the send queue, notify the user
     // The goal it to make sure we always have at least enough data to fill the
     // window.  We'd like to notify the app when we are halfway to that point.
-    kIdealRefillSize = (sizeof(priv->sbuf) + sizeof(priv->rbuf)) / 2;
-    if (priv->bWriteEnable && (priv->slen < kIdealRefillSize)) {
+    // The user is only notified once the whole segment is processed, so
+    // that whatever it sends acknowledges the data of this segment too.
+    kIdealRefillSize = (priv->sbuf.buffer_length + priv->rbuf.buffer_length) / 2;
+    if (priv->bWriteEnable &&
+        (pseudo_tcp_fifo_get_buffered (&priv->sbuf) < kIdealRefillSize)) {
       priv->bWriteEnable = FALSE;
-      if (priv->callbacks.PseudoTcpWritable)
-        priv->callbacks.PseudoTcpWritable(self, priv->callbacks.user_data);
+      bWritable = TRUE;
     }
   } else if (seg->ack == priv->snd_una) {
     /* !?! Note, tcp says don't do this... but otherwise how does a
@@ -1046,23 +1781,41 @@ process(PseudoTcpSocket *self, Segment *seg)
     if (seg->len > 0) {
       // it's a dup ack, but with a data payload, so don't modify priv->dup_acks
     } else if (priv->snd_una != priv->snd_nxt) {
-      guint32 nInFlight;
-
       priv->dup_acks += 1;
+      if (priv->dup_acks < 3 && priv->sack_ok && early_retransmit(self))
+        priv->dup_acks = 3;
       if (priv->dup_acks == 3) { // (Fast Retransmit)
+        gboolean probe = is_probe(self, 0);
+
         DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "enter recovery");
         DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
-        if (!transmit(self, priv->slist, now)) {
+        priv->stats.fast_retransmits++;
+        priv->sack_rxt = priv->snd_una;
+        if (!retransmit(self, 0, now)) {
           closedown(self, ECONNABORTED);
           return FALSE;
         }
         priv->recover = priv->snd_nxt;
-        nInFlight = priv->snd_nxt - priv->snd_una;
-        priv->ssthresh = max(nInFlight / 2, 2 * priv->mss);
-        //LOG(LS_INFO) << "priv->ssthresh: " << priv->ssthresh << "  nInFlight: " << nInFlight << "  priv->mss: " << priv->mss;
-        priv->cwnd = priv->ssthresh + 3 * priv->mss;
+        // The loss of a path MTU probe is no sign of congestion
+        if (!probe) {
+          priv->ssthresh = priv->cc->ssthresh(self, now);
+          priv->cwnd = priv->ssthresh + 3 * priv->mss;
+        }
       } else if (priv->dup_acks > 3) {
-        priv->cwnd += priv->mss;
+        guint32 hole;
+
+        // With SACK, the segment that left the network makes room for the
+        // next hole rather than for new data
+        if (priv->sack_ok && next_hole(self, &hole)) {
+          DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "recovery retransmit");
+          priv->stats.fast_retransmits++;
+          if (!retransmit(self, hole, now)) {
+            closedown(self, ECONNABORTED);
+            return FALSE;
+          }
+        } else {
+          priv->cwnd += priv->mss;
+        }
       }
     } else {
       priv->dup_acks = 0;
@@ -1101,10 +1854,9 @@ process(PseudoTcpSocket *self, Segment *seg)
       seg->len = 0;
     }
   }
-  if ((seg->seq + seg->len - priv->rcv_nxt) >
-      (sizeof(priv->rbuf) - priv->rlen)) {
-    guint32 nAdjust = seg->seq + seg->len - priv->rcv_nxt -
-        (sizeof(priv->rbuf) - priv->rlen);
+  available_space = pseudo_tcp_fifo_get_write_remaining (&priv->rbuf);
+  if ((seg->seq + seg->len - priv->rcv_nxt) > available_space) {
+    guint32 nAdjust = seg->seq + seg->len - priv->rcv_nxt - available_space;
     if (nAdjust < seg->len) {
       seg->len -= nAdjust;
     } else {
@@ -1122,50 +1874,65 @@ process(PseudoTcpSocket *self, Segment *seg)
       }
     } else {
       guint32 nOffset = seg->seq - priv->rcv_nxt;
-      memcpy(priv->rbuf + priv->rlen + nOffset, seg->data, seg->len);
+      gsize res;
+
+      res = pseudo_tcp_fifo_write_offset (&priv->rbuf,
+          (const guint8 *) seg->data, seg->len, nOffset);
+      g_assert (res == seg->len);
+
       if (seg->seq == priv->rcv_nxt) {
-        GList *iter = NULL;
+        guint32 nSegments = pseudo_tcp_ring_get_length (&priv->rlist);
+        guint32 i;
 
-        priv->rlen += seg->len;
+        pseudo_tcp_fifo_consume_write_buffer (&priv->rbuf, seg->len);
         priv->rcv_nxt += seg->len;
         priv->rcv_wnd -= seg->len;
         bNewData = TRUE;
 
-        iter = priv->rlist;
-        while (iter && (((RSegment *)iter->data)->seq <= priv->rcv_nxt)) {
-          RSegment *data = (RSegment *)(iter->data);
+        for (i = 0; i < nSegments; i++) {
+          RSegment *data = pseudo_tcp_ring_nth (&priv->rlist, i);
+          if (data->seq > priv->rcv_nxt)
+            break;
           if (data->seq + data->len > priv->rcv_nxt) {
             guint32 nAdjust = (data->seq + data->len) - priv->rcv_nxt;
             sflags = sfImmediateAck; // (Fast Recovery)
             DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Recovered %d bytes (%d -> %d)",
                 nAdjust, priv->rcv_nxt, priv->rcv_nxt + nAdjust);
-            priv->rlen += nAdjust;
+            pseudo_tcp_fifo_consume_write_buffer (&priv->rbuf, nAdjust);
             priv->rcv_nxt += nAdjust;
             priv->rcv_wnd -= nAdjust;
           }
-          g_slice_free (RSegment, priv->rlist->data);
-          priv->rlist = g_list_delete_link (priv->rlist, priv->rlist);
-          iter = priv->rlist;
         }
+        pseudo_tcp_ring_remove_front (&priv->rlist, i);
       } else {
-        GList *iter = NULL;
-        RSegment *rseg = g_slice_new0 (RSegment);
+        guint32 lo = 0, hi = pseudo_tcp_ring_get_length (&priv->rlist);
+        RSegment *rseg;
 
         DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Saving %d bytes (%d -> %d)",
             seg->len, seg->seq, seg->seq + seg->len);
+        priv->sack_recent = seg->seq;
+        // Out of order data mostly arrives in order after a hole, so this
+        // usually appends
+        while (lo < hi) {
+          guint32 mid = lo + (hi - lo) / 2;
+          if (((RSegment *) pseudo_tcp_ring_nth (&priv->rlist, mid))->seq <
+              seg->seq)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+        rseg = pseudo_tcp_ring_insert (&priv->rlist, lo);
         rseg->seq = seg->seq;
         rseg->len = seg->len;
-        iter = priv->rlist;
-        while (iter && (((RSegment*)iter->data)->seq < rseg->seq)) {
-          iter = g_list_next (iter);
-        }
-        priv->rlist = g_list_insert_before(priv->rlist, iter, rseg);
       }
     }
   }
 
   attempt_send(self, sflags);
 
+  if (bWritable && priv->callbacks.PseudoTcpWritable)
+    priv->callbacks.PseudoTcpWritable(self, priv->callbacks.user_data);
+
   // If we have new data, notify the user
   if (bNewData && priv->bReadEnable) {
     priv->bReadEnable = FALSE;
@@ -1177,12 +1944,19 @@ process(PseudoTcpSocket *self, Segment *seg)
 }
 
 static gboolean
-transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
+transmit(PseudoTcpSocket *self, guint32 seg, guint32 now)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  SSegment *segment = (SSegment*)(seg->data);
+  SSegment *segment = pseudo_tcp_ring_nth (&priv->slist, seg);
   guint32 nTransmit = min(segment->len, priv->mss);
 
+  // A path MTU probe is larger than the mss, the first time only
+  if (priv->pmtu_probe && (segment->seq == priv->pmtu_probe_seq)
+      && (segment->xmit == 0)) {
+    nTransmit = min(segment->len,
+        priv->pmtu_probe - HEADER_SIZE - priv->overhead);
+  }
+
   if (segment->xmit >= ((priv->state == XICE_TCP_ESTABLISHED) ? 15 : 30)) {
     DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "too many retransmits");
     return FALSE;
@@ -1191,8 +1965,8 @@ transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
   while (TRUE) {
     guint32 seq = segment->seq;
     guint8 flags = (segment->bCtrl ? FLAG_CTL : 0);
-    const gchar * buffer = priv->sbuf + (segment->seq - priv->snd_una);
-    PseudoTcpWriteResult wres = packet(self, seq, flags, buffer, nTransmit);
+    PseudoTcpWriteResult wres = packet(self, seq, flags,
+        segment->seq - priv->snd_una, nTransmit);
 
     if (wres == WR_SUCCESS)
       break;
@@ -1204,6 +1978,13 @@ transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
 
     g_assert(wres == WR_TOO_LARGE);
 
+    if (nTransmit > priv->mss) {
+      // The probe did not even leave the host
+      pmtu_probe_lost(self, TRUE, now);
+      nTransmit = min(segment->len, priv->mss);
+      continue;
+    }
+
     while (TRUE) {
       if (PACKET_MAXIMUMS[priv->msslevel + 1] == 0) {
         DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "MTU too small");
@@ -1212,7 +1993,10 @@ transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
       /* !?! We need to break up all outstanding and pending packets
          and then retransmit!?! */
 
-      priv->mss = PACKET_MAXIMUMS[++priv->msslevel] - PACKET_OVERHEAD;
+      priv->mss = PACKET_MAXIMUMS[++priv->msslevel] - HEADER_SIZE -
+          priv->overhead;
+      priv->pmtu_high = priv->pmtu_low;
+      priv->pmtu_low = PACKET_MAXIMUMS[priv->msslevel];
       // I added this... haven't researched actual formula
       priv->cwnd = 2 * priv->mss;
 
@@ -1225,7 +2009,9 @@ transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
   }
 
   if (nTransmit < segment->len) {
-    SSegment *subseg = g_slice_new0 (SSegment);
+    SSegment *subseg = pseudo_tcp_ring_insert (&priv->slist, seg + 1);
+
+    segment = pseudo_tcp_ring_nth (&priv->slist, seg);
     subseg->seq = segment->seq + nTransmit;
     subseg->len = segment->len - nTransmit;
     subseg->bCtrl = segment->bCtrl;
@@ -1234,11 +2020,12 @@ transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
     DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "mss reduced to %d", priv->mss);
 
     segment->len = nTransmit;
-    priv->slist = g_list_insert_before(priv->slist, seg->next, subseg);
   }
 
   if (segment->xmit == 0) {
     priv->snd_nxt += segment->len;
+  } else {
+    priv->stats.retransmits++;
   }
   segment->xmit += 1;
 
@@ -1249,11 +2036,61 @@ transmit(PseudoTcpSocket *self, const GList *seg, guint32 now)
   return TRUE;
 }
 
+// Pacing rate in bytes per millisecond, or 0 when not pacing. It runs a
+// quarter ahead of cwnd / srtt so that the window can still grow. Slow start
+// is not paced: it is clocked by the acks already, and spreading it out
+// would hold back the window growth and the bandwidth samples of BBR.
+static guint32
+pacing_rate(PseudoTcpSocket *self)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint64 rate;
+
+  if (!priv->pacing || (priv->state != XICE_TCP_ESTABLISHED)
+      || (priv->rx_srtt == 0) || (priv->cwnd < priv->ssthresh)) {
+    return 0;
+  }
+
+  rate = (guint64) priv->cwnd * 5 / (4 * priv->rx_srtt);
+  return (guint32) min(max(rate, 1), G_MAXINT32 / 2);
+}
+
+// Earns the credit for the time elapsed since the last call, and tells
+// whether a segment may leave now. The credit saved while idle is capped at
+// one millisecond worth of data, or two segments on slow paths.
+static gboolean
+pace(PseudoTcpSocket *self, guint32 rate, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  gint64 credit = priv->pace_credit;
+  long elapsed = time_diff(now, priv->pace_last);
+
+  if (elapsed > 0) {
+    credit += (gint64) rate * elapsed;
+  }
+  priv->pace_credit = (gint32) min(credit, (gint64) max(rate, 2 * priv->mss));
+  priv->pace_last = now;
+
+  return priv->pace_credit > 0;
+}
+
+// Whether segments the window allows are held back by the pacing
+static gboolean
+pace_waiting(PseudoTcpSocket *self)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 nInFlight = priv->snd_nxt - priv->snd_una;
+
+  return (priv->pace_credit <= 0) && (pacing_rate(self) > 0)
+      && (pseudo_tcp_fifo_get_buffered (&priv->sbuf) > nInFlight)
+      && (nInFlight < min(priv->snd_wnd, priv->cwnd));
+}
+
 static void
 attempt_send(PseudoTcpSocket *self, SendFlags sflags)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  guint32 now = get_current_time();
+  guint32 now = get_current_time (self);
   gboolean bFirst = TRUE;
 
   if (time_diff(now, priv->lastsend) > (long) priv->rx_rto) {
@@ -1267,7 +2104,10 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags)
     guint32 nInFlight;
     guint32 nUseable;
     guint32 nAvailable;
-    GList *iter;
+    guint32 next;
+    guint32 rate;
+    guint32 probe;
+    SSegment *sseg;
 
     cwnd = priv->cwnd;
     if ((priv->dup_acks == 1) || (priv->dup_acks == 2)) { // Limited Transmit
@@ -1276,7 +2116,8 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags)
     nWindow = min(priv->snd_wnd, cwnd);
     nInFlight = priv->snd_nxt - priv->snd_una;
     nUseable = (nInFlight < nWindow) ? (nWindow - nInFlight) : 0;
-    nAvailable = min(priv->slen - nInFlight, priv->mss);
+    nAvailable = min(pseudo_tcp_fifo_get_buffered (&priv->sbuf) - nInFlight,
+        priv->mss);
 
     if (nAvailable > nUseable) {
       if (nUseable * 4 < nWindow) {
@@ -1287,13 +2128,38 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags)
       }
     }
 
+    // A path MTU probe is sent when enough data follows for its loss to be
+    // noticed quickly. Until the window has room for it, the data waits.
+    probe = pmtu_probe_size(self, now);
+    if (probe > 0) {
+      guint32 payload = probe - HEADER_SIZE - priv->overhead;
+
+      if ((priv->dup_acks != 0) || (nWindow < payload + 3 * priv->mss)
+          || (pseudo_tcp_fifo_get_buffered (&priv->sbuf) - nInFlight <
+              payload + 3 * priv->mss)) {
+        probe = 0;
+      } else if (nUseable < payload) {
+        probe = 0;
+        nAvailable = 0;
+      } else {
+        nAvailable = payload;
+      }
+    }
+
+    // Data sent ahead of the pacing rate waits for the clock, acks do not
+    rate = pacing_rate(self);
+    if ((nAvailable > 0) && (rate > 0) && !pace(self, rate, now)) {
+      nAvailable = 0;
+    }
+
     if (bFirst) {
       bFirst = FALSE;
       DEBUG (PSEUDO_TCP_DEBUG_VERBOSE, "[cwnd: %d  nWindow: %d  nInFlight: %d "
           "nAvailable: %d nQueued: %d  nEmpty: %" G_GSIZE_FORMAT
           "  ssthresh: %d]",
-          priv->cwnd, nWindow, nInFlight, nAvailable, priv->slen - nInFlight,
-          sizeof(priv->sbuf) - priv->slen, priv->ssthresh);
+          priv->cwnd, nWindow, nInFlight, nAvailable,
+          (guint32) pseudo_tcp_fifo_get_buffered (&priv->sbuf) - nInFlight,
+          pseudo_tcp_fifo_get_write_remaining (&priv->sbuf), priv->ssthresh);
     }
 
     if (nAvailable == 0) {
@@ -1304,7 +2170,7 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags)
       if ((sflags == sfImmediateAck) || priv->t_ack) {
         packet(self, priv->snd_nxt, 0, 0, 0);
       } else {
-        priv->t_ack = get_current_time();
+        priv->t_ack = get_current_time (self);
       }
       return;
     }
@@ -1315,24 +2181,36 @@ attempt_send(PseudoTcpSocket *self, SendFlags sflags)
     }
 
     // Find the next segment to transmit
-    iter = priv->slist;
-    while (((SSegment*)iter->data)->xmit > 0) {
-      iter = g_list_next (iter);
-      g_assert(iter);
+    next = find_segment(self, priv->snd_nxt);
+    sseg = pseudo_tcp_ring_nth (&priv->slist, next);
+    g_assert(sseg->xmit == 0);
+
+    if ((probe > 0) && !sseg->bCtrl && (sseg->len >= nAvailable)) {
+      DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "probing path mtu %d", probe);
+      priv->pmtu_probe = probe;
+      priv->pmtu_probe_seq = sseg->seq;
     }
 
-    // If the segment is too large, break it into two
-    if (((SSegment*)iter->data)->len > nAvailable) {
-      SSegment *subseg = g_slice_new0 (SSegment);
-      subseg->seq = ((SSegment*)iter->data)->seq + nAvailable;
-      subseg->len = ((SSegment*)iter->data)->len - nAvailable;
-      subseg->bCtrl = ((SSegment*)iter->data)->bCtrl;
+    // If the segment is too large, break it into two. Control segments are
+    // only a few bytes and are always sent whole, as the peer parses the
+    // connect options from a single segment, even if this slightly exceeds
+    // the initial one byte window.
+    if (sseg->len > nAvailable && !sseg->bCtrl) {
+      SSegment *subseg = pseudo_tcp_ring_insert (&priv->slist, next + 1);
+
+      sseg = pseudo_tcp_ring_nth (&priv->slist, next);
+      subseg->seq = sseg->seq + nAvailable;
+      subseg->len = sseg->len - nAvailable;
+      subseg->bCtrl = sseg->bCtrl;
 
-      ((SSegment*)iter->data)->len = nAvailable;
-      priv->slist = g_list_insert_before(priv->slist, iter->next, subseg);
+      sseg->len = nAvailable;
     }
 
-    if (!transmit(self, iter, now)) {
+    if (rate > 0) {
+      priv->pace_credit -= sseg->len;
+    }
+
+    if (!transmit(self, next, now)) {
       DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "transmit failed");
       // TODO: consider closing socket
       return;
@@ -1346,7 +2224,10 @@ static void
 closedown(PseudoTcpSocket *self, guint32 err)
 {
   PseudoTcpSocketPrivate *priv = self->priv;
-  priv->slen = 0;
+
+  pseudo_tcp_fifo_consume_read_data (&priv->sbuf,
+      pseudo_tcp_fifo_get_buffered (&priv->sbuf));
+  pseudo_tcp_fifo_release (&priv->sbuf);
 
   DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "State: XICE_TCP_CLOSED");
   priv->state = XICE_TCP_CLOSED;
@@ -1354,6 +2235,275 @@ closedown(PseudoTcpSocket *self, guint32 err)
     priv->callbacks.PseudoTcpClosed(self, err, priv->callbacks.user_data);
 }
 
+// Smallest shift that lets the whole receive buffer be advertised
+static guint8
+window_scale(PseudoTcpSocket *self)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint8 scale = 0;
+
+  while (scale < MAX_WND_SCALE && (priv->rbuf.buffer_length >> scale) > 0xFFFF)
+    scale++;
+  return scale;
+}
+
+// Offers every option we support, or when replying, those the peer offered
+static void
+queue_connect_message(PseudoTcpSocket *self, gboolean reply)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  gchar buffer[6];
+  guint32 len = 1;
+
+  buffer[0] = CTL_CONNECT;
+  if (!reply || priv->wnd_scale_ok) {
+    buffer[len++] = TCP_OPT_WND_SCALE;
+    buffer[len++] = 3;
+    buffer[len++] = window_scale(self);
+  }
+  if (priv->sack_enabled && (!reply || priv->sack_ok)) {
+    buffer[len++] = TCP_OPT_SACK_PERMITTED;
+    buffer[len++] = 2;
+  }
+  queue(self, buffer, len, TRUE);
+}
+
+/* Parses the options following a CTL_CONNECT and enables what both sides
+ * support. Peers predating the options send none. */
+static void
+parse_options(PseudoTcpSocket *self, const guint8 *data, guint32 len)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  gboolean wnd_scale = FALSE;
+  gboolean sack = FALSE;
+  guint32 pos = 0;
+
+  while (pos < len) {
+    guint8 kind = data[pos];
+    guint8 opt_len;
+
+    if (kind == TCP_OPT_EOL)
+      break;
+    if (kind == TCP_OPT_NOOP) {
+      pos++;
+      continue;
+    }
+
+    if (pos + 1 >= len)
+      break;
+    opt_len = data[pos + 1];
+    if (opt_len < 2 || pos + opt_len > len) {
+      DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Malformed option %d", kind);
+      break;
+    }
+
+    if (kind == TCP_OPT_WND_SCALE && opt_len == 3) {
+      priv->swnd_scale = min(data[pos + 2], MAX_WND_SCALE);
+      wnd_scale = TRUE;
+    } else if (kind == TCP_OPT_SACK_PERMITTED && opt_len == 2) {
+      sack = priv->sack_enabled;
+    } else {
+      DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Ignoring option %d", kind);
+    }
+    pos += opt_len;
+  }
+
+  priv->wnd_scale_ok = wnd_scale;
+  if (wnd_scale) {
+    priv->rwnd_scale = window_scale(self);
+  } else {
+    // The peer can not scale windows, so advertise at most 64 KB
+    priv->rwnd_scale = priv->swnd_scale = 0;
+  }
+  DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Window scale: send %d, receive %d",
+      priv->swnd_scale, priv->rwnd_scale);
+
+  priv->sack_ok = sack;
+  DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "SACK: %s", sack ? "yes" : "no");
+}
+
+/* Writes a SACK option with the out of order data received, merged into
+ * contiguous blocks: the block received last comes first, then the lowest
+ * others. Returns the length of the option, padded to 32 bits. */
+static guint32
+sack_option(PseudoTcpSocket *self, guint8 *buffer)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 blocks[MAX_SACK_BLOCKS][2];
+  guint32 left, right;
+  guint n = 1, i;
+  gboolean recent = FALSE;
+  guint32 nSegments = pseudo_tcp_ring_get_length (&priv->rlist);
+  guint32 j = 0;
+
+  while (j < nSegments) {
+    RSegment *rseg = pseudo_tcp_ring_nth (&priv->rlist, j);
+
+    left = rseg->seq;
+    right = rseg->seq + rseg->len;
+    for (j++; j < nSegments; j++) {
+      rseg = pseudo_tcp_ring_nth (&priv->rlist, j);
+      if (rseg->seq > right)
+        break;
+      right = max(right, rseg->seq + rseg->len);
+    }
+
+    if (!recent && left <= priv->sack_recent && priv->sack_recent < right) {
+      blocks[0][0] = left;
+      blocks[0][1] = right;
+      recent = TRUE;
+    } else if (n < MAX_SACK_BLOCKS) {
+      blocks[n][0] = left;
+      blocks[n][1] = right;
+      n++;
+    } else if (recent) {
+      break;
+    }
+  }
+  if (!recent) {
+    // The block received last was merged into the in-order data
+    memmove(blocks, blocks + 1, (n - 1) * sizeof(blocks[0]));
+    n--;
+  }
+
+  buffer[0] = TCP_OPT_NOOP;
+  buffer[1] = TCP_OPT_NOOP;
+  buffer[2] = TCP_OPT_SACK;
+  buffer[3] = 2 + 8 * n;
+  for (i = 0; i < n; i++) {
+    *((guint32 *) (buffer + 4 + 8 * i)) = htonl(blocks[i][0]);
+    *((guint32 *) (buffer + 8 + 8 * i)) = htonl(blocks[i][1]);
+  }
+
+  return 4 + 8 * n;
+}
+
+/* Marks the segments covered by the SACK blocks of an incoming segment, so
+ * that recovery only resends what the peer is missing */
+static void
+update_scoreboard(PseudoTcpSocket *self, const guint8 *data, guint32 len)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 pos = 0;
+
+  while (pos + 1 < len) {
+    guint8 kind = data[pos];
+    guint8 opt_len;
+    guint32 i;
+
+    if (kind == TCP_OPT_EOL)
+      break;
+    if (kind == TCP_OPT_NOOP) {
+      pos++;
+      continue;
+    }
+    opt_len = data[pos + 1];
+    if (opt_len < 2 || pos + opt_len > len)
+      break;
+
+    for (i = pos + 2; kind == TCP_OPT_SACK && i + 8 <= pos + opt_len; i += 8) {
+      guint32 left = ntohl(*(guint32 *)(data + i));
+      guint32 right = ntohl(*(guint32 *)(data + i + 4));
+      guint32 nSegments = pseudo_tcp_ring_get_length (&priv->slist);
+      guint32 j;
+
+      if (left >= right || left < priv->snd_una || right > priv->snd_nxt)
+        continue;
+      priv->sack_high = max(priv->sack_high, right);
+
+      for (j = find_segment(self, left); j < nSegments; j++) {
+        SSegment *sseg = pseudo_tcp_ring_nth (&priv->slist, j);
+
+        if (sseg->xmit == 0 || sseg->seq >= right)
+          break;
+        if (sseg->seq >= left && sseg->seq + sseg->len <= right)
+          sseg->bSacked = TRUE;
+      }
+    }
+    pos += opt_len;
+  }
+}
+
+/* Next segment to resend during recovery: the first one the peer is missing
+ * while it has data above it, that was not resent yet or whose retransmission
+ * was lost as well. Unlike NewReno, a partial ack alone does not make the
+ * first segment a hole: it may have been sent along with the retransmission
+ * that was just acked. */
+static gboolean
+next_hole(PseudoTcpSocket *self, guint32 *hole)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 nSegments = pseudo_tcp_ring_get_length (&priv->slist);
+  guint32 i;
+
+  for (i = 0; i < nSegments; i++) {
+    SSegment *sseg = pseudo_tcp_ring_nth (&priv->slist, i);
+
+    if (sseg->xmit == 0 || sseg->seq >= priv->sack_high)
+      break;
+    if (!sseg->bSacked && (sseg->seq >= priv->sack_rxt ||
+        priv->sack_high > sseg->rxt_nxt)) {
+      *hole = i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Index of the first segment starting at or after @seq, or the number of
+ * segments if there is none */
+static guint32
+find_segment(PseudoTcpSocket *self, guint32 seq)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 lo = 0, hi = pseudo_tcp_ring_get_length (&priv->slist);
+
+  while (lo < hi) {
+    guint32 mid = lo + (hi - lo) / 2;
+    if (((SSegment *) pseudo_tcp_ring_nth (&priv->slist, mid))->seq < seq)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* RFC 5827: with fewer than four segments in flight there can not be three
+ * duplicate acks, so recover once all but one of them were sacked */
+static gboolean
+early_retransmit(PseudoTcpSocket *self)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 nSegments = pseudo_tcp_ring_get_length (&priv->slist);
+  guint32 i;
+  guint outstanding = 0;
+
+  for (i = 0; i < nSegments; i++) {
+    if (((SSegment *) pseudo_tcp_ring_nth (&priv->slist, i))->xmit == 0)
+      break;
+    if (++outstanding > 3)
+      return FALSE;
+  }
+  return priv->dup_acks + 1 >= outstanding;
+}
+
+static gboolean
+retransmit(PseudoTcpSocket *self, guint32 seg, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  SSegment *sseg;
+
+  if (is_probe(self, seg))
+    pmtu_probe_lost(self, FALSE, now);
+  if (!transmit(self, seg, now))
+    return FALSE;
+  // transmit() may have split the segment and moved it
+  sseg = pseudo_tcp_ring_nth (&priv->slist, seg);
+  priv->sack_rxt = max(priv->sack_rxt, sseg->seq + sseg->len);
+  sseg->rxt_nxt = priv->snd_nxt;
+  return TRUE;
+}
+
 static void
 adjustMTU(PseudoTcpSocket *self)
 {
@@ -1367,10 +2517,401 @@ adjustMTU(PseudoTcpSocket *self)
       break;
     }
   }
-  priv->mss = priv->mtu_advise - PACKET_OVERHEAD;
+  priv->mss = priv->mtu_advise - HEADER_SIZE - priv->overhead;
   // !?! Should we reset priv->largest here?
   DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Adjusting mss to %d bytes", priv->mss);
   // Enforce minimums on ssthresh and cwnd
   priv->ssthresh = max(priv->ssthresh, 2 * priv->mss);
   priv->cwnd = max(priv->cwnd, priv->mss);
+
+  // Look for a larger path MTU from there
+  priv->pmtu_low = priv->mtu_advise;
+  priv->pmtu_high = priv->pmtu_max + 1;
+  priv->pmtu_probe = 0;
+  priv->pmtu_failures = 0;
+  priv->pmtu_next = get_current_time (self);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Path MTU discovery
+//////////////////////////////////////////////////////////////////////
+//
+// Packetization layer path MTU discovery (RFC 4821): now and then, a
+// segment larger than the mss is sent as a probe. The MTU is raised once
+// the probe is acknowledged, and a size is given up when its probes keep
+// getting lost, without taking these losses as congestion. The largest MTU
+// to look for is tried first, then the search goes on by bisection.
+//
+
+// Size of the next probe, or 0 if none is due
+static guint32
+pmtu_probe_size(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  if ((priv->pmtu_probe != 0) || (priv->pmtu_max <= priv->pmtu_low)
+      || (priv->state != XICE_TCP_ESTABLISHED)
+      || (time_diff(priv->pmtu_next, now) > 0)) {
+    return 0;
+  }
+  if (priv->pmtu_high > priv->pmtu_max)
+    return priv->pmtu_max;
+  return (priv->pmtu_low + priv->pmtu_high) / 2;
+}
+
+// Whether the segment is a probe that was sent but not acknowledged yet
+static gboolean
+is_probe(PseudoTcpSocket *self, guint32 seg)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  SSegment *sseg = pseudo_tcp_ring_nth (&priv->slist, seg);
+
+  return (priv->pmtu_probe != 0) && (sseg->seq == priv->pmtu_probe_seq)
+      && (sseg->xmit > 0);
+}
+
+// Moves on to the next probe, or waits a while once the MTU is known
+static void
+pmtu_search_next(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  priv->pmtu_probe = 0;
+  if (priv->pmtu_high <= priv->pmtu_low + PMTU_SEARCH_DONE) {
+    DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "path mtu is %d", priv->pmtu_low);
+    // The path may allow more later
+    priv->pmtu_high = priv->pmtu_max + 1;
+    priv->pmtu_next = now + PMTU_RAISE_INTERVAL;
+  } else {
+    priv->pmtu_next = now;
+  }
+}
+
+static void
+pmtu_probe_acked(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  priv->pmtu_low = priv->pmtu_probe;
+  priv->pmtu_failures = 0;
+  priv->mss = priv->pmtu_probe - HEADER_SIZE - priv->overhead;
+  priv->ssthresh = max(priv->ssthresh, 2 * priv->mss);
+  DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "Adjusting mss to %d bytes", priv->mss);
+  pmtu_search_next(self, now);
+}
+
+// A definitive failure is one the host itself reported
+static void
+pmtu_probe_lost(PseudoTcpSocket *self, gboolean definitive, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "path mtu probe %d lost", priv->pmtu_probe);
+  if (definitive || (++priv->pmtu_failures >= PMTU_MAX_PROBES)) {
+    priv->pmtu_high = priv->pmtu_probe;
+    priv->pmtu_failures = 0;
+  }
+  pmtu_search_next(self, now);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Congestion control
+//////////////////////////////////////////////////////////////////////
+
+static void
+reno_init(PseudoTcpSocket *self, guint32 now)
+{
+}
+
+static void
+reno_on_ack(PseudoTcpSocket *self, guint32 acked, long rtt,
+    gboolean recovering, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  if (recovering)
+    return;
+
+  // Slow start, congestion avoidance
+  if (priv->cwnd < priv->ssthresh) {
+    priv->cwnd += priv->mss;
+  } else {
+    priv->cwnd += max(1LU, priv->mss * priv->mss / priv->cwnd);
+  }
+}
+
+static guint32
+reno_ssthresh(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 nInFlight = priv->snd_nxt - priv->snd_una;
+
+  return max(nInFlight / 2, 2 * priv->mss);
+}
+
+static const CongestionOps reno_ops = {
+  reno_init,
+  reno_on_ack,
+  reno_ssthresh
+};
+
+// Newton's method, good enough for window sizes and without libm
+static gdouble
+cube_root(gdouble x)
+{
+  gdouble r = x > 1 ? x / 3 : 1;
+  int i;
+
+  if (x <= 0)
+    return 0;
+  for (i = 0; i < 40; ++i) {
+    gdouble next = (2 * r + x / (r * r)) / 3;
+    if (next >= r * 0.999999 && next <= r * 1.000001)
+      return next;
+    r = next;
+  }
+  return r;
+}
+
+static void
+cubic_init(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  memset(&priv->cc_state.cubic, 0, sizeof(CubicState));
+}
+
+static void
+cubic_on_ack(PseudoTcpSocket *self, guint32 acked, long rtt,
+    gboolean recovering, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  CubicState *c = &priv->cc_state.cubic;
+  gdouble t, target;
+
+  if (recovering)
+    return;
+
+  if (priv->cwnd < priv->ssthresh) {
+    priv->cwnd += priv->mss;
+    return;
+  }
+
+  if (c->epoch_start == 0) {
+    c->epoch_start = now ? now : 1;
+    if (priv->cwnd < c->w_max) {
+      // K = cbrt((W_max - cwnd) / C), in segments and seconds
+      c->k = (guint32) (cube_root((gdouble) (c->w_max - priv->cwnd) /
+          priv->mss / CUBIC_C) * 1000);
+      c->origin = c->w_max;
+    } else {
+      c->k = 0;
+      c->origin = priv->cwnd;
+    }
+    c->w_est = priv->cwnd;
+  }
+
+  // W_cubic(t + RTT), t being the time since the reduction
+  t = (gdouble) ((long) time_diff(now, c->epoch_start) + (long) priv->rx_srtt -
+      (long) c->k) / 1000;
+  target = c->origin + CUBIC_C * t * t * t * priv->mss;
+
+  // Never grow slower than Reno would (the TCP-friendly region)
+  c->w_est += max(1, (guint32) ((gdouble) priv->mss * acked *
+      3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) / priv->cwnd));
+  if (target < c->w_est)
+    target = c->w_est;
+
+  if (target > priv->cwnd * 1.5)
+    target = priv->cwnd * 1.5;
+  if (target > priv->cwnd) {
+    priv->cwnd += max(1LU,
+        (guint32) ((target - priv->cwnd) * priv->mss / priv->cwnd));
+  }
+}
+
+static guint32
+cubic_ssthresh(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  CubicState *c = &priv->cc_state.cubic;
+  guint32 nInFlight = priv->snd_nxt - priv->snd_una;
+
+  c->epoch_start = 0;
+  // Fast convergence: release bandwidth if the window keeps shrinking
+  if (nInFlight < c->w_max)
+    c->w_max = (guint32) (nInFlight * (1 + CUBIC_BETA) / 2);
+  else
+    c->w_max = nInFlight;
+
+  return max((guint32) (nInFlight * CUBIC_BETA), 2 * priv->mss);
+}
+
+static const CongestionOps cubic_ops = {
+  cubic_init,
+  cubic_on_ack,
+  cubic_ssthresh
+};
+
+static guint32
+bbr_bandwidth(BbrState *b)
+{
+  guint32 bw = 0;
+  int i;
+
+  for (i = 0; i < BBR_BW_ROUNDS; ++i)
+    bw = max(bw, b->bw[i]);
+  return bw;
+}
+
+// Estimated bandwidth-delay product in bytes, 0 while it is unknown
+static guint32
+bbr_bdp(BbrState *b)
+{
+  if (b->min_rtt == G_MAXUINT32)
+    return 0;
+  return (guint32) ((guint64) bbr_bandwidth(b) * b->min_rtt / 1000);
+}
+
+static void
+bbr_init(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  BbrState *b = &priv->cc_state.bbr;
+
+  memset(b, 0, sizeof(BbrState));
+  b->mode = BBR_STARTUP;
+  b->min_rtt = G_MAXUINT32;
+  b->round_end = priv->snd_nxt;
+  b->round_start = now;
+}
+
+static void
+bbr_on_round(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  BbrState *b = &priv->cc_state.bbr;
+  guint32 elapsed = time_diff(now, b->round_start);
+
+  if (elapsed > 0) {
+    b->bw[b->round % BBR_BW_ROUNDS] =
+        (guint32) ((b->delivered - b->round_delivered) * 1000 / elapsed);
+    b->round++;
+  }
+
+  switch (b->mode) {
+    case BBR_STARTUP:
+      // The pipe is full once the bandwidth stops growing by a quarter
+      if (bbr_bandwidth(b) >= (guint64) b->full_bw * 5 / 4) {
+        b->full_bw = bbr_bandwidth(b);
+        b->full_bw_rounds = 0;
+      } else if (++b->full_bw_rounds >= 3) {
+        DEBUG (PSEUDO_TCP_DEBUG_NORMAL, "bbr: drain, bw %u bdp %u",
+            bbr_bandwidth(b), bbr_bdp(b));
+        b->mode = BBR_DRAIN;
+      }
+      break;
+    case BBR_DRAIN:
+      if (priv->snd_nxt - priv->snd_una <= bbr_bdp(b)) {
+        b->mode = BBR_PROBE_BW;
+        b->cycle = 0;
+      }
+      break;
+    case BBR_PROBE_BW:
+      b->cycle = (b->cycle + 1) % BBR_CYCLE_LENGTH;
+      break;
+  }
+
+  b->round_end = priv->snd_nxt;
+  b->round_start = now;
+  b->round_delivered = b->delivered;
+}
+
+static void
+bbr_on_ack(PseudoTcpSocket *self, guint32 acked, long rtt,
+    gboolean recovering, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  BbrState *b = &priv->cc_state.bbr;
+  guint32 target;
+
+  b->delivered += acked;
+  if (rtt >= 0 && ((guint32) rtt <= b->min_rtt ||
+          time_diff(now, b->min_rtt_stamp) > BBR_MIN_RTT_WINDOW)) {
+    b->min_rtt = max(rtt, 1);
+    b->min_rtt_stamp = now;
+  }
+  if (priv->snd_una >= b->round_end)
+    bbr_on_round(self, now);
+
+  if (recovering)
+    return;
+
+  switch (b->mode) {
+    case BBR_STARTUP:
+      priv->cwnd += acked;
+      return;
+    case BBR_DRAIN:
+      target = bbr_bdp(b);
+      break;
+    case BBR_PROBE_BW:
+    default:
+      // Probe for more bandwidth, then drain the queue this created
+      if (b->cycle == 0)
+        target = bbr_bdp(b) * 5 / 4;
+      else if (b->cycle == 1)
+        target = bbr_bdp(b) * 3 / 4;
+      else
+        target = bbr_bdp(b);
+      break;
+  }
+  // Leave room for delayed acks
+  target = max(target + 2 * priv->mss, 4 * priv->mss);
+
+  // Regrow quickly after a timeout but never send a burst
+  if (priv->cwnd < target)
+    priv->cwnd = min(priv->cwnd + acked, target);
+  else
+    priv->cwnd = target;
+}
+
+static guint32
+bbr_ssthresh(PseudoTcpSocket *self, guint32 now)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+  guint32 bdp = bbr_bdp(&priv->cc_state.bbr);
+
+  // Losses are not a congestion signal once the path is modelled
+  if (bdp == 0)
+    return reno_ssthresh(self, now);
+  return max(bdp, 4 * priv->mss);
+}
+
+static const CongestionOps bbr_ops = {
+  bbr_init,
+  bbr_on_ack,
+  bbr_ssthresh
+};
+
+static void
+set_congestion_control(PseudoTcpSocket *self,
+    PseudoTcpCongestionControl type)
+{
+  PseudoTcpSocketPrivate *priv = self->priv;
+
+  switch (type) {
+    case PSEUDO_TCP_CC_CUBIC:
+      priv->cc = &cubic_ops;
+      break;
+    case PSEUDO_TCP_CC_BBR:
+      priv->cc = &bbr_ops;
+      break;
+    case PSEUDO_TCP_CC_RENO:
+    default:
+      type = PSEUDO_TCP_CC_RENO;
+      priv->cc = &reno_ops;
+      break;
+  }
+  priv->cc_type = type;
+  priv->cc->init(self, get_current_time(self));
 }
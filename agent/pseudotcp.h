@@ -173,7 +173,8 @@ typedef enum {
  * @PseudoTcpOpened: The #PseudoTcpSocket is now connected
  * @PseudoTcpReadable: The socket is readable
  * @PseudoTcpWritable: The socket is writable
- * @PseudoTcpClosed: The socket was closed
+ * @PseudoTcpClosed: The socket was closed, with an error of 0 when the peer
+ * closed it with pseudo_tcp_socket_finish_close() after a graceful close
  * @WritePacket: This callback is called when the socket needs to send data.
  *
  * A structure containing callbacks functions that will be called by the
@@ -262,6 +263,53 @@ gboolean pseudo_tcp_socket_connect(PseudoTcpSocket *self);
 gint  pseudo_tcp_socket_recv(PseudoTcpSocket *self, char * buffer, size_t len);
 
 
+/**
+ * pseudo_tcp_socket_peek:
+ * @self: The #PseudoTcpSocket object.
+ * @len: Return location for the number of bytes readable at the returned
+ * address
+ *
+ * Gives access to the received data in place, without copying it. When the
+ * data wraps around the end of the receive buffer, only the first part is
+ * returned, and the rest once that part is consumed. The data is not
+ * consumed: call pseudo_tcp_socket_consume() once done with it.
+ *
+ <note>
+   <para>
+     The returned data stays valid, even as more data arrives, until it is
+     consumed or the socket is destroyed.
+   </para>
+   <para>
+     Like pseudo_tcp_socket_recv(), this function should be called until it
+     fails with EWOULDBLOCK as the error, or the
+     %PseudoTcpCallbacks:PseudoTcpReadable callback will not be called again.
+   </para>
+ </note>
+ *
+ * Returns: The received data, or %NULL in case of error
+ * <para> See also: pseudo_tcp_socket_get_error() </para>
+ *
+ * Since: 0.1.4
+ */
+const gchar *pseudo_tcp_socket_peek(PseudoTcpSocket *self, gsize *len);
+
+
+/**
+ * pseudo_tcp_socket_consume:
+ * @self: The #PseudoTcpSocket object.
+ * @len: The number of bytes to consume, at most what is buffered
+ *
+ * Consumes received data returned by pseudo_tcp_socket_peek(), opening the
+ * receive window to the peer as pseudo_tcp_socket_recv() does.
+ *
+ * Returns: The number of bytes consumed or -1 in case of error
+ * <para> See also: pseudo_tcp_socket_get_error() </para>
+ *
+ * Since: 0.1.4
+ */
+gint pseudo_tcp_socket_consume(PseudoTcpSocket *self, gsize len);
+
+
 /**
  * pseudo_tcp_socket_send:
  * @self: The #PseudoTcpSocket object.
@@ -298,7 +346,8 @@ gint pseudo_tcp_socket_send(PseudoTcpSocket *self, const char * buffer,
  <note>
    <para>
      The %PseudoTcpCallbacks:PseudoTcpClosed callback will not be called once
-     the socket gets closed. It is only used for aborted connection.
+     the socket gets closed. It is only used for aborted connection, or
+     when the peer calls pseudo_tcp_socket_finish_close().
      Instead, the socket gets closed when the pseudo_tcp_socket_get_next_clock()
      function returns FALSE.
    </para>
@@ -311,6 +360,21 @@ gint pseudo_tcp_socket_send(PseudoTcpSocket *self, const char * buffer,
 void pseudo_tcp_socket_close(PseudoTcpSocket *self, gboolean force);
 
 
+/**
+ * pseudo_tcp_socket_finish_close:
+ * @self: The #PseudoTcpSocket object.
+ *
+ * Closes the socket at once and tells the peer with a reset. Once a graceful
+ * pseudo_tcp_socket_close() has had all its data acknowledged, the
+ * %PseudoTcpCallbacks:PseudoTcpClosed callback of the peer gets an error of
+ * 0, and ECONNRESET otherwise. The data the peer received before can still
+ * be read.
+ *
+ * Since: 0.1.4
+ */
+void pseudo_tcp_socket_finish_close(PseudoTcpSocket *self);
+
+
 /**
  * pseudo_tcp_socket_get_error:
  * @self: The #PseudoTcpSocket object.
@@ -386,6 +450,166 @@ void pseudo_tcp_socket_notify_clock(PseudoTcpSocket *self);
 void pseudo_tcp_socket_notify_mtu(PseudoTcpSocket *self, guint16 mtu);
 
 
+/**
+ * PseudoTcpClockFunc:
+ * @self: The #PseudoTcpSocket object.
+ * @user_data: The data passed to pseudo_tcp_socket_set_clock()
+ *
+ * Returns the current time in milliseconds. Only differences between two
+ * values are used, so the epoch is arbitrary, but the value must not be 0.
+ *
+ * Since: 0.1.4
+ */
+typedef guint32 (*PseudoTcpClockFunc) (PseudoTcpSocket *self,
+    gpointer user_data);
+
+
+/**
+ * pseudo_tcp_socket_set_clock:
+ * @self: The #PseudoTcpSocket object.
+ * @func: The clock to use, or %NULL to use the monotonic system clock
+ * @user_data: Data passed to @func
+ *
+ * Set the time source used for retransmission, delayed ack and idle timers.
+ * This lets the socket share the cached clock of its #XiceContext, or run on
+ * virtual time in tests.
+ *
+ * Since: 0.1.4
+ */
+void pseudo_tcp_socket_set_clock (PseudoTcpSocket *self,
+    PseudoTcpClockFunc func, gpointer user_data);
+
+
+/**
+ * PseudoTcpStats:
+ * @packets_sent: Packets handed to the WritePacket callback, including
+ * acknowledgements
+ * @packets_received: Packets passed to pseudo_tcp_socket_notify_packet()
+ * @bytes_sent: Payload bytes sent, including retransmissions
+ * @retransmits: Segments sent more than once
+ * @fast_retransmits: Retransmissions triggered by duplicate acks
+ * @timeouts: Expirations of the retransmission timer
+ * @smoothed_rtt: Current smoothed round trip time in milliseconds
+ *
+ * Counters describing the traffic of a #PseudoTcpSocket since it was
+ * created.
+ *
+ * Since: 0.1.4
+ */
+typedef struct {
+  guint64 packets_sent;
+  guint64 packets_received;
+  guint64 bytes_sent;
+  guint64 retransmits;
+  guint64 fast_retransmits;
+  guint64 timeouts;
+  guint32 smoothed_rtt;
+} PseudoTcpStats;
+
+
+/**
+ * pseudo_tcp_socket_get_stats:
+ * @self: The #PseudoTcpSocket object.
+ * @stats: The #PseudoTcpStats to fill
+ *
+ * Get the traffic counters of the socket.
+ *
+ * Since: 0.1.4
+ */
+void pseudo_tcp_socket_get_stats (PseudoTcpSocket *self,
+    PseudoTcpStats *stats);
+
+
+/**
+ * PseudoTcpOption:
+ * @PSEUDO_TCP_OPT_SNDBUF: Size of the send buffer in bytes
+ * @PSEUDO_TCP_OPT_RCVBUF: Size of the receive buffer in bytes. It can only be
+ * changed before the socket connects, and sizes of 64 KB or more are only
+ * used in full if the peer supports window scaling.
+ * @PSEUDO_TCP_OPT_SACK: Whether to offer selective acknowledgements, 1 by
+ * default. They are only used if the peer supports them too, and can only be
+ * changed before the socket connects.
+ * @PSEUDO_TCP_OPT_PACING: Whether to spread the segments of a window over
+ * the round trip time instead of sending them in bursts, 0 by default. Slow
+ * start is not paced.
+ * @PSEUDO_TCP_OPT_OVERHEAD: Bytes the path adds to each packet below the
+ * PseudoTcp header, such as the IP and UDP headers and any relay framing. 92
+ * by default, for IPv4 and UDP with 64 bytes of relay framing.
+ * @PSEUDO_TCP_OPT_MAX_MTU: Largest MTU to look for with path MTU discovery,
+ * starting from the one given to pseudo_tcp_socket_notify_mtu(), or 0 (the
+ * default) not to probe the path
+ * @PSEUDO_TCP_OPT_MTU: The MTU the segments are currently sized for, 0 until
+ * the socket is connected. It can only be read.
+ *
+ * Options of a #PseudoTcpSocket
+ *
+ * <para> See also: pseudo_tcp_socket_set_option() </para>
+ *
+ * Since: 0.1.4
+ */
+typedef enum {
+  PSEUDO_TCP_OPT_SNDBUF = 1,
+  PSEUDO_TCP_OPT_RCVBUF,
+  PSEUDO_TCP_OPT_SACK,
+  PSEUDO_TCP_OPT_PACING,
+  PSEUDO_TCP_OPT_OVERHEAD,
+  PSEUDO_TCP_OPT_MAX_MTU,
+  PSEUDO_TCP_OPT_MTU
+} PseudoTcpOption;
+
+
+/**
+ * PseudoTcpCongestionControl:
+ * @PSEUDO_TCP_CC_RENO: NewReno, the default
+ * @PSEUDO_TCP_CC_CUBIC: CUBIC, which regrows the window faster on paths
+ * with a large bandwidth-delay product
+ * @PSEUDO_TCP_CC_BBR: A model based algorithm in the style of BBR, which
+ * sizes the window from the measured bandwidth and minimum round trip time
+ * instead of reacting to losses, keeping queues short
+ *
+ * Congestion control algorithms of a #PseudoTcpSocket
+ *
+ * <para> See also: #PseudoTcpSocket:congestion-control </para>
+ *
+ * Since: 0.1.4
+ */
+typedef enum {
+  PSEUDO_TCP_CC_RENO,
+  PSEUDO_TCP_CC_CUBIC,
+  PSEUDO_TCP_CC_BBR
+} PseudoTcpCongestionControl;
+
+
+/**
+ * pseudo_tcp_socket_set_option:
+ * @self: The #PseudoTcpSocket object.
+ * @option: The #PseudoTcpOption to set
+ * @value: The new value of the option
+ *
+ * Set an option of the socket. The send buffer can not be shrunk below the
+ * amount of data it currently holds.
+ *
+ * Since: 0.1.4
+ */
+void pseudo_tcp_socket_set_option (PseudoTcpSocket *self,
+    PseudoTcpOption option, guint32 value);
+
+
+/**
+ * pseudo_tcp_socket_get_option:
+ * @self: The #PseudoTcpSocket object.
+ * @option: The #PseudoTcpOption to get
+ *
+ * Get an option of the socket.
+ *
+ * Returns: The value of the option
+ *
+ * Since: 0.1.4
+ */
+guint32 pseudo_tcp_socket_get_option (PseudoTcpSocket *self,
+    PseudoTcpOption option);
+
+
 /**
  * pseudo_tcp_socket_notify_packet:
  * @self: The #PseudoTcpSocket object.
@@ -0,0 +1,639 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * TURN allocations made ahead of the agents that use them. Each one has
+ * its own UDP socket and STUN agent, and goes through the challenge and
+ * the authenticated Allocate as a relay discovery would. Once ready, it
+ * is refreshed a minute before it expires until an agent claims it: the
+ * agent then attaches the socket to its component, creates the relayed
+ * candidate on it and takes the refreshes over, with the credentials the
+ * allocation was made with.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "debug.h"
+
+#include "agent.h"
+#include "agent-priv.h"
+#include "component.h"
+#include "discovery.h"
+#include "turnpool.h"
+#include "turn.h"
+
+#include "stun/usages/turn.h"
+
+/* before trying again a server which failed an allocation */
+#define TURN_POOL_RETRY_MS 5000
+
+/* how long before it expires an allocation is refreshed */
+#define TURN_POOL_REFRESH_MARGIN 60
+
+typedef struct _TurnPoolServer TurnPoolServer;
+
+struct _TurnPoolAllocation
+{
+  TurnPoolServer *server;
+  XiceSocket *sock;
+  XiceTimer *timer;         /* retransmission, or the next refresh */
+  gboolean ready;           /* relayed is allocated */
+  gboolean pending;         /* stun_message is waiting for its response */
+  gboolean failed;          /* to be dropped from the timer */
+  XiceAddress relayed;
+  XiceAddress mapped;
+  gboolean has_mapped;
+  gint64 expires;           /* context clock, usecs */
+  StunAgent stun_agent;
+  StunTimer stun_timer;
+  uint8_t stun_buffer[STUN_MAX_MESSAGE_SIZE];
+  StunMessage stun_message; /* the last request, with REALM and NONCE */
+  uint8_t stun_resp_buffer[STUN_MAX_MESSAGE_SIZE];
+  StunMessage stun_resp_msg; /* the last challenge, NULL buffer if none */
+
+  /* set once claimed */
+  XiceAgent *agent;
+  Stream *stream;
+  Component *component;
+  TurnServer *turn;
+};
+
+struct _TurnPoolServer
+{
+  XiceTurnPool *pool;
+  XiceAddress addr;
+  gchar *username;
+  gchar *password;
+  guint size;
+  GSList *allocations;
+  XiceTimer *retry_timer;
+};
+
+struct _XiceTurnPool
+{
+  XiceContext *ctx;
+  XiceAddress local_addr;
+  GSList *servers;
+};
+
+static void priv_server_fill (TurnPoolServer *server);
+
+static void
+priv_schedule (TurnPoolAllocation *alloc, guint interval)
+{
+  xice_timer_stop (alloc->timer);
+  alloc->timer->interval = interval;
+  xice_timer_start (alloc->timer);
+}
+
+static void
+priv_send_request (TurnPoolAllocation *alloc, size_t len)
+{
+  xice_context_start_stun_timer (alloc->server->pool->ctx, &alloc->stun_timer,
+      200, STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
+  alloc->pending = TRUE;
+  xice_socket_send (alloc->sock, &alloc->server->addr, len,
+      (gchar *) alloc->stun_buffer);
+  priv_schedule (alloc, stun_timer_remainder (&alloc->stun_timer));
+}
+
+static gboolean
+priv_send_allocate (TurnPoolAllocation *alloc)
+{
+  TurnPoolServer *server = alloc->server;
+  size_t len;
+
+  len = stun_usage_turn_create (&alloc->stun_agent, &alloc->stun_message,
+      alloc->stun_buffer, sizeof(alloc->stun_buffer),
+      alloc->stun_resp_msg.buffer == NULL ? NULL : &alloc->stun_resp_msg,
+      STUN_USAGE_TURN_REQUEST_PORT_NORMAL, -1, -1,
+      (uint8_t *) server->username, strlen (server->username),
+      (uint8_t *) server->password, strlen (server->password),
+      STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  if (len == 0)
+    return FALSE;
+
+  priv_send_request (alloc, len);
+  return TRUE;
+}
+
+static gboolean
+priv_send_refresh (TurnPoolAllocation *alloc, int32_t lifetime)
+{
+  TurnPoolServer *server = alloc->server;
+  size_t len;
+
+  len = stun_usage_turn_create_refresh (&alloc->stun_agent,
+      &alloc->stun_message, alloc->stun_buffer, sizeof(alloc->stun_buffer),
+      alloc->stun_resp_msg.buffer == NULL ? NULL : &alloc->stun_resp_msg,
+      lifetime,
+      (uint8_t *) server->username, strlen (server->username),
+      (uint8_t *) server->password, strlen (server->password),
+      STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  if (len == 0)
+    return FALSE;
+
+  if (lifetime == 0) {
+    StunTransactionId id;
+
+    /* released without waiting for the answer, as a TURN socket does
+     * when freed */
+    stun_message_id (&alloc->stun_message, id);
+    stun_agent_forget_transaction (&alloc->stun_agent, id);
+    xice_socket_send (alloc->sock, &server->addr, len,
+        (gchar *) alloc->stun_buffer);
+    xice_socket_send (alloc->sock, &server->addr, len,
+        (gchar *) alloc->stun_buffer);
+  } else {
+    priv_send_request (alloc, len);
+  }
+  return TRUE;
+}
+
+/* Frees the allocation, and its socket unless it was claimed */
+static void
+priv_allocation_free (TurnPoolAllocation *alloc, gboolean release)
+{
+  if (alloc->timer)
+    xice_timer_destroy (alloc->timer);
+  if (alloc->sock) {
+    if (release && alloc->ready)
+      priv_send_refresh (alloc, 0);
+    xice_socket_free (alloc->sock);
+  }
+  g_slice_free (TurnPoolAllocation, alloc);
+}
+
+static gboolean
+priv_retry_tick (XiceTimer *timer, gpointer data)
+{
+  TurnPoolServer *server = data;
+
+  agent_lock ();
+  xice_timer_destroy (server->retry_timer);
+  server->retry_timer = NULL;
+  priv_server_fill (server);
+  agent_unlock ();
+
+  return FALSE;
+}
+
+/* The server failed the allocation: it is dropped, and made again later */
+static void
+priv_allocation_failed (TurnPoolAllocation *alloc)
+{
+  TurnPoolServer *server = alloc->server;
+
+  xice_debug ("TURN pool %p : allocation %p failed", server->pool, alloc);
+
+  server->allocations = g_slist_remove (server->allocations, alloc);
+  priv_allocation_free (alloc, FALSE);
+
+  if (server->retry_timer == NULL) {
+    server->retry_timer = xice_create_timer (server->pool->ctx,
+        TURN_POOL_RETRY_MS, priv_retry_tick, server);
+    xice_timer_start (server->retry_timer);
+  }
+}
+
+static void
+priv_schedule_refresh (TurnPoolAllocation *alloc, uint32_t lifetime)
+{
+  gint64 now = xice_context_get_time (alloc->server->pool->ctx);
+  guint delay = lifetime > TURN_POOL_REFRESH_MARGIN ?
+      lifetime - TURN_POOL_REFRESH_MARGIN : 0;
+
+  alloc->expires = now + (gint64) lifetime * G_USEC_PER_SEC;
+  priv_schedule (alloc, delay * 1000);
+}
+
+static gboolean
+priv_allocation_tick (XiceTimer *timer, gpointer data)
+{
+  TurnPoolAllocation *alloc = data;
+
+  agent_lock ();
+
+  if (alloc->failed) {
+    priv_allocation_failed (alloc);
+    agent_unlock ();
+    return FALSE;
+  }
+
+  if (!alloc->pending) {
+    /* time to refresh */
+    if (!priv_send_refresh (alloc, -1))
+      priv_allocation_failed (alloc);
+    agent_unlock ();
+    return FALSE;
+  }
+
+  switch (stun_timer_refresh (&alloc->stun_timer)) {
+    case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+      {
+        StunTransactionId id;
+
+        stun_message_id (&alloc->stun_message, id);
+        stun_agent_forget_transaction (&alloc->stun_agent, id);
+        priv_allocation_failed (alloc);
+        break;
+      }
+    case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+      xice_socket_send (alloc->sock, &alloc->server->addr,
+          stun_message_length (&alloc->stun_message),
+          (gchar *) alloc->stun_buffer);
+      priv_schedule (alloc, stun_timer_remainder (&alloc->stun_timer));
+      break;
+    case STUN_USAGE_TIMER_RETURN_SUCCESS:
+      priv_schedule (alloc, stun_timer_remainder (&alloc->stun_timer));
+      break;
+  }
+
+  agent_unlock ();
+  return FALSE;
+}
+
+/*
+ * Keeps a 401 or 438 answer to build the request again with its REALM and
+ * NONCE, as priv_map_reply_to_relay_request() does. Returns FALSE if the
+ * error is final: any other error, or a 401 to credentials for the same
+ * realm.
+ */
+static gboolean
+priv_handle_challenge (TurnPoolAllocation *alloc, StunMessage *resp)
+{
+  int code = -1;
+  uint16_t sent_realm_len = 0;
+  uint16_t recv_realm_len = 0;
+  const uint8_t *sent_realm = stun_message_find (&alloc->stun_message,
+      STUN_ATTRIBUTE_REALM, &sent_realm_len);
+  const uint8_t *recv_realm = stun_message_find (resp,
+      STUN_ATTRIBUTE_REALM, &recv_realm_len);
+
+  if (stun_message_get_class (resp) != STUN_ERROR ||
+      stun_message_find_error (resp, &code) != STUN_MESSAGE_RETURN_SUCCESS ||
+      recv_realm == NULL || recv_realm_len == 0)
+    return FALSE;
+
+  if (code != 438 &&
+      !(code == 401 && !(sent_realm != NULL &&
+              recv_realm_len == sent_realm_len &&
+              memcmp (sent_realm, recv_realm, sent_realm_len) == 0)))
+    return FALSE;
+
+  alloc->stun_resp_msg = *resp;
+  memcpy (alloc->stun_resp_buffer, resp->buffer, stun_message_length (resp));
+  alloc->stun_resp_msg.buffer = alloc->stun_resp_buffer;
+  alloc->stun_resp_msg.buffer_len = sizeof(alloc->stun_resp_buffer);
+  alloc->stun_resp_msg.agent = NULL;
+  alloc->stun_resp_msg.key = NULL;
+  return TRUE;
+}
+
+static void
+priv_handle_response (TurnPoolAllocation *alloc, StunMessage *resp)
+{
+  struct sockaddr_storage relayed, mapped, alternate;
+  socklen_t relayed_len = sizeof(relayed);
+  socklen_t mapped_len = sizeof(mapped);
+  socklen_t alternate_len = sizeof(alternate);
+  uint32_t bandwidth, lifetime = 0;
+  StunUsageTurnReturn res;
+  gboolean refresh = stun_message_get_method (resp) == STUN_REFRESH;
+
+  alloc->pending = FALSE;
+
+  if (refresh)
+    res = stun_usage_turn_refresh_process (resp, &lifetime,
+        STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  else
+    res = stun_usage_turn_process (resp,
+        (struct sockaddr *) &relayed, &relayed_len,
+        (struct sockaddr *) &mapped, &mapped_len,
+        (struct sockaddr *) &alternate, &alternate_len,
+        &bandwidth, &lifetime, STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+
+  if (res == STUN_USAGE_TURN_RETURN_RELAY_SUCCESS ||
+      res == STUN_USAGE_TURN_RETURN_MAPPED_SUCCESS) {
+    if (!refresh) {
+      xice_address_set_from_sockaddr (&alloc->relayed,
+          (struct sockaddr *) &relayed);
+      alloc->has_mapped = res == STUN_USAGE_TURN_RETURN_MAPPED_SUCCESS;
+      if (alloc->has_mapped)
+        xice_address_set_from_sockaddr (&alloc->mapped,
+            (struct sockaddr *) &mapped);
+      alloc->ready = TRUE;
+      xice_debug ("TURN pool %p : allocation %p ready",
+          alloc->server->pool, alloc);
+    }
+    priv_schedule_refresh (alloc, lifetime);
+  } else if (res == STUN_USAGE_TURN_RETURN_ERROR &&
+      priv_handle_challenge (alloc, resp) &&
+      (refresh ? priv_send_refresh (alloc, -1) : priv_send_allocate (alloc))) {
+    return;
+  } else {
+    /* not from under the socket's own callback */
+    alloc->failed = TRUE;
+    priv_schedule (alloc, 0);
+  }
+}
+
+/* what a claimed socket gets until the agent attaches it */
+static gboolean
+priv_discard_cb (XiceSocket *sock, XiceSocketCondition condition,
+    gpointer data, gchar *buf, guint len, XiceAddress *from)
+{
+  return TRUE;
+}
+
+static gboolean
+priv_recv_cb (XiceSocket *sock, XiceSocketCondition condition,
+    gpointer data, gchar *buf, guint len, XiceAddress *from)
+{
+  TurnPoolAllocation *alloc = data;
+  TurnPoolServer *server = alloc->server;
+  StunDefaultValidaterData creds[] = {
+    { (uint8_t *) server->username, strlen (server->username),
+      (uint8_t *) server->password, strlen (server->password) },
+    { NULL, 0, NULL, 0 }
+  };
+  StunTransactionId sent_id, resp_id;
+  StunMessage resp;
+
+  if (condition != XICE_SOCKET_READABLE)
+    return TRUE;
+
+  agent_lock ();
+
+  if (alloc->pending && xice_address_equal (from, &server->addr) &&
+      stun_agent_validate (&alloc->stun_agent, &resp, (uint8_t *) buf, len,
+          stun_agent_default_validater, creds) == STUN_VALIDATION_SUCCESS) {
+    stun_message_id (&alloc->stun_message, sent_id);
+    stun_message_id (&resp, resp_id);
+    if (memcmp (sent_id, resp_id, sizeof(StunTransactionId)) == 0)
+      priv_handle_response (alloc, &resp);
+  }
+
+  agent_unlock ();
+  return TRUE;
+}
+
+static void
+priv_allocation_start (TurnPoolServer *server)
+{
+  TurnPoolAllocation *alloc = g_slice_new0 (TurnPoolAllocation);
+  XiceAddress addr = server->pool->local_addr;
+
+  alloc->server = server;
+  alloc->sock = xice_create_udp_socket (server->pool->ctx, &addr);
+  if (alloc->sock == NULL) {
+    g_slice_free (TurnPoolAllocation, alloc);
+    return;
+  }
+  xice_socket_set_callback (alloc->sock, priv_recv_cb, alloc);
+  alloc->timer = xice_create_timer (server->pool->ctx, 0,
+      priv_allocation_tick, alloc);
+
+  /* as priv_add_new_candidate_discovery_turn() does for RFC 5245 */
+  stun_agent_init (&alloc->stun_agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389,
+      STUN_AGENT_USAGE_ADD_SOFTWARE |
+      STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+
+  server->allocations = g_slist_prepend (server->allocations, alloc);
+  if (!priv_send_allocate (alloc))
+    priv_allocation_failed (alloc);
+}
+
+/* Starts allocations until there are as many as the server should keep */
+static void
+priv_server_fill (TurnPoolServer *server)
+{
+  while (g_slist_length (server->allocations) < server->size &&
+      server->retry_timer == NULL) {
+    guint before = g_slist_length (server->allocations);
+
+    priv_allocation_start (server);
+    if (g_slist_length (server->allocations) <= before)
+      break;
+  }
+}
+
+XICEAPI_EXPORT XiceTurnPool *
+xice_turn_pool_new (XiceContext *ctx, const gchar *local_ip)
+{
+  XiceTurnPool *pool;
+  XiceAddress addr;
+
+  g_return_val_if_fail (ctx != NULL, NULL);
+  g_return_val_if_fail (local_ip != NULL, NULL);
+
+  xice_address_init (&addr);
+  if (!xice_address_set_from_string (&addr, local_ip))
+    return NULL;
+
+  pool = g_slice_new0 (XiceTurnPool);
+  pool->ctx = ctx;
+  pool->local_addr = addr;
+
+  return pool;
+}
+
+XICEAPI_EXPORT gboolean
+xice_turn_pool_add_server (XiceTurnPool *pool, const gchar *server_ip,
+    guint server_port, const gchar *username, const gchar *password,
+    guint size)
+{
+  TurnPoolServer *server;
+  XiceAddress addr;
+
+  g_return_val_if_fail (pool != NULL, FALSE);
+  g_return_val_if_fail (server_ip != NULL, FALSE);
+  g_return_val_if_fail (server_port != 0, FALSE);
+  g_return_val_if_fail (username != NULL, FALSE);
+  g_return_val_if_fail (password != NULL, FALSE);
+
+  xice_address_init (&addr);
+  if (!xice_address_set_from_string (&addr, server_ip))
+    return FALSE;
+  xice_address_set_port (&addr, server_port);
+
+  agent_lock ();
+
+  server = g_slice_new0 (TurnPoolServer);
+  server->pool = pool;
+  server->addr = addr;
+  server->username = g_strdup (username);
+  server->password = g_strdup (password);
+  server->size = size;
+  pool->servers = g_slist_append (pool->servers, server);
+  priv_server_fill (server);
+
+  agent_unlock ();
+
+  return TRUE;
+}
+
+XICEAPI_EXPORT guint
+xice_turn_pool_get_ready (XiceTurnPool *pool)
+{
+  GSList *i, *j;
+  guint ready = 0;
+
+  g_return_val_if_fail (pool != NULL, 0);
+
+  agent_lock ();
+
+  for (i = pool->servers; i; i = i->next) {
+    TurnPoolServer *server = i->data;
+
+    for (j = server->allocations; j; j = j->next) {
+      TurnPoolAllocation *alloc = j->data;
+
+      if (alloc->ready)
+        ready++;
+    }
+  }
+
+  agent_unlock ();
+
+  return ready;
+}
+
+XICEAPI_EXPORT void
+xice_turn_pool_free (XiceTurnPool *pool)
+{
+  GSList *i, *j;
+
+  if (pool == NULL)
+    return;
+
+  agent_lock ();
+
+  for (i = pool->servers; i; i = i->next) {
+    TurnPoolServer *server = i->data;
+
+    for (j = server->allocations; j; j = j->next)
+      priv_allocation_free (j->data, TRUE);
+    g_slist_free (server->allocations);
+    if (server->retry_timer)
+      xice_timer_destroy (server->retry_timer);
+    g_free (server->username);
+    g_free (server->password);
+    g_slice_free (TurnPoolServer, server);
+  }
+  g_slist_free (pool->servers);
+  g_slice_free (XiceTurnPool, pool);
+
+  agent_unlock ();
+}
+
+TurnPoolAllocation *
+turn_pool_claim (XiceTurnPool *pool, XiceAgent *agent, Stream *stream,
+    Component *component, TurnServer *turn)
+{
+  GSList *i, *j;
+
+  if (agent->compatibility != XICE_COMPATIBILITY_RFC5245 ||
+      turn->type != XICE_RELAY_TYPE_TURN_UDP)
+    return NULL;
+
+  for (i = pool->servers; i; i = i->next) {
+    TurnPoolServer *server = i->data;
+
+    if (!xice_address_equal (&server->addr, &turn->server) ||
+        strcmp (server->username, turn->username) != 0 ||
+        strcmp (server->password, turn->password) != 0)
+      continue;
+
+    for (j = server->allocations; j; j = j->next) {
+      TurnPoolAllocation *alloc = j->data;
+
+      /* not in the middle of a refresh, the agent would not know the
+       * answer */
+      if (!alloc->ready || alloc->pending)
+        continue;
+
+      xice_debug ("Agent %p : claiming TURN allocation %p of pool %p",
+          agent, alloc, pool);
+      server->allocations = g_slist_delete_link (server->allocations, j);
+      xice_timer_destroy (alloc->timer);
+      alloc->timer = NULL;
+      xice_socket_set_callback (alloc->sock, priv_discard_cb, NULL);
+      alloc->agent = agent;
+      alloc->stream = stream;
+      alloc->component = component;
+      alloc->turn = turn;
+      priv_server_fill (server);
+      return alloc;
+    }
+  }
+
+  return NULL;
+}
+
+void
+turn_pool_adopt (TurnPoolAllocation *alloc)
+{
+  XiceAgent *agent = alloc->agent;
+  Stream *stream = alloc->stream;
+  Component *component = alloc->component;
+  XiceCandidate *relay_cand;
+  gint64 now = xice_context_get_time (agent->main_context);
+  gint64 lifetime = (alloc->expires - now) / G_USEC_PER_SEC;
+
+  /* the socket is the component's from now on */
+  agent_attach_stream_component_socket (agent, stream, component,
+      alloc->sock);
+  component->sockets = g_slist_append (component->sockets, alloc->sock);
+
+  if (alloc->has_mapped)
+    discovery_add_server_reflexive_candidate (agent, stream->id,
+        component->id, &alloc->mapped, alloc->sock);
+
+  relay_cand = discovery_add_relay_candidate (agent, stream->id,
+      component->id, &alloc->relayed, alloc->sock, alloc->turn);
+  if (relay_cand) {
+    xice_turn_socket_set_realm_nonce (relay_cand->sockptr,
+        &alloc->stun_message);
+    xice_turn_socket_refresh_allocation (relay_cand->sockptr,
+        alloc->stun_resp_msg.buffer == NULL ? NULL : &alloc->stun_resp_msg,
+        lifetime > 0 ? (guint) lifetime : 0);
+    discovery_relay_won (agent, stream, component);
+  }
+
+  alloc->sock = NULL;
+  priv_allocation_free (alloc, FALSE);
+}
+
+void
+turn_pool_release (TurnPoolAllocation *alloc)
+{
+  priv_allocation_free (alloc, TRUE);
+}
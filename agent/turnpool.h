@@ -0,0 +1,128 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef _XICE_TURNPOOL_H
+#define _XICE_TURNPOOL_H
+
+/**
+ * SECTION:turnpool
+ * @short_description: TURN allocations made ahead of need
+ * @include: turnpool.h
+ * @see_also: #XiceAgent
+ *
+ * Allocating a relayed candidate costs a couple of round trips to the TURN
+ * server, the challenge and the authenticated Allocate, while the gathering
+ * waits for it. A #XiceTurnPool keeps a number of authenticated allocations
+ * ready on each of its servers, and refreshes them until an agent given the
+ * pool with xice_agent_set_turn_pool() gathers candidates for a component
+ * using the same server and credentials. The agent then takes one over as
+ * its relayed candidate at once, and the pool makes another in its place.
+ *
+ * Only UDP relays of agents in %XICE_COMPATIBILITY_RFC5245 are served from
+ * a pool, the others are allocated when gathering as usual, as are those
+ * asked for while the pool has no allocation ready.
+ *
+ * Since: 0.1.4
+ */
+
+#include <glib.h>
+
+#include "address.h"
+#include "contexts/xicecontext.h"
+
+G_BEGIN_DECLS
+
+/**
+ * XiceTurnPool:
+ *
+ * An opaque structure holding TURN allocations ready to be used.
+ *
+ * Since: 0.1.4
+ */
+typedef struct _XiceTurnPool XiceTurnPool;
+
+/**
+ * xice_turn_pool_new:
+ * @ctx: The #XiceContext the allocations are made and refreshed on
+ * @local_ip: The local address the allocations are made from
+ *
+ * Creates a pool without any server. The agents given the pool must run on
+ * the same @ctx, and the pool must outlive them.
+ *
+ * Returns: The new #XiceTurnPool, or %NULL if @local_ip is invalid
+ *
+ * Since: 0.1.4
+ */
+XiceTurnPool *
+xice_turn_pool_new (XiceContext *ctx, const gchar *local_ip);
+
+/**
+ * xice_turn_pool_add_server:
+ * @pool: The #XiceTurnPool
+ * @server_ip: The IP address of the TURN server
+ * @server_port: The UDP port of the TURN server
+ * @username: The TURN username
+ * @password: The TURN password
+ * @size: The number of allocations to keep ready
+ *
+ * Starts making @size allocations on a TURN server, and keeps as many ready
+ * from then on.
+ *
+ * Returns: %TRUE if the server was added, %FALSE if the address was invalid
+ *
+ * Since: 0.1.4
+ */
+gboolean
+xice_turn_pool_add_server (XiceTurnPool *pool, const gchar *server_ip,
+    guint server_port, const gchar *username, const gchar *password,
+    guint size);
+
+/**
+ * xice_turn_pool_get_ready:
+ * @pool: The #XiceTurnPool
+ *
+ * Returns: The number of allocations ready to be taken, on all the servers
+ *
+ * Since: 0.1.4
+ */
+guint
+xice_turn_pool_get_ready (XiceTurnPool *pool);
+
+/**
+ * xice_turn_pool_free:
+ * @pool: The #XiceTurnPool
+ *
+ * Releases the allocations still in the pool and frees it. The allocations
+ * taken by agents are theirs.
+ *
+ * Since: 0.1.4
+ */
+void
+xice_turn_pool_free (XiceTurnPool *pool);
+
+G_END_DECLS
+
+#endif /* _XICE_TURNPOOL_H */
@@ -0,0 +1,576 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Connection establishment benchmark: runs pairs of agents through
+ * gathering and connectivity checks and reports the distribution of the
+ * time to the first selected pair, the time to READY and the number of
+ * STUN requests it took.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "stun/stunmessage.h"
+#include "bench.h"
+
+#ifdef HAVE_LIBUV
+#include <uv.h>
+#endif
+
+#define TIMEOUT_MS 30000
+
+typedef struct {
+	const gchar *context;
+	guint runs;
+	guint candidates;
+	guint ta;
+	gboolean trickle;
+	guint signalling;
+	XiceSimLinkParams link;
+	const gchar *turn_ip;
+	guint turn_port;
+	const gchar *turn_user;
+	const gchar *turn_pass;
+	gboolean json;
+	guint32 seed;
+} BenchConfig;
+
+typedef struct _BenchRun BenchRun;
+
+typedef struct {
+	BenchRun *run;
+	XiceAgent *agent;
+	XiceContext *ctx;
+	guint stream;
+	gboolean ready;
+	gboolean failed;
+} BenchAgent;
+
+struct _BenchRun {
+	const BenchConfig *config;
+	BenchAgent agents[2];
+	XiceSimNetwork *net;
+#ifdef HAVE_LIBUV
+	uv_loop_t *loop;
+#endif
+	GSList *signals;
+	gint64 start;
+	gint64 selected;
+	gint64 ready;
+	guint requests;
+	GHashTable *transactions;
+	gboolean done;
+};
+
+/* candidates on their way to the other agent through the signalling
+ * channel */
+typedef struct {
+	BenchRun *run;
+	BenchAgent *to;
+	GSList *candidates;
+	XiceTimer *timer;
+} BenchSignal;
+
+static BenchConfig config = {
+	"sim", 100, 1, 0, FALSE, 0, { 25, 0, 0, 0, 0 },
+	NULL, 3478, "", "", FALSE, 1
+};
+
+static gint64
+bench_now(BenchRun *run)
+{
+	if (run->net != NULL)
+		return xice_sim_network_get_time(run->net);
+	return g_get_monotonic_time();
+}
+
+static void
+bench_stop(BenchRun *run)
+{
+	run->done = TRUE;
+	if (run->net != NULL)
+		xice_sim_network_stop(run->net);
+#ifdef HAVE_LIBUV
+	if (run->loop != NULL)
+		uv_stop(run->loop);
+#endif
+}
+
+static void
+tap_cb(XiceSimNetwork *net, const XiceAddress *from, const XiceAddress *to,
+	const gchar *buf, guint len, gpointer data)
+{
+	BenchRun *run = data;
+	StunMessage msg;
+
+	if (stun_message_validate_buffer_length((const uint8_t *)buf, len, TRUE) <= 0)
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.buffer = (uint8_t *)buf;
+	msg.buffer_len = len;
+	if (stun_message_get_class(&msg) != STUN_REQUEST)
+		return;
+
+	/* retransmissions count as requests but not as new transactions */
+	run->requests++;
+	g_hash_table_insert(run->transactions,
+		g_memdup(buf + 8, STUN_MESSAGE_TRANS_ID_LEN), GUINT_TO_POINTER(1));
+}
+
+static guint
+transaction_hash(gconstpointer key)
+{
+	guint hash;
+	memcpy(&hash, key, sizeof(hash));
+	return hash;
+}
+
+static gboolean
+transaction_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, STUN_MESSAGE_TRANS_ID_LEN) == 0;
+}
+
+static gboolean
+signal_cb(XiceTimer *timer, gpointer data)
+{
+	BenchSignal *signal = data;
+	BenchAgent *to = signal->to;
+
+	xice_agent_set_remote_candidates(to->agent, to->stream, 1,
+		signal->candidates);
+
+	signal->run->signals = g_slist_remove(signal->run->signals, signal);
+	g_slist_free_full(signal->candidates, (GDestroyNotify)xice_candidate_free);
+	xice_timer_destroy(signal->timer);
+	g_slice_free(BenchSignal, signal);
+
+	return FALSE;
+}
+
+static void
+bench_signal(BenchRun *run, BenchAgent *to, GSList *candidates)
+{
+	BenchSignal *signal = g_slice_new0(BenchSignal);
+
+	signal->run = run;
+	signal->to = to;
+	signal->candidates = candidates;
+	signal->timer = xice_create_timer(to->ctx, run->config->signalling,
+		signal_cb, signal);
+	run->signals = g_slist_prepend(run->signals, signal);
+	xice_timer_start(signal->timer);
+}
+
+static BenchAgent *
+bench_agent(BenchRun *run, XiceAgent *agent)
+{
+	return run->agents[0].agent == agent ? &run->agents[0] : &run->agents[1];
+}
+
+static BenchAgent *
+bench_peer(BenchRun *run, XiceAgent *agent)
+{
+	return run->agents[0].agent == agent ? &run->agents[1] : &run->agents[0];
+}
+
+static void
+cb_new_candidate(XiceAgent *agent, guint stream_id, guint component_id,
+	gchar *foundation, gpointer data)
+{
+	BenchRun *run = data;
+	GSList *cands, *i, *found = NULL;
+
+	if (!run->config->trickle)
+		return;
+
+	cands = xice_agent_get_local_candidates(agent, stream_id, component_id);
+	for (i = cands; i; i = i->next) {
+		XiceCandidate *cand = i->data;
+		if (strcmp(cand->foundation, foundation) == 0)
+			found = g_slist_append(found, xice_candidate_copy(cand));
+	}
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+
+	if (found != NULL)
+		bench_signal(run, bench_peer(run, agent), found);
+}
+
+static void
+cb_candidate_gathering_done(XiceAgent *agent, guint stream_id, gpointer data)
+{
+	BenchRun *run = data;
+
+	if (run->config->trickle)
+		return;
+
+	bench_signal(run, bench_peer(run, agent),
+		xice_agent_get_local_candidates(agent, stream_id, 1));
+}
+
+static void
+cb_new_selected_pair(XiceAgent *agent, guint stream_id, guint component_id,
+	gchar *lfoundation, gchar *rfoundation, gpointer data)
+{
+	BenchRun *run = data;
+
+	if (run->selected < 0)
+		run->selected = bench_now(run) - run->start;
+}
+
+static void
+cb_component_state_changed(XiceAgent *agent, guint stream_id,
+	guint component_id, guint state, gpointer data)
+{
+	BenchRun *run = data;
+	BenchAgent *self = bench_agent(run, agent);
+
+	if (state == XICE_COMPONENT_STATE_READY) {
+		self->ready = TRUE;
+	} else if (state == XICE_COMPONENT_STATE_FAILED) {
+		self->failed = TRUE;
+		bench_stop(run);
+		return;
+	}
+
+	if (run->agents[0].ready && run->agents[1].ready && run->ready < 0) {
+		run->ready = bench_now(run) - run->start;
+		bench_stop(run);
+	}
+}
+
+static void
+cb_xice_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+}
+
+#ifdef HAVE_LIBUV
+static void
+timeout_cb(uv_timer_t *handle)
+{
+	bench_stop(handle->data);
+}
+#endif
+
+static void
+bench_agent_init(BenchRun *run, BenchAgent *self, guint index)
+{
+	const BenchConfig *cfg = run->config;
+	XiceAddress addr;
+	guint i;
+
+	self->run = run;
+	self->agent = xice_agent_new(self->ctx, XICE_COMPATIBILITY_RFC5245);
+	g_object_set(G_OBJECT(self->agent), "controlling-mode", index == 0, NULL);
+	if (cfg->ta > 0)
+		g_object_set(G_OBJECT(self->agent), "stun-pacing-timer", cfg->ta, NULL);
+
+	g_signal_connect(G_OBJECT(self->agent), "new-candidate",
+		G_CALLBACK(cb_new_candidate), run);
+	g_signal_connect(G_OBJECT(self->agent), "candidate-gathering-done",
+		G_CALLBACK(cb_candidate_gathering_done), run);
+	g_signal_connect(G_OBJECT(self->agent), "new-selected-pair",
+		G_CALLBACK(cb_new_selected_pair), run);
+	g_signal_connect(G_OBJECT(self->agent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), run);
+
+	/* 10.0.<agent>.<n> on the simulated network, 127.0.<agent>.<n> on
+	 * the loopback interface */
+	for (i = 0; i < cfg->candidates; i++) {
+		guint32 net = run->net != NULL ? 0x0a000000 : 0x7f000000;
+		xice_address_init(&addr);
+		xice_address_set_ipv4(&addr, net | (index << 8) | (i + 1));
+		xice_agent_add_local_address(self->agent, &addr);
+	}
+
+	self->stream = xice_agent_add_stream(self->agent, 1);
+	xice_agent_attach_recv(self->agent, self->stream, 1, cb_xice_recv, NULL);
+
+	if (cfg->turn_ip != NULL) {
+		xice_agent_set_relay_info(self->agent, self->stream, 1, cfg->turn_ip,
+			cfg->turn_port, cfg->turn_user, cfg->turn_pass,
+			XICE_RELAY_TYPE_TURN_UDP);
+	}
+}
+
+static void
+bench_exchange_credentials(BenchAgent *from, BenchAgent *to)
+{
+	gchar *ufrag = NULL, *pwd = NULL;
+
+	xice_agent_get_local_credentials(from->agent, from->stream, &ufrag, &pwd);
+	xice_agent_set_remote_credentials(to->agent, to->stream, ufrag, pwd);
+	g_free(ufrag);
+	g_free(pwd);
+}
+
+/* Runs one pair of agents, returns FALSE if they did not both get READY */
+static gboolean
+bench_run(BenchRun *run, guint32 seed)
+{
+	const BenchConfig *cfg = run->config;
+	guint i;
+
+	run->selected = -1;
+	run->ready = -1;
+	run->transactions = g_hash_table_new_full(transaction_hash,
+		transaction_equal, g_free, NULL);
+
+	if (strcmp(cfg->context, "sim") == 0) {
+		run->net = xice_sim_network_new(seed);
+		xice_sim_network_set_default_link(run->net, &cfg->link);
+		xice_sim_network_set_tap(run->net, tap_cb, run);
+		for (i = 0; i < 2; i++)
+			run->agents[i].ctx = xice_context_create("sim", run->net);
+#ifdef HAVE_LIBUV
+	} else if (strcmp(cfg->context, "libuv") == 0) {
+		run->loop = g_slice_new0(uv_loop_t);
+		uv_loop_init(run->loop);
+		for (i = 0; i < 2; i++)
+			run->agents[i].ctx = xice_context_create("libuv", run->loop);
+#endif
+	} else {
+		g_printerr("unsupported context '%s'\n", cfg->context);
+		exit(1);
+	}
+
+	for (i = 0; i < 2; i++)
+		bench_agent_init(run, &run->agents[i], i);
+	bench_exchange_credentials(&run->agents[0], &run->agents[1]);
+	bench_exchange_credentials(&run->agents[1], &run->agents[0]);
+
+	run->start = bench_now(run);
+	for (i = 0; i < 2; i++)
+		xice_agent_gather_candidates(run->agents[i].agent, run->agents[i].stream);
+
+	if (run->net != NULL) {
+		if (!run->done)
+			xice_sim_network_run_for(run->net, TIMEOUT_MS);
+#ifdef HAVE_LIBUV
+	} else {
+		uv_timer_t timeout;
+
+		uv_timer_init(run->loop, &timeout);
+		timeout.data = run;
+		uv_timer_start(&timeout, timeout_cb, TIMEOUT_MS, 0);
+		if (!run->done)
+			uv_run(run->loop, UV_RUN_DEFAULT);
+		uv_close((uv_handle_t *)&timeout, NULL);
+#endif
+	}
+
+	while (run->signals != NULL) {
+		BenchSignal *signal = run->signals->data;
+		run->signals = g_slist_delete_link(run->signals, run->signals);
+		g_slist_free_full(signal->candidates, (GDestroyNotify)xice_candidate_free);
+		xice_timer_destroy(signal->timer);
+		g_slice_free(BenchSignal, signal);
+	}
+
+	for (i = 0; i < 2; i++) {
+		g_object_unref(run->agents[i].agent);
+		xice_context_destroy(run->agents[i].ctx);
+	}
+
+	if (run->net != NULL)
+		xice_sim_network_free(run->net);
+#ifdef HAVE_LIBUV
+	if (run->loop != NULL) {
+		/* let the closed handles run their callbacks */
+		uv_run(run->loop, UV_RUN_NOWAIT);
+		uv_loop_close(run->loop);
+		g_slice_free(uv_loop_t, run->loop);
+	}
+#endif
+
+	return run->ready >= 0;
+}
+
+static void
+usage(const char *name)
+{
+	g_print("Usage: %s [OPTION]...\n"
+		"Measure ICE connection establishment between pairs of agents.\n"
+		"\n"
+		"  -c, --context=NAME    sim (default) or libuv\n"
+		"  -n, --runs=N          number of agent pairs to run [100]\n"
+		"  -k, --candidates=N    host candidates per agent [1]\n"
+		"  -a, --ta=MS           connectivity check pacing (Ta) [agent default]\n"
+		"  -t, --trickle         signal candidates as they are gathered\n"
+		"  -s, --signalling=MS   signalling channel delay [0]\n"
+		"  -l, --latency=MS      sim: one-way link delay [25]\n"
+		"  -j, --jitter=MS       sim: link jitter [0]\n"
+		"  -p, --loss=PERCENT    sim: packet loss [0]\n"
+		"  -r, --turn=IP[:PORT]  gather relayed candidates from this TURN server\n"
+		"  -u, --turn-user=USER  TURN username\n"
+		"  -w, --turn-pass=PASS  TURN password\n"
+		"  -S, --seed=N          sim: seed of the first run [1]\n"
+		"      --json            print results as JSON\n"
+		"  -h, --help            display this help and exit\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "context", required_argument, NULL, 'c' },
+		{ "runs", required_argument, NULL, 'n' },
+		{ "candidates", required_argument, NULL, 'k' },
+		{ "ta", required_argument, NULL, 'a' },
+		{ "trickle", no_argument, NULL, 't' },
+		{ "signalling", required_argument, NULL, 's' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "jitter", required_argument, NULL, 'j' },
+		{ "loss", required_argument, NULL, 'p' },
+		{ "turn", required_argument, NULL, 'r' },
+		{ "turn-user", required_argument, NULL, 'u' },
+		{ "turn-pass", required_argument, NULL, 'w' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	BenchStats selected, ready, requests, transactions;
+	guint failures = 0;
+	guint i;
+
+	for (;;) {
+		int val = getopt_long(argc, argv, "c:n:k:a:ts:l:j:p:r:u:w:S:h", opts, NULL);
+		if (val == -1)
+			break;
+
+		switch (val) {
+		case 'c': config.context = optarg; break;
+		case 'n': config.runs = atoi(optarg); break;
+		case 'k': config.candidates = atoi(optarg); break;
+		case 'a': config.ta = atoi(optarg); break;
+		case 't': config.trickle = TRUE; break;
+		case 's': config.signalling = atoi(optarg); break;
+		case 'l': config.link.latency = atoi(optarg); break;
+		case 'j': config.link.jitter = atoi(optarg); break;
+		case 'p': config.link.loss = atof(optarg) / 100; break;
+		case 'r': {
+			gchar *port = strrchr(optarg, ':');
+			if (port != NULL) {
+				*port = '\0';
+				config.turn_port = atoi(port + 1);
+			}
+			config.turn_ip = optarg;
+			break;
+		}
+		case 'u': config.turn_user = optarg; break;
+		case 'w': config.turn_pass = optarg; break;
+		case 'S': config.seed = strtoul(optarg, NULL, 10); break;
+		case 'J': config.json = TRUE; break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (config.runs == 0 || config.candidates == 0 || config.candidates > 254) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	g_type_init();
+
+	bench_stats_init(&selected);
+	bench_stats_init(&ready);
+	bench_stats_init(&requests);
+	bench_stats_init(&transactions);
+
+	for (i = 0; i < config.runs; i++) {
+		BenchRun run;
+
+		memset(&run, 0, sizeof(run));
+		run.config = &config;
+		if (!bench_run(&run, config.seed + i)) {
+			failures++;
+		} else {
+			bench_stats_add(&selected, run.selected / 1000.0);
+			bench_stats_add(&ready, run.ready / 1000.0);
+			if (run.net != NULL) {
+				bench_stats_add(&requests, run.requests);
+				bench_stats_add(&transactions,
+					g_hash_table_size(run.transactions));
+			}
+		}
+		g_hash_table_destroy(run.transactions);
+	}
+
+	if (config.json) {
+		g_print("{\"benchmark\": \"conncheck\", \"context\": \"%s\", "
+			"\"runs\": %u, \"candidates\": %u, \"ta\": %u, \"trickle\": %s, "
+			"\"signalling_ms\": %u, \"latency_ms\": %u, \"jitter_ms\": %u, "
+			"\"loss\": %g, \"turn\": %s, \"failures\": %u",
+			config.context, config.runs, config.candidates, config.ta,
+			config.trickle ? "true" : "false", config.signalling,
+			config.link.latency, config.link.jitter, config.link.loss,
+			config.turn_ip ? "true" : "false", failures);
+		bench_stats_print_json(&selected, "selected_pair_ms");
+		bench_stats_print_json(&ready, "ready_ms");
+		bench_stats_print_json(&requests, "stun_requests");
+		bench_stats_print_json(&transactions, "stun_transactions");
+		g_print("}\n");
+	} else {
+		g_print("context=%s runs=%u candidates=%u ta=%u trickle=%s "
+			"signalling=%ums turn=%s\n",
+			config.context, config.runs, config.candidates, config.ta,
+			config.trickle ? "on" : "off", config.signalling,
+			config.turn_ip ? "on" : "off");
+		if (strcmp(config.context, "sim") == 0)
+			g_print("link: latency=%ums jitter=%ums loss=%g%%\n",
+				config.link.latency, config.link.jitter, config.link.loss * 100);
+		g_print("%-24s %10s %10s %10s\n", "", "p50", "p95", "p99");
+		bench_stats_print(&selected, "selected pair (ms)");
+		bench_stats_print(&ready, "ready (ms)");
+		bench_stats_print(&requests, "stun requests");
+		bench_stats_print(&transactions, "stun transactions");
+		g_print("failures: %u/%u\n", failures, config.runs);
+	}
+
+	bench_stats_clear(&selected);
+	bench_stats_clear(&ready);
+	bench_stats_clear(&requests);
+	bench_stats_clear(&transactions);
+
+	return failures == config.runs ? 1 : 0;
+}
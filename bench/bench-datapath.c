@@ -0,0 +1,524 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+/*
+ * Data path benchmark: brings a component up to READY between two agents
+ * on the same event loop, then pushes packets through
+ * xice_agent_send() -> socket -> xice_agent_g_source_cb() -> recv callback
+ * and reports packets/s, Mbit/s and the cost per packet. With more than
+ * one thread every thread runs its own pair of agents on its own loop, so
+ * the results also show how much the agents contend with each other.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#ifndef G_OS_WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include <xice/xice.h>
+#include "bench.h"
+
+#ifdef HAVE_LIBUV
+#include <uv.h>
+#endif
+
+#define SETUP_TIMEOUT_MS 10000
+#define STALL_CHECK_MS 50
+
+typedef struct {
+	guint packets;
+	guint window;
+	guint max_threads;
+	GArray *sizes;
+	const gchar *turn_ip;
+	guint turn_port;
+	const gchar *turn_user;
+	const gchar *turn_pass;
+} BenchConfig;
+
+typedef struct {
+	const BenchConfig *config;
+	const gchar *context;
+	guint size;
+	volatile gint *ready;
+	gint nthreads;
+
+	XiceContext *ctx;
+	GMainLoop *gloop;
+#ifdef HAVE_LIBUV
+	uv_loop_t *uvloop;
+#endif
+	XiceAgent *lagent;
+	XiceAgent *ragent;
+	guint lstream;
+	guint rstream;
+	guint gathered;
+	guint connected;
+	gboolean failed;
+
+	gchar *buf;
+	guint sent;
+	guint received;
+	guint last_received;
+	guint64 bytes;
+	gint64 start;
+	gint64 end;
+	gboolean measuring;
+} BenchWorker;
+
+static BenchConfig config = { 20000, 64, 1, NULL, NULL, 3478, "", "" };
+
+static void
+worker_run(BenchWorker *w)
+{
+	if (w->gloop != NULL)
+		g_main_loop_run(w->gloop);
+#ifdef HAVE_LIBUV
+	else
+		uv_run(w->uvloop, UV_RUN_DEFAULT);
+#endif
+}
+
+static void
+worker_quit(BenchWorker *w)
+{
+	if (w->gloop != NULL)
+		g_main_loop_quit(w->gloop);
+#ifdef HAVE_LIBUV
+	else
+		uv_stop(w->uvloop);
+#endif
+}
+
+static void
+exchange_candidates(XiceAgent *from, guint from_stream, XiceAgent *to,
+	guint to_stream, gboolean relayed_only)
+{
+	GSList *cands, *i, *remote = NULL;
+	gchar *ufrag = NULL, *pwd = NULL;
+
+	xice_agent_get_local_credentials(from, from_stream, &ufrag, &pwd);
+	xice_agent_set_remote_credentials(to, to_stream, ufrag, pwd);
+	g_free(ufrag);
+	g_free(pwd);
+
+	/* to measure the relayed path only the relayed candidates are given
+	 * to the peer, so that every pair goes through the TURN server */
+	cands = xice_agent_get_local_candidates(from, from_stream, 1);
+	for (i = cands; i; i = i->next) {
+		XiceCandidate *cand = i->data;
+		if (!relayed_only || cand->type == XICE_CANDIDATE_TYPE_RELAYED)
+			remote = g_slist_append(remote, cand);
+	}
+	xice_agent_set_remote_candidates(to, to_stream, 1, remote);
+	g_slist_free(remote);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+}
+
+static void
+cb_candidate_gathering_done(XiceAgent *agent, guint stream_id, gpointer data)
+{
+	BenchWorker *w = data;
+	gboolean relayed = w->config->turn_ip != NULL;
+
+	if (++w->gathered < 2)
+		return;
+
+	exchange_candidates(w->lagent, w->lstream, w->ragent, w->rstream, relayed);
+	exchange_candidates(w->ragent, w->rstream, w->lagent, w->lstream, relayed);
+}
+
+static void
+cb_component_state_changed(XiceAgent *agent, guint stream_id,
+	guint component_id, guint state, gpointer data)
+{
+	BenchWorker *w = data;
+
+	if (state == XICE_COMPONENT_STATE_READY) {
+		if (++w->connected == 2)
+			worker_quit(w);
+	} else if (state == XICE_COMPONENT_STATE_FAILED) {
+		w->failed = TRUE;
+		worker_quit(w);
+	}
+}
+
+static void
+send_packet(BenchWorker *w)
+{
+	if (xice_agent_send(w->lagent, w->lstream, 1, w->size, w->buf) > 0)
+		w->sent++;
+}
+
+static void
+cb_recv(XiceAgent *agent, guint stream_id, guint component_id, guint len,
+	gchar *buf, gpointer data)
+{
+	BenchWorker *w = data;
+
+	if (!w->measuring)
+		return;
+
+	w->received++;
+	w->bytes += len;
+	w->end = g_get_monotonic_time();
+
+	/* keep a fixed number of packets in flight */
+	if (w->sent < w->config->packets)
+		send_packet(w);
+	else if (w->received == w->sent)
+		worker_quit(w);
+}
+
+static gboolean
+stall_cb(XiceTimer *timer, gpointer data)
+{
+	BenchWorker *w = data;
+	guint i;
+
+	if (w->received != w->last_received) {
+		w->last_received = w->received;
+		return TRUE;
+	}
+
+	/* nothing arrived since the last check: whatever is in flight was
+	 * dropped, so refill the window or give up once everything is sent */
+	if (w->sent >= w->config->packets) {
+		worker_quit(w);
+		return TRUE;
+	}
+	for (i = 0; i < w->config->window && w->sent < w->config->packets; i++)
+		send_packet(w);
+
+	return TRUE;
+}
+
+static gboolean
+timeout_cb(XiceTimer *timer, gpointer data)
+{
+	BenchWorker *w = data;
+
+	w->failed = TRUE;
+	worker_quit(w);
+	return FALSE;
+}
+
+static XiceAgent *
+worker_agent(BenchWorker *w, gboolean controlling, guint *stream)
+{
+	XiceAgent *agent;
+	XiceAddress addr;
+
+	agent = xice_agent_new(w->ctx, XICE_COMPATIBILITY_RFC5245);
+	g_object_set(G_OBJECT(agent), "controlling-mode", controlling, NULL);
+	g_signal_connect(G_OBJECT(agent), "candidate-gathering-done",
+		G_CALLBACK(cb_candidate_gathering_done), w);
+	g_signal_connect(G_OBJECT(agent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), w);
+
+	xice_address_init(&addr);
+	xice_address_set_from_string(&addr, "127.0.0.1");
+	xice_agent_add_local_address(agent, &addr);
+
+	*stream = xice_agent_add_stream(agent, 1);
+	xice_agent_attach_recv(agent, *stream, 1, cb_recv, w);
+
+	if (w->config->turn_ip != NULL) {
+		xice_agent_set_relay_info(agent, *stream, 1, w->config->turn_ip,
+			w->config->turn_port, w->config->turn_user, w->config->turn_pass,
+			XICE_RELAY_TYPE_TURN_UDP);
+	}
+
+	return agent;
+}
+
+static gpointer
+worker_thread(gpointer data)
+{
+	BenchWorker *w = data;
+	XiceTimer *timer;
+	guint i;
+
+	if (strcmp(w->context, "gio") == 0) {
+		GMainContext *mctx = g_main_context_new();
+		w->gloop = g_main_loop_new(mctx, FALSE);
+		w->ctx = xice_context_create("gio", mctx);
+		g_main_context_unref(mctx);
+#ifdef HAVE_LIBUV
+	} else {
+		w->uvloop = g_slice_new0(uv_loop_t);
+		uv_loop_init(w->uvloop);
+		w->ctx = xice_context_create("libuv", w->uvloop);
+#endif
+	}
+
+	w->lagent = worker_agent(w, TRUE, &w->lstream);
+	w->ragent = worker_agent(w, FALSE, &w->rstream);
+
+	timer = xice_create_timer(w->ctx, SETUP_TIMEOUT_MS, timeout_cb, w);
+	xice_timer_start(timer);
+	xice_agent_gather_candidates(w->lagent, w->lstream);
+	xice_agent_gather_candidates(w->ragent, w->rstream);
+	worker_run(w);
+	xice_timer_destroy(timer);
+
+	if (w->failed)
+		g_printerr("%s: agents failed to connect\n", w->context);
+
+	/* start every thread's measurement at the same time */
+	g_atomic_int_inc(w->ready);
+	while (g_atomic_int_get(w->ready) < w->nthreads)
+		g_usleep(1000);
+
+	if (!w->failed) {
+		w->buf = g_malloc0(w->size);
+		w->measuring = TRUE;
+		timer = xice_create_timer(w->ctx, STALL_CHECK_MS, stall_cb, w);
+		xice_timer_start(timer);
+
+		w->start = w->end = g_get_monotonic_time();
+		for (i = 0; i < w->config->window && i < w->config->packets; i++)
+			send_packet(w);
+		worker_run(w);
+
+		xice_timer_destroy(timer);
+		g_free(w->buf);
+	}
+
+	g_object_unref(w->lagent);
+	g_object_unref(w->ragent);
+	xice_context_destroy(w->ctx);
+
+	if (w->gloop != NULL)
+		g_main_loop_unref(w->gloop);
+#ifdef HAVE_LIBUV
+	if (w->uvloop != NULL) {
+		uv_run(w->uvloop, UV_RUN_NOWAIT);
+		uv_loop_close(w->uvloop);
+		g_slice_free(uv_loop_t, w->uvloop);
+	}
+#endif
+
+	return NULL;
+}
+
+static gint64
+cpu_time(void)
+{
+#ifndef G_OS_WIN32
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+/* Runs one configuration on nthreads threads and prints its JSON object */
+static void
+bench_run(const gchar *context, guint size, guint nthreads, gboolean first)
+{
+	BenchWorker *workers = g_new0(BenchWorker, nthreads);
+	GThread **threads = g_new0(GThread *, nthreads);
+	volatile gint ready = 0;
+	guint64 received = 0, sent = 0, bytes = 0;
+	gint64 start = G_MAXINT64, end = 0, cpu;
+	gdouble seconds;
+	guint i, failed = 0;
+
+	cpu = cpu_time();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].config = &config;
+		workers[i].context = context;
+		workers[i].size = size;
+		workers[i].ready = &ready;
+		workers[i].nthreads = nthreads;
+#if !GLIB_CHECK_VERSION(2,31,8)
+		threads[i] = g_thread_create(worker_thread, &workers[i], TRUE, NULL);
+#else
+		threads[i] = g_thread_new("bench", worker_thread, &workers[i]);
+#endif
+	}
+	for (i = 0; i < nthreads; i++)
+		g_thread_join(threads[i]);
+	cpu = cpu_time() - cpu;
+
+	for (i = 0; i < nthreads; i++) {
+		BenchWorker *w = &workers[i];
+		if (w->failed) {
+			failed++;
+			continue;
+		}
+		sent += w->sent;
+		received += w->received;
+		bytes += w->bytes;
+		start = MIN(start, w->start);
+		end = MAX(end, w->end);
+	}
+	seconds = end > start ? (end - start) / (gdouble)G_USEC_PER_SEC : 0;
+
+	/* the CPU time includes connection setup, which is small next to the
+	 * transfer itself at the default packet count */
+	g_print("%s  {\"context\": \"%s\", \"path\": \"%s\", \"size\": %u, "
+		"\"threads\": %u, \"failed_threads\": %u, \"sent\": %" G_GUINT64_FORMAT
+		", \"received\": %" G_GUINT64_FORMAT ", \"seconds\": %g, "
+		"\"packets_per_sec\": %.0f, \"mbit_per_sec\": %.2f, "
+		"\"ns_per_packet\": %.0f, \"cpu_ns_per_packet\": %.0f}",
+		first ? "" : ",\n", context, config.turn_ip ? "turn" : "direct", size,
+		nthreads, failed, sent, received, seconds,
+		seconds > 0 ? received / seconds : 0,
+		seconds > 0 ? bytes * 8 / seconds / 1e6 : 0,
+		received > 0 ? seconds * 1e9 / received : 0,
+		received > 0 ? cpu * 1e3 / received : 0);
+
+	g_free(threads);
+	g_free(workers);
+}
+
+static void
+usage(const char *name)
+{
+	g_print("Usage: %s [OPTION]...\n"
+		"Measure the throughput and per-packet cost of the agent data path.\n"
+		"\n"
+		"  -c, --context=NAME    gio, libuv or all (default)\n"
+		"  -s, --sizes=LIST      comma separated packet sizes [100,200,500,1000,1400]\n"
+		"  -n, --packets=N       packets per thread and measurement [20000]\n"
+		"  -W, --window=N        packets in flight per thread [64]\n"
+		"  -T, --threads=N       measure with 1 to N threads [1]\n"
+		"  -r, --turn=IP[:PORT]  relay every packet through this TURN server\n"
+		"  -u, --turn-user=USER  TURN username\n"
+		"  -w, --turn-pass=PASS  TURN password\n"
+		"  -h, --help            display this help and exit\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "context", required_argument, NULL, 'c' },
+		{ "sizes", required_argument, NULL, 's' },
+		{ "packets", required_argument, NULL, 'n' },
+		{ "window", required_argument, NULL, 'W' },
+		{ "threads", required_argument, NULL, 'T' },
+		{ "turn", required_argument, NULL, 'r' },
+		{ "turn-user", required_argument, NULL, 'u' },
+		{ "turn-pass", required_argument, NULL, 'w' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const gchar *contexts[] = { "gio",
+#ifdef HAVE_LIBUV
+		"libuv",
+#endif
+		NULL };
+	const gchar *context = "all";
+	const gchar *sizes = "100,200,500,1000,1400";
+	gchar **tokens;
+	gboolean first = TRUE;
+	guint c, s, t;
+
+	for (;;) {
+		int val = getopt_long(argc, argv, "c:s:n:W:T:r:u:w:h", opts, NULL);
+		if (val == -1)
+			break;
+
+		switch (val) {
+		case 'c': context = optarg; break;
+		case 's': sizes = optarg; break;
+		case 'n': config.packets = atoi(optarg); break;
+		case 'W': config.window = atoi(optarg); break;
+		case 'T': config.max_threads = atoi(optarg); break;
+		case 'r': {
+			gchar *port = strrchr(optarg, ':');
+			if (port != NULL) {
+				*port = '\0';
+				config.turn_port = atoi(port + 1);
+			}
+			config.turn_ip = optarg;
+			break;
+		}
+		case 'u': config.turn_user = optarg; break;
+		case 'w': config.turn_pass = optarg; break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	config.sizes = g_array_new(FALSE, FALSE, sizeof(guint));
+	tokens = g_strsplit(sizes, ",", 0);
+	for (s = 0; tokens[s] != NULL; s++) {
+		guint size = atoi(tokens[s]);
+		if (size > 0 && size <= 65000)
+			g_array_append_val(config.sizes, size);
+	}
+	g_strfreev(tokens);
+
+	if (config.sizes->len == 0 || config.packets == 0 || config.window == 0 ||
+		config.max_threads == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	g_type_init();
+#if !GLIB_CHECK_VERSION(2,31,8)
+	g_thread_init(NULL);
+#endif
+
+	g_print("{\"benchmark\": \"datapath\", \"packets\": %u, \"window\": %u, "
+		"\"results\": [\n", config.packets, config.window);
+	for (c = 0; contexts[c] != NULL; c++) {
+		if (strcmp(context, "all") != 0 && strcmp(context, contexts[c]) != 0)
+			continue;
+		for (s = 0; s < config.sizes->len; s++) {
+			for (t = 1; t <= config.max_threads; t++) {
+				bench_run(contexts[c], g_array_index(config.sizes, guint, s), t,
+					first);
+				first = FALSE;
+			}
+		}
+	}
+	g_print("\n]}\n");
+
+	g_array_free(config.sizes, TRUE);
+
+	return first ? 2 : 0;
+}
@@ -0,0 +1,680 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+/*
+ * PseudoTCP bulk transfer benchmark: two PseudoTcpSockets exchange a large
+ * payload over the simulated network, for every combination of round trip
+ * time and loss rate asked for. Transfers run on virtual time, so goodput
+ * is what the protocol achieves on such a link, independently of the
+ * speed of the machine, while the CPU cost per megabyte is measured for
+ * real. The time spent in PseudoTCP itself and, with glibc, the heap
+ * allocations it makes are also reported per segment, as are the clock
+ * timer rearms and the largest burst of data segments sent in the same
+ * millisecond.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#ifndef G_OS_WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include <xice/xice.h>
+#include "agent/pseudotcp.h"
+#include "contexts/simcontext.h"
+#include "bench.h"
+
+/* virtual time after which a transfer is given up */
+#define TRANSFER_TIMEOUT_MS (30 * 60 * 1000)
+
+typedef struct _BenchTransfer BenchTransfer;
+
+typedef struct {
+	BenchTransfer *transfer;
+	PseudoTcpSocket *tcp;
+	XiceSocket *sock;
+	XiceAddress peer;
+	XiceTimer *clock;
+	gint64 deadline;        /* when clock fires in ms, 0 if stopped */
+} BenchEndpoint;
+
+struct _BenchTransfer {
+	XiceSimNetwork *net;
+	XiceContext *ctx;
+	BenchEndpoint sender;
+	BenchEndpoint receiver;
+	guint64 total;
+	guint64 written;
+	guint64 read;
+	gint64 start;
+	gint64 end;
+	gboolean failed;
+	guint64 srtt_sum;
+	guint64 srtt_samples;
+	guint64 rearms;
+	/* data segments the sender wrote in the same millisecond */
+	gint64 burst_ms;
+	guint burst;
+	guint burst_max;
+};
+
+typedef struct {
+	GArray *rtts;
+	GArray *losses;
+	guint64 bytes;
+	guint bandwidth;
+	guint sndbuf;
+	guint rcvbuf;
+	guint32 seed;
+	gboolean json;
+} BenchConfig;
+
+static BenchConfig config = { NULL, NULL, 4 * 1024 * 1024, 0, 0, 0, 1, FALSE };
+
+/* SACK and pacing settings to run each point of the grid with */
+static const gboolean mode_on[] = { TRUE };
+static const gboolean mode_off[] = { FALSE };
+static const gboolean mode_both[] = { FALSE, TRUE };
+
+/* congestion controllers, indexed by PseudoTcpCongestionControl */
+static const gchar *cc_names[] = { "reno", "cubic", "bbr" };
+
+/* the payload byte at stream offset n is n % PATTERN_PERIOD, so the
+ * receiver can check that everything arrived intact and in order */
+#define PATTERN_PERIOD 251
+
+static gchar pattern[16384 + PATTERN_PERIOD];
+
+static void adjust_clock(BenchEndpoint *ep);
+
+/* Time and heap allocations are accounted to PseudoTCP from a call into it
+ * until it calls back into the benchmark */
+static gboolean in_pseudotcp;
+static guint64 pseudotcp_ns;
+static guint64 pseudotcp_allocations;
+static guint64 entered_ns;
+
+static guint64
+now_ns(void)
+{
+#ifndef G_OS_WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return g_get_monotonic_time() * 1000;
+#endif
+}
+
+static gboolean
+pseudotcp_enter(gboolean inside)
+{
+	gboolean was_inside = in_pseudotcp;
+
+	if (inside && !was_inside)
+		entered_ns = now_ns();
+	else if (!inside && was_inside)
+		pseudotcp_ns += now_ns() - entered_ns;
+	in_pseudotcp = inside;
+	return was_inside;
+}
+
+/* sanitizers replace malloc themselves */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+	if (in_pseudotcp)
+		pseudotcp_allocations++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	if (in_pseudotcp)
+		pseudotcp_allocations++;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (in_pseudotcp)
+		pseudotcp_allocations++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static guint32
+sim_clock(PseudoTcpSocket *tcp, gpointer data)
+{
+	BenchTransfer *t = data;
+	return (guint32)(xice_sim_network_get_time(t->net) / 1000);
+}
+
+static PseudoTcpWriteResult
+write_packet(PseudoTcpSocket *tcp, const gchar *buf, guint32 len,
+	gpointer data)
+{
+	BenchEndpoint *ep = data;
+	BenchTransfer *t = ep->transfer;
+	gboolean inside = pseudotcp_enter(FALSE);
+	gboolean sent = xice_socket_send(ep->sock, &ep->peer, len, buf);
+
+	if (ep == &t->sender && len > 100) {
+		gint64 ms = xice_sim_network_get_time(t->net) / 1000;
+		if (ms != t->burst_ms) {
+			t->burst_ms = ms;
+			t->burst = 0;
+		}
+		t->burst_max = MAX(t->burst_max, ++t->burst);
+	}
+	pseudotcp_enter(inside);
+	return sent ? WR_SUCCESS : WR_FAIL;
+}
+
+static void
+fill(BenchEndpoint *ep)
+{
+	BenchTransfer *t = ep->transfer;
+
+	while (t->written < t->total) {
+		guint len = MIN(16384, t->total - t->written);
+		gboolean inside = pseudotcp_enter(TRUE);
+		gint ret = pseudo_tcp_socket_send(ep->tcp,
+			pattern + t->written % PATTERN_PERIOD, len);
+		pseudotcp_enter(inside);
+		if (ret <= 0)
+			break;
+		t->written += ret;
+	}
+	adjust_clock(ep);
+}
+
+static void
+opened(PseudoTcpSocket *tcp, gpointer data)
+{
+	BenchEndpoint *ep = data;
+
+	if (ep == &ep->transfer->sender)
+		fill(ep);
+}
+
+static void
+writable(PseudoTcpSocket *tcp, gpointer data)
+{
+	BenchEndpoint *ep = data;
+
+	if (ep == &ep->transfer->sender)
+		fill(ep);
+}
+
+static void
+readable(PseudoTcpSocket *tcp, gpointer data)
+{
+	BenchEndpoint *ep = data;
+	BenchTransfer *t = ep->transfer;
+	gchar buf[16384];
+	gboolean inside = pseudotcp_enter(FALSE);
+	gint len, i;
+
+	do {
+		pseudotcp_enter(TRUE);
+		len = pseudo_tcp_socket_recv(tcp, buf, sizeof(buf));
+		pseudotcp_enter(FALSE);
+		for (i = 0; i < len; i++) {
+			if ((guchar)buf[i] != (t->read + i) % PATTERN_PERIOD) {
+				g_printerr("corrupted data at offset %" G_GUINT64_FORMAT "\n",
+					t->read + i);
+				t->failed = TRUE;
+				xice_sim_network_stop(t->net);
+				pseudotcp_enter(inside);
+				return;
+			}
+		}
+		if (len > 0)
+			t->read += len;
+	} while (len > 0);
+
+	if (t->read >= t->total && t->end == 0) {
+		t->end = xice_sim_network_get_time(t->net);
+		xice_sim_network_stop(t->net);
+	}
+	adjust_clock(ep);
+	pseudotcp_enter(inside);
+}
+
+static void
+closed(PseudoTcpSocket *tcp, guint32 error, gpointer data)
+{
+	BenchEndpoint *ep = data;
+	BenchTransfer *t = ep->transfer;
+
+	if (t->end == 0) {
+		t->failed = TRUE;
+		xice_sim_network_stop(t->net);
+	}
+}
+
+static gboolean
+clock_cb(XiceTimer *timer, gpointer data)
+{
+	BenchEndpoint *ep = data;
+
+	/* one timer per endpoint, rearmed by adjust_clock() like the agent does */
+	xice_timer_stop(timer);
+	ep->deadline = 0;
+	pseudotcp_enter(TRUE);
+	pseudo_tcp_socket_notify_clock(ep->tcp);
+	pseudotcp_enter(FALSE);
+	adjust_clock(ep);
+	return FALSE;
+}
+
+static void
+adjust_clock(BenchEndpoint *ep)
+{
+	gboolean inside = pseudotcp_enter(FALSE);
+	long timeout = 0;
+
+	if (pseudo_tcp_socket_get_next_clock(ep->tcp, &timeout)) {
+		gint64 deadline;
+
+		timeout = MAX(timeout, 0);
+		deadline = xice_sim_network_get_time(ep->transfer->net) / 1000 + timeout;
+		if (ep->deadline == 0 || deadline < ep->deadline) {
+			if (ep->clock == NULL) {
+				ep->clock = xice_create_timer(ep->transfer->ctx, timeout,
+					clock_cb, ep);
+			} else {
+				xice_timer_stop(ep->clock);
+				ep->clock->interval = timeout;
+			}
+			xice_timer_start(ep->clock);
+			ep->deadline = deadline;
+			ep->transfer->rearms++;
+		}
+	} else if (ep->clock != NULL) {
+		xice_timer_stop(ep->clock);
+		ep->deadline = 0;
+	}
+	pseudotcp_enter(inside);
+}
+
+static gboolean
+socket_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	BenchEndpoint *ep = data;
+
+	if (condition == XICE_SOCKET_READABLE) {
+		pseudotcp_enter(TRUE);
+		pseudo_tcp_socket_notify_packet(ep->tcp, buf, len);
+		pseudotcp_enter(FALSE);
+		adjust_clock(ep);
+		if (ep == &ep->transfer->sender) {
+			/* sample the round trip time, queueing included, on every ack */
+			PseudoTcpStats stats;
+			pseudo_tcp_socket_get_stats(ep->tcp, &stats);
+			ep->transfer->srtt_sum += stats.smoothed_rtt;
+			ep->transfer->srtt_samples++;
+		}
+	}
+	return TRUE;
+}
+
+static void
+endpoint_init(BenchTransfer *t, BenchEndpoint *ep, const gchar *ip,
+	gboolean sack, guint cc, gboolean pacing)
+{
+	PseudoTcpCallbacks cbs = {
+		ep, opened, readable, writable, closed, write_packet
+	};
+	XiceAddress addr;
+
+	ep->transfer = t;
+	xice_address_init(&addr);
+	xice_address_set_from_string(&addr, ip);
+	ep->sock = xice_create_udp_socket(t->ctx, &addr);
+	xice_socket_set_callback(ep->sock, socket_cb, ep);
+
+	ep->tcp = pseudo_tcp_socket_new(0, &cbs);
+	pseudo_tcp_socket_set_clock(ep->tcp, sim_clock, t);
+	if (config.sndbuf > 0)
+		pseudo_tcp_socket_set_option(ep->tcp, PSEUDO_TCP_OPT_SNDBUF, config.sndbuf);
+	if (config.rcvbuf > 0)
+		pseudo_tcp_socket_set_option(ep->tcp, PSEUDO_TCP_OPT_RCVBUF, config.rcvbuf);
+	pseudo_tcp_socket_set_option(ep->tcp, PSEUDO_TCP_OPT_SACK, sack);
+	pseudo_tcp_socket_set_option(ep->tcp, PSEUDO_TCP_OPT_PACING, pacing);
+	g_object_set(ep->tcp, "congestion-control", cc, NULL);
+	pseudo_tcp_socket_notify_mtu(ep->tcp, 1400);
+}
+
+static void
+endpoint_clear(BenchEndpoint *ep)
+{
+	if (ep->clock != NULL)
+		xice_timer_destroy(ep->clock);
+	g_object_unref(ep->tcp);
+	xice_socket_free(ep->sock);
+}
+
+static gint64
+cpu_time(void)
+{
+#ifndef G_OS_WIN32
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC
+		+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#else
+	return 0;
+#endif
+}
+
+static void
+bench_run(guint rtt, gdouble loss, gboolean sack, guint cc, gboolean pacing,
+	gboolean first)
+{
+	XiceSimLinkParams link = { rtt / 2, 0, loss / 100, 0, config.bandwidth };
+	BenchTransfer t;
+	PseudoTcpStats stats, receiver_stats;
+	gdouble seconds, megabytes, goodput, srtt, ns_per_segment, allocs_per_segment;
+	gdouble rearms_per_segment;
+	guint64 segments;
+	gint64 cpu;
+
+	memset(&t, 0, sizeof(t));
+	t.total = config.bytes;
+	t.net = xice_sim_network_new(config.seed);
+	xice_sim_network_set_default_link(t.net, &link);
+	t.ctx = xice_context_create("sim", t.net);
+
+	endpoint_init(&t, &t.sender, "10.0.0.1", sack, cc, pacing);
+	endpoint_init(&t, &t.receiver, "10.0.0.2", sack, cc, pacing);
+	t.sender.peer = t.receiver.sock->addr;
+	t.receiver.peer = t.sender.sock->addr;
+
+	cpu = cpu_time();
+	pseudotcp_ns = pseudotcp_allocations = 0;
+	t.start = xice_sim_network_get_time(t.net);
+	pseudotcp_enter(TRUE);
+	pseudo_tcp_socket_connect(t.sender.tcp);
+	pseudotcp_enter(FALSE);
+	adjust_clock(&t.sender);
+	adjust_clock(&t.receiver);
+	xice_sim_network_run_for(t.net, TRANSFER_TIMEOUT_MS);
+	cpu = cpu_time() - cpu;
+
+	pseudo_tcp_socket_get_stats(t.sender.tcp, &stats);
+	pseudo_tcp_socket_get_stats(t.receiver.tcp, &receiver_stats);
+	if (t.end == 0)
+		t.failed = TRUE;
+
+	seconds = ((t.end ? t.end : xice_sim_network_get_time(t.net)) - t.start)
+		/ (gdouble)G_USEC_PER_SEC;
+	megabytes = t.read / (1024.0 * 1024.0);
+	goodput = seconds > 0 ? t.read * 8 / seconds / 1e6 : 0;
+	srtt = t.srtt_samples > 0 ? t.srtt_sum / (gdouble)t.srtt_samples : 0;
+	/* every segment is sent by one side and processed by the other */
+	segments = stats.packets_sent + receiver_stats.packets_sent;
+	ns_per_segment = segments > 0 ? pseudotcp_ns / (gdouble)segments : 0;
+	allocs_per_segment = segments > 0 ?
+		pseudotcp_allocations / (gdouble)segments : 0;
+	rearms_per_segment = segments > 0 ? t.rearms / (gdouble)segments : 0;
+
+	if (config.json) {
+		g_print("%s  {\"rtt_ms\": %u, \"loss\": %g, \"sack\": %s, "
+			"\"cc\": \"%s\", \"pacing\": %s, \"completed\": %s, \"bytes\": %" G_GUINT64_FORMAT ", \"seconds\": %g, "
+			"\"goodput_mbit\": %.3f, \"packets_sent\": %" G_GUINT64_FORMAT
+			", \"retransmits\": %" G_GUINT64_FORMAT ", \"fast_retransmits\": %"
+			G_GUINT64_FORMAT ", \"rto_events\": %" G_GUINT64_FORMAT
+			", \"avg_srtt_ms\": %.1f, \"cpu_ms_per_mb\": %.2f, "
+			"\"ns_per_segment\": %.0f, \"allocs_per_segment\": %.3f, "
+			"\"rearms_per_segment\": %.3f, \"max_burst\": %u}",
+			first ? "" : ",\n", rtt, loss / 100, sack ? "true" : "false",
+			cc_names[cc], pacing ? "true" : "false", t.failed ? "false" : "true",
+			t.read, seconds, goodput, stats.packets_sent, stats.retransmits,
+			stats.fast_retransmits, stats.timeouts, srtt,
+			megabytes > 0 ? cpu / 1000.0 / megabytes : 0, ns_per_segment,
+			allocs_per_segment, rearms_per_segment, t.burst_max);
+	} else {
+		g_print("%6u %6.1f%% %5s %6s %6s %12.3f %10.2f %10" G_GUINT64_FORMAT " %10"
+			G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %8.1f %12.2f %8.0f %10.3f"
+			" %10.3f %6u%s\n",
+			rtt, loss, sack ? "on" : "off", cc_names[cc], pacing ? "on" : "off",
+			goodput, seconds, stats.retransmits, stats.fast_retransmits,
+			stats.timeouts, srtt, megabytes > 0 ? cpu / 1000.0 / megabytes : 0,
+			ns_per_segment, allocs_per_segment, rearms_per_segment, t.burst_max,
+			t.failed ? "  (incomplete)" : "");
+	}
+
+	endpoint_clear(&t.sender);
+	endpoint_clear(&t.receiver);
+	xice_context_destroy(t.ctx);
+	xice_sim_network_free(t.net);
+}
+
+static GArray *
+parse_list(const gchar *list)
+{
+	GArray *values = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	gchar **tokens = g_strsplit(list, ",", 0);
+	guint i;
+
+	for (i = 0; tokens[i] != NULL; i++) {
+		gdouble value = g_ascii_strtod(tokens[i], NULL);
+		if (value >= 0)
+			g_array_append_val(values, value);
+	}
+	g_strfreev(tokens);
+
+	return values;
+}
+
+static void
+usage(const char *name)
+{
+	g_print("Usage: %s [OPTION]...\n"
+		"Measure PseudoTCP bulk transfers over a simulated lossy link.\n"
+		"\n"
+		"  -r, --rtt=LIST        comma separated round trip times in ms [10,20,50,100,200]\n"
+		"  -l, --loss=LIST       comma separated loss rates in percent [0,1,2,5]\n"
+		"  -b, --bytes=N         bytes to transfer [4194304]\n"
+		"  -B, --bandwidth=KBPS  link bandwidth, 0 for unlimited [0]\n"
+		"  -s, --sndbuf=BYTES    PseudoTCP send buffer size [default]\n"
+		"  -R, --rcvbuf=BYTES    PseudoTCP receive buffer size [default]\n"
+		"  -k, --sack=MODE       selective acknowledgements: on, off or both [on]\n"
+		"  -c, --cc=NAME         congestion control: reno, cubic, bbr or all [reno]\n"
+		"  -p, --pacing=MODE     send pacing: on, off or both [off]\n"
+		"  -S, --seed=N          seed of the simulated network [1]\n"
+		"      --json            print results as JSON\n"
+		"  -h, --help            display this help and exit\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "rtt", required_argument, NULL, 'r' },
+		{ "loss", required_argument, NULL, 'l' },
+		{ "bytes", required_argument, NULL, 'b' },
+		{ "bandwidth", required_argument, NULL, 'B' },
+		{ "sndbuf", required_argument, NULL, 's' },
+		{ "rcvbuf", required_argument, NULL, 'R' },
+		{ "sack", required_argument, NULL, 'k' },
+		{ "cc", required_argument, NULL, 'c' },
+		{ "pacing", required_argument, NULL, 'p' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const gchar *rtts = "10,20,50,100,200";
+	const gchar *losses = "0,1,2,5";
+	const gboolean *sacks = mode_on;
+	guint n_sacks = 1;
+	const gboolean *pacings = mode_off;
+	guint n_pacings = 1;
+	guint cc_first = PSEUDO_TCP_CC_RENO, cc_last = PSEUDO_TCP_CC_RENO;
+	gboolean first = TRUE;
+	guint i, j, k, c, p;
+
+	for (;;) {
+		int val = getopt_long(argc, argv, "r:l:b:B:s:R:k:c:p:S:h", opts, NULL);
+		if (val == -1)
+			break;
+
+		switch (val) {
+		case 'r': rtts = optarg; break;
+		case 'l': losses = optarg; break;
+		case 'b': config.bytes = g_ascii_strtoull(optarg, NULL, 10); break;
+		case 'B': config.bandwidth = atoi(optarg); break;
+		case 's': config.sndbuf = atoi(optarg); break;
+		case 'R': config.rcvbuf = atoi(optarg); break;
+		case 'k':
+			if (strcmp(optarg, "on") == 0) {
+				sacks = mode_on;
+				n_sacks = 1;
+			} else if (strcmp(optarg, "off") == 0) {
+				sacks = mode_off;
+				n_sacks = 1;
+			} else if (strcmp(optarg, "both") == 0) {
+				sacks = mode_both;
+				n_sacks = 2;
+			} else {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "on") == 0) {
+				pacings = mode_on;
+				n_pacings = 1;
+			} else if (strcmp(optarg, "off") == 0) {
+				pacings = mode_off;
+				n_pacings = 1;
+			} else if (strcmp(optarg, "both") == 0) {
+				pacings = mode_both;
+				n_pacings = 2;
+			} else {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+		case 'c':
+			if (strcmp(optarg, "all") == 0) {
+				cc_first = PSEUDO_TCP_CC_RENO;
+				cc_last = PSEUDO_TCP_CC_BBR;
+				break;
+			}
+			for (c = 0; c < G_N_ELEMENTS(cc_names); c++) {
+				if (strcmp(optarg, cc_names[c]) == 0)
+					break;
+			}
+			if (c == G_N_ELEMENTS(cc_names)) {
+				usage(argv[0]);
+				return 2;
+			}
+			cc_first = cc_last = c;
+			break;
+		case 'S': config.seed = strtoul(optarg, NULL, 10); break;
+		case 'J': config.json = TRUE; break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	config.rtts = parse_list(rtts);
+	config.losses = parse_list(losses);
+	if (config.rtts->len == 0 || config.losses->len == 0 || config.bytes == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* make GSlice allocations visible to the counters */
+	g_setenv("G_SLICE", "always-malloc", TRUE);
+	g_type_init();
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i % PATTERN_PERIOD;
+
+	if (config.json) {
+		g_print("{\"benchmark\": \"pseudotcp\", \"bytes\": %" G_GUINT64_FORMAT
+			", \"bandwidth_kbps\": %u, \"sndbuf\": %u, \"rcvbuf\": %u, "
+			"\"seed\": %u, \"results\": [\n",
+			config.bytes, config.bandwidth, config.sndbuf, config.rcvbuf,
+			config.seed);
+	} else {
+		g_print("%6s %7s %5s %6s %6s %12s %10s %10s %10s %10s %8s %12s %8s %10s"
+			" %10s %6s\n",
+			"rtt", "loss", "sack", "cc", "pacing", "goodput", "seconds", "retrans",
+			"fast", "rto", "srtt", "cpu ms/MB", "ns/seg", "allocs/seg",
+			"rearms/seg", "burst");
+	}
+
+	for (i = 0; i < config.rtts->len; i++) {
+		for (j = 0; j < config.losses->len; j++) {
+			for (k = 0; k < n_sacks; k++) {
+				for (c = cc_first; c <= cc_last; c++) {
+					for (p = 0; p < n_pacings; p++) {
+						bench_run((guint)g_array_index(config.rtts, gdouble, i),
+							g_array_index(config.losses, gdouble, j), sacks[k], c,
+							pacings[p], first);
+						first = FALSE;
+					}
+				}
+			}
+		}
+	}
+
+	if (config.json)
+		g_print("\n]}\n");
+
+	g_array_free(config.rtts, TRUE);
+	g_array_free(config.losses, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+/*
+ * TURN over TCP receive path benchmark: a stream of ChannelData messages
+ * of a given size, framed as the TCP TURN socket sends them, is handed to
+ * it in reads of a given size, the way the base socket would, and the rate
+ * at which it delivers the messages is reported for both framings. Frames
+ * read whole are delivered in place; only those split across two reads
+ * are copied.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <xice/xice.h>
+#include "socket/tcp-turn.h"
+
+/* bytes of stream built, and read over and over */
+#define STREAM_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+	GArray *sizes;
+	guint read;
+	guint64 bytes;
+	gboolean json;
+} BenchConfig;
+
+static BenchConfig config = { NULL, 16384, 1024 * 1024 * 1024, FALSE };
+
+static GString *stream;
+static guint64 delivered;
+
+static guint64
+now_ns(void)
+{
+#ifndef G_OS_WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return g_get_monotonic_time() * 1000;
+#endif
+}
+
+static gboolean
+stream_send(XiceSocket *sock, const XiceAddress *to, guint len,
+	const gchar *buf)
+{
+	g_string_append_len(stream, buf, len);
+	return TRUE;
+}
+
+static gboolean
+stream_is_reliable(XiceSocket *sock)
+{
+	return TRUE;
+}
+
+static void
+stream_close(XiceSocket *sock)
+{
+}
+
+static gboolean
+frame_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	delivered++;
+	return TRUE;
+}
+
+static void
+bench_run(XiceTurnSocketCompatibility compatibility, const gchar *name,
+	guint size, gboolean first)
+{
+	XiceSocket *base = g_slice_new0(XiceSocket);
+	XiceSocket *sock;
+	XiceAddress from;
+	gchar *message = g_malloc0(size);
+	guint64 fed = 0, start;
+	gdouble seconds;
+	guint pos;
+
+	base->send = stream_send;
+	base->is_reliable = stream_is_reliable;
+	base->close = stream_close;
+	sock = xice_tcp_turn_socket_new(base, compatibility);
+	xice_socket_set_callback(sock, frame_cb, NULL);
+	xice_address_init(&from);
+
+	/* channel 0x4000 */
+	message[0] = 0x40;
+	message[2] = (size - 4) >> 8;
+	message[3] = (size - 4) & 0xff;
+	stream = g_string_new(NULL);
+	while (stream->len < STREAM_SIZE)
+		if (!xice_socket_send(sock, &from, size, message))
+			break;
+	delivered = 0;
+
+	start = now_ns();
+	while (fed < config.bytes) {
+		for (pos = 0; pos < stream->len; pos += config.read) {
+			guint len = MIN(config.read, stream->len - pos);
+
+			base->callback(base, XICE_SOCKET_READABLE, base->data,
+				stream->str + pos, len, &from);
+		}
+		fed += stream->len;
+	}
+	seconds = (now_ns() - start) / 1e9;
+
+	if (config.json) {
+		g_print("%s  {\"framing\": \"%s\", \"size\": %u, \"read\": %u"
+			", \"messages\": %" G_GUINT64_FORMAT
+			", \"messages_per_second\": %.0f, \"mbytes_per_second\": %.1f}",
+			first ? "" : ",\n", name, size, config.read, delivered,
+			seconds > 0 ? delivered / seconds : 0,
+			seconds > 0 ? fed / seconds / 1e6 : 0);
+	} else {
+		g_print("%-8s %6u %8u %12" G_GUINT64_FORMAT " %12.0f %10.1f\n",
+			name, size, config.read, delivered,
+			seconds > 0 ? delivered / seconds : 0,
+			seconds > 0 ? fed / seconds / 1e6 : 0);
+	}
+
+	g_string_free(stream, TRUE);
+	g_free(message);
+	xice_socket_free(sock);
+}
+
+static GArray *
+parse_list(const gchar *list)
+{
+	GArray *values = g_array_new(FALSE, FALSE, sizeof(guint));
+	gchar **tokens = g_strsplit(list, ",", 0);
+	guint i;
+
+	for (i = 0; tokens[i] != NULL; i++) {
+		guint value = strtoul(tokens[i], NULL, 10);
+		if (value >= 4 && value <= 65535)
+			g_array_append_val(values, value);
+	}
+	g_strfreev(tokens);
+
+	return values;
+}
+
+static void
+usage(const char *name)
+{
+	g_print("Usage: %s [OPTION]...\n"
+		"Measure the framing of TURN messages received over TCP.\n"
+		"\n"
+		"  -s, --sizes=LIST      comma separated message sizes [100,1200,8000]\n"
+		"  -r, --read=BYTES      bytes handed over per read [16384]\n"
+		"  -m, --mbytes=N        megabytes of stream to parse per run [1024]\n"
+		"      --json            print results as JSON\n"
+		"  -h, --help            display this help and exit\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "sizes", required_argument, NULL, 's' },
+		{ "read", required_argument, NULL, 'r' },
+		{ "mbytes", required_argument, NULL, 'm' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const gchar *sizes = "100,1200,8000";
+	gboolean first = TRUE;
+	guint i;
+
+	for (;;) {
+		int val = getopt_long(argc, argv, "s:r:m:h", opts, NULL);
+		if (val == -1)
+			break;
+
+		switch (val) {
+		case 's': sizes = optarg; break;
+		case 'r': config.read = strtoul(optarg, NULL, 10); break;
+		case 'm':
+			config.bytes = (guint64)strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'J': config.json = TRUE; break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	config.sizes = parse_list(sizes);
+	if (config.sizes->len == 0 || config.read == 0 || config.bytes == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	g_type_init();
+
+	if (config.json) {
+		g_print("{\"benchmark\": \"tcp-turn\", \"read\": %u, "
+			"\"results\": [\n", config.read);
+	} else {
+		g_print("%-8s %6s %8s %12s %12s %10s\n",
+			"framing", "size", "read", "messages", "messages/s", "MB/s");
+	}
+
+	for (i = 0; i < config.sizes->len; i++) {
+		guint size = g_array_index(config.sizes, guint, i);
+
+		bench_run(XICE_TURN_SOCKET_COMPATIBILITY_RFC5766, "rfc5766", size,
+			first);
+		first = FALSE;
+		bench_run(XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE, "google", size,
+			FALSE);
+	}
+
+	if (config.json)
+		g_print("\n]}\n");
+
+	g_array_free(config.sizes, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+/*
+ * Relayed data path benchmark: one RFC 5766 TURN socket binds a channel to
+ * each of many peers through a minimal server on the simulated network,
+ * which reflects every ChannelData message back. Packets are then sent to
+ * the peers in turn, and the time spent in the TURN socket to send each
+ * of them and to map each reflected one back to its peer is reported, for
+ * every number of peers asked for. Both used to grow with the number of
+ * channels of the allocation. So is the virtual time it takes to bind all
+ * the channels, in round trips to the server.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "socket/turn.h"
+#include "stun/stunagent.h"
+
+/* packets sent before letting the network deliver them */
+#define WINDOW 64
+#define SETUP_TIMEOUT_MS 60000
+#define DRAIN_TIMEOUT_MS 10000
+
+typedef struct {
+	GArray *peers;
+	guint packets;
+	guint size;
+	guint rtt;
+	gboolean json;
+} BenchConfig;
+
+static BenchConfig config = { NULL, 200000, 200, 50, FALSE };
+
+typedef struct {
+	XiceSimNetwork *net;
+	XiceContext *ctx;
+	XiceSocket *base;
+	XiceSocket *turn;
+	XiceSocket *server;
+	StunAgent server_agent;
+	XiceAddress server_addr;
+	XiceAddress *peers;
+	guint n_peers;
+	guint bindings;
+	guint64 sent;
+	guint64 received;
+	guint64 misrouted;
+	guint64 send_ns;
+	guint64 recv_ns;
+} BenchRelay;
+
+static guint64
+now_ns(void)
+{
+#ifndef G_OS_WIN32
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return g_get_monotonic_time() * 1000;
+#endif
+}
+
+#define USERNAME "user"
+#define PASSWORD "pass"
+#define REALM "bench"
+#define NONCE "0123456789abcdef"
+
+/* Answers ChannelBind and CreatePermission requests with a success once
+ * they carry long term credentials, and sends ChannelData back the way it
+ * came */
+static gboolean
+server_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	BenchRelay *r = data;
+	StunDefaultValidaterData creds[] = {
+		{ (uint8_t *)USERNAME, strlen(USERNAME),
+		  (uint8_t *)PASSWORD, strlen(PASSWORD) },
+		{ NULL, 0, NULL, 0 }
+	};
+	StunMessage req, resp;
+	StunValidationStatus valid;
+	uint8_t resp_buf[STUN_MAX_MESSAGE_SIZE];
+	size_t resp_len;
+
+	if (condition != XICE_SOCKET_READABLE || len < 4)
+		return TRUE;
+
+	if (((guchar)buf[0] & 0xC0) == 0x40) {
+		xice_socket_send(sock, from, len, buf);
+		return TRUE;
+	}
+
+	valid = stun_agent_validate(&r->server_agent, &req, (uint8_t *)buf, len,
+		stun_agent_default_validater, creds);
+	if (valid == STUN_VALIDATION_UNAUTHORIZED_BAD_REQUEST) {
+		/* the first request of every transaction is challenged */
+		stun_agent_init_error(&r->server_agent, &resp, resp_buf,
+			sizeof(resp_buf), &req, STUN_ERROR_UNAUTHORIZED);
+		stun_message_append_string(&resp, STUN_ATTRIBUTE_REALM, REALM);
+		stun_message_append_string(&resp, STUN_ATTRIBUTE_NONCE, NONCE);
+	} else if (valid == STUN_VALIDATION_SUCCESS &&
+		stun_message_get_class(&req) == STUN_REQUEST &&
+		(stun_message_get_method(&req) == STUN_CHANNELBIND ||
+			stun_message_get_method(&req) == STUN_CREATEPERMISSION)) {
+		stun_agent_init_response(&r->server_agent, &resp, resp_buf,
+			sizeof(resp_buf), &req);
+		if (stun_message_get_method(&req) == STUN_CHANNELBIND)
+			r->bindings++;
+	} else {
+		return TRUE;
+	}
+
+	resp_len = stun_agent_finish_message(&r->server_agent, &resp, NULL, 0);
+	if (resp_len > 0)
+		xice_socket_send(sock, from, resp_len, (gchar *)resp_buf);
+
+	return TRUE;
+}
+
+static gboolean
+base_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	BenchRelay *r = data;
+	XiceSocket *from_sock = sock;
+	guint64 start;
+
+	if (condition != XICE_SOCKET_READABLE)
+		return TRUE;
+
+	/* like the agent does for packets from its TURN servers */
+	start = now_ns();
+	xice_turn_socket_parse_recv(r->turn, &from_sock, from, len, buf, from,
+		buf, len);
+	r->recv_ns += now_ns() - start;
+
+	return TRUE;
+}
+
+/* the first bytes of every packet tell which peer it was sent to */
+static gboolean
+relayed_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	BenchRelay *r = data;
+	guint32 peer;
+
+	if (condition != XICE_SOCKET_READABLE || len < sizeof(peer))
+		return TRUE;
+
+	memcpy(&peer, buf, sizeof(peer));
+	if (peer >= r->n_peers || !xice_address_equal(from, &r->peers[peer]))
+		r->misrouted++;
+	r->received++;
+
+	return TRUE;
+}
+
+static void
+set_address(XiceAddress *addr, const gchar *ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_from_string(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+/* Hands the socket the REALM and NONCE of an Allocate request, as the
+ * agent does once the allocation succeeded */
+static void
+set_realm_nonce(BenchRelay *r)
+{
+	StunAgent agent;
+	StunMessage msg;
+	uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+
+	stun_agent_init(&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+		STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+	stun_agent_init_request(&agent, &msg, buf, sizeof(buf), STUN_ALLOCATE);
+	stun_message_append_string(&msg, STUN_ATTRIBUTE_REALM, REALM);
+	stun_message_append_string(&msg, STUN_ATTRIBUTE_NONCE, NONCE);
+	xice_turn_socket_set_realm_nonce(r->turn, &msg);
+}
+
+static void
+send_to_peer(BenchRelay *r, guint peer, gchar *buf)
+{
+	guint32 index = peer;
+	guint64 start;
+
+	memcpy(buf, &index, sizeof(index));
+	start = now_ns();
+	xice_socket_send(r->turn, &r->peers[peer], config.size, buf);
+	r->send_ns += now_ns() - start;
+	r->sent++;
+}
+
+/* delivers what was sent, FALSE if some of it never comes back */
+static gboolean
+drain(BenchRelay *r)
+{
+	gint64 deadline = xice_sim_network_get_time(r->net) +
+		DRAIN_TIMEOUT_MS * 1000;
+
+	while (r->received < r->sent) {
+		if (xice_sim_network_get_time(r->net) > deadline ||
+			!xice_sim_network_step(r->net))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+bench_run(guint n_peers, gboolean first)
+{
+	XiceSimLinkParams link = { 0, 0, 0, 0, 0 };
+	BenchRelay r;
+	XiceAddress addr;
+	gchar *buf = g_malloc0(config.size);
+	gdouble seconds;
+	gdouble setup_rtts;
+	gint64 start_time, deadline;
+	gboolean ready;
+	guint i;
+
+	memset(&r, 0, sizeof(r));
+	link.latency = config.rtt / 2;
+	r.net = xice_sim_network_new(1);
+	xice_sim_network_set_default_link(r.net, &link);
+	r.ctx = xice_context_create("sim", r.net);
+	r.n_peers = n_peers;
+
+	stun_agent_init(&r.server_agent, STUN_ALL_KNOWN_ATTRIBUTES,
+		STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+	set_address(&addr, "10.0.0.100", 3478);
+	r.server = xice_create_udp_socket(r.ctx, &addr);
+	xice_socket_set_callback(r.server, server_cb, &r);
+	r.server_addr = r.server->addr;
+
+	set_address(&addr, "10.0.0.1", 0);
+	r.base = xice_create_udp_socket(r.ctx, &addr);
+	set_address(&addr, "10.0.0.100", 50000);
+	r.turn = xice_turn_socket_new(r.ctx, &addr, r.base, &r.server_addr,
+		USERNAME, PASSWORD, XICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+	xice_socket_set_callback(r.base, base_cb, &r);
+	xice_socket_set_callback(r.turn, relayed_cb, &r);
+	set_realm_nonce(&r);
+
+	r.peers = g_new0(XiceAddress, n_peers);
+	for (i = 0; i < n_peers; i++) {
+		gchar ip[32];
+
+		g_snprintf(ip, sizeof(ip), "10.1.%u.%u", i / 250, i % 250 + 1);
+		set_address(&r.peers[i], ip, 40000 + i % 1000);
+		xice_turn_socket_set_peer(r.turn, &r.peers[i]);
+	}
+
+	/* bind every channel, and get a permission for every peer. The server
+	 * drops Send indications, so none of these come back */
+	start_time = xice_sim_network_get_time(r.net);
+	for (i = 0; i < n_peers; i++)
+		send_to_peer(&r, i, buf);
+	deadline = start_time + SETUP_TIMEOUT_MS * 1000;
+	while (r.bindings < n_peers &&
+		xice_sim_network_get_time(r.net) < deadline &&
+		xice_sim_network_step(r.net))
+		;
+	ready = r.bindings >= n_peers;
+	/* until the last success response reaches the client */
+	setup_rtts = config.rtt > 0 ? ((xice_sim_network_get_time(r.net) -
+		start_time) / 1000.0 + link.latency) / config.rtt : 0;
+	xice_sim_network_run_for(r.net, link.latency + 1);
+	r.sent = r.received = r.misrouted = 0;
+	r.send_ns = r.recv_ns = 0;
+
+	if (ready) {
+		guint64 start = now_ns();
+
+		while (ready && r.sent < config.packets) {
+			for (i = 0; i < WINDOW && r.sent < config.packets; i++)
+				send_to_peer(&r, r.sent % n_peers, buf);
+			ready = drain(&r);
+		}
+		seconds = (now_ns() - start) / 1e9;
+	} else {
+		seconds = 0;
+	}
+
+	if (config.json) {
+		g_print("%s  {\"peers\": %u, \"completed\": %s, \"packets\": %"
+			G_GUINT64_FORMAT ", \"misrouted\": %" G_GUINT64_FORMAT
+			", \"setup_rtts\": %.1f"
+			", \"send_ns_per_packet\": %.0f, \"recv_ns_per_packet\": %.0f"
+			", \"packets_per_second\": %.0f}",
+			first ? "" : ",\n", n_peers, ready ? "true" : "false", r.received,
+			r.misrouted, setup_rtts,
+			r.sent > 0 ? r.send_ns / (gdouble)r.sent : 0,
+			r.received > 0 ? r.recv_ns / (gdouble)r.received : 0,
+			seconds > 0 ? r.received / seconds : 0);
+	} else {
+		g_print("%6u %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+			" %10.1f %10.0f %10.0f %12.0f%s\n",
+			n_peers, r.received, r.misrouted, setup_rtts,
+			r.sent > 0 ? r.send_ns / (gdouble)r.sent : 0,
+			r.received > 0 ? r.recv_ns / (gdouble)r.received : 0,
+			seconds > 0 ? r.received / seconds : 0,
+			ready ? "" : "  (incomplete)");
+	}
+
+	xice_socket_free(r.turn);
+	xice_socket_free(r.base);
+	xice_socket_free(r.server);
+	g_free(r.peers);
+	g_free(buf);
+	xice_context_destroy(r.ctx);
+	xice_sim_network_free(r.net);
+}
+
+static GArray *
+parse_list(const gchar *list)
+{
+	GArray *values = g_array_new(FALSE, FALSE, sizeof(guint));
+	gchar **tokens = g_strsplit(list, ",", 0);
+	guint i;
+
+	for (i = 0; tokens[i] != NULL; i++) {
+		guint value = strtoul(tokens[i], NULL, 10);
+		if (value > 0 && value <= 10000)
+			g_array_append_val(values, value);
+	}
+	g_strfreev(tokens);
+
+	return values;
+}
+
+static void
+usage(const char *name)
+{
+	g_print("Usage: %s [OPTION]...\n"
+		"Measure the TURN socket data path with many peers per allocation.\n"
+		"\n"
+		"  -p, --peers=LIST      comma separated numbers of peers [1,10,100,500]\n"
+		"  -n, --packets=N       packets to relay for each number of peers [200000]\n"
+		"  -s, --size=BYTES      payload size [200]\n"
+		"  -r, --rtt=MS          round trip time to the server [50]\n"
+		"      --json            print results as JSON\n"
+		"  -h, --help            display this help and exit\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "peers", required_argument, NULL, 'p' },
+		{ "packets", required_argument, NULL, 'n' },
+		{ "size", required_argument, NULL, 's' },
+		{ "rtt", required_argument, NULL, 'r' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const gchar *peers = "1,10,100,500";
+	guint i;
+
+	for (;;) {
+		int val = getopt_long(argc, argv, "p:n:s:r:h", opts, NULL);
+		if (val == -1)
+			break;
+
+		switch (val) {
+		case 'p': peers = optarg; break;
+		case 'n': config.packets = strtoul(optarg, NULL, 10); break;
+		case 's': config.size = strtoul(optarg, NULL, 10); break;
+		case 'r': config.rtt = strtoul(optarg, NULL, 10); break;
+		case 'J': config.json = TRUE; break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	config.peers = parse_list(peers);
+	if (config.peers->len == 0 || config.packets == 0 || config.size < 4 ||
+		config.size > 1200) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	g_type_init();
+
+	if (config.json) {
+		g_print("{\"benchmark\": \"turn\", \"packets\": %u, \"size\": %u, "
+			"\"rtt_ms\": %u, \"results\": [\n", config.packets, config.size,
+			config.rtt);
+	} else {
+		g_print("%6s %10s %10s %10s %10s %10s %12s\n",
+			"peers", "packets", "misrouted", "setup rtts", "send ns", "recv ns",
+			"packets/s");
+	}
+
+	for (i = 0; i < config.peers->len; i++)
+		bench_run(g_array_index(config.peers, guint, i), i == 0);
+
+	if (config.json)
+		g_print("\n]}\n");
+
+	g_array_free(config.peers, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <math.h>
+
+#include "bench.h"
+
+void
+bench_stats_init(BenchStats *stats)
+{
+	stats->samples = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	stats->sorted = TRUE;
+}
+
+void
+bench_stats_clear(BenchStats *stats)
+{
+	g_array_free(stats->samples, TRUE);
+	stats->samples = NULL;
+}
+
+void
+bench_stats_add(BenchStats *stats, gdouble value)
+{
+	g_array_append_val(stats->samples, value);
+	stats->sorted = FALSE;
+}
+
+guint
+bench_stats_count(BenchStats *stats)
+{
+	return stats->samples->len;
+}
+
+gdouble
+bench_stats_mean(BenchStats *stats)
+{
+	gdouble sum = 0;
+	guint i;
+
+	if (stats->samples->len == 0)
+		return 0;
+
+	for (i = 0; i < stats->samples->len; i++)
+		sum += g_array_index(stats->samples, gdouble, i);
+	return sum / stats->samples->len;
+}
+
+static gint
+compare_doubles(gconstpointer a, gconstpointer b)
+{
+	gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+gdouble
+bench_stats_percentile(BenchStats *stats, guint percent)
+{
+	guint rank;
+
+	if (stats->samples->len == 0)
+		return 0;
+
+	if (!stats->sorted) {
+		g_array_sort(stats->samples, compare_doubles);
+		stats->sorted = TRUE;
+	}
+
+	rank = (guint)ceil(percent / 100.0 * stats->samples->len);
+	if (rank == 0)
+		rank = 1;
+	return g_array_index(stats->samples, gdouble, rank - 1);
+}
+
+void
+bench_stats_print(BenchStats *stats, const gchar *name)
+{
+	if (stats->samples->len == 0) {
+		g_print("%-24s %10s %10s %10s\n", name, "-", "-", "-");
+		return;
+	}
+
+	g_print("%-24s %10.2f %10.2f %10.2f\n", name,
+		bench_stats_percentile(stats, 50),
+		bench_stats_percentile(stats, 95),
+		bench_stats_percentile(stats, 99));
+}
+
+void
+bench_stats_print_json(BenchStats *stats, const gchar *name)
+{
+	g_print(", \"%s\": {\"count\": %u, \"mean\": %g, "
+		"\"p50\": %g, \"p95\": %g, \"p99\": %g}",
+		name, stats->samples->len, bench_stats_mean(stats),
+		bench_stats_percentile(stats, 50),
+		bench_stats_percentile(stats, 95),
+		bench_stats_percentile(stats, 99));
+}
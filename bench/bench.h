@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/* Helpers shared by the benchmarks: sample collection and the percentile
+ * and JSON reporting they all print. */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct {
+	GArray *samples;        /* gdouble */
+	gboolean sorted;
+} BenchStats;
+
+void bench_stats_init(BenchStats *stats);
+void bench_stats_clear(BenchStats *stats);
+void bench_stats_add(BenchStats *stats, gdouble value);
+guint bench_stats_count(BenchStats *stats);
+gdouble bench_stats_mean(BenchStats *stats);
+
+/* nearest-rank percentile, 0 if there are no samples */
+gdouble bench_stats_percentile(BenchStats *stats, guint percent);
+
+/* "name  p50  p95  p99" row of a text table */
+void bench_stats_print(BenchStats *stats, const gchar *name);
+/* ", \"name\": {\"count\": n, \"p50\": ...}" continuing a JSON object */
+void bench_stats_print_json(BenchStats *stats, const gchar *name);
+
+G_END_DECLS
+
+#endif /* _BENCH_H */
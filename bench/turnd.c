@@ -0,0 +1,193 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+
+/*
+ * TURN daemon: runs the in-process TURN server of socket/turnserver.c on a
+ * GIO context, the sibling of stund for TURN, so that agents and
+ * benchmarks in other processes can relay through it on loopback or on a
+ * test network. It is not run by "make bench".
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include <xice/xice.h>
+#include "socket/turnserver.h"
+
+/* Exits, rather than being killed, for gcov to work properly */
+static void
+exit_handler(int signum)
+{
+	(void)signum;
+	exit(0);
+}
+
+static gboolean
+report_cb(gpointer data)
+{
+	XiceTurnServer *server = data;
+	XiceTurnServerStats stats;
+
+	xice_turn_server_get_stats(server, &stats);
+	g_print("%u allocations, %u TCP clients, %" G_GUINT64_FORMAT
+		" requests, %" G_GUINT64_FORMAT " challenges, %" G_GUINT64_FORMAT
+		" errors, %" G_GUINT64_FORMAT " packets to peers, %" G_GUINT64_FORMAT
+		" packets from peers, %" G_GUINT64_FORMAT " dropped\n",
+		stats.allocations, stats.tcp_clients, stats.requests,
+		stats.challenges, stats.errors, stats.packets_to_peers, stats.packets_from_peers,
+		stats.packets_dropped);
+	return TRUE;
+}
+
+static void
+usage(const char *name)
+{
+	g_print("Usage: %s [OPTION]... [IP [PORT]]\n"
+		"Run a TURN server (RFC 5766) on IP [127.0.0.1] and PORT [3478].\n"
+		"\n"
+		"  -r, --realm=REALM     realm of the long-term credentials [xice]\n"
+		"  -u, --user=USER:PASS  accept these credentials, may be repeated\n"
+		"                        [user:pass]\n"
+		"  -t, --tcp             also accept TCP clients on PORT\n"
+		"  -i, --interval=SECS   print statistics every SECS seconds\n"
+		"  -h, --help            display this help and exit\n",
+		name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "realm", required_argument, NULL, 'r' },
+		{ "user", required_argument, NULL, 'u' },
+		{ "tcp", no_argument, NULL, 't' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	const gchar *realm = "xice";
+	const gchar *ip = "127.0.0.1";
+	guint port = 3478;
+	gboolean tcp = FALSE;
+	guint interval = 0;
+	GPtrArray *users = g_ptr_array_new();
+	GMainContext *main_ctx;
+	GMainLoop *loop;
+	XiceContext *ctx;
+	XiceTurnServer *server;
+	XiceAddress addr;
+	gchar ipstr[XICE_ADDRESS_STRING_LEN];
+	guint i;
+
+	for (;;) {
+		int val = getopt_long(argc, argv, "r:u:ti:h", opts, NULL);
+		if (val == -1)
+			break;
+
+		switch (val) {
+		case 'r': realm = optarg; break;
+		case 'u': g_ptr_array_add(users, optarg); break;
+		case 't': tcp = TRUE; break;
+		case 'i': interval = strtoul(optarg, NULL, 10); break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind < argc)
+		ip = argv[optind++];
+	if (optind < argc)
+		port = strtoul(argv[optind++], NULL, 10);
+	if (optind < argc || port > 65535) {
+		usage(argv[0]);
+		return 2;
+	}
+	for (i = 0; i < users->len; i++) {
+		if (strchr(g_ptr_array_index(users, i), ':') == NULL) {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (users->len == 0)
+		g_ptr_array_add(users, "user:pass");
+
+	xice_address_init(&addr);
+	if (!xice_address_set_from_string(&addr, ip)) {
+		fprintf(stderr, "%s: not an IP address\n", ip);
+		return 2;
+	}
+	xice_address_set_port(&addr, port);
+
+	g_type_init();
+
+	main_ctx = g_main_context_default();
+	ctx = xice_context_create("gio", main_ctx);
+	server = xice_turn_server_new(ctx, &addr, realm);
+	if (server == NULL) {
+		fprintf(stderr, "Cannot listen on %s port %u\n", ip, port);
+		return 1;
+	}
+	if (tcp && !xice_turn_server_listen_tcp(server)) {
+		fprintf(stderr, "Cannot listen for TCP on %s port %u\n", ip, port);
+		return 1;
+	}
+
+	for (i = 0; i < users->len; i++) {
+		gchar **cred = g_strsplit(g_ptr_array_index(users, i), ":", 2);
+		xice_turn_server_add_user(server, cred[0], cred[1]);
+		g_strfreev(cred);
+	}
+
+	addr = *xice_turn_server_get_address(server);
+	xice_address_to_string(&addr, ipstr);
+	g_print("Listening on %s port %u%s\n", ipstr, xice_address_get_port(&addr),
+		tcp ? ", UDP and TCP" : "");
+
+	loop = g_main_loop_new(main_ctx, FALSE);
+	if (interval > 0)
+		g_timeout_add(interval * 1000, report_cb, server);
+	signal(SIGINT, exit_handler);
+	signal(SIGTERM, exit_handler);
+	g_main_loop_run(loop);
+
+	g_main_loop_unref(loop);
+	xice_turn_server_free(server);
+	xice_context_destroy(ctx);
+	g_ptr_array_free(users, TRUE);
+
+	return 0;
+}
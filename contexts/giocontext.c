@@ -13,8 +13,11 @@ typedef struct _XiceContextGIO
 
 static XiceSocket* gio_create_tcp_socket(XiceContext* ctx, XiceAddress* addr);
 static XiceSocket* gio_create_udp_socket(XiceContext* ctx, XiceAddress* addr);
+static XiceSocket* gio_create_tcp_listener(XiceContext* ctx,
+	XiceAddress* addr, XiceSocketAcceptFunc func, gpointer data);
 static XiceTimer* gio_create_timer(XiceContext* ctx, guint interval,
 	XiceTimerFunc function, gpointer data);
+static gint64 gio_get_time(XiceContext* ctx);
 
 static void gio_destroy(XiceContext *ctx);
 
@@ -45,7 +48,9 @@ XiceContext *gio_context_create(gpointer ctx)
 	xctx->priv = gio;
 	xctx->create_tcp_socket = gio_create_tcp_socket;
 	xctx->create_udp_socket = gio_create_udp_socket;
+	xctx->create_tcp_listener = gio_create_tcp_listener;
 	xctx->create_timer = gio_create_timer;
+	xctx->get_time = gio_get_time;
 
 	xctx->destroy = gio_destroy;
 	return xctx;
@@ -69,6 +74,12 @@ static XiceSocket* gio_create_udp_socket(XiceContext* ctx, XiceAddress* addr) {
 	return sock;
 }
 
+static XiceSocket* gio_create_tcp_listener(XiceContext* ctx,
+	XiceAddress* addr, XiceSocketAcceptFunc func, gpointer data) {
+	XiceContextGIO* gio = ctx->priv;
+	return gio_tcp_listener_create(gio->main_context, addr, func, data);
+}
+
 static XiceTimer* gio_create_timer(XiceContext* ctx, guint interval, 
 	XiceTimerFunc function, gpointer data)
 {
@@ -77,11 +88,20 @@ static XiceTimer* gio_create_timer(XiceContext* ctx, guint interval,
 	return timer;
 }
 
+static gint64 gio_get_time(XiceContext* ctx) {
+	GSource* source = g_main_current_source();
+
+	/* the time of the dispatched source is only read once per iteration */
+	if (source != NULL) {
+		return g_source_get_time(source);
+	}
+	return g_get_monotonic_time();
+}
+
 static void gio_destroy(XiceContext *ctx) {
 	XiceContextGIO* gio = ctx->priv;
 
 	g_main_context_unref(gio->main_context);
 	g_slice_free(XiceContextGIO, gio);
 	ctx->priv = NULL;
-	g_slice_free(XiceContext, ctx);
 }
@@ -131,12 +131,53 @@ attach_socket(
 
 }
 
-XiceSocket *
-gio_tcp_socket_create(GMainContext *ctx, XiceAddress *addr)
+/*
+ * Wraps @gsock, connected or connecting to @peer. Takes @gsock, and closes
+ * it on failure.
+ */
+static XiceSocket *
+socket_new (GMainContext *ctx, GSocket *gsock, const XiceAddress *peer)
 {
   struct sockaddr_storage name;
   XiceSocket *sock;
   TcpPriv *priv;
+  GSocketAddress *gaddr;
+
+  gaddr = g_socket_get_local_address (gsock, NULL);
+  if (gaddr == NULL ||
+      !g_socket_address_to_native (gaddr, &name, sizeof (name), NULL)) {
+    if (gaddr != NULL)
+      g_object_unref (gaddr);
+    g_socket_close (gsock, NULL);
+    g_object_unref (gsock);
+    return NULL;
+  }
+  g_object_unref (gaddr);
+
+  sock = g_slice_new0 (XiceSocket);
+  xice_address_set_from_sockaddr (&sock->addr, (struct sockaddr *)&name);
+
+  sock->priv = priv = g_slice_new0 (TcpPriv);
+
+  priv->context = g_main_context_ref (ctx);
+  priv->server_addr = *peer;
+  priv->error = FALSE;
+
+  sock->fileno = (gpointer)gsock;
+  sock->send = socket_send;
+  sock->is_reliable = socket_is_reliable;
+  sock->close = socket_close;
+  sock->get_fd = socket_get_fd;
+
+  attach_socket(sock);
+
+  return sock;
+}
+
+XiceSocket *
+gio_tcp_socket_create(GMainContext *ctx, XiceAddress *addr)
+{
+  struct sockaddr_storage name;
   GSocket *gsock = NULL;
   GError *gerr = NULL;
   gboolean gret = FALSE;
@@ -147,8 +188,6 @@ gio_tcp_socket_create(GMainContext *ctx, XiceAddress *addr)
     return NULL;
   }
 
-  sock = g_slice_new0 (XiceSocket);
-
   xice_address_copy_to_sockaddr (addr, (struct sockaddr *)&name);
 
   if (gsock == NULL) {
@@ -170,10 +209,8 @@ gio_tcp_socket_create(GMainContext *ctx, XiceAddress *addr)
     }
   }
 
-  if (gsock == NULL) {
-    g_slice_free (XiceSocket, sock);
+  if (gsock == NULL)
     return NULL;
-  }
 
   /* GSocket: All socket file descriptors are set to be close-on-exec. */
   g_socket_set_blocking (gsock, FALSE);
@@ -189,37 +226,135 @@ gio_tcp_socket_create(GMainContext *ctx, XiceAddress *addr)
     if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_PENDING) == FALSE) {
       g_socket_close (gsock, NULL);
       g_object_unref (gsock);
-      g_slice_free (XiceSocket, sock);
       return NULL;
     }
     g_error_free(gerr);
   }
 
-  gaddr = g_socket_get_local_address (gsock, NULL);
+  return socket_new (ctx, gsock, addr);
+}
+
+/*
+ * Listening sockets: each connection accepted is wrapped as above, with
+ * the address of the client as its peer.
+ */
+
+typedef struct {
+  GMainContext *context;
+  GSource *source;
+  XiceSocketAcceptFunc func;
+  gpointer data;
+} TcpListenerPriv;
+
+static gboolean
+listener_callback (GSocket *gsocket, GIOCondition condition, gpointer data)
+{
+  XiceSocket *listener = data;
+  TcpListenerPriv *priv = listener->priv;
+  struct sockaddr_storage name;
+  GSocketAddress *gaddr;
+  GSocket *gsock;
+  XiceAddress peer;
+  XiceSocket *sock;
+
+  while ((gsock = g_socket_accept (gsocket, NULL, NULL)) != NULL) {
+    g_socket_set_blocking (gsock, FALSE);
+
+    gaddr = g_socket_get_remote_address (gsock, NULL);
+    if (gaddr == NULL ||
+        !g_socket_address_to_native (gaddr, &name, sizeof (name), NULL)) {
+      if (gaddr != NULL)
+        g_object_unref (gaddr);
+      g_socket_close (gsock, NULL);
+      g_object_unref (gsock);
+      continue;
+    }
+    g_object_unref (gaddr);
+
+    xice_address_init (&peer);
+    xice_address_set_from_sockaddr (&peer, (struct sockaddr *)&name);
+    sock = socket_new (priv->context, gsock, &peer);
+    if (sock != NULL)
+      priv->func (listener, sock, priv->data);
+  }
+
+  return TRUE;
+}
+
+static gboolean
+listener_send (XiceSocket *sock, const XiceAddress *to,
+    guint len, const gchar *buf)
+{
+  return FALSE;
+}
+
+static void
+listener_close (XiceSocket *sock)
+{
+  TcpListenerPriv *priv = sock->priv;
+
+  g_source_destroy (priv->source);
+  g_source_unref (priv->source);
+  g_socket_close ((GSocket*)sock->fileno, NULL);
+  g_object_unref ((GSocket*)sock->fileno);
+  g_main_context_unref (priv->context);
+  g_slice_free (TcpListenerPriv, priv);
+}
+
+XiceSocket *
+gio_tcp_listener_create (GMainContext *ctx, XiceAddress *addr,
+    XiceSocketAcceptFunc func, gpointer data)
+{
+  struct sockaddr_storage name;
+  XiceSocket *sock;
+  TcpListenerPriv *priv;
+  GSocket *gsock;
+  GSocketAddress *gaddr;
+  gboolean gret = FALSE;
+
+  xice_address_copy_to_sockaddr (addr, (struct sockaddr *)&name);
+  gsock = g_socket_new (name.ss_family == AF_INET6 ?
+      G_SOCKET_FAMILY_IPV6 : G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+      G_SOCKET_PROTOCOL_TCP, NULL);
+  if (gsock == NULL)
+    return NULL;
+  g_socket_set_blocking (gsock, FALSE);
+
+  gaddr = g_socket_address_new_from_native (&name, sizeof (name));
+  if (gaddr != NULL) {
+    gret = g_socket_bind (gsock, gaddr, TRUE, NULL) &&
+        g_socket_listen (gsock, NULL);
+    g_object_unref (gaddr);
+  }
+  gaddr = gret ? g_socket_get_local_address (gsock, NULL) : NULL;
   if (gaddr == NULL ||
       !g_socket_address_to_native (gaddr, &name, sizeof (name), NULL)) {
-    g_slice_free (XiceSocket, sock);
+    if (gaddr != NULL)
+      g_object_unref (gaddr);
     g_socket_close (gsock, NULL);
     g_object_unref (gsock);
     return NULL;
   }
   g_object_unref (gaddr);
 
+  sock = g_slice_new0 (XiceSocket);
   xice_address_set_from_sockaddr (&sock->addr, (struct sockaddr *)&name);
 
-  sock->priv = priv = g_slice_new0 (TcpPriv);
-
+  sock->priv = priv = g_slice_new0 (TcpListenerPriv);
   priv->context = g_main_context_ref (ctx);
-  priv->server_addr = *addr;
-  priv->error = FALSE;
+  priv->func = func;
+  priv->data = data;
 
   sock->fileno = (gpointer)gsock;
-  sock->send = socket_send;
+  sock->send = listener_send;
   sock->is_reliable = socket_is_reliable;
-  sock->close = socket_close;
+  sock->close = listener_close;
   sock->get_fd = socket_get_fd;
 
-  attach_socket(sock);
+  priv->source = g_socket_create_source (gsock, G_IO_IN, NULL);
+  g_source_set_callback (priv->source, (GSourceFunc)listener_callback, sock,
+      NULL);
+  g_source_attach (priv->source, priv->context);
 
   return sock;
 }
@@ -45,6 +45,10 @@ G_BEGIN_DECLS
 XiceSocket *
 gio_tcp_socket_create (GMainContext *ctx, XiceAddress *addr);
 
+XiceSocket *
+gio_tcp_listener_create (GMainContext *ctx, XiceAddress *addr,
+    XiceSocketAcceptFunc func, gpointer data);
+
 
 G_END_DECLS
 
@@ -17,6 +17,7 @@ static XiceSocket* create_tcp_socket(XiceContext* ctx, XiceAddress* addr);
 static XiceSocket* create_udp_socket(XiceContext* ctx, XiceAddress* addr);
 static XiceTimer* create_timer(XiceContext* ctx, guint interval,
 	XiceTimerFunc function, gpointer data);
+static gint64 get_time(XiceContext* ctx);
 
 static void destroy(XiceContext* ctx);
 
@@ -29,6 +30,7 @@ XiceContext *libuv_context_create(gpointer ctx)
 	xice->create_tcp_socket = create_tcp_socket;
 	xice->create_udp_socket = create_udp_socket;
 	xice->create_timer = create_timer;
+	xice->get_time = get_time;
 	xice->destroy = destroy;
 
 	return xice;
@@ -50,12 +52,17 @@ static XiceTimer* create_timer(XiceContext* ctx, guint interval,
 	return libuv_timer_create(uv->loop, interval, function, data);
 }
 
+static gint64 get_time(XiceContext* ctx) {
+	XiceContextLibuv* uv = ctx->priv;
+	/* uv_now() is updated once per loop iteration */
+	return (gint64)uv_now(uv->loop) * 1000;
+}
+
 static void destroy(XiceContext* ctx) {
 	XiceContextLibuv *uv = ctx->priv;
 
 	g_slice_free(XiceContextLibuv, uv);
-
-	g_slice_free(XiceContext, ctx);
+	ctx->priv = NULL;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,871 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+#include "agent/debug.h"
+#include "simcontext.h"
+
+/* the virtual clock does not start at 0, some timers use 0 as "unset" */
+#define SIM_EPOCH (G_USEC_PER_SEC)
+
+#define SIM_FIRST_PORT 49152
+#define SIM_KEY_SIZE (INET6_ADDRSTRLEN + 8)
+
+typedef enum _SimEventType {
+	SIM_EVENT_TIMER,
+	SIM_EVENT_PACKET,
+	SIM_EVENT_ACCEPT
+} SimEventType;
+
+typedef struct _SimTimer SimTimer;
+
+typedef struct _SimEvent {
+	gint64 time;
+	guint64 seq;                    /* breaks ties between equal times */
+	guint index;                    /* position in the event heap */
+	SimEventType type;
+	SimTimer* timer;                /* SIM_EVENT_TIMER */
+	XiceSocket* accepted;           /* SIM_EVENT_ACCEPT */
+	guint dest;                     /* connected peer id, 0 for datagrams */
+	XiceSocketCondition condition;
+	XiceAddress from;
+	XiceAddress to;
+	guint len;
+	gchar* buf;
+} SimEvent;
+
+struct _SimTimer {
+	XiceSimNetwork* net;
+	XiceTimer* timer;
+	SimEvent* event;                /* pending expiration, if started */
+};
+
+typedef struct _SimLink {
+	gint64 busy_until;              /* end of the last transmission */
+	gint64 last_arrival;            /* keeps deliveries in order */
+} SimLink;
+
+typedef struct _SimListener {
+	XiceSimAcceptFunc func;
+	gpointer data;
+} SimListener;
+
+typedef struct _SimSocket {
+	XiceSimNetwork* net;
+	guint id;
+	gboolean reliable;
+	guint peer;                     /* id of the other end, 0 once closed */
+	XiceAddress peer_addr;
+} SimSocket;
+
+struct _XiceSimNetwork {
+	gint64 now;
+	guint64 seq;
+	GRand* rand;
+	GPtrArray* events;              /* binary min-heap on (time, seq) */
+	GHashTable* sockets;            /* id -> XiceSocket */
+	GHashTable* bindings;           /* "ip:port" -> datagram XiceSocket */
+	GHashTable* listeners;          /* "ip:port" -> SimListener */
+	GHashTable* params;             /* "src>dst" -> XiceSimLinkParams */
+	GHashTable* links;              /* "src>dst" -> SimLink */
+	XiceSimLinkParams default_params;
+	guint next_id;
+	guint next_port;
+	SimTimer* dispatching;
+	gboolean stopped;
+	XiceSimStats stats;
+	XiceSimTapFunc tap;
+	gpointer tap_data;
+};
+
+typedef struct _XiceContextSim {
+	XiceSimNetwork* net;
+} XiceContextSim;
+
+static XiceSocket* sim_create_tcp_socket(XiceContext* ctx, XiceAddress* addr);
+static XiceSocket* sim_create_udp_socket(XiceContext* ctx, XiceAddress* addr);
+static XiceSocket* sim_create_tcp_listener(XiceContext* ctx,
+	XiceAddress* addr, XiceSocketAcceptFunc func, gpointer data);
+static XiceTimer* sim_create_timer(XiceContext* ctx, guint interval,
+	XiceTimerFunc function, gpointer data);
+static gint64 sim_get_time(XiceContext* ctx);
+
+static void sim_destroy(XiceContext *ctx);
+
+static gboolean socket_send(XiceSocket *sock, const XiceAddress *to,
+	guint len, const gchar *buf);
+static gboolean socket_is_reliable(XiceSocket *sock);
+static void socket_close(XiceSocket *sock);
+static int socket_get_fd(XiceSocket *sock);
+
+static void sim_timer_start(XiceTimer* timer);
+static void sim_timer_stop(XiceTimer* timer);
+static void sim_timer_destroy(XiceTimer* timer);
+
+/* event heap */
+
+static gboolean priv_event_before(SimEvent* a, SimEvent* b) {
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void priv_heap_swap(GPtrArray* heap, guint i, guint j) {
+	SimEvent* a = g_ptr_array_index(heap, i);
+	SimEvent* b = g_ptr_array_index(heap, j);
+
+	g_ptr_array_index(heap, i) = b;
+	g_ptr_array_index(heap, j) = a;
+	b->index = i;
+	a->index = j;
+}
+
+static void priv_heap_up(GPtrArray* heap, guint i) {
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
+		if (!priv_event_before(g_ptr_array_index(heap, i),
+			g_ptr_array_index(heap, parent)))
+			break;
+		priv_heap_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void priv_heap_down(GPtrArray* heap, guint i) {
+	for (;;) {
+		guint left = 2 * i + 1;
+		guint right = left + 1;
+		guint smallest = i;
+
+		if (left < heap->len && priv_event_before(g_ptr_array_index(heap, left),
+			g_ptr_array_index(heap, smallest)))
+			smallest = left;
+		if (right < heap->len && priv_event_before(g_ptr_array_index(heap, right),
+			g_ptr_array_index(heap, smallest)))
+			smallest = right;
+		if (smallest == i)
+			break;
+		priv_heap_swap(heap, i, smallest);
+		i = smallest;
+	}
+}
+
+static SimEvent* priv_event_new(SimEventType type, guint len) {
+	SimEvent* event = g_malloc0(sizeof(SimEvent) + len);
+
+	event->type = type;
+	event->len = len;
+	event->buf = (gchar*)(event + 1);
+	return event;
+}
+
+static void priv_event_push(XiceSimNetwork* net, SimEvent* event, gint64 time) {
+	event->time = time;
+	event->seq = net->seq++;
+	event->index = net->events->len;
+	g_ptr_array_add(net->events, event);
+	priv_heap_up(net->events, event->index);
+}
+
+static void priv_event_remove(XiceSimNetwork* net, SimEvent* event) {
+	GPtrArray* heap = net->events;
+	guint i = event->index;
+	guint last = heap->len - 1;
+
+	if (i != last)
+		priv_heap_swap(heap, i, last);
+	g_ptr_array_remove_index(heap, last);
+	if (i < heap->len) {
+		priv_heap_down(heap, i);
+		priv_heap_up(heap, i);
+	}
+}
+
+/* addresses and links */
+
+static void priv_address_key(const XiceAddress* addr, gboolean port, gchar* key) {
+	gchar ip[INET6_ADDRSTRLEN];
+
+	if (addr == NULL) {
+		g_strlcpy(key, "*", SIM_KEY_SIZE);
+		return;
+	}
+	xice_address_to_string(addr, ip);
+	if (port)
+		g_snprintf(key, SIM_KEY_SIZE, "%s:%u", ip, xice_address_get_port(addr));
+	else
+		g_strlcpy(key, ip, SIM_KEY_SIZE);
+}
+
+static void priv_link_key(const gchar* from, const gchar* to, gchar* key) {
+	g_snprintf(key, 2 * SIM_KEY_SIZE, "%s>%s", from, to);
+}
+
+static const XiceSimLinkParams* priv_find_params(XiceSimNetwork* net,
+	const gchar* from, const gchar* to) {
+	const gchar* keys[][2] = { { from, to }, { from, "*" }, { "*", to } };
+	gchar key[2 * SIM_KEY_SIZE];
+	XiceSimLinkParams* params;
+	guint i;
+
+	if (g_hash_table_size(net->params) == 0)
+		return &net->default_params;
+
+	for (i = 0; i < G_N_ELEMENTS(keys); i++) {
+		priv_link_key(keys[i][0], keys[i][1], key);
+		params = g_hash_table_lookup(net->params, key);
+		if (params != NULL)
+			return params;
+	}
+	return &net->default_params;
+}
+
+static SimLink* priv_get_link(XiceSimNetwork* net, const XiceAddress* from,
+	const XiceAddress* to, const XiceSimLinkParams** params) {
+	gchar src[SIM_KEY_SIZE];
+	gchar dst[SIM_KEY_SIZE];
+	gchar key[2 * SIM_KEY_SIZE];
+	SimLink* link;
+
+	priv_address_key(from, FALSE, src);
+	priv_address_key(to, FALSE, dst);
+	*params = priv_find_params(net, src, dst);
+
+	priv_link_key(src, dst, key);
+	link = g_hash_table_lookup(net->links, key);
+	if (link == NULL) {
+		link = g_new0(SimLink, 1);
+		g_hash_table_insert(net->links, g_strdup(key), link);
+	}
+	return link;
+}
+
+/* Computes when a packet of len bytes sent now arrives, or returns -1 when
+ * the loss model drops it. Reliable transports are never lossy and never
+ * reordered. */
+static gint64 priv_link_arrival(XiceSimNetwork* net, const XiceAddress* from,
+	const XiceAddress* to, guint len, gboolean reliable) {
+	const XiceSimLinkParams* params;
+	SimLink* link = priv_get_link(net, from, to, &params);
+	gint64 arrival;
+
+	if (!reliable && params->loss > 0 &&
+		g_rand_double(net->rand) < params->loss) {
+		net->stats.packets_lost++;
+		return -1;
+	}
+
+	link->busy_until = MAX(net->now, link->busy_until);
+	if (params->bandwidth > 0)
+		link->busy_until += (gint64)len * 8 * 1000 / params->bandwidth;
+
+	arrival = link->busy_until + (gint64)params->latency * 1000;
+	if (params->jitter > 0)
+		arrival += g_rand_int_range(net->rand, 0, params->jitter * 1000 + 1);
+
+	if (!reliable && params->reorder > 0 &&
+		g_rand_double(net->rand) < params->reorder) {
+		/* held back, later packets may overtake it */
+		arrival = MAX(arrival, link->last_arrival) + g_rand_int_range(net->rand,
+			1000, (params->latency + params->jitter) * 1000 + 1001);
+	} else {
+		arrival = MAX(arrival, link->last_arrival);
+		link->last_arrival = arrival;
+	}
+	return arrival;
+}
+
+static gboolean priv_send(XiceSimNetwork* net, XiceSocket* sock, guint dest,
+	const XiceAddress* to, XiceSocketCondition condition, guint len,
+	const gchar* buf) {
+	SimSocket* sim = sock->priv;
+	SimEvent* event;
+	gint64 arrival;
+
+	if (condition == XICE_SOCKET_READABLE) {
+		net->stats.packets_sent++;
+		if (net->tap != NULL)
+			net->tap(net, &sock->addr, to, buf, len, net->tap_data);
+	}
+
+	arrival = priv_link_arrival(net, &sock->addr, to, len, sim->reliable);
+	if (arrival < 0)
+		return TRUE;
+
+	event = priv_event_new(SIM_EVENT_PACKET, len);
+	event->dest = dest;
+	event->condition = condition;
+	event->from = sock->addr;
+	event->to = *to;
+	if (len > 0)
+		memcpy(event->buf, buf, len);
+	priv_event_push(net, event, arrival);
+
+	return TRUE;
+}
+
+/* sockets */
+
+static XiceSocket* priv_socket_new(XiceSimNetwork* net, gboolean reliable) {
+	XiceSocket* sock = g_slice_new0(XiceSocket);
+	SimSocket* sim = g_slice_new0(SimSocket);
+
+	sim->net = net;
+	sim->id = net->next_id++;
+	sim->reliable = reliable;
+
+	sock->priv = sim;
+	sock->send = socket_send;
+	sock->is_reliable = socket_is_reliable;
+	sock->close = socket_close;
+	sock->get_fd = socket_get_fd;
+
+	g_hash_table_insert(net->sockets, GUINT_TO_POINTER(sim->id), sock);
+	return sock;
+}
+
+static guint priv_next_port(XiceSimNetwork* net) {
+	guint port = net->next_port++;
+
+	if (net->next_port > 65535)
+		net->next_port = SIM_FIRST_PORT;
+	return port;
+}
+
+static XiceSocket* priv_udp_socket_create(XiceSimNetwork* net, XiceAddress* addr) {
+	XiceSocket* sock;
+	XiceAddress local = *addr;
+	gchar key[SIM_KEY_SIZE];
+	guint tries;
+
+	if (xice_address_get_port(&local) == 0) {
+		for (tries = SIM_FIRST_PORT; tries <= 65535; tries++) {
+			xice_address_set_port(&local, priv_next_port(net));
+			priv_address_key(&local, TRUE, key);
+			if (g_hash_table_lookup(net->bindings, key) == NULL)
+				break;
+		}
+	}
+	priv_address_key(&local, TRUE, key);
+	if (g_hash_table_lookup(net->bindings, key) != NULL) {
+		xice_debug("sim: %s is already bound", key);
+		return NULL;
+	}
+
+	sock = priv_socket_new(net, FALSE);
+	sock->addr = local;
+	g_hash_table_insert(net->bindings, g_strdup(key), sock);
+
+	return sock;
+}
+
+static XiceSocket* priv_tcp_socket_create(XiceSimNetwork* net, XiceAddress* addr) {
+	XiceSocket* client;
+	XiceSocket* server;
+	SimSocket* csim;
+	SimSocket* ssim;
+	SimEvent* event;
+	gchar key[SIM_KEY_SIZE];
+	gint64 arrival;
+
+	if (addr == NULL)
+		return NULL;
+
+	/* nobody listening: connection refused */
+	priv_address_key(addr, TRUE, key);
+	if (g_hash_table_lookup(net->listeners, key) == NULL)
+		return NULL;
+
+	client = priv_socket_new(net, TRUE);
+	server = priv_socket_new(net, TRUE);
+	csim = client->priv;
+	ssim = server->priv;
+
+	/* the local address of a client is the unspecified address */
+	client->addr = *addr;
+	if (xice_address_ip_version(addr) == 6) {
+		guchar any[16] = { 0 };
+		xice_address_set_ipv6(&client->addr, any);
+	} else {
+		xice_address_set_ipv4(&client->addr, 0);
+	}
+	xice_address_set_port(&client->addr, priv_next_port(net));
+	server->addr = *addr;
+
+	csim->peer = ssim->id;
+	csim->peer_addr = server->addr;
+	ssim->peer = csim->id;
+	ssim->peer_addr = client->addr;
+
+	/* the listener sees the connection one way delay later, data the client
+	 * sends meanwhile is queued behind it on the same link */
+	arrival = priv_link_arrival(net, &client->addr, addr, 0, TRUE);
+	event = priv_event_new(SIM_EVENT_ACCEPT, 0);
+	event->accepted = server;
+	event->from = client->addr;
+	event->to = *addr;
+	priv_event_push(net, event, arrival);
+
+	return client;
+}
+
+static gboolean socket_send(XiceSocket *sock, const XiceAddress *to,
+	guint len, const gchar *buf) {
+	SimSocket* sim = sock->priv;
+
+	if (sim->reliable) {
+		if (sim->peer == 0)
+			return FALSE;
+		return priv_send(sim->net, sock, sim->peer, &sim->peer_addr,
+			XICE_SOCKET_READABLE, len, buf);
+	}
+
+	return priv_send(sim->net, sock, 0, to, XICE_SOCKET_READABLE, len, buf);
+}
+
+static gboolean socket_is_reliable(XiceSocket *sock) {
+	SimSocket* sim = sock->priv;
+	return sim->reliable;
+}
+
+static void socket_close(XiceSocket *sock) {
+	SimSocket* sim = sock->priv;
+	XiceSimNetwork* net = sim->net;
+	gchar key[SIM_KEY_SIZE];
+
+	if (sim->reliable) {
+		if (sim->peer != 0 &&
+			g_hash_table_lookup(net->sockets, GUINT_TO_POINTER(sim->peer)) != NULL) {
+			priv_send(net, sock, sim->peer, &sim->peer_addr, XICE_SOCKET_CLOSE,
+				0, NULL);
+		}
+	} else {
+		priv_address_key(&sock->addr, TRUE, key);
+		g_hash_table_remove(net->bindings, key);
+	}
+
+	g_hash_table_remove(net->sockets, GUINT_TO_POINTER(sim->id));
+	g_slice_free(SimSocket, sim);
+	sock->priv = NULL;
+}
+
+static int socket_get_fd(XiceSocket *sock) {
+	return -1;
+}
+
+/* timers */
+
+static XiceTimer* priv_timer_create(XiceSimNetwork* net, guint interval,
+	XiceTimerFunc function, gpointer data) {
+	XiceTimer* timer = g_slice_new0(XiceTimer);
+	SimTimer* sim = g_slice_new0(SimTimer);
+
+	sim->net = net;
+	sim->timer = timer;
+
+	timer->interval = interval;
+	timer->func = function;
+	timer->data = data;
+	timer->priv = sim;
+
+	timer->start = sim_timer_start;
+	timer->stop = sim_timer_stop;
+	timer->destroy = sim_timer_destroy;
+
+	return timer;
+}
+
+static void sim_timer_start(XiceTimer* timer) {
+	SimTimer* sim = timer->priv;
+
+	sim_timer_stop(timer);
+	sim->event = priv_event_new(SIM_EVENT_TIMER, 0);
+	sim->event->timer = sim;
+	priv_event_push(sim->net, sim->event,
+		sim->net->now + (gint64)timer->interval * 1000);
+}
+
+static void sim_timer_stop(XiceTimer* timer) {
+	SimTimer* sim = timer->priv;
+
+	if (sim->event != NULL) {
+		priv_event_remove(sim->net, sim->event);
+		g_free(sim->event);
+		sim->event = NULL;
+	}
+}
+
+static void sim_timer_destroy(XiceTimer* timer) {
+	SimTimer* sim = timer->priv;
+
+	sim_timer_stop(timer);
+	if (sim->net->dispatching == sim)
+		sim->net->dispatching = NULL;
+
+	g_slice_free(SimTimer, sim);
+	g_slice_free(XiceTimer, timer);
+}
+
+/* dispatch */
+
+static void priv_dispatch_timer(XiceSimNetwork* net, SimTimer* sim) {
+	XiceTimer* timer = sim->timer;
+	gboolean ret;
+
+	net->stats.timers_fired++;
+	sim->event = NULL;
+	net->dispatching = sim;
+
+	ret = timer->func(timer, timer->data);
+
+	/* like a GSource, the timer repeats while its callback returns TRUE,
+	 * unless it was destroyed or restarted from the callback */
+	if (net->dispatching == sim && ret && sim->event == NULL)
+		sim_timer_start(timer);
+	net->dispatching = NULL;
+}
+
+static void priv_dispatch_packet(XiceSimNetwork* net, SimEvent* event) {
+	XiceSocket* sock;
+	gchar key[SIM_KEY_SIZE];
+
+	if (event->dest != 0) {
+		sock = g_hash_table_lookup(net->sockets, GUINT_TO_POINTER(event->dest));
+	} else {
+		priv_address_key(&event->to, TRUE, key);
+		sock = g_hash_table_lookup(net->bindings, key);
+	}
+
+	if (event->condition == XICE_SOCKET_CLOSE) {
+		if (sock != NULL) {
+			SimSocket* sim = sock->priv;
+			sim->peer = 0;
+			if (sock->callback != NULL)
+				sock->callback(sock, XICE_SOCKET_CLOSE, sock->data, NULL, 0, NULL);
+		}
+		return;
+	}
+
+	if (sock == NULL || sock->callback == NULL) {
+		net->stats.packets_unreachable++;
+		return;
+	}
+
+	net->stats.packets_delivered++;
+	net->stats.bytes_delivered += event->len;
+	sock->callback(sock, XICE_SOCKET_READABLE, sock->data, event->buf,
+		event->len, &event->from);
+}
+
+static void priv_dispatch_accept(XiceSimNetwork* net, SimEvent* event) {
+	XiceSocket* sock = event->accepted;
+	SimSocket* sim = sock->priv;
+	SimListener* listener;
+	gchar key[SIM_KEY_SIZE];
+
+	priv_address_key(&event->to, TRUE, key);
+	listener = g_hash_table_lookup(net->listeners, key);
+
+	if (listener == NULL) {
+		/* stopped listening in the meantime, reset the connection */
+		xice_socket_free(sock);
+		return;
+	}
+
+	if (g_hash_table_lookup(net->sockets, GUINT_TO_POINTER(sim->peer)) == NULL)
+		sim->peer = 0;
+
+	listener->func(net, sock, listener->data);
+}
+
+XiceSimNetwork* xice_sim_network_new(guint32 seed) {
+	XiceSimNetwork* net = g_slice_new0(XiceSimNetwork);
+
+	net->now = SIM_EPOCH;
+	net->rand = g_rand_new_with_seed(seed);
+	net->events = g_ptr_array_new();
+	net->sockets = g_hash_table_new(g_direct_hash, g_direct_equal);
+	net->bindings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	net->listeners = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	net->params = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	net->links = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	net->next_id = 1;
+	net->next_port = SIM_FIRST_PORT;
+
+	return net;
+}
+
+void xice_sim_network_free(XiceSimNetwork* net) {
+	guint i;
+
+	g_assert(net != NULL);
+
+	for (i = 0; i < net->events->len; i++) {
+		SimEvent* event = g_ptr_array_index(net->events, i);
+		if (event->type == SIM_EVENT_TIMER) {
+			event->timer->event = NULL;
+		} else if (event->type == SIM_EVENT_ACCEPT) {
+			g_slice_free(SimSocket, event->accepted->priv);
+			g_slice_free(XiceSocket, event->accepted);
+		}
+		g_free(event);
+	}
+	g_ptr_array_free(net->events, TRUE);
+
+	g_hash_table_destroy(net->sockets);
+	g_hash_table_destroy(net->bindings);
+	g_hash_table_destroy(net->listeners);
+	g_hash_table_destroy(net->params);
+	g_hash_table_destroy(net->links);
+	g_rand_free(net->rand);
+
+	g_slice_free(XiceSimNetwork, net);
+}
+
+void xice_sim_network_set_default_link(XiceSimNetwork* net,
+	const XiceSimLinkParams* params) {
+	g_assert(net != NULL && params != NULL);
+
+	net->default_params = *params;
+}
+
+void xice_sim_network_set_link(XiceSimNetwork* net, const XiceAddress* from,
+	const XiceAddress* to, const XiceSimLinkParams* params) {
+	gchar src[SIM_KEY_SIZE];
+	gchar dst[SIM_KEY_SIZE];
+	gchar key[2 * SIM_KEY_SIZE];
+
+	g_assert(net != NULL && params != NULL);
+
+	priv_address_key(from, FALSE, src);
+	priv_address_key(to, FALSE, dst);
+	priv_link_key(src, dst, key);
+	g_hash_table_insert(net->params, g_strdup(key),
+		g_memdup(params, sizeof(XiceSimLinkParams)));
+}
+
+gboolean xice_sim_network_listen(XiceSimNetwork* net, const XiceAddress* addr,
+	XiceSimAcceptFunc func, gpointer data) {
+	SimListener* listener;
+	gchar key[SIM_KEY_SIZE];
+
+	g_assert(net != NULL && addr != NULL && func != NULL);
+
+	priv_address_key(addr, TRUE, key);
+	if (g_hash_table_lookup(net->listeners, key) != NULL)
+		return FALSE;
+
+	listener = g_new0(SimListener, 1);
+	listener->func = func;
+	listener->data = data;
+	g_hash_table_insert(net->listeners, g_strdup(key), listener);
+
+	return TRUE;
+}
+
+void xice_sim_network_unlisten(XiceSimNetwork* net, const XiceAddress* addr) {
+	gchar key[SIM_KEY_SIZE];
+
+	g_assert(net != NULL && addr != NULL);
+
+	priv_address_key(addr, TRUE, key);
+	g_hash_table_remove(net->listeners, key);
+}
+
+void xice_sim_network_set_tap(XiceSimNetwork* net, XiceSimTapFunc func,
+	gpointer data) {
+	g_assert(net != NULL);
+
+	net->tap = func;
+	net->tap_data = data;
+}
+
+gint64 xice_sim_network_get_time(XiceSimNetwork* net) {
+	return net->now;
+}
+
+gboolean xice_sim_network_step(XiceSimNetwork* net) {
+	SimEvent* event;
+
+	g_assert(net != NULL);
+
+	if (net->events->len == 0)
+		return FALSE;
+
+	event = g_ptr_array_index(net->events, 0);
+	priv_event_remove(net, event);
+	if (event->time > net->now)
+		net->now = event->time;
+
+	switch (event->type) {
+	case SIM_EVENT_TIMER:
+		priv_dispatch_timer(net, event->timer);
+		break;
+	case SIM_EVENT_PACKET:
+		priv_dispatch_packet(net, event);
+		break;
+	case SIM_EVENT_ACCEPT:
+		priv_dispatch_accept(net, event);
+		break;
+	}
+	g_free(event);
+
+	return TRUE;
+}
+
+guint xice_sim_network_run_until(XiceSimNetwork* net, gint64 deadline) {
+	guint count = 0;
+
+	g_assert(net != NULL);
+
+	net->stopped = FALSE;
+	while (!net->stopped && net->events->len > 0) {
+		SimEvent* next = g_ptr_array_index(net->events, 0);
+		if (next->time > deadline)
+			break;
+		xice_sim_network_step(net);
+		count++;
+	}
+
+	if (!net->stopped && net->now < deadline)
+		net->now = deadline;
+
+	return count;
+}
+
+guint xice_sim_network_run_for(XiceSimNetwork* net, guint ms) {
+	return xice_sim_network_run_until(net, net->now + (gint64)ms * 1000);
+}
+
+void xice_sim_network_stop(XiceSimNetwork* net) {
+	net->stopped = TRUE;
+}
+
+void xice_sim_network_get_stats(XiceSimNetwork* net, XiceSimStats* stats) {
+	g_assert(net != NULL && stats != NULL);
+
+	*stats = net->stats;
+}
+
+/* context */
+
+XiceContext *sim_context_create(gpointer net)
+{
+	XiceContext* xctx = g_slice_new0(XiceContext);
+	XiceContextSim* sim = g_slice_new0(XiceContextSim);
+
+	g_assert(net != NULL);
+
+	sim->net = net;
+
+	xctx->priv = sim;
+	xctx->create_tcp_socket = sim_create_tcp_socket;
+	xctx->create_udp_socket = sim_create_udp_socket;
+	xctx->create_tcp_listener = sim_create_tcp_listener;
+	xctx->create_timer = sim_create_timer;
+	xctx->get_time = sim_get_time;
+
+	xctx->destroy = sim_destroy;
+	return xctx;
+}
+
+static XiceSocket* sim_create_tcp_socket(XiceContext* ctx, XiceAddress* addr) {
+	XiceContextSim* sim = ctx->priv;
+	return priv_tcp_socket_create(sim->net, addr);
+}
+
+static XiceSocket* sim_create_udp_socket(XiceContext* ctx, XiceAddress* addr) {
+	XiceContextSim* sim = ctx->priv;
+	return priv_udp_socket_create(sim->net, addr);
+}
+
+/* A listening socket of the context, over xice_sim_network_listen() */
+typedef struct _SimTcpListener {
+	XiceSimNetwork* net;
+	XiceSocket* sock;
+	XiceSocketAcceptFunc func;
+	gpointer data;
+} SimTcpListener;
+
+static void priv_listener_accept(XiceSimNetwork* net, XiceSocket* sock,
+	gpointer data) {
+	SimTcpListener* listener = data;
+
+	listener->func(listener->sock, sock, listener->data);
+}
+
+static gboolean priv_listener_send(XiceSocket* sock, const XiceAddress* to,
+	guint len, const gchar* buf) {
+	return FALSE;
+}
+
+static gboolean priv_listener_is_reliable(XiceSocket* sock) {
+	return TRUE;
+}
+
+static void priv_listener_close(XiceSocket* sock) {
+	SimTcpListener* listener = sock->priv;
+
+	xice_sim_network_unlisten(listener->net, &sock->addr);
+	g_slice_free(SimTcpListener, listener);
+}
+
+static XiceSocket* sim_create_tcp_listener(XiceContext* ctx,
+	XiceAddress* addr, XiceSocketAcceptFunc func, gpointer data) {
+	XiceContextSim* sim = ctx->priv;
+	XiceSimNetwork* net = sim->net;
+	SimTcpListener* listener;
+	XiceSocket* sock;
+	XiceAddress local = *addr;
+	gchar key[SIM_KEY_SIZE];
+	guint tries;
+
+	if (xice_address_get_port(&local) == 0) {
+		for (tries = SIM_FIRST_PORT; tries <= 65535; tries++) {
+			xice_address_set_port(&local, priv_next_port(net));
+			priv_address_key(&local, TRUE, key);
+			if (g_hash_table_lookup(net->listeners, key) == NULL)
+				break;
+		}
+	}
+
+	listener = g_slice_new0(SimTcpListener);
+	if (!xice_sim_network_listen(net, &local, priv_listener_accept,
+		listener)) {
+		g_slice_free(SimTcpListener, listener);
+		return NULL;
+	}
+
+	sock = g_slice_new0(XiceSocket);
+	sock->addr = local;
+	sock->priv = listener;
+	sock->send = priv_listener_send;
+	sock->is_reliable = priv_listener_is_reliable;
+	sock->close = priv_listener_close;
+
+	listener->net = net;
+	listener->sock = sock;
+	listener->func = func;
+	listener->data = data;
+
+	return sock;
+}
+
+static XiceTimer* sim_create_timer(XiceContext* ctx, guint interval,
+	XiceTimerFunc function, gpointer data) {
+	XiceContextSim* sim = ctx->priv;
+	return priv_timer_create(sim->net, interval, function, data);
+}
+
+static gint64 sim_get_time(XiceContext* ctx) {
+	XiceContextSim* sim = ctx->priv;
+	return sim->net->now;
+}
+
+static void sim_destroy(XiceContext *ctx) {
+	XiceContextSim* sim = ctx->priv;
+
+	/* the network is owned by the caller and may outlive the context */
+	g_slice_free(XiceContextSim, sim);
+	ctx->priv = NULL;
+}
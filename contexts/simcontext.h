@@ -0,0 +1,73 @@
+#ifndef __SIM_CONTEXT_H__
+#define __SIM_CONTEXT_H__
+
+#include "xicecontext.h"
+
+G_BEGIN_DECLS
+
+/* In-memory network shared by any number of "sim" contexts. Sockets are
+ * queues, timers run on a virtual clock and nothing happens unless the
+ * network is driven with xice_sim_network_step() or one of the run
+ * functions. Given the same seed and the same calls, a simulation always
+ * produces the same events in the same order. Sockets, timers and contexts
+ * using a network must be freed before the network itself. */
+typedef struct _XiceSimNetwork XiceSimNetwork;
+
+typedef struct _XiceSimLinkParams {
+	guint latency;          /* one-way delay in milliseconds */
+	guint jitter;           /* extra uniform delay in [0, jitter] milliseconds */
+	gdouble loss;           /* probability that a datagram is dropped */
+	gdouble reorder;        /* probability that a datagram is held back */
+	guint bandwidth;        /* kbit/s, 0 for unlimited */
+} XiceSimLinkParams;
+
+typedef struct _XiceSimStats {
+	guint64 packets_sent;
+	guint64 packets_delivered;
+	guint64 packets_lost;           /* dropped by the loss model */
+	guint64 packets_unreachable;    /* nobody bound to the destination */
+	guint64 bytes_delivered;
+	guint64 timers_fired;
+} XiceSimStats;
+
+/* Called when a simulated TCP connection reaches a listener. The callback
+ * must set the socket callback, and owns the socket. */
+typedef void (*XiceSimAcceptFunc)(XiceSimNetwork* net, XiceSocket* sock,
+	gpointer data);
+
+/* Sees every packet handed to the network, before the loss model */
+typedef void (*XiceSimTapFunc)(XiceSimNetwork* net, const XiceAddress* from,
+	const XiceAddress* to, const gchar* buf, guint len, gpointer data);
+
+XiceSimNetwork* xice_sim_network_new(guint32 seed);
+void xice_sim_network_free(XiceSimNetwork* net);
+
+/* Link parameters are looked up by source and destination IP, a NULL
+ * address matching any host. Exact matches win over wildcards. */
+void xice_sim_network_set_default_link(XiceSimNetwork* net,
+	const XiceSimLinkParams* params);
+void xice_sim_network_set_link(XiceSimNetwork* net, const XiceAddress* from,
+	const XiceAddress* to, const XiceSimLinkParams* params);
+
+gboolean xice_sim_network_listen(XiceSimNetwork* net, const XiceAddress* addr,
+	XiceSimAcceptFunc func, gpointer data);
+void xice_sim_network_unlisten(XiceSimNetwork* net, const XiceAddress* addr);
+
+void xice_sim_network_set_tap(XiceSimNetwork* net, XiceSimTapFunc func,
+	gpointer data);
+
+/* virtual time in microseconds */
+gint64 xice_sim_network_get_time(XiceSimNetwork* net);
+
+gboolean xice_sim_network_step(XiceSimNetwork* net);
+guint xice_sim_network_run_until(XiceSimNetwork* net, gint64 deadline);
+guint xice_sim_network_run_for(XiceSimNetwork* net, guint ms);
+void xice_sim_network_stop(XiceSimNetwork* net);
+
+void xice_sim_network_get_stats(XiceSimNetwork* net, XiceSimStats* stats);
+
+XiceContext *sim_context_create(gpointer net);
+
+G_END_DECLS
+
+#endif
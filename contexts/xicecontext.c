@@ -5,10 +5,19 @@
 #include "agent.h"
 #include "xicesocket.h"
 #include "giocontext.h"
+#include "simcontext.h"
+#include "stun/usages/timer.h"
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+static void priv_stun_clock(struct timeval* now, void* user_data) {
+	gint64 time = xice_context_get_time(user_data);
+
+	now->tv_sec = (long)(time / G_USEC_PER_SEC);
+	now->tv_usec = (long)(time % G_USEC_PER_SEC);
+}
+
 void xice_context_destroy(XiceContext* ctx) {
 	g_assert(ctx != NULL);
 
@@ -33,6 +42,16 @@ XiceSocket* xice_create_udp_socket(XiceContext* ctx, XiceAddress* addr) {
 	return ctx->create_udp_socket(ctx, addr);
 }
 
+XiceSocket* xice_create_tcp_listener(XiceContext* ctx, XiceAddress* addr,
+	XiceSocketAcceptFunc func, gpointer data) {
+	g_assert(ctx != NULL);
+	g_assert(addr != NULL && func != NULL);
+
+	if (ctx->create_tcp_listener == NULL)
+		return NULL;
+	return ctx->create_tcp_listener(ctx, addr, func, data);
+}
+
 XiceTimer* xice_create_timer(XiceContext* ctx, guint interval,
 	XiceTimerFunc function, gpointer data) {
 	XiceTimer* timer;
@@ -45,12 +64,44 @@ XiceTimer* xice_create_timer(XiceContext* ctx, guint interval,
 	return timer;
 }
 
+gint64 xice_context_get_time(XiceContext* ctx) {
+	g_assert(ctx != NULL);
+
+	if (ctx->clock != NULL)
+		return ctx->clock(ctx->clock_data);
+
+	if (ctx->get_time != NULL)
+		return ctx->get_time(ctx);
+
+	return g_get_monotonic_time();
+}
+
+void xice_context_set_clock(XiceContext* ctx, XiceClockFunc func, gpointer data) {
+	g_assert(ctx != NULL);
+
+	ctx->clock = func;
+	ctx->clock_data = data;
+}
+
+void xice_context_start_stun_timer(XiceContext* ctx, StunTimer* timer,
+	guint initial_timeout, guint max_retransmissions) {
+	g_assert(ctx != NULL);
+
+	/* the timer reads the clock of its own context, whichever that is */
+	stun_timer_start_with_clock(timer, initial_timeout, max_retransmissions,
+		priv_stun_clock, ctx);
+}
+
 XiceContext *xice_context_create(const char* type, gpointer ctx)
 {
 	if (strcmp(type, "gio") == 0) {
 		return gio_context_create(ctx);
 	}
 
+	if (strcmp(type, "sim") == 0) {
+		return sim_context_create(ctx);
+	}
+
 #ifdef HAVE_LIBUV
 #include "libuvcontext.h"
 	if (strcmp(type, "libuv") == 0) {
@@ -4,24 +4,36 @@
 #include <glib-object.h>
 #include "xicesocket.h"
 #include "xicetimer.h"
+#include "stun/usages/timer.h"
 
 G_BEGIN_DECLS
 
 typedef struct _XiceContext XiceContext;
 
+/* Returns the current time in microseconds. Used to replace the clock of a
+ * context, e.g. with a virtual clock driven by a simulation. */
+typedef gint64 (*XiceClockFunc)(gpointer data);
+
 struct _XiceContext {
 
 	//functions
 	XiceSocket* (*create_tcp_socket)(XiceContext* ctx, XiceAddress* addr);
 	XiceSocket* (*create_udp_socket)(XiceContext* ctx, XiceAddress* addr);
+	XiceSocket* (*create_tcp_listener)(XiceContext* ctx, XiceAddress* addr,
+		XiceSocketAcceptFunc func, gpointer data);
 
 	XiceTimer* (*create_timer)(XiceContext* ctx, guint interval,
 		XiceTimerFunc function, gpointer data);
+
+	//monotonic time in microseconds, cached once per loop iteration
+	gint64 (*get_time)(XiceContext* ctx);
 	
 	void (*destroy)(XiceContext *ctx);
 
 	//attributes
 	void* priv;
+	XiceClockFunc clock;
+	gpointer clock_data;
 };
 
 XiceContext* xice_context_create(const char* type, gpointer data);
@@ -30,9 +42,23 @@ void xice_context_destroy(XiceContext* ctx);
 XiceSocket* xice_create_tcp_socket(XiceContext* ctx, XiceAddress* addr);
 XiceSocket* xice_create_udp_socket(XiceContext* ctx, XiceAddress* addr);
 
+/* Listens for TCP connections on @addr, any port if its port is 0, and
+ * hands each one to @func. Freeing the returned socket stops listening.
+ * NULL if the address is taken, or the context cannot listen. */
+XiceSocket* xice_create_tcp_listener(XiceContext* ctx, XiceAddress* addr,
+	XiceSocketAcceptFunc func, gpointer data);
+
 XiceTimer* xice_create_timer(XiceContext* ctx, guint interval,
 	XiceTimerFunc function, gpointer data);
 
+gint64 xice_context_get_time(XiceContext* ctx);
+void xice_context_set_clock(XiceContext* ctx, XiceClockFunc func, gpointer data);
+
+/* Starts a STUN retransmission timer on the clock of the context, 0
+ * retransmissions for a reliable transport */
+void xice_context_start_stun_timer(XiceContext* ctx, StunTimer* timer,
+	guint initial_timeout, guint max_retransmissions);
+
 G_END_DECLS
 
 #endif
@@ -62,11 +62,19 @@ typedef gboolean (*XiceSocketCallbackFunc)(
 	guint len,
 	XiceAddress *from);
 
+/* Called with each connection a listening socket accepts. The callee owns
+ * @sock and must set its callback. */
+typedef void (*XiceSocketAcceptFunc)(
+	XiceSocket *listener,
+	XiceSocket *sock,
+	gpointer data);
+
 enum _XiceSocketCondition
 {
 	XICE_SOCKET_ERROR,
 	XICE_SOCKET_CLOSE,
-	XICE_SOCKET_READABLE
+	XICE_SOCKET_READABLE,
+	XICE_SOCKET_WRITABLE	/* data was refused, and may be sent again */
 };
 
 struct _XiceSocket
@@ -52,16 +52,19 @@
 #include <unistd.h>
 #endif
 
+#define MAX_UDP_MESSAGE_SIZE 65535
+
+/* the longest frame: a STUN header, the largest length and its padding */
+#define MAX_FRAME_SIZE (20 + MAX_UDP_MESSAGE_SIZE + 3)
+
 typedef struct {
   XiceTurnSocketCompatibility compatibility;
-  gchar recv_buf[65536];
+  gchar recv_buf[MAX_FRAME_SIZE];   /* a frame split across reads */
   guint recv_buf_len;
-  guint expecting_len;
+  guint frame_len;                  /* its length, once its header is read */
   XiceSocket *base_socket;
 } TurnTcpPriv;
 
-#define MAX_UDP_MESSAGE_SIZE 65535
-
 static gboolean read_callback(
 	XiceSocket *socket,
 	XiceSocketCondition condition,
@@ -110,6 +113,51 @@ socket_close (XiceSocket *sock)
   g_slice_free(TurnTcpPriv, sock->priv);
 }
 
+/* Bytes needed to know how long a frame is, 0 if the framing is unknown */
+static guint
+priv_header_length (TurnTcpPriv *priv)
+{
+  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
+    return 4;
+  else if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE)
+    return 2;
+  return 0;
+}
+
+/*
+ * Length on the stream of the frame whose header starts at @header, and
+ * the part of it that is handed on: STUN messages and ChannelData with
+ * their padding to 4 bytes for RFC 5766, the payload after the 2 bytes
+ * length for Google.
+ */
+static guint
+priv_frame_length (TurnTcpPriv *priv, const gchar *header,
+    guint *offset, guint *len)
+{
+  const guint8 *p = (const guint8 *) header;
+  guint length = (p[0] << 8) | p[1];
+
+  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
+    *offset = 2;
+    *len = length;
+    return 2 + length;
+  }
+
+  /* a ChannelData channel number is at least 0x4000, a STUN message type
+   * is below it and its length is that of its attributes */
+  length = (p[0] < 0x40 ? 20 : 4) + ((p[2] << 8) | p[3]);
+  length += (4 - length % 4) % 4;
+  *offset = 0;
+  *len = length;
+  return length;
+}
+
+/*
+ * Frames read whole are handed on where they are in @buf. Only a frame
+ * split across reads is copied, into recv_buf, and only once: its start
+ * when it is read, then what is missing of it.
+ */
 static gboolean read_callback(
 	XiceSocket *socket,
 	XiceSocketCondition condition,
@@ -119,107 +167,61 @@ static gboolean read_callback(
 	XiceAddress *from) {
   XiceSocket* sock = data;
   TurnTcpPriv *priv = sock->priv;
-  guint padlen;
-  guint headerlen = 0;
-  guint copy = 0;
+  guint headerlen = priv_header_length (priv);
+  guint frame_len, offset, frame_data_len, copy;
 
-  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-	  priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
-	  headerlen = 4;
-  else if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE)
-	  headerlen = 2;
-  else
-	  return FALSE;
-  //do our best to reduse memory copy.
-  if (len < 0 || condition != XICE_SOCKET_READABLE) {
-	  return sock->callback(sock, condition, sock->data, buf, len, from);
-  }
-next:
-  if (len == 0) {
-	  return TRUE;
-  }
+  if (condition != XICE_SOCKET_READABLE)
+    return sock->callback ?
+        sock->callback (sock, condition, sock->data, buf, len, from) : TRUE;
+  if (headerlen == 0)
+    return FALSE;
 
-  if (priv->expecting_len == 0 && priv->recv_buf_len == 0) {
-	if (len < headerlen) {
-		memcpy(priv->recv_buf, buf, len);
-		priv->recv_buf_len = len;
-		return TRUE;
-	}
-    if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      guint16 magic = ntohs (*(guint16*)buf);
-      guint16 packetlen = ntohs (*(guint16*)(buf + 2));
-	  priv->expecting_len = (magic < 0x4000 ? 20 : 4) + packetlen;
-	  padlen = (priv->expecting_len % 4) ? 4 - (priv->expecting_len % 4) : 0;
-    }
-    else if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
-      guint len = ntohs (*(guint16*)buf);
-      priv->expecting_len = len;
-	  padlen = 0;
+  if (priv->recv_buf_len > 0) {
+    if (priv->frame_len == 0) {
+      copy = MIN (len, headerlen - priv->recv_buf_len);
+      memcpy (priv->recv_buf + priv->recv_buf_len, buf, copy);
+      priv->recv_buf_len += copy;
+      buf += copy;
+      len -= copy;
+      if (priv->recv_buf_len < headerlen)
+        return TRUE;
+      priv->frame_len = priv_frame_length (priv, priv->recv_buf,
+          &offset, &frame_data_len);
     }
 
-	if (len >= priv->expecting_len + padlen) {
-		if (sock->callback) {
-			sock->callback(sock, XICE_SOCKET_READABLE, sock->data, buf, priv->expecting_len + padlen, from);
-		}
-		buf += priv->expecting_len + padlen;
-		len -= priv->expecting_len + padlen;
-		priv->recv_buf_len = 0;
-		priv->expecting_len = 0;
-		goto next;
-	}
-	else {
-		priv->expecting_len = priv->expecting_len + padlen - len;
-		memcpy(priv->recv_buf, buf, len);
-		priv->recv_buf_len = len;
-		return TRUE;
-	}
+    copy = MIN (len, priv->frame_len - priv->recv_buf_len);
+    memcpy (priv->recv_buf + priv->recv_buf_len, buf, copy);
+    priv->recv_buf_len += copy;
+    buf += copy;
+    len -= copy;
+    if (priv->recv_buf_len < priv->frame_len)
+      return TRUE;
+
+    priv_frame_length (priv, priv->recv_buf, &offset, &frame_data_len);
+    priv->recv_buf_len = 0;
+    priv->frame_len = 0;
+    if (sock->callback)
+      sock->callback (sock, XICE_SOCKET_READABLE, sock->data,
+          priv->recv_buf + offset, frame_data_len, from);
   }
-  else {
-	  if (priv->expecting_len == 0) {
-		  if (len + priv->recv_buf_len < headerlen) {
-			  memcpy(priv->recv_buf + priv->recv_buf_len, buf, len);
-			  priv->recv_buf_len += len;
-			  return TRUE;
-		  }
-		  if (priv->recv_buf_len < headerlen) {
-			  memcpy(priv->recv_buf + priv->recv_buf_len, buf, headerlen - priv->recv_buf_len);
-			  buf += headerlen - priv->recv_buf_len;
-			  len -= headerlen - priv->recv_buf_len;
-			  priv->recv_buf_len = headerlen;
-		  }
-		  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-			  priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-			  guint16 magic = ntohs(*(guint16*)priv->recv_buf);
-			  guint16 packetlen = ntohs(*(guint16*)(priv->recv_buf + 2));
-			  priv->expecting_len = (magic < 0x4000 ? 20 : 4) + packetlen;
-			  padlen = (priv->expecting_len % 4) ? 4 - (priv->expecting_len % 4) : 0;
-		  }
-		  else if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
-			  guint len = ntohs(*(guint16*)priv->recv_buf);
-			  priv->expecting_len = len;
-			  padlen = 0;
-		  }			  
-	  }
-	  copy = MIN(len, padlen + priv->expecting_len - priv->recv_buf_len);
-	  memcpy(priv->recv_buf + priv->recv_buf_len, buf, copy);
-	  buf += copy;
-	  len -= copy;
-	  priv->recv_buf_len += copy;
-
-	  if (priv->recv_buf_len >= padlen + priv->expecting_len) {
-		  if (sock->callback) {
-			  sock->callback(sock, XICE_SOCKET_READABLE, sock->data, priv->recv_buf, priv->expecting_len + padlen, from);
-		  }
-		  memmove(priv->recv_buf, priv->recv_buf + priv->expecting_len + padlen, priv->recv_buf_len - priv->expecting_len - padlen);
-		  priv->recv_buf_len -= priv->expecting_len + padlen;
-		  priv->expecting_len = 0;
-		  goto next;
-	  }
-	  else {
-		  priv->expecting_len -= priv->recv_buf_len - padlen;
-		  return TRUE;
-	  }
+
+  while (len >= headerlen) {
+    frame_len = priv_frame_length (priv, buf, &offset, &frame_data_len);
+    if (frame_len > len)
+      break;
+    if (sock->callback)
+      sock->callback (sock, XICE_SOCKET_READABLE, sock->data,
+          buf + offset, frame_data_len, from);
+    buf += frame_len;
+    len -= frame_len;
+  }
+
+  if (len > 0) {
+    memcpy (priv->recv_buf, buf, len);
+    priv->recv_buf_len = len;
+    if (len >= headerlen)
+      priv->frame_len = priv_frame_length (priv, buf, &offset,
+          &frame_data_len);
   }
 
   return TRUE;
@@ -49,6 +49,7 @@
 #include "turn.h"
 #include "stun/stunagent.h"
 #include "stun/usages/timer.h"
+#include "stun/usages/turn.h"
 #include "agent-priv.h"
 
 #define STUN_END_TIMEOUT 8000
@@ -56,35 +57,84 @@
 #define STUN_EXPIRE_TIMEOUT 60 /* Time we refresh before expiration  */
 #define STUN_PERMISSION_TIMEOUT (300 - STUN_EXPIRE_TIMEOUT) /* 240 s */
 #define STUN_BINDING_TIMEOUT (600 - STUN_EXPIRE_TIMEOUT) /* 540 s */
+#define STUN_ALLOCATION_LIFETIME 600 /* s, unless the server says otherwise */
+/* Refreshes falling due this soon after one that is due are sent along
+ * with it, rather than waking up again for each of them */
+#define TURN_REFRESH_WINDOW 5 /* s */
+#define TURN_CHANNEL_MIN 0x4000 /* channel numbers of RFC 5766 */
+#define TURN_CHANNEL_MAX 0x7FFF
+
+/* Requests in flight at once, well within the STUN_AGENT_MAX_SAVED_IDS
+ * transactions the agent can match responses to */
+#define TURN_MAX_CHANNEL_BIND_REQUESTS 128
+#define TURN_MAX_PERMISSION_REQUESTS 32
+/* XOR-PEER-ADDRESS attributes carried by one CreatePermission */
+#define TURN_MAX_PERMISSION_PEERS 32
+
+/* Bytes queued for a peer while its permission is being installed */
+#define TURN_DEFAULT_QUEUE_SIZE (64 * 1024)
 
 typedef struct {
   StunMessage message;
   uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
   StunTimer timer;
+  gboolean nonce_renewed;       /* already sent again for a stale NONCE */
 } TURNMessage;
 
 typedef struct {
   XiceAddress peer;
   uint16_t channel;
   gboolean renew;
-  XiceTimer* timeout_source;
+  gint64 refresh_at;    /* when to renew the binding, or 0 */
+  gint64 expire_at;     /* when the binding expires unless renewed, or 0 */
 } ChannelBinding;
 
+/* A ChannelBind transaction creating or refreshing a binding */
+typedef struct {
+  TURNMessage *msg;
+  ChannelBinding *binding;
+  gboolean refresh;     /* binding is in the channels list already */
+} ChannelBindRequest;
+
+/* A CreatePermission transaction for one or more peers */
+typedef struct {
+  TURNMessage *msg;
+  XiceAddress peers[TURN_MAX_PERMISSION_PEERS];
+  guint n_peers;
+} PermissionRequest;
+
 typedef struct {
   //GMainContext *ctx;
   XiceContext *ctx;
   StunAgent agent;
   GList *channels;
+  GHashTable *channels_by_peer; /* XiceAddress -> ChannelBinding */
+  GPtrArray *channels_by_number; /* ChannelBinding, indexed by its channel
+                                    number minus TURN_CHANNEL_MIN */
   GList *pending_bindings;
+  GList *channel_bind_requests; /* ChannelBindRequest */
   ChannelBinding *current_binding;
   TURNMessage *current_binding_msg;
-  GList *pending_permissions;
-  //GSource *tick_source_channel_bind;
-  //GSource *tick_source_create_permission;
-  XiceTimer* tick_source_channel_bind;
-  XiceTimer* tick_source_create_permission;
+  GList *pending_permissions;   /* PermissionRequest */
+  GList *permission_peers;      /* XiceAddress waiting for a CreatePermission */
+  gboolean permission_flush;    /* permission_peers to send on the next tick */
+  /* The one timer of the socket, armed for the earliest of the
+     retransmissions, the permission flush and the deadlines below */
+  XiceTimer* tick_source;
+  gint64 next_deadline;         /* earliest refresh, expiry or forgotten
+                                   Send request, or 0 */
+  /* REALM and NONCE of the last challenge, so that new requests do not
+     have to be challenged again */
+  uint8_t *realm;
+  uint16_t realm_len;
+  uint8_t *nonce;
+  uint16_t nonce_len;
 
   XiceSocket *base_socket;
+  /* what the base socket called before, for the packets not from the
+   * server: it may be a host candidate's too */
+  XiceSocketCallbackFunc base_callback;
+  gpointer base_data;
   XiceAddress server_addr;
   uint8_t *username;
   size_t username_len;
@@ -96,21 +146,34 @@ typedef struct {
   uint8_t ms_connection_id[20];
   uint32_t ms_sequence_num;
   bool ms_connection_id_valid;
-  GList *permissions;           /* the peers (XiceAddress) for which
+  GHashTable *permissions;      /* the peers (XiceAddress) for which
                                    there is an installed permission */
-  GList *sent_permissions; /* ongoing permission installed */
+  GHashTable *sent_permissions; /* ongoing permission installed */
   GHashTable *send_data_queues; /* stores a send data queue for per peer */
-  //guint permission_timeout_source;      /* timer used to invalidate
-                                           //permissions */
-  XiceTimer *permission_timeout_source;
+  guint queue_size;             /* limit of each queue, in bytes */
+  XiceTurnSocketDropPolicy drop_policy;
+  guint64 packets_queued;
+  guint64 packets_dropped;
+  guint64 bytes_pending;        /* in all the queues */
+  XiceSocket *sock;
+  gint64 permission_refresh_at; /* when to invalidate the permissions so
+                                   that they get installed again, or 0 */
+  /* The refreshes of the allocation, once the agent has handed them over;
+     it is released when the socket is closed */
+  gboolean allocation_refresh;
+  gint64 allocation_refresh_at; /* when to send the next Refresh, or 0 */
+  TURNMessage *allocation_msg;  /* the Refresh in flight */
+  /* last challenge to the Allocate or its refreshes, which MSN, OC2007 and
+     Google take their REALM and NONCE from rather than the cache above */
+  StunMessage challenge;
+  uint8_t challenge_buffer[STUN_MAX_MESSAGE_SIZE];
 
 } TurnPriv;
 
 
 typedef struct {
   StunTransactionId id;
-  XiceTimer *source;
-  TurnPriv *priv;
+  gint64 forget_at;
 } SendRequest;
 
 /* used to store data sent while obtaining a permission */
@@ -119,6 +182,60 @@ typedef struct {
   guint data_len;
 } SendData;
 
+typedef struct {
+  GQueue packets;               /* SendData */
+  guint bytes;
+  gboolean blocked;             /* data was refused, tell when it drains */
+} SendDataQueue;
+
+/* Storage of queued packets, shared by all sockets. Packets up to
+ * POOL_BLOCK_SIZE bytes, which is all of them on a UDP relay, use blocks
+ * of that size, and a few free blocks are kept for the next packets so
+ * that a burst queued under a slow server reuses the memory of the last
+ * one. Free blocks are chained through their first bytes. */
+#define POOL_BLOCK_SIZE 2048
+#define POOL_MAX_BLOCKS 256
+
+static gpointer pool_blocks;
+static guint pool_count;
+G_LOCK_DEFINE_STATIC (pool);
+
+static gchar *
+pool_alloc (guint len)
+{
+  gchar *block = NULL;
+
+  if (len > POOL_BLOCK_SIZE)
+    return g_malloc (len);
+
+  G_LOCK (pool);
+  block = pool_blocks;
+  if (block) {
+    pool_blocks = *(gpointer *) block;
+    pool_count--;
+  }
+  G_UNLOCK (pool);
+
+  return block ? block : g_malloc (POOL_BLOCK_SIZE);
+}
+
+static void
+pool_free (gchar *block, guint len)
+{
+  if (len <= POOL_BLOCK_SIZE) {
+    G_LOCK (pool);
+    if (pool_count < POOL_MAX_BLOCKS) {
+      *(gpointer *) block = pool_blocks;
+      pool_blocks = block;
+      pool_count++;
+      block = NULL;
+    }
+    G_UNLOCK (pool);
+  }
+
+  g_free (block);
+}
+
 static gboolean read_callback(
 	XiceSocket *socket,
 	XiceSocketCondition condition,
@@ -134,43 +251,57 @@ static gboolean socket_send (XiceSocket *sock, const XiceAddress *to,
 static gboolean socket_is_reliable (XiceSocket *sock);
 
 static void priv_process_pending_bindings (TurnPriv *priv);
-static gboolean priv_retransmissions_tick_unlocked (TurnPriv *priv);
-static gboolean priv_retransmissions_tick (XiceTimer* timer, gpointer pointer);
+static void priv_channel_bind_done (TurnPriv *priv, ChannelBindRequest *req,
+    gboolean success);
+static void priv_flush_permissions (TurnPriv *priv);
+static void priv_grant_permissions (TurnPriv *priv, PermissionRequest *req);
+static gboolean priv_is_response_to (TURNMessage *req, StunMessage *resp);
+static gboolean priv_handle_challenge (TurnPriv *priv, TURNMessage *req,
+    StunMessage *resp);
+static void priv_tick_unlocked (TurnPriv *priv);
+static gboolean priv_tick (XiceTimer* timer, gpointer pointer);
 static void priv_schedule_tick (TurnPriv *priv);
+static void priv_add_deadline (TurnPriv *priv, gint64 deadline);
 static void priv_send_turn_message (TurnPriv *priv, TURNMessage *msg);
-static gboolean priv_send_create_permission (TurnPriv *priv,  StunMessage *resp,
-    const XiceAddress *peer);
-static gboolean priv_send_channel_bind (TurnPriv *priv, StunMessage *resp,
-    uint16_t channel,
+static void priv_queue_create_permission (TurnPriv *priv,
     const XiceAddress *peer);
+static gboolean priv_send_create_permission (TurnPriv *priv,
+    PermissionRequest *req);
+static gboolean priv_send_channel_bind (TurnPriv *priv,
+    ChannelBindRequest *req);
 static gboolean priv_add_channel_binding (TurnPriv *priv,
     const XiceAddress *peer);
-static gboolean priv_forget_send_request (XiceTimer* timer, gpointer pointer);
 static void priv_clear_permissions (TurnPriv *priv);
+static TURNMessage *priv_build_allocation_refresh (TurnPriv *priv,
+    int32_t lifetime);
+static void priv_send_allocation_refresh (TurnPriv *priv);
+static void priv_allocation_refresh_done (TurnPriv *priv, StunMessage *resp);
 
-static guint
-priv_xice_address_hash (gconstpointer data)
+static GHashTable *
+priv_peer_set_new (void)
 {
-  gchar address[XICE_ADDRESS_STRING_LEN];
-
-  xice_address_to_string ((XiceAddress *) data, address);
+  return g_hash_table_new_full ((GHashFunc) xice_address_hash,
+      (GEqualFunc) xice_address_equal,
+      (GDestroyNotify) xice_address_free, NULL);
+}
 
-  return g_str_hash(address);
+static void
+priv_send_data_free (SendData *data)
+{
+  pool_free (data->data, data->data_len);
+  g_slice_free (SendData, data);
 }
 
 static void
 priv_send_data_queue_destroy (gpointer data)
 {
-  GQueue *send_queue = (GQueue *) data;
+  SendDataQueue *send_queue = (SendDataQueue *) data;
   GList *i;
 
-  for (i = g_queue_peek_head_link (send_queue); i; i = i->next) {
-    SendData *data = (SendData *) i->data;
-
-    g_free (data->data);
-    g_slice_free (SendData, data);
-  }
-  g_queue_free (send_queue);
+  for (i = g_queue_peek_head_link (&send_queue->packets); i; i = i->next)
+    priv_send_data_free (i->data);
+  g_queue_clear (&send_queue->packets);
+  g_slice_free (SendDataQueue, send_queue);
 }
 
 XiceSocket *
@@ -212,6 +343,12 @@ xice_turn_socket_new (XiceContext *ctx, XiceAddress *addr,
   }
 
   priv->channels = NULL;
+  /* the bindings own the addresses used as keys */
+  priv->channels_by_peer = g_hash_table_new ((GHashFunc) xice_address_hash,
+      (GEqualFunc) xice_address_equal);
+  priv->channels_by_number = g_ptr_array_new ();
+  priv->permissions = priv_peer_set_new ();
+  priv->sent_permissions = priv_peer_set_new ();
   priv->current_binding = NULL;
   priv->base_socket = base_socket;
   //if (ctx)
@@ -236,11 +373,16 @@ xice_turn_socket_new (XiceContext *ctx, XiceAddress *addr,
   priv->compatibility = compatibility;
   priv->send_requests = g_queue_new ();
 
+  priv->queue_size = TURN_DEFAULT_QUEUE_SIZE;
+  priv->drop_policy = XICE_TURN_SOCKET_DROP_NEWEST;
+  priv->sock = sock;
   priv->send_data_queues =
-      g_hash_table_new_full (priv_xice_address_hash,
+      g_hash_table_new_full ((GHashFunc) xice_address_hash,
           (GEqualFunc) xice_address_equal,
           (GDestroyNotify) xice_address_free,
           priv_send_data_queue_destroy);
+  priv->base_callback = base_socket->callback;
+  priv->base_data = base_socket->data;
   xice_socket_set_callback(base_socket, read_callback, sock);
   sock->addr = *addr;
   sock->fileno = base_socket->fileno;
@@ -261,35 +403,52 @@ socket_close (XiceSocket *sock)
   TurnPriv *priv = (TurnPriv *) sock->priv;
   GList *i = NULL;
 
-  for (i = priv->channels; i; i = i->next) {
-    ChannelBinding *b = i->data;
-	if (b->timeout_source) {
-		xice_timer_destroy(b->timeout_source);
-		b->timeout_source = NULL;
-	}
-    g_free (b);
+  if (priv->allocation_refresh) {
+    TURNMessage *msg = priv_build_allocation_refresh (priv, 0);
+
+    if (msg != NULL) {
+      StunTransactionId id;
+      size_t len = stun_message_length (&msg->message);
+
+      /* released without waiting for the answer, so the Refresh is sent
+         twice rather than retransmitted */
+      stun_message_id (&msg->message, id);
+      stun_agent_forget_transaction (&priv->agent, id);
+      xice_socket_send (priv->base_socket, &priv->server_addr, len,
+          (gchar *) msg->buffer);
+      if (!xice_socket_is_reliable (priv->base_socket))
+        xice_socket_send (priv->base_socket, &priv->server_addr, len,
+            (gchar *) msg->buffer);
+      g_free (msg);
+    }
   }
+  g_free (priv->allocation_msg);
+
+  g_list_foreach (priv->channels, (GFunc) g_free, NULL);
   g_list_free (priv->channels);
+  g_hash_table_destroy (priv->channels_by_peer);
+  g_ptr_array_free (priv->channels_by_number, TRUE);
 
   g_list_foreach (priv->pending_bindings, (GFunc) xice_address_free,
       NULL);
   g_list_free (priv->pending_bindings);
 
-  if (priv->tick_source_channel_bind != NULL) {
-    xice_timer_destroy (priv->tick_source_channel_bind);;
-    priv->tick_source_channel_bind = NULL;
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    if (!req->refresh)
+      g_free (req->binding);
+    g_free (req->msg);
+    g_slice_free (ChannelBindRequest, req);
   }
+  g_list_free (priv->channel_bind_requests);
 
-  if (priv->tick_source_create_permission != NULL) {
-    xice_timer_destroy (priv->tick_source_create_permission);
-    priv->tick_source_create_permission = NULL;
+  if (priv->tick_source != NULL) {
+    xice_timer_destroy (priv->tick_source);
+    priv->tick_source = NULL;
   }
 
-
   for (i = g_queue_peek_head_link (priv->send_requests); i; i = i->next) {
     SendRequest *r = i->data;
-	xice_timer_destroy(r->source);
-	r->source = NULL;
 
     stun_agent_forget_transaction (&priv->agent, r->id);
 
@@ -298,20 +457,22 @@ socket_close (XiceSocket *sock)
   }
   g_queue_free (priv->send_requests);
 
-  priv_clear_permissions (priv);
-  g_list_foreach (priv->sent_permissions, (GFunc) xice_address_free, NULL);
-  g_list_free (priv->sent_permissions);
+  g_hash_table_destroy (priv->permissions);
+  g_hash_table_destroy (priv->sent_permissions);
   g_hash_table_destroy (priv->send_data_queues);
 
-  if (priv->permission_timeout_source) {
-	  xice_timer_destroy(priv->permission_timeout_source);
-	  priv->permission_timeout_source = NULL;
-  }
-
   g_free (priv->current_binding);
   g_free (priv->current_binding_msg);
-  g_list_foreach (priv->pending_permissions, (GFunc) g_free, NULL);
+  for (i = priv->pending_permissions; i; i = i->next) {
+    PermissionRequest *req = i->data;
+    g_free (req->msg);
+    g_slice_free (PermissionRequest, req);
+  }
   g_list_free(priv->pending_permissions);
+  g_list_foreach (priv->permission_peers, (GFunc) xice_address_free, NULL);
+  g_list_free (priv->permission_peers);
+  g_free (priv->realm);
+  g_free (priv->nonce);
   g_free (priv->username);
   g_free (priv->password);
   g_free (priv);
@@ -336,25 +497,17 @@ static gboolean read_callback(
 		return sock->callback(sock, condition, sock->data, buf, len, from);
 	if (recv_len == 0)
 		return TRUE;
-
+	if (priv->base_callback != NULL &&
+		!xice_address_equal(&priv->server_addr, from))
+		return priv->base_callback(socket, condition, priv->base_data, buf,
+			len, from);
+
+	/* parse_recv tells the server apart by the source, and overwrites @from
+	 * with the peer of relayed data */
+	recv_from = *from;
 	return xice_turn_socket_parse_recv(sock, &dummy, from, len, buf, &recv_from, recv_buf, recv_len) < 0;
 }
 
-static XiceTimer*
-priv_timeout_add_with_context(TurnPriv *priv, guint interval,
-	XiceTimerFunc function, gpointer data)
-{
-	XiceTimer* timer;
-
-	g_return_val_if_fail(function != NULL, NULL);
-
-	timer = xice_create_timer(priv->ctx, interval, function, data);
-
-	xice_timer_start(timer);
-
-	return timer;
-}
-
 static StunMessageReturn
 stun_message_append_ms_connection_id(StunMessage *msg,
     uint8_t *ms_connection_id, uint32_t ms_sequence_num)
@@ -382,120 +535,188 @@ stun_message_ensure_ms_realm(StunMessage *msg, uint8_t *realm)
   }
 }
 
-static gboolean
-priv_is_peer_in_list (const GList *list, const XiceAddress *peer)
-{
-  const GList *iter;
-
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    XiceAddress *address = (XiceAddress *) iter->data;
-
-    if (xice_address_equal (address, peer))
-      return TRUE;
-  }
-
-  return FALSE;
-}
-
 static gboolean
 priv_has_permission_for_peer (TurnPriv *priv, const XiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->permissions, peer);
+  return g_hash_table_lookup (priv->permissions, peer) != NULL;
 }
 
 static gboolean
 priv_has_sent_permission_for_peer (TurnPriv *priv, const XiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->sent_permissions, peer);
+  return g_hash_table_lookup (priv->sent_permissions, peer) != NULL;
 }
 
 static void
 priv_add_permission_for_peer (TurnPriv *priv, const XiceAddress *peer)
 {
-  priv->permissions =
-      g_list_append (priv->permissions, xice_address_dup (peer));
+  XiceAddress *address = xice_address_dup (peer);
+
+  g_hash_table_replace (priv->permissions, address, address);
 }
 
 static void
 priv_add_sent_permission_for_peer (TurnPriv *priv, const XiceAddress *peer)
 {
-  priv->sent_permissions =
-      g_list_append (priv->sent_permissions, xice_address_dup (peer));
+  XiceAddress *address = xice_address_dup (peer);
+
+  g_hash_table_replace (priv->sent_permissions, address, address);
 }
 
-static GList *
-priv_remove_peer_from_list (GList *list, const XiceAddress *peer)
+static void
+priv_remove_sent_permission_for_peer (TurnPriv *priv, const XiceAddress *peer)
 {
-  GList *iter;
+  g_hash_table_remove (priv->sent_permissions, peer);
+}
 
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    XiceAddress *address = (XiceAddress *) iter->data;
+static void
+priv_clear_permissions (TurnPriv *priv)
+{
+  g_hash_table_remove_all (priv->permissions);
+}
 
-    if (xice_address_equal (address, peer)) {
-      xice_address_free (address);
-      list = g_list_delete_link (list, iter);
-    }
-  }
+static ChannelBinding *
+priv_find_binding_by_peer (TurnPriv *priv, const XiceAddress *peer)
+{
+  return g_hash_table_lookup (priv->channels_by_peer, peer);
+}
+
+static ChannelBinding *
+priv_find_binding_by_number (TurnPriv *priv, uint16_t channel)
+{
+  guint index = channel - TURN_CHANNEL_MIN;
+
+  if (channel < TURN_CHANNEL_MIN || index >= priv->channels_by_number->len)
+    return NULL;
 
-  return list;
+  return g_ptr_array_index (priv->channels_by_number, index);
 }
 
+/* Makes the channel number of @b look up @b, which also keeps the number
+ * from being handed out again while @b is being bound */
 static void
-priv_remove_sent_permission_for_peer (TurnPriv *priv, const XiceAddress *peer)
+priv_set_binding_number (TurnPriv *priv, ChannelBinding *b)
 {
-  priv->sent_permissions =
-      priv_remove_peer_from_list (priv->sent_permissions, peer);
+  if (b->channel >= TURN_CHANNEL_MIN) {
+    guint index = b->channel - TURN_CHANNEL_MIN;
+
+    if (index >= priv->channels_by_number->len)
+      g_ptr_array_set_size (priv->channels_by_number, index + 1);
+    g_ptr_array_index (priv->channels_by_number, index) = b;
+  }
 }
 
+/* Adds an established binding to the list and to the lookup tables */
 static void
-priv_clear_permissions (TurnPriv *priv)
+priv_add_binding (TurnPriv *priv, ChannelBinding *b)
 {
-  g_list_foreach (priv->permissions, (GFunc) xice_address_free, NULL);
-  g_list_free (priv->permissions);
-  priv->permissions = NULL;
+  priv->channels = g_list_append (priv->channels, b);
+  /* like the list walk it replaces, the oldest binding to a peer wins */
+  if (priv_find_binding_by_peer (priv, &b->peer) == NULL)
+    g_hash_table_insert (priv->channels_by_peer, &b->peer, b);
+
+  priv_set_binding_number (priv, b);
 }
 
 static void
+priv_remove_binding (TurnPriv *priv, ChannelBinding *b)
+{
+  priv->channels = g_list_remove (priv->channels, b);
+  if (priv_find_binding_by_peer (priv, &b->peer) == b) {
+    GList *i;
+
+    g_hash_table_remove (priv->channels_by_peer, &b->peer);
+    for (i = priv->channels; i; i = i->next) {
+      ChannelBinding *other = i->data;
+      if (xice_address_equal (&other->peer, &b->peer)) {
+        g_hash_table_insert (priv->channels_by_peer, &other->peer, other);
+        break;
+      }
+    }
+  }
+  if (priv_find_binding_by_number (priv, b->channel) == b)
+    g_ptr_array_index (priv->channels_by_number,
+        b->channel - TURN_CHANNEL_MIN) = NULL;
+}
+
+/* Queues a packet for a peer waiting for its permission, FALSE if it
+ * is dropped because the queue is full */
+static gboolean
 socket_enqueue_data(TurnPriv *priv, const XiceAddress *to,
     guint len, const gchar *buf)
 {
-  SendData *data = g_slice_new0 (SendData);
-  GQueue *queue = g_hash_table_lookup (priv->send_data_queues, to);
+  SendData *data;
+  SendDataQueue *queue = g_hash_table_lookup (priv->send_data_queues, to);
 
   if (queue == NULL) {
-    queue = g_queue_new ();
+    queue = g_slice_new0 (SendDataQueue);
+    g_queue_init (&queue->packets);
     g_hash_table_insert (priv->send_data_queues, xice_address_dup (to),
         queue);
   }
 
-  data->data = g_memdup(buf, len);
+  while (queue->bytes + len > priv->queue_size) {
+    /* either way, tell the sender when the queue has drained */
+    queue->blocked = TRUE;
+    if (priv->drop_policy == XICE_TURN_SOCKET_DROP_NEWEST ||
+        g_queue_is_empty (&queue->packets)) {
+      xice_debug ("TURN queue full, dropping data");
+      priv->packets_dropped++;
+      return FALSE;
+    }
+
+    data = g_queue_pop_head (&queue->packets);
+    queue->bytes -= data->data_len;
+    priv->bytes_pending -= data->data_len;
+    priv->packets_dropped++;
+    priv_send_data_free (data);
+  }
+
+  data = g_slice_new0 (SendData);
+  data->data = pool_alloc (len);
+  memcpy (data->data, buf, len);
   data->data_len = len;
-  g_queue_push_tail (queue, data);
+  g_queue_push_tail (&queue->packets, data);
+  queue->bytes += len;
+  priv->bytes_pending += len;
+  priv->packets_queued++;
+
+  return TRUE;
 }
 
 static void
 socket_dequeue_all_data (TurnPriv *priv, const XiceAddress *to)
 {
-  GQueue *send_queue = g_hash_table_lookup (priv->send_data_queues, to);
+  SendDataQueue *send_queue = g_hash_table_lookup (priv->send_data_queues, to);
+  gboolean blocked;
+  XiceAddress peer;
 
   if (send_queue) {
-    while (!g_queue_is_empty (send_queue)) {
+    while (!g_queue_is_empty (&send_queue->packets)) {
       SendData *data =
-          (SendData *) g_queue_pop_head(send_queue);
+          (SendData *) g_queue_pop_head(&send_queue->packets);
 
       xice_debug ("dequeuing data");
-      xice_socket_send (priv->base_socket, to, data->data_len, data->data);
+      xice_socket_send (priv->base_socket, &priv->server_addr,
+          data->data_len, data->data);
 
-      g_free (data->data);
-      g_slice_free (SendData, data);
+      priv->bytes_pending -= data->data_len;
+      priv_send_data_free (data);
     }
 
+    blocked = send_queue->blocked;
+    peer = *to;
+
     /* remove queue from table */
     g_hash_table_remove (priv->send_data_queues, to);
+
+    /* the sender may go on now */
+    if (blocked && priv->sock->callback)
+      priv->sock->callback (priv->sock, XICE_SOCKET_WRITABLE,
+          priv->sock->data, NULL, 0, &peer);
   }
 }
 
-
 static gboolean
 socket_send (XiceSocket *sock, const XiceAddress *to,
     guint len, const gchar *buf)
@@ -505,16 +726,7 @@ socket_send (XiceSocket *sock, const XiceAddress *to,
   uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
   size_t msg_len;
   struct sockaddr_storage sa;
-  GList *i = priv->channels;
-  ChannelBinding *binding = NULL;
-
-  for (; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (xice_address_equal (&b->peer, to)) {
-      binding = b;
-      break;
-    }
-  }
+  ChannelBinding *binding = priv_find_binding_by_peer (priv, to);
 
   xice_address_copy_to_sockaddr (to, (struct sockaddr *)&sa);
 
@@ -589,11 +801,11 @@ socket_send (XiceSocket *sock, const XiceAddress *to,
     if (msg_len > 0 && stun_message_get_class (&msg) == STUN_REQUEST) {
       SendRequest *req = g_slice_new0 (SendRequest);
 
-      req->priv = priv;
       stun_message_id (&msg, req->id);
-      req->source = priv_timeout_add_with_context (priv,
-          STUN_END_TIMEOUT, priv_forget_send_request, req);
+      req->forget_at = xice_context_get_time (priv->ctx) +
+          STUN_END_TIMEOUT * 1000;
       g_queue_push_tail (priv->send_requests, req);
+      priv_add_deadline (priv, req->forget_at);
     }
   }
 
@@ -601,13 +813,12 @@ socket_send (XiceSocket *sock, const XiceAddress *to,
     if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
         !priv_has_permission_for_peer (priv, to)) {
       if (!priv_has_sent_permission_for_peer (priv, to)) {
-        priv_send_create_permission (priv, NULL, to);
+        priv_queue_create_permission (priv, to);
       }
 
       /* enque data */
       xice_debug ("enqueuing data");
-      socket_enqueue_data(priv, to, msg_len, (gchar *)buffer);
-      return TRUE;
+      return socket_enqueue_data(priv, to, msg_len, (gchar *)buffer);
     } else {
       return xice_socket_send (priv->base_socket, &priv->server_addr,
           msg_len, (gchar *)buffer);
@@ -624,127 +835,17 @@ socket_is_reliable (XiceSocket *sock)
   return xice_socket_is_reliable (priv->base_socket);
 }
 
-static gboolean
-priv_forget_send_request (XiceTimer* timer, gpointer pointer)
-{
-  SendRequest *req = pointer;
-
-  agent_lock ();
-
-  stun_agent_forget_transaction (&req->priv->agent, req->id);
-
-  g_queue_remove (req->priv->send_requests, req);
-
-  xice_timer_destroy(req->source);
-
-  req->source = NULL;
-
-  agent_unlock ();
-
-  g_slice_free (SendRequest, req);
-
-  return FALSE;
-}
-
-static gboolean
-priv_permission_timeout (XiceTimer* timer, gpointer data)
-{
-  TurnPriv *priv = (TurnPriv *) data;
-
-  xice_debug ("Permission is about to timeout, schedule renewal");
-
-  agent_lock ();
-  /* remove all permissions for this agent (the permission for the peer
-     we are sending to will be renewed) */
-  priv_clear_permissions (priv);
-  agent_unlock ();
-
-  return TRUE;
-}
-
-static gboolean
-priv_binding_expired_timeout (XiceTimer* timer, gpointer data)
-{
-  TurnPriv *priv = (TurnPriv *) data;
-  GList *i;
-  //GSource *source = NULL;
-
-  xice_debug ("Permission expired, refresh failed");
-
-  agent_lock ();
-
-  /* find current binding and destroy it */
-  for (i = priv->channels ; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (b->timeout_source == timer) {
-      priv->channels = g_list_remove (priv->channels, b);
-      /* Make sure we don't free a currently being-refreshed binding */
-      if (priv->current_binding_msg && !priv->current_binding) {
-        struct sockaddr_storage sa;
-        socklen_t sa_len = sizeof(sa);
-        XiceAddress to;
-
-        /* look up binding associated with peer */
-        stun_message_find_xor_addr (
-            &priv->current_binding_msg->message,
-            STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &sa,
-            &sa_len);
-        xice_address_set_from_sockaddr (&to, (struct sockaddr *) &sa);
-
-        /* If the binding is being refreshed, then move it to
-           priv->current_binding so it counts as a 'new' binding and
-           will get readded to the list if it succeeds */
-        if (xice_address_equal (&b->peer, &to)) {
-          priv->current_binding = b;
-          break;
-        }
-      }
-      /* In case the binding timed out before it could be processed, add it to
-         the pending list */
-      priv_add_channel_binding (priv, &b->peer);
-      g_free (b);
-      break;
-    }
-  }
-
-  agent_unlock ();
-
-  return FALSE;
-}
-
-static gboolean
-priv_binding_timeout (XiceTimer* timer, gpointer data)
+static ChannelBindRequest *
+priv_find_channel_bind_request (TurnPriv *priv, const XiceAddress *peer)
 {
-  TurnPriv *priv = (TurnPriv *) data;
   GList *i;
 
-  xice_debug ("Permission is about to timeout, sending binding renewal");
-
-  agent_lock ();
-
-  /* find current binding and mark it for renewal */
-  for (i = priv->channels ; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (b->timeout_source == timer) {
-      b->renew = TRUE;
-      /* Install timer to expire the permission */
-	  if (b->timeout_source) {
-		  xice_timer_destroy(b->timeout_source);
-		  b->timeout_source = NULL;
-	  }
-
-	  b->timeout_source = priv_timeout_add_with_context(priv, STUN_EXPIRE_TIMEOUT, 
-		  priv_binding_expired_timeout, priv);
-	  /* Send renewal */
-      if (!priv->current_binding_msg)
-        priv_send_channel_bind (priv, NULL, b->channel, &b->peer);
-      break;
-    }
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    if (xice_address_equal (&req->binding->peer, peer))
+      return req;
   }
-
-  agent_unlock ();
-
-  return FALSE;
+  return NULL;
 }
 
 gint
@@ -758,7 +859,6 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
   StunMessage msg;
   struct sockaddr_storage sa;
   socklen_t from_len = sizeof (sa);
-  GList *i = priv->channels;
   ChannelBinding *binding = NULL;
 
   if (xice_address_equal (&priv->server_addr, recv_from)) {
@@ -776,6 +876,12 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
           goto recv;
       }
 
+      if (priv->allocation_msg != NULL &&
+          priv_is_response_to (priv->allocation_msg, &msg)) {
+        priv_allocation_refresh_done (priv, &msg);
+        return 0;
+      }
+
       if (stun_message_get_method (&msg) == STUN_SEND) {
         if (stun_message_get_class (&msg) == STUN_RESPONSE) {
           SendRequest *req = NULL;
@@ -793,9 +899,6 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
           }
 
           if (req) {
-			xice_timer_destroy(req->source);
-            req->source = NULL;
-
             g_queue_remove (priv->send_requests, req);
 
             g_slice_free (SendRequest, req);
@@ -834,198 +937,61 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
 
         return 0;
       } else if (stun_message_get_method (&msg) == STUN_CHANNELBIND) {
-        StunTransactionId request_id;
-        StunTransactionId response_id;
-
-        if (priv->current_binding_msg) {
-          stun_message_id (&msg, response_id);
-          stun_message_id (&priv->current_binding_msg->message, request_id);
-          if (memcmp (request_id, response_id,
-                  sizeof(StunTransactionId)) == 0) {
+        GList *i;
 
-            if (priv->current_binding) {
-              /* New channel binding */
-              binding = priv->current_binding;
-            } else {
-              /* Existing binding refresh */
-              GList *i;
-              struct sockaddr_storage sa;
-              socklen_t sa_len = sizeof(sa);
-              XiceAddress to;
-
-              /* look up binding associated with peer */
-              stun_message_find_xor_addr (
-                  &priv->current_binding_msg->message,
-                  STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &sa,
-                  &sa_len);
-              xice_address_set_from_sockaddr (&to, (struct sockaddr *) &sa);
-
-              for (i = priv->channels; i; i = i->next) {
-                ChannelBinding *b = i->data;
-                if (xice_address_equal (&b->peer, &to)) {
-                  binding = b;
-                  break;
-                }
-              }
-            }
+        for (i = priv->channel_bind_requests; i; i = i->next) {
+          ChannelBindRequest *req = i->data;
 
-            if (stun_message_get_class (&msg) == STUN_ERROR) {
-              int code = -1;
-              uint8_t *sent_realm = NULL;
-              uint8_t *recv_realm = NULL;
-              uint16_t sent_realm_len = 0;
-              uint16_t recv_realm_len = 0;
-
-              sent_realm =
-                  (uint8_t *) stun_message_find (
-                      &priv->current_binding_msg->message,
-                      STUN_ATTRIBUTE_REALM, &sent_realm_len);
-              recv_realm =
-                  (uint8_t *) stun_message_find (&msg,
-                      STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-              /* check for unauthorized error response */
-              if (stun_message_find_error (&msg, &code) ==
-                  STUN_MESSAGE_RETURN_SUCCESS &&
-                  (code == 438 || (code == 401 &&
-                      !(recv_realm != NULL &&
-                          recv_realm_len > 0 &&
-                          recv_realm_len == sent_realm_len &&
-                          sent_realm != NULL &&
-                          memcmp (sent_realm, recv_realm,
-                              sent_realm_len) == 0)))) {
-
-                g_free (priv->current_binding_msg);
-                priv->current_binding_msg = NULL;
-                if (binding)
-                  priv_send_channel_bind (priv, &msg, binding->channel,
-                      &binding->peer);
-              } else {
-                g_free (priv->current_binding);
-                priv->current_binding = NULL;
-                g_free (priv->current_binding_msg);
-                priv->current_binding_msg = NULL;
-                priv_process_pending_bindings (priv);
-              }
-            } else if (stun_message_get_class (&msg) == STUN_RESPONSE) {
-              g_free (priv->current_binding_msg);
-              priv->current_binding_msg = NULL;
-
-              /* If it's a new channel binding, then add it to the list */
-              if (priv->current_binding)
-                priv->channels = g_list_append (priv->channels,
-                    priv->current_binding);
-              priv->current_binding = NULL;
+          if (!priv_is_response_to (req->msg, &msg))
+            continue;
 
-              if (binding) {
-                binding->renew = FALSE;
-
-                /* Remove any existing timer */
-				if (binding->timeout_source) {
-					xice_timer_destroy(binding->timeout_source);
-					binding->timeout_source = NULL;
-				}
-                /* Install timer to schedule refresh of the permission */
-				binding->timeout_source =
-					priv_timeout_add_with_context(priv, STUN_BINDING_TIMEOUT,
-						priv_binding_timeout, priv);
-
-			  }
-              priv_process_pending_bindings (priv);
-            }
+          if (stun_message_get_class (&msg) == STUN_ERROR) {
+            /* unathorized => resend with realm and nonce */
+            if (priv_handle_challenge (priv, req->msg, &msg) &&
+                priv_send_channel_bind (priv, req))
+              break;
+            priv_channel_bind_done (priv, req, FALSE);
+          } else if (stun_message_get_class (&msg) == STUN_RESPONSE) {
+            priv_channel_bind_done (priv, req, TRUE);
           }
+          priv_process_pending_bindings (priv);
+          break;
         }
         return 0;
       } else if (stun_message_get_method (&msg) == STUN_CREATEPERMISSION) {
-        StunTransactionId request_id;
-        StunTransactionId response_id;
-        GList *i, *next;
-        TURNMessage *current_create_permission_msg;
-
-        for (i = priv->pending_permissions; i; i = next) {
-          current_create_permission_msg = (TURNMessage *) i->data;
-          next = i->next;
-
-          stun_message_id (&msg, response_id);
-          stun_message_id (&current_create_permission_msg->message, request_id);
-
-          if (memcmp (request_id, response_id,
-                  sizeof(StunTransactionId)) == 0) {
-            struct sockaddr_storage peer;
-            socklen_t peer_len = sizeof(peer);
-            XiceAddress to;
-
-            xice_debug ("got response for CreatePermission");
-            stun_message_find_xor_addr (
-                &current_create_permission_msg->message,
-                STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &peer,
-                &peer_len);
-            xice_address_set_from_sockaddr (&to, (struct sockaddr *) &peer);
-
-            /* unathorized => resend with realm and nonce */
-            if (stun_message_get_class (&msg) == STUN_ERROR) {
-              int code = -1;
-              uint8_t *sent_realm = NULL;
-              uint8_t *recv_realm = NULL;
-              uint16_t sent_realm_len = 0;
-              uint16_t recv_realm_len = 0;
-
-              sent_realm =
-                  (uint8_t *) stun_message_find (
-                      &current_create_permission_msg->message,
-                      STUN_ATTRIBUTE_REALM, &sent_realm_len);
-              recv_realm =
-                  (uint8_t *) stun_message_find (&msg,
-                      STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-              /* check for unauthorized error response */
-              if (stun_message_find_error (&msg, &code) ==
-                  STUN_MESSAGE_RETURN_SUCCESS &&
-                  (code == 438 || (code == 401 &&
-                      !(recv_realm != NULL &&
-                          recv_realm_len > 0 &&
-                          recv_realm_len == sent_realm_len &&
-                          sent_realm != NULL &&
-                          memcmp (sent_realm, recv_realm,
-                              sent_realm_len) == 0)))) {
-
-                priv->pending_permissions = g_list_delete_link (
-                    priv->pending_permissions, i);
-                g_free (current_create_permission_msg);
-                current_create_permission_msg = NULL;
-                /* resend CreatePermission */
-                priv_send_create_permission (priv, &msg, &to);
-                return 0;
-              }
-            }
-            /* If we get an error, we just assume the server somehow
-               doesn't support permissions and we ignore the error and
-               fake a successful completion. If the server needs a permission
-               but it failed to create it, then the connchecks will fail. */
-            priv_remove_sent_permission_for_peer (priv, &to);
-            priv_add_permission_for_peer (priv, &to);
-
-            /* install timer to schedule refresh of the permission */
-            /* (will not schedule refresh if we got an error) */
-            if (stun_message_get_class (&msg) == STUN_RESPONSE &&
-                !priv->permission_timeout_source) {
-
-				priv->permission_timeout_source =
-					priv_timeout_add_with_context(priv, STUN_PERMISSION_TIMEOUT,
-						priv_permission_timeout, priv);
+        GList *i;
 
-			}
+        for (i = priv->pending_permissions; i; i = i->next) {
+          PermissionRequest *req = i->data;
 
-            /* send enqued data */
-            socket_dequeue_all_data (priv, &to);
-
-            priv->pending_permissions = g_list_delete_link (
-                priv->pending_permissions, i);
-            g_free (current_create_permission_msg);
-            current_create_permission_msg = NULL;
+          if (!priv_is_response_to (req->msg, &msg))
+            continue;
 
+          xice_debug ("got response for CreatePermission");
+          /* unathorized => resend with realm and nonce */
+          if (stun_message_get_class (&msg) == STUN_ERROR &&
+              priv_handle_challenge (priv, req->msg, &msg) &&
+              priv_send_create_permission (priv, req))
             break;
+
+          /* schedule the refresh of the permission */
+          /* (will not schedule refresh if we got an error) */
+          if (stun_message_get_class (&msg) == STUN_RESPONSE &&
+              priv->permission_refresh_at == 0) {
+            priv->permission_refresh_at = xice_context_get_time (priv->ctx) +
+                STUN_PERMISSION_TIMEOUT * G_USEC_PER_SEC;
+            priv_add_deadline (priv, priv->permission_refresh_at);
           }
+
+          /* If we get an error, we just assume the server somehow
+             doesn't support permissions and we ignore the error and
+             fake a successful completion. If the server needs a permission
+             but it failed to create it, then the connchecks will fail. */
+          priv->pending_permissions = g_list_delete_link (
+              priv->pending_permissions, i);
+          priv_grant_permissions (priv, req);
+          priv_flush_permissions (priv);
+          break;
         }
 
         return 0;
@@ -1069,20 +1035,18 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
   }
 
  recv:
-  for (i = priv->channels; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      if (b->channel == ntohs(((uint16_t *)recv_buf)[0])) {
+  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
+    if (recv_len >= sizeof(uint32_t)) {
+      binding = priv_find_binding_by_number (priv,
+          ntohs (((uint16_t *)recv_buf)[0]));
+      if (binding) {
         recv_len = ntohs (((uint16_t *)recv_buf)[1]);
         recv_buf += sizeof(uint32_t);
-        binding = b;
-        break;
       }
-    } else {
-      binding = b;
-      break;
     }
+  } else if (priv->channels) {
+    binding = priv->channels->data;
   }
 
   if (binding) {
@@ -1101,13 +1065,12 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
  msn_google_lock:
 
   if (priv->current_binding) {
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
+    while (priv->channels) {
+      ChannelBinding *b = priv->channels->data;
+      priv_remove_binding (priv, b);
       g_free (b);
     }
-    g_list_free (priv->channels);
-    priv->channels = g_list_append (NULL, priv->current_binding);
+    priv_add_binding (priv, priv->current_binding);
     priv->current_binding = NULL;
     priv_process_pending_bindings (priv);
   }
@@ -1123,316 +1086,697 @@ xice_turn_socket_set_peer (XiceSocket *sock, XiceAddress *peer)
   return priv_add_channel_binding (priv, peer);
 }
 
+/* Bytes the relay adds to a packet sent to @peer: the ChannelData header
+ * once a channel is bound or being bound to the peer, the indication or
+ * request wrapping the data otherwise */
+guint
+xice_turn_socket_get_overhead (XiceSocket *sock, const XiceAddress *peer)
+{
+  TurnPriv *priv = (TurnPriv *) sock->priv;
+  gboolean ipv6 = xice_address_ip_version (peer) == 6;
+  GList *i;
+
+  if (priv->compatibility != XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 &&
+      priv->compatibility != XICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
+    return 64;
+
+  if (priv_find_binding_by_peer (priv, peer) ||
+      priv_find_channel_bind_request (priv, peer))
+    return 4;
+  for (i = priv->pending_bindings; i; i = i->next) {
+    if (xice_address_equal (i->data, peer))
+      return 4;
+  }
+
+  /* STUN header, XOR-PEER-ADDRESS and DATA of a Send indication */
+  return 20 + (ipv6 ? 24 : 12) + 4;
+}
+
+/* Whether another binding may be requested now, rather than queued */
+static gboolean
+priv_can_start_binding (TurnPriv *priv)
+{
+  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
+    return g_list_length (priv->channel_bind_requests) <
+        TURN_MAX_CHANNEL_BIND_REQUESTS;
+
+  return priv->current_binding == NULL;
+}
+
 static void
 priv_process_pending_bindings (TurnPriv *priv)
 {
-  gboolean ret = FALSE;
+  GList *i;
 
-  while (priv->pending_bindings != NULL && ret == FALSE) {
+  while (priv->pending_bindings != NULL && priv_can_start_binding (priv)) {
     XiceAddress *peer = priv->pending_bindings->data;
-    ret = priv_add_channel_binding (priv, peer);
     priv->pending_bindings = g_list_remove (priv->pending_bindings, peer);
+    priv_add_channel_binding (priv, peer);
     xice_address_free (peer);
   }
 
-  /* If no new channel bindings are in progress and there are no
-     pending bindings, then renew the soon to be expired bindings */
-  if (priv->pending_bindings == NULL && priv->current_binding_msg == NULL) {
-    GList *i = NULL;
+  /* If there are no pending bindings, then renew the soon to be expired
+     bindings, as many at once as new bindings would be */
+  if (priv->pending_bindings != NULL)
+    return;
 
-    /* find binding to renew */
-    for (i = priv->channels ; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      if (b->renew) {
-        priv_send_channel_bind (priv, NULL, b->channel, &b->peer);
-        break;
+  for (i = priv->channels; i && priv_can_start_binding (priv); i = i->next) {
+    ChannelBinding *b = i->data;
+
+    if (b->renew && priv_find_channel_bind_request (priv, &b->peer) == NULL) {
+      ChannelBindRequest *req = g_slice_new0 (ChannelBindRequest);
+
+      req->binding = b;
+      req->refresh = TRUE;
+      if (priv_send_channel_bind (priv, req)) {
+        priv->channel_bind_requests =
+            g_list_append (priv->channel_bind_requests, req);
+      } else {
+        g_slice_free (ChannelBindRequest, req);
+        b->renew = FALSE;
       }
     }
   }
 }
 
-
-static gboolean
-priv_retransmissions_tick_unlocked (TurnPriv *priv)
+/* Ends a ChannelBind transaction; the caller processes the pending
+ * bindings afterwards */
+static void
+priv_channel_bind_done (TurnPriv *priv, ChannelBindRequest *req,
+    gboolean success)
 {
-  gboolean ret = FALSE;
+  ChannelBinding *b = req->binding;
 
-  if (priv->current_binding_msg) {
-    switch (stun_timer_refresh (&priv->current_binding_msg->timer)) {
-      case STUN_USAGE_TIMER_RETURN_TIMEOUT:
-        {
-          /* Time out */
-          StunTransactionId id;
+  priv->channel_bind_requests =
+      g_list_remove (priv->channel_bind_requests, req);
+  g_free (req->msg);
 
-          stun_message_id (&priv->current_binding_msg->message, id);
-          stun_agent_forget_transaction (&priv->agent, id);
+  if (success) {
+    /* If it's a new channel binding, then add it to the list */
+    if (!req->refresh)
+      priv_add_binding (priv, b);
+    b->renew = FALSE;
 
-          g_free (priv->current_binding);
-          priv->current_binding = NULL;
-          g_free (priv->current_binding_msg);
-          priv->current_binding_msg = NULL;
+    /* Schedule the refresh of the binding */
+    b->refresh_at = xice_context_get_time (priv->ctx) +
+        STUN_BINDING_TIMEOUT * G_USEC_PER_SEC;
+    b->expire_at = 0;
+    priv_add_deadline (priv, b->refresh_at);
 
+    /* The binding installs a permission for the peer too */
+    if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
+        !priv_has_permission_for_peer (priv, &b->peer)) {
+      priv_add_permission_for_peer (priv, &b->peer);
+      socket_dequeue_all_data (priv, &b->peer);
+    }
+  } else if (req->refresh) {
+    /* leave it to the expiry deadline */
+    b->renew = FALSE;
+  } else {
+    if (priv_find_binding_by_number (priv, b->channel) == b)
+      g_ptr_array_index (priv->channels_by_number,
+          b->channel - TURN_CHANNEL_MIN) = NULL;
+    g_free (b);
+  }
 
-          priv_process_pending_bindings (priv);
-          break;
-        }
-      case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
-        /* Retransmit */
-        xice_socket_send (priv->base_socket, &priv->server_addr,
+  g_slice_free (ChannelBindRequest, req);
+}
+
+static gboolean
+priv_is_response_to (TURNMessage *req, StunMessage *resp)
+{
+  StunTransactionId request_id;
+  StunTransactionId response_id;
+
+  stun_message_id (&req->message, request_id);
+  stun_message_id (resp, response_id);
+
+  return memcmp (request_id, response_id, sizeof(StunTransactionId)) == 0;
+}
+
+/* Whether an error response to @req is a challenge to answer with the
+ * REALM and NONCE it carries; they are kept for the next requests */
+static gboolean
+priv_handle_challenge (TurnPriv *priv, TURNMessage *req, StunMessage *resp)
+{
+  int code = -1;
+  uint8_t *sent_realm = NULL;
+  uint8_t *recv_realm = NULL;
+  uint8_t *sent_nonce = NULL;
+  uint8_t *nonce = NULL;
+  uint16_t sent_realm_len = 0;
+  uint16_t recv_realm_len = 0;
+  uint16_t sent_nonce_len = 0;
+  uint16_t nonce_len = 0;
+  gboolean same_realm;
+
+  sent_realm = (uint8_t *) stun_message_find (&req->message,
+      STUN_ATTRIBUTE_REALM, &sent_realm_len);
+  recv_realm = (uint8_t *) stun_message_find (resp,
+      STUN_ATTRIBUTE_REALM, &recv_realm_len);
+  sent_nonce = (uint8_t *) stun_message_find (&req->message,
+      STUN_ATTRIBUTE_NONCE, &sent_nonce_len);
+  nonce = (uint8_t *) stun_message_find (resp,
+      STUN_ATTRIBUTE_NONCE, &nonce_len);
+  same_realm = recv_realm != NULL &&
+      recv_realm_len > 0 &&
+      recv_realm_len == sent_realm_len &&
+      sent_realm != NULL &&
+      memcmp (sent_realm, recv_realm, sent_realm_len) == 0;
+
+  /* Some servers refuse a stale NONCE with a 401 for the same realm rather
+     than a 438. A request sent with a cached NONCE is sent once more with
+     the new one before its credentials are taken as wrong. */
+  if (stun_message_find_error (resp, &code) == STUN_MESSAGE_RETURN_SUCCESS &&
+      code == 401 && same_realm && !req->nonce_renewed &&
+      sent_nonce != NULL && nonce != NULL &&
+      !(nonce_len == sent_nonce_len &&
+          memcmp (nonce, sent_nonce, nonce_len) == 0)) {
+    req->nonce_renewed = TRUE;
+  } else if (code == -1 || recv_realm == NULL || recv_realm_len == 0 ||
+      !(code == 438 || (code == 401 && !same_realm))) {
+    /* not a challenge naming the realm to sign the next request for; if
+       the cached credentials were refused, let the next request be
+       challenged again */
+    if (code == 401) {
+      g_free (priv->realm);
+      priv->realm = NULL;
+      g_free (priv->nonce);
+      priv->nonce = NULL;
+    }
+    return FALSE;
+  }
+
+  g_free (priv->realm);
+  priv->realm = recv_realm ? g_memdup (recv_realm, recv_realm_len) : NULL;
+  priv->realm_len = recv_realm ? recv_realm_len : 0;
+  g_free (priv->nonce);
+  priv->nonce = nonce ? g_memdup (nonce, nonce_len) : NULL;
+  priv->nonce_len = nonce ? nonce_len : 0;
+
+  return TRUE;
+}
+
+/* Appends USERNAME and the cached REALM and NONCE to a request */
+static gboolean
+priv_append_credentials (TurnPriv *priv, StunMessage *msg)
+{
+  if (priv->username != NULL && priv->username_len > 0) {
+    if (stun_message_append_bytes (msg, STUN_ATTRIBUTE_USERNAME,
+            priv->username, priv->username_len)
+        != STUN_MESSAGE_RETURN_SUCCESS)
+      return FALSE;
+  }
+
+  if (priv->realm != NULL) {
+    if (stun_message_append_bytes (msg, STUN_ATTRIBUTE_REALM,
+            priv->realm, priv->realm_len)
+        != STUN_MESSAGE_RETURN_SUCCESS)
+      return FALSE;
+  }
+
+  if (priv->nonce != NULL) {
+    if (stun_message_append_bytes (msg, STUN_ATTRIBUTE_NONCE,
+            priv->nonce, priv->nonce_len)
+        != STUN_MESSAGE_RETURN_SUCCESS)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Lowers the deadline the tick is armed for, if need be */
+static void
+priv_add_deadline (TurnPriv *priv, gint64 deadline)
+{
+  if (priv->next_deadline != 0 && priv->next_deadline <= deadline)
+    return;
+
+  priv->next_deadline = deadline;
+  priv_schedule_tick (priv);
+}
+
+/* Expires the bindings that could not be renewed in time, and marks for
+ * renewal those due within TURN_REFRESH_WINDOW, so that the bindings set
+ * up together are renewed together; returns the next deadline, or 0 */
+static gint64
+priv_run_binding_deadlines (TurnPriv *priv, gint64 now)
+{
+  gint64 window = now + TURN_REFRESH_WINDOW * G_USEC_PER_SEC;
+  gint64 next = 0;
+  GList *i, *next_link;
+
+  for (i = priv->channels; i; i = next_link) {
+    ChannelBinding *b = i->data;
+
+    next_link = i->next;
+    if (b->expire_at != 0 && b->expire_at <= now) {
+      ChannelBindRequest *req;
+
+      xice_debug ("Permission expired, refresh failed");
+      b->expire_at = 0;
+      priv_remove_binding (priv, b);
+
+      /* If the binding is being refreshed, it counts as a 'new' binding
+         from now on and will get readded to the list if it succeeds */
+      req = priv_find_channel_bind_request (priv, &b->peer);
+      if (req && req->binding == b) {
+        req->refresh = FALSE;
+        priv_set_binding_number (priv, b);
+        continue;
+      }
+      /* In case the binding timed out before it could be processed, add it to
+         the pending list */
+      priv_add_channel_binding (priv, &b->peer);
+      g_free (b);
+      continue;
+    }
+
+    if (b->refresh_at != 0 && b->refresh_at <= window) {
+      xice_debug ("Permission is about to timeout, sending binding renewal");
+      b->renew = TRUE;
+      b->expire_at = b->refresh_at + STUN_EXPIRE_TIMEOUT * G_USEC_PER_SEC;
+      b->refresh_at = 0;
+    }
+
+    if (b->refresh_at != 0 && (next == 0 || b->refresh_at < next))
+      next = b->refresh_at;
+    if (b->expire_at != 0 && (next == 0 || b->expire_at < next))
+      next = b->expire_at;
+  }
+
+  return next;
+}
+
+/* Handles the deadlines that have passed and returns the next one, or 0 */
+static gint64
+priv_run_deadlines (TurnPriv *priv, gint64 now)
+{
+  gint64 next;
+
+  /* Send requests are queued in the order they expire in */
+  while (!g_queue_is_empty (priv->send_requests)) {
+    SendRequest *req = g_queue_peek_head (priv->send_requests);
+
+    if (req->forget_at > now)
+      break;
+    g_queue_pop_head (priv->send_requests);
+    stun_agent_forget_transaction (&priv->agent, req->id);
+    g_slice_free (SendRequest, req);
+  }
+
+  if (priv->permission_refresh_at != 0 &&
+      priv->permission_refresh_at <= now +
+      TURN_REFRESH_WINDOW * G_USEC_PER_SEC) {
+    xice_debug ("Permission is about to timeout, schedule renewal");
+    /* remove all permissions for this agent (the permission for the peer
+       we are sending to will be renewed, and schedules the next refresh) */
+    priv_clear_permissions (priv);
+    priv->permission_refresh_at = 0;
+  }
+
+  if (priv->allocation_refresh_at != 0 &&
+      priv->allocation_refresh_at <= now +
+      TURN_REFRESH_WINDOW * G_USEC_PER_SEC) {
+    priv->allocation_refresh_at = 0;
+    if (priv->allocation_msg == NULL)
+      priv_send_allocation_refresh (priv);
+  }
+
+  next = priv_run_binding_deadlines (priv, now);
+  /* Send the renewals, unless too many requests are in flight already */
+  priv_process_pending_bindings (priv);
+
+  if (!g_queue_is_empty (priv->send_requests)) {
+    SendRequest *req = g_queue_peek_head (priv->send_requests);
+    if (next == 0 || req->forget_at < next)
+      next = req->forget_at;
+  }
+  if (priv->permission_refresh_at != 0 &&
+      (next == 0 || priv->permission_refresh_at < next))
+    next = priv->permission_refresh_at;
+  if (priv->allocation_refresh_at != 0 &&
+      (next == 0 || priv->allocation_refresh_at < next))
+    next = priv->allocation_refresh_at;
+
+  return next;
+}
+
+static void
+priv_tick_unlocked (TurnPriv *priv)
+{
+  GList *i, *next;
+  gboolean bindings_done = FALSE;
+  gboolean permissions_done = FALSE;
+  gint64 now = xice_context_get_time (priv->ctx);
+
+  if (priv->next_deadline != 0 && priv->next_deadline <= now) {
+    gint64 deadline;
+
+    priv->next_deadline = 0;
+    deadline = priv_run_deadlines (priv, now);
+    if (deadline != 0 &&
+        (priv->next_deadline == 0 || deadline < priv->next_deadline))
+      priv->next_deadline = deadline;
+  }
+
+  if (priv->permission_flush) {
+    priv->permission_flush = FALSE;
+    permissions_done = TRUE;
+  }
+
+  if (priv->current_binding_msg) {
+    switch (stun_timer_refresh (&priv->current_binding_msg->timer)) {
+      case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+        {
+          /* Time out */
+          StunTransactionId id;
+
+          stun_message_id (&priv->current_binding_msg->message, id);
+          stun_agent_forget_transaction (&priv->agent, id);
+
+          g_free (priv->current_binding);
+          priv->current_binding = NULL;
+          g_free (priv->current_binding_msg);
+          priv->current_binding_msg = NULL;
+
+          bindings_done = TRUE;
+          break;
+        }
+      case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+        /* Retransmit */
+        xice_socket_send (priv->base_socket, &priv->server_addr,
             stun_message_length (&priv->current_binding_msg->message),
             (gchar *)priv->current_binding_msg->buffer);
-        ret = TRUE;
         break;
       case STUN_USAGE_TIMER_RETURN_SUCCESS:
-        ret = TRUE;
         break;
     }
   }
 
-  if (ret)
-    priv_schedule_tick (priv);
-  return ret;
-}
+  if (priv->allocation_msg) {
+    switch (stun_timer_refresh (&priv->allocation_msg->timer)) {
+      case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+        {
+          /* Time out, the allocation is left to expire */
+          StunTransactionId id;
 
-static gboolean
-priv_retransmissions_create_permission_tick_unlocked (TurnPriv *priv, GList *list_element)
-{
-  gboolean ret = FALSE;
-  TURNMessage *current_create_permission_msg;
+          xice_debug ("Refresh of the allocation timed out");
+          stun_message_id (&priv->allocation_msg->message, id);
+          stun_agent_forget_transaction (&priv->agent, id);
+          g_free (priv->allocation_msg);
+          priv->allocation_msg = NULL;
+          break;
+        }
+      case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+        /* Retransmit */
+        xice_socket_send (priv->base_socket, &priv->server_addr,
+            stun_message_length (&priv->allocation_msg->message),
+            (gchar *)priv->allocation_msg->buffer);
+        break;
+      case STUN_USAGE_TIMER_RETURN_SUCCESS:
+        break;
+    }
+  }
 
-  current_create_permission_msg = (TURNMessage *)list_element->data;
+  for (i = priv->channel_bind_requests; i; i = next) {
+    ChannelBindRequest *req = i->data;
 
-  if (current_create_permission_msg) {
-    switch (stun_timer_refresh (&current_create_permission_msg->timer)) {
+    next = i->next;
+    switch (stun_timer_refresh (&req->msg->timer)) {
       case STUN_USAGE_TIMER_RETURN_TIMEOUT:
         {
           /* Time out */
           StunTransactionId id;
-          XiceAddress to;
-          struct sockaddr_storage addr;
-          socklen_t addr_len = sizeof(addr);
 
-          stun_message_id (&current_create_permission_msg->message, id);
+          stun_message_id (&req->msg->message, id);
           stun_agent_forget_transaction (&priv->agent, id);
-          stun_message_find_xor_addr (
-              &current_create_permission_msg->message,
-              STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *) &addr,
-              &addr_len);
-          xice_address_set_from_sockaddr (&to, (struct sockaddr *) &addr);
+          priv_channel_bind_done (priv, req, FALSE);
+          bindings_done = TRUE;
+          break;
+        }
+      case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+        /* Retransmit */
+        xice_socket_send (priv->base_socket, &priv->server_addr,
+            stun_message_length (&req->msg->message),
+            (gchar *)req->msg->buffer);
+        break;
+      case STUN_USAGE_TIMER_RETURN_SUCCESS:
+        break;
+    }
+  }
 
-          priv_remove_sent_permission_for_peer (priv, &to);
+  for (i = priv->pending_permissions; i; i = next) {
+    PermissionRequest *req = i->data;
+
+    next = i->next;
+    switch (stun_timer_refresh (&req->msg->timer)) {
+      case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+        {
+          /* Time out */
+          StunTransactionId id;
+
+          stun_message_id (&req->msg->message, id);
+          stun_agent_forget_transaction (&priv->agent, id);
           priv->pending_permissions = g_list_delete_link (
-              priv->pending_permissions, list_element);
-          g_free (current_create_permission_msg);
-          current_create_permission_msg = NULL;
+              priv->pending_permissions, i);
 
           /* we got a timeout when retransmitting a CreatePermission
              message, assume we can just send the data, the server
              might not support RFC TURN, or connectivity check will
              fail eventually anyway */
-          priv_add_permission_for_peer (priv, &to);
-
-          socket_dequeue_all_data (priv, &to);
-
+          priv_grant_permissions (priv, req);
+          permissions_done = TRUE;
           break;
         }
       case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
         /* Retransmit */
         xice_socket_send (priv->base_socket, &priv->server_addr,
-            stun_message_length (&current_create_permission_msg->message),
-            (gchar *)current_create_permission_msg->buffer);
-        ret = TRUE;
+            stun_message_length (&req->msg->message),
+            (gchar *)req->msg->buffer);
         break;
       case STUN_USAGE_TIMER_RETURN_SUCCESS:
-        ret = TRUE;
         break;
     }
   }
 
-  if (ret)
-    priv_schedule_tick (priv);
-  return ret;
+  if (bindings_done)
+    priv_process_pending_bindings (priv);
+  if (permissions_done)
+    priv_flush_permissions (priv);
+
+  priv_schedule_tick (priv);
 }
 
 static gboolean
-priv_retransmissions_tick (XiceTimer* timer, gpointer pointer)
+priv_tick (XiceTimer* timer, gpointer pointer)
 {
   TurnPriv *priv = pointer;
 
   agent_lock ();
-
-  if (priv_retransmissions_tick_unlocked (priv) == FALSE) {
-    if (priv->tick_source_channel_bind != NULL) {
-      xice_timer_destroy (priv->tick_source_channel_bind);
-      priv->tick_source_channel_bind = NULL;
-    }
-  }
+  xice_timer_stop (timer);
+  priv_tick_unlocked (priv);
   agent_unlock ();
 
   return FALSE;
 }
 
-static gboolean
-priv_retransmissions_create_permission_tick (XiceTimer* timer, gpointer pointer)
+/* Arms the one timer of the socket, and so of its allocation, for the
+ * earliest of the retransmissions of the transactions in flight, the
+ * permission flush and the deadlines */
+static void
+priv_schedule_tick (TurnPriv *priv)
 {
-  TurnPriv *priv = pointer;
-  GList *i, *next;
-
-  agent_lock ();
+  GList *i;
+  guint timeout = G_MAXUINT;
 
-  for (i = priv->pending_permissions; i; i = next) {
-    next = i->next;
+  if (priv->permission_flush)
+    timeout = 0;
 
-    if (!priv_retransmissions_create_permission_tick_unlocked (priv, i)) {
-      if (priv->tick_source_create_permission != NULL) {
-        xice_timer_destroy (priv->tick_source_create_permission);
-        priv->tick_source_create_permission = NULL;
-      }
-    }
+  if (priv->next_deadline != 0) {
+    gint64 delay = priv->next_deadline - xice_context_get_time (priv->ctx);
+    timeout = MIN (timeout, delay > 0 ? (guint) ((delay + 999) / 1000) : 0);
   }
-  agent_unlock ();
 
-  return FALSE;
-}
+  if (priv->current_binding_msg)
+    timeout = MIN (timeout,
+        stun_timer_remainder (&priv->current_binding_msg->timer));
 
-static void
-priv_schedule_tick (TurnPriv *priv)
-{
-  GList *i, *next;
-  TURNMessage *current_create_permission_msg;
+  if (priv->allocation_msg)
+    timeout = MIN (timeout,
+        stun_timer_remainder (&priv->allocation_msg->timer));
 
-  if (priv->tick_source_channel_bind != NULL) {
-	xice_timer_destroy(priv->tick_source_channel_bind);
-    priv->tick_source_channel_bind = NULL;
+  for (i = priv->channel_bind_requests; i; i = i->next) {
+    ChannelBindRequest *req = i->data;
+    timeout = MIN (timeout, stun_timer_remainder (&req->msg->timer));
   }
 
-  if (priv->current_binding_msg) {
-    guint timeout = stun_timer_remainder (&priv->current_binding_msg->timer);
-    if (timeout > 0) {
-      priv->tick_source_channel_bind =
-          priv_timeout_add_with_context (priv, timeout,
-              priv_retransmissions_tick, priv);
-    } else {
-      priv_retransmissions_tick_unlocked (priv);
-    }
+  for (i = priv->pending_permissions; i; i = i->next) {
+    PermissionRequest *req = i->data;
+    timeout = MIN (timeout, stun_timer_remainder (&req->msg->timer));
   }
 
-  for (i = priv->pending_permissions; i; i = next) {
-    guint timeout;
-
-    current_create_permission_msg = (TURNMessage *)i->data;
-    next = i->next;
-
-    timeout = stun_timer_remainder (&current_create_permission_msg->timer);
+  if (timeout == G_MAXUINT) {
+    if (priv->tick_source != NULL)
+      xice_timer_stop (priv->tick_source);
+    return;
+  }
 
-    if (timeout > 0) {
-      priv->tick_source_create_permission =
-          priv_timeout_add_with_context (priv,
-              timeout,
-              priv_retransmissions_create_permission_tick,
-              priv);
-    } else {
-      priv_retransmissions_create_permission_tick_unlocked (priv, i);
-    }
+  if (priv->tick_source == NULL) {
+    priv->tick_source = xice_create_timer (priv->ctx, timeout,
+        priv_tick, priv);
+  } else {
+    xice_timer_stop (priv->tick_source);
+    priv->tick_source->interval = timeout;
   }
+  xice_timer_start (priv->tick_source);
 }
 
+/* Sends a new request and starts its retransmission timer */
 static void
-priv_send_turn_message (TurnPriv *priv, TURNMessage *msg)
+priv_start_request (TurnPriv *priv, TURNMessage *msg)
 {
   size_t stun_len = stun_message_length (&msg->message);
 
-  if (priv->current_binding_msg) {
-    g_free (priv->current_binding_msg);
-    priv->current_binding_msg = NULL;
-  }
-
   xice_socket_send (priv->base_socket, &priv->server_addr,
       stun_len, (gchar *)msg->buffer);
 
   if (xice_socket_is_reliable (priv->base_socket)) {
-    stun_timer_start_reliable (&msg->timer,
-        STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT);
+    xice_context_start_stun_timer (priv->ctx, &msg->timer,
+        STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT, 0);
   } else {
-    stun_timer_start (&msg->timer, STUN_TIMER_DEFAULT_TIMEOUT,
-        STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
+    xice_context_start_stun_timer (priv->ctx, &msg->timer,
+        STUN_TIMER_DEFAULT_TIMEOUT, STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
   }
+}
+
+static void
+priv_send_turn_message (TurnPriv *priv, TURNMessage *msg)
+{
+  if (priv->current_binding_msg) {
+    g_free (priv->current_binding_msg);
+    priv->current_binding_msg = NULL;
+  }
+
+  priv_start_request (priv, msg);
 
   priv->current_binding_msg = msg;
   priv_schedule_tick (priv);
 }
 
-static gboolean
-priv_send_create_permission(TurnPriv *priv, StunMessage *resp,
-    const XiceAddress *peer)
+/* Peers needing a permission are collected until the main loop comes
+ * back, on the next tick, so that they share CreatePermission requests */
+static void
+priv_queue_create_permission (TurnPriv *priv, const XiceAddress *peer)
 {
-  guint msg_buf_len;
-  gboolean res = FALSE;
-  TURNMessage *msg = g_new0 (TURNMessage, 1);
-  struct sockaddr_storage addr;
-  uint8_t *realm = NULL;
-  uint16_t realm_len = 0;
-  uint8_t *nonce = NULL;
-  uint16_t nonce_len = 0;
+  priv_add_sent_permission_for_peer (priv, peer);
+  priv->permission_peers = g_list_append (priv->permission_peers,
+      xice_address_dup (peer));
 
-  if (resp) {
-    realm = (uint8_t *) stun_message_find (resp,
-        STUN_ATTRIBUTE_REALM, &realm_len);
-    nonce = (uint8_t *) stun_message_find (resp,
-        STUN_ATTRIBUTE_NONCE, &nonce_len);
+  if (!priv->permission_flush) {
+    priv->permission_flush = TRUE;
+    priv_schedule_tick (priv);
   }
+}
+
+static void
+priv_flush_permissions (TurnPriv *priv)
+{
+  while (priv->permission_peers != NULL &&
+      g_list_length (priv->pending_permissions) <
+      TURN_MAX_PERMISSION_REQUESTS) {
+    PermissionRequest *req = g_slice_new0 (PermissionRequest);
+
+    while (priv->permission_peers != NULL &&
+        req->n_peers < TURN_MAX_PERMISSION_PEERS) {
+      XiceAddress *peer = priv->permission_peers->data;
+
+      req->peers[req->n_peers++] = *peer;
+      priv->permission_peers = g_list_delete_link (priv->permission_peers,
+          priv->permission_peers);
+      xice_address_free (peer);
+    }
 
-  /* register this peer as being pening a permission (if not already pending) */
-  if (!priv_has_sent_permission_for_peer (priv, peer)) {
-    priv_add_sent_permission_for_peer (priv, peer);
+    if (priv_send_create_permission (priv, req))
+      priv->pending_permissions = g_list_append (priv->pending_permissions,
+          req);
+    else
+      priv_grant_permissions (priv, req);
   }
+}
 
-  xice_address_copy_to_sockaddr (peer, (struct sockaddr *) &addr);
+/* Considers the peers of a finished CreatePermission as permitted, sends
+ * the data queued for them and frees the request */
+static void
+priv_grant_permissions (TurnPriv *priv, PermissionRequest *req)
+{
+  guint i;
 
-  /* send CreatePermission */
-  msg_buf_len = stun_usage_turn_create_permission(&priv->agent, &msg->message,
-      msg->buffer,
-      sizeof(msg->buffer),
-      priv->username,
-      priv->username_len,
-      priv->password,
-      priv->password_len,
-      realm, realm_len,
-      nonce, nonce_len,
-      (struct sockaddr *) &addr,
-      STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  for (i = 0; i < req->n_peers; i++) {
+    priv_remove_sent_permission_for_peer (priv, &req->peers[i]);
+    priv_add_permission_for_peer (priv, &req->peers[i]);
 
-  if (msg_buf_len > 0) {
-    res = xice_socket_send (priv->base_socket, &priv->server_addr,
-        msg_buf_len, (gchar *) msg->buffer);
+    /* send enqued data */
+    socket_dequeue_all_data (priv, &req->peers[i]);
+  }
 
-    if (xice_socket_is_reliable (priv->base_socket)) {
-      stun_timer_start_reliable (&msg->timer,
-        STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT);
-    } else {
-      stun_timer_start (&msg->timer, STUN_TIMER_DEFAULT_TIMEOUT,
-        STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
+  g_free (req->msg);
+  g_slice_free (PermissionRequest, req);
+}
+
+static gboolean
+priv_send_create_permission (TurnPriv *priv, PermissionRequest *req)
+{
+  TURNMessage *msg = g_new0 (TURNMessage, 1);
+  guint i;
+
+  if (!stun_agent_init_request (&priv->agent, &msg->message,
+          msg->buffer, sizeof(msg->buffer),
+          STUN_CREATEPERMISSION)) {
+    g_free (msg);
+    return FALSE;
+  }
+
+  /* one permission request for all the peers */
+  for (i = 0; i < req->n_peers; i++) {
+    struct sockaddr_storage sa;
+
+    xice_address_copy_to_sockaddr (&req->peers[i], (struct sockaddr *)&sa);
+    if (stun_message_append_xor_addr (&msg->message,
+            STUN_ATTRIBUTE_XOR_PEER_ADDRESS, (struct sockaddr *)&sa,
+            sizeof(sa))
+        != STUN_MESSAGE_RETURN_SUCCESS) {
+      g_free (msg);
+      return FALSE;
     }
+  }
 
-    priv_schedule_tick (priv);
-    priv->pending_permissions = g_list_append (priv->pending_permissions, msg);
-  } else {
-    g_free(msg);
+  if (!priv_append_credentials (priv, &msg->message) ||
+      stun_agent_finish_message (&priv->agent, &msg->message,
+          priv->password, priv->password_len) == 0) {
+    g_free (msg);
+    return FALSE;
   }
 
-  return res;
+  if (req->msg)
+    msg->nonce_renewed = req->msg->nonce_renewed;
+  g_free (req->msg);
+  req->msg = msg;
+  priv_start_request (priv, msg);
+  priv_schedule_tick (priv);
+
+  return TRUE;
 }
 
 static gboolean
-priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
-    uint16_t channel, const XiceAddress *peer)
+priv_send_channel_bind (TurnPriv *priv, ChannelBindRequest *req)
 {
-  uint32_t channel_attr = channel << 16;
-  size_t stun_len;
+  uint32_t channel_attr = req->binding->channel << 16;
   struct sockaddr_storage sa;
   TURNMessage *msg = g_new0 (TURNMessage, 1);
 
-  xice_address_copy_to_sockaddr (peer, (struct sockaddr *)&sa);
+  xice_address_copy_to_sockaddr (&req->binding->peer, (struct sockaddr *)&sa);
 
   if (!stun_agent_init_request (&priv->agent, &msg->message,
           msg->buffer, sizeof(msg->buffer),
@@ -1455,50 +1799,124 @@ priv_send_channel_bind (TurnPriv *priv,  StunMessage *resp,
     return FALSE;
   }
 
-  if (priv->username != NULL && priv->username_len > 0) {
-    if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_USERNAME,
-            priv->username, priv->username_len)
-        != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
-      return FALSE;
-    }
+  if (!priv_append_credentials (priv, &msg->message) ||
+      stun_agent_finish_message (&priv->agent, &msg->message,
+          priv->password, priv->password_len) == 0) {
+    g_free (msg);
+    return FALSE;
   }
 
-  if (resp) {
-    uint8_t *realm;
-    uint8_t *nonce;
-    uint16_t len;
+  if (req->msg)
+    msg->nonce_renewed = req->msg->nonce_renewed;
+  g_free (req->msg);
+  req->msg = msg;
+  priv_start_request (priv, msg);
+  priv_schedule_tick (priv);
 
-    realm = (uint8_t *) stun_message_find (resp, STUN_ATTRIBUTE_REALM, &len);
-    if (realm != NULL) {
-      if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_REALM,
-              realm, len)
-          != STUN_MESSAGE_RETURN_SUCCESS) {
-        g_free (msg);
-        return 0;
-      }
-    }
-    nonce = (uint8_t *) stun_message_find (resp, STUN_ATTRIBUTE_NONCE, &len);
-    if (nonce != NULL) {
-      if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_NONCE,
-              nonce, len)
-          != STUN_MESSAGE_RETURN_SUCCESS) {
-        g_free (msg);
-        return 0;
-      }
-    }
+  return TRUE;
+}
+
+/* Keeps a copy of @resp for the next requests of the compatibilities
+ * that take REALM and NONCE from the last challenge */
+static void
+priv_set_challenge (TurnPriv *priv, StunMessage *resp)
+{
+  priv->challenge = *resp;
+  memcpy (priv->challenge_buffer, resp->buffer, stun_message_length (resp));
+  priv->challenge.buffer = priv->challenge_buffer;
+  priv->challenge.buffer_len = sizeof (priv->challenge_buffer);
+  priv->challenge.agent = NULL;
+  priv->challenge.key = NULL;
+}
+
+/* A Refresh of the allocation, or the Allocate that stands for it with
+ * MSN, OC2007 and Google, asking for @lifetime seconds, the server's
+ * default if -1 */
+static TURNMessage *
+priv_build_allocation_refresh (TurnPriv *priv, int32_t lifetime)
+{
+  TURNMessage *msg = g_new0 (TURNMessage, 1);
+  size_t len = 0;
+
+  if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
+    if (stun_agent_init_request (&priv->agent, &msg->message,
+            msg->buffer, sizeof(msg->buffer), STUN_REFRESH) &&
+        (lifetime < 0 ||
+            stun_message_append32 (&msg->message, STUN_ATTRIBUTE_LIFETIME,
+                lifetime) == STUN_MESSAGE_RETURN_SUCCESS) &&
+        priv_append_credentials (priv, &msg->message))
+      len = stun_agent_finish_message (&priv->agent, &msg->message,
+          priv->password, priv->password_len);
+  } else {
+    /* the socket compatibilities match those of the usage */
+    len = stun_usage_turn_create_refresh (&priv->agent, &msg->message,
+        msg->buffer, sizeof(msg->buffer),
+        priv->challenge.buffer != NULL ? &priv->challenge : NULL, lifetime,
+        priv->username, priv->username_len,
+        priv->password, priv->password_len,
+        (StunUsageTurnCompatibility) priv->compatibility);
   }
 
-  stun_len = stun_agent_finish_message (&priv->agent, &msg->message,
-      priv->password, priv->password_len);
+  if (len == 0) {
+    g_free (msg);
+    return NULL;
+  }
+  return msg;
+}
 
-  if (stun_len > 0) {
-    priv_send_turn_message (priv, msg);
-    return TRUE;
+static void
+priv_send_allocation_refresh (TurnPriv *priv)
+{
+  TURNMessage *msg = priv_build_allocation_refresh (priv, -1);
+
+  xice_debug ("Sending allocation Refresh");
+  if (msg != NULL && priv->allocation_msg != NULL)
+    msg->nonce_renewed = priv->allocation_msg->nonce_renewed;
+  g_free (priv->allocation_msg);
+  priv->allocation_msg = msg;
+  if (msg != NULL) {
+    priv_start_request (priv, msg);
+    priv_schedule_tick (priv);
   }
+}
 
-  g_free (msg);
-  return FALSE;
+/* Schedules the next Refresh a little before @lifetime seconds */
+static void
+priv_schedule_allocation_refresh (TurnPriv *priv, guint lifetime)
+{
+  guint delay = lifetime > STUN_EXPIRE_TIMEOUT ?
+      lifetime - STUN_EXPIRE_TIMEOUT : 0;
+
+  priv->allocation_refresh_at = xice_context_get_time (priv->ctx) +
+      (gint64) delay * G_USEC_PER_SEC;
+  priv_add_deadline (priv, priv->allocation_refresh_at);
+}
+
+static void
+priv_allocation_refresh_done (TurnPriv *priv, StunMessage *resp)
+{
+  uint32_t lifetime = STUN_ALLOCATION_LIFETIME;
+
+  if (stun_message_get_class (resp) == STUN_ERROR) {
+    /* unathorized => resend with realm and nonce */
+    if (priv_handle_challenge (priv, priv->allocation_msg, resp)) {
+      priv_set_challenge (priv, resp);
+      priv_send_allocation_refresh (priv);
+      return;
+    }
+
+    /* the allocation is left to expire */
+    xice_debug ("Refresh of the allocation failed");
+    g_free (priv->allocation_msg);
+    priv->allocation_msg = NULL;
+    return;
+  }
+
+  g_free (priv->allocation_msg);
+  priv->allocation_msg = NULL;
+  stun_message_find32 (resp, STUN_ATTRIBUTE_LIFETIME, &lifetime);
+  priv_schedule_allocation_refresh (priv, lifetime);
 }
 
 static gboolean
@@ -1509,7 +1927,7 @@ priv_add_channel_binding (TurnPriv *priv, const XiceAddress *peer)
 
   xice_address_copy_to_sockaddr (peer, (struct sockaddr *)&sa);
 
-  if (priv->current_binding) {
+  if (!priv_can_start_binding (priv)) {
     XiceAddress * pending= xice_address_new ();
     *pending = *peer;
     priv->pending_bindings = g_list_append (priv->pending_bindings, pending);
@@ -1518,27 +1936,34 @@ priv_add_channel_binding (TurnPriv *priv, const XiceAddress *peer)
 
   if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
       priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-    uint16_t channel = 0x4000;
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      if (channel == b->channel) {
-        i = priv->channels;
-        channel++;
-        continue;
-      }
-    }
+    ChannelBindRequest *req;
+    guint channel = TURN_CHANNEL_MIN;
 
-    if (channel >= 0x4000 && channel < 0xffff) {
-      gboolean ret = priv_send_channel_bind (priv, NULL, channel, peer);
-      if (ret) {
-        priv->current_binding = g_new0 (ChannelBinding, 1);
-        priv->current_binding->channel = channel;
-        priv->current_binding->peer = *peer;
-      }
-      return ret;
+    if (priv_find_channel_bind_request (priv, peer) != NULL)
+      return TRUE;
+
+    /* the lowest number no binding uses or is being bound to */
+    while (priv_find_binding_by_number (priv, channel) != NULL)
+      channel++;
+
+    if (channel > TURN_CHANNEL_MAX)
+      return FALSE;
+
+    req = g_slice_new0 (ChannelBindRequest);
+    req->binding = g_new0 (ChannelBinding, 1);
+    req->binding->channel = channel;
+    req->binding->peer = *peer;
+
+    if (!priv_send_channel_bind (priv, req)) {
+      g_free (req->binding);
+      g_slice_free (ChannelBindRequest, req);
+      return FALSE;
     }
-    return FALSE;
+
+    priv_set_binding_number (priv, req->binding);
+    priv->channel_bind_requests =
+        g_list_append (priv->channel_bind_requests, req);
+    return TRUE;
   } else if (priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_MSN ||
       priv->compatibility == XICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
     TURNMessage *msg = g_new0 (TURNMessage, 1);
@@ -1632,3 +2057,65 @@ xice_turn_socket_set_ms_connection_id (XiceSocket *sock, StunMessage *msg)
     priv->ms_connection_id_valid = TRUE;
   }
 }
+
+void
+xice_turn_socket_set_realm_nonce (XiceSocket *sock, StunMessage *msg)
+{
+  TurnPriv *priv = (TurnPriv *)sock->priv;
+  uint16_t realm_len;
+  uint16_t nonce_len;
+  const uint8_t *realm = stun_message_find (msg, STUN_ATTRIBUTE_REALM,
+      &realm_len);
+  const uint8_t *nonce = stun_message_find (msg, STUN_ATTRIBUTE_NONCE,
+      &nonce_len);
+
+  if (priv->compatibility != XICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 &&
+      priv->compatibility != XICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
+    return;
+
+  if (realm && nonce) {
+    g_free (priv->realm);
+    priv->realm = g_memdup (realm, realm_len);
+    priv->realm_len = realm_len;
+    g_free (priv->nonce);
+    priv->nonce = g_memdup (nonce, nonce_len);
+    priv->nonce_len = nonce_len;
+  }
+}
+
+/* Hands the refreshes of the allocation over to the socket, the first one
+ * due a minute before @lifetime seconds have passed. @challenge, if not
+ * NULL, is the last challenge to the Allocate request. The allocation is
+ * released when the socket is freed. */
+void
+xice_turn_socket_refresh_allocation (XiceSocket *sock, StunMessage *challenge,
+    guint lifetime)
+{
+  TurnPriv *priv = (TurnPriv *)sock->priv;
+
+  if (challenge != NULL)
+    priv_set_challenge (priv, challenge);
+  priv->allocation_refresh = TRUE;
+  priv_schedule_allocation_refresh (priv, lifetime);
+}
+
+void
+xice_turn_socket_set_queue_size (XiceSocket *sock, guint queue_size,
+    XiceTurnSocketDropPolicy drop_policy)
+{
+  TurnPriv *priv = (TurnPriv *)sock->priv;
+
+  priv->queue_size = queue_size > 0 ? queue_size : TURN_DEFAULT_QUEUE_SIZE;
+  priv->drop_policy = drop_policy;
+}
+
+void
+xice_turn_socket_get_queue_stats (XiceSocket *sock, guint64 *packets_queued,
+    guint64 *packets_dropped, guint64 *bytes_pending)
+{
+  TurnPriv *priv = (TurnPriv *)sock->priv;
+
+  *packets_queued = priv->packets_queued;
+  *packets_dropped = priv->packets_dropped;
+  *bytes_pending = priv->bytes_pending;
+}
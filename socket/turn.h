@@ -46,6 +46,13 @@ typedef enum {
   XICE_TURN_SOCKET_COMPATIBILITY_RFC5766,
 } XiceTurnSocketCompatibility;
 
+/* What to drop when the data queued for a peer waiting for its
+ * permission does not fit */
+typedef enum {
+  XICE_TURN_SOCKET_DROP_NEWEST,
+  XICE_TURN_SOCKET_DROP_OLDEST,
+} XiceTurnSocketDropPolicy;
+
 
 #include "contexts/xicesocket.h"
 #include "stun/stunmessage.h"
@@ -61,6 +68,9 @@ xice_turn_socket_parse_recv (XiceSocket *sock, XiceSocket **from_sock,
 gboolean
 xice_turn_socket_set_peer (XiceSocket *sock, XiceAddress *peer);
 
+guint
+xice_turn_socket_get_overhead (XiceSocket *sock, const XiceAddress *peer);
+
 XiceSocket*
 xice_turn_socket_new (XiceContext *ctx, XiceAddress *addr,
     XiceSocket *base_socket, XiceAddress *server_addr,
@@ -72,6 +82,21 @@ xice_turn_socket_set_ms_realm(XiceSocket *sock, StunMessage *msg);
 void
 xice_turn_socket_set_ms_connection_id (XiceSocket *sock, StunMessage *msg);
 
+void
+xice_turn_socket_set_realm_nonce (XiceSocket *sock, StunMessage *msg);
+
+void
+xice_turn_socket_refresh_allocation (XiceSocket *sock, StunMessage *challenge,
+    guint lifetime);
+
+void
+xice_turn_socket_set_queue_size (XiceSocket *sock, guint queue_size,
+    XiceTurnSocketDropPolicy drop_policy);
+
+void
+xice_turn_socket_get_queue_stats (XiceSocket *sock, guint64 *packets_queued,
+    guint64 *packets_dropped, guint64 *bytes_pending);
+
 
 G_END_DECLS
 
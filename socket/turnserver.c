@@ -0,0 +1,1109 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "turnserver.h"
+#include "stun/stunagent.h"
+#include "stun/utils.h"
+
+#define TURN_DEFAULT_LIFETIME 600 /* s */
+#define TURN_MAX_LIFETIME 3600 /* s */
+#define TURN_PERMISSION_LIFETIME 300 /* s */
+#define TURN_CHANNEL_LIFETIME 600 /* s */
+#define TURN_SWEEP_INTERVAL 1000 /* ms, for closed connections */
+
+#define TURN_CHANNEL_MIN 0x4000
+#define TURN_CHANNEL_MAX 0x7FFF
+#define TURN_TRANSPORT_UDP 17
+
+typedef struct _Connection Connection;
+
+typedef struct {
+  XiceAddress peer;             /* only the IP counts */
+  gint64 expires;
+} Permission;
+
+typedef struct {
+  uint16_t number;
+  XiceAddress peer;
+  gint64 expires;
+} Channel;
+
+typedef struct {
+  XiceTurnServer *server;
+  Connection *conn;             /* NULL for UDP clients */
+  XiceAddress client;
+  XiceSocket *relay;
+  StunTransactionId id;         /* of the Allocate request */
+  gint64 expires;
+  GList *permissions;
+  GList *channels;
+} Allocation;
+
+/* A request kept by the filter */
+typedef struct {
+  Connection *conn;             /* NULL for UDP clients */
+  XiceAddress from;
+  gchar *buf;
+  guint len;
+} Held;
+
+struct _Connection {
+  XiceTurnServer *server;
+  XiceSocket *sock;
+  XiceAddress client;
+  Allocation *allocation;
+  GByteArray *partial;          /* a frame split across reads */
+  gboolean closed;
+};
+
+struct _XiceTurnServer {
+  XiceContext *ctx;
+  XiceSocket *udp;
+  XiceSocket *listener;         /* TCP, if listening */
+  StunAgent agent;
+  gchar *realm;
+  gchar nonce[17];
+  StunError stale_error;        /* for a request with an older nonce */
+  GHashTable *users;
+  GHashTable *udp_allocations;  /* client address -> Allocation */
+  GList *connections;
+  XiceTimer *timer;
+  gint64 sweep_at;              /* 0 if no sweep is due */
+  XiceTurnServerFilterFunc filter;
+  gpointer filter_data;
+  GQueue held;
+  XiceTurnServerStats stats;
+};
+
+static void priv_allocation_free (Allocation *alloc);
+static void priv_schedule_sweep (XiceTurnServer *server);
+
+static gboolean
+priv_same_ip (const XiceAddress *a, const XiceAddress *b)
+{
+  XiceAddress a_ip = *a, b_ip = *b;
+
+  xice_address_set_port (&a_ip, 0);
+  xice_address_set_port (&b_ip, 0);
+  return xice_address_equal (&a_ip, &b_ip);
+}
+
+static gint64
+priv_now (XiceTurnServer *server)
+{
+  return xice_context_get_time (server->ctx);
+}
+
+static void
+priv_send (XiceTurnServer *server, Connection *conn, const XiceAddress *to,
+    const gchar *buf, guint len)
+{
+  if (conn != NULL)
+    (void) xice_socket_send (conn->sock, to, len, buf);
+  else
+    (void) xice_socket_send (server->udp, to, len, buf);
+}
+
+static void
+priv_send_message (XiceTurnServer *server, Connection *conn,
+    const XiceAddress *to, StunMessage *msg)
+{
+  size_t len = stun_agent_finish_message (&server->agent, msg, NULL, 0);
+
+  if (len > 0)
+    priv_send (server, conn, to, (const gchar *) msg->buffer, len);
+}
+
+static void
+priv_append_addr (StunMessage *msg, StunAttribute type,
+    const XiceAddress *addr)
+{
+  struct sockaddr_storage sa;
+
+  xice_address_copy_to_sockaddr (addr, (struct sockaddr *) &sa);
+  stun_message_append_xor_addr (msg, type, (struct sockaddr *) &sa,
+      addr->s.addr.sa_family == AF_INET6 ?
+      sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in));
+}
+
+/* Reads the XOR-PEER-ADDRESS attribute at or after @offset into @peer.
+ * stun_message_find() only ever returns the first one, while
+ * CreatePermission may carry several. Returns the offset to read the next
+ * one from, or 0 once there is none left. */
+static size_t
+priv_next_peer (const StunMessage *msg, size_t offset, XiceAddress *peer)
+{
+  size_t length = stun_message_length (msg);
+
+  while (offset + STUN_ATTRIBUTE_VALUE_POS <= length) {
+    uint16_t atype = stun_getw (msg->buffer + offset);
+    uint16_t alen = stun_getw (msg->buffer + offset + STUN_ATTRIBUTE_TYPE_LEN);
+    const uint8_t *value = msg->buffer + offset + STUN_ATTRIBUTE_VALUE_POS;
+    struct sockaddr_storage sa;
+
+    offset += STUN_ATTRIBUTE_VALUE_POS + stun_align (alen);
+
+    /* only the attributes covered by the MESSAGE-INTEGRITY count */
+    if (atype == STUN_ATTRIBUTE_MESSAGE_INTEGRITY ||
+        atype == STUN_ATTRIBUTE_FINGERPRINT)
+      return 0;
+    if (atype != STUN_ATTRIBUTE_XOR_PEER_ADDRESS)
+      continue;
+
+    memset (&sa, 0, sizeof (sa));
+    if (alen == 8 && value[1] == 1) {
+      struct sockaddr_in *ip4 = (struct sockaddr_in *) &sa;
+
+      ip4->sin_family = AF_INET;
+      memcpy (&ip4->sin_port, value + 2, 2);
+      memcpy (&ip4->sin_addr, value + 4, 4);
+      stun_xor_address (msg, (struct sockaddr *) &sa, sizeof (*ip4),
+          STUN_MAGIC_COOKIE);
+    } else if (alen == 20 && value[1] == 2) {
+      struct sockaddr_in6 *ip6 = (struct sockaddr_in6 *) &sa;
+
+      ip6->sin6_family = AF_INET6;
+      memcpy (&ip6->sin6_port, value + 2, 2);
+      memcpy (&ip6->sin6_addr, value + 4, 16);
+      stun_xor_address (msg, (struct sockaddr *) &sa, sizeof (*ip6),
+          STUN_MAGIC_COOKIE);
+    } else {
+      continue;
+    }
+
+    xice_address_init (peer);
+    xice_address_set_from_sockaddr (peer, (struct sockaddr *) &sa);
+    return offset;
+  }
+
+  return 0;
+}
+
+static Permission *
+priv_find_permission (Allocation *alloc, const XiceAddress *peer, gint64 now)
+{
+  GList *i;
+
+  for (i = alloc->permissions; i; i = i->next) {
+    Permission *perm = i->data;
+    if (perm->expires > now && priv_same_ip (&perm->peer, peer))
+      return perm;
+  }
+  return NULL;
+}
+
+static void
+priv_add_permission (Allocation *alloc, const XiceAddress *peer, gint64 now)
+{
+  Permission *perm = priv_find_permission (alloc, peer, now);
+
+  if (perm == NULL) {
+    perm = g_slice_new0 (Permission);
+    perm->peer = *peer;
+    alloc->permissions = g_list_prepend (alloc->permissions, perm);
+    alloc->server->stats.permissions++;
+  }
+  perm->expires = now + (gint64) TURN_PERMISSION_LIFETIME * G_USEC_PER_SEC;
+}
+
+static Channel *
+priv_find_channel_by_number (Allocation *alloc, uint16_t number, gint64 now)
+{
+  GList *i;
+
+  for (i = alloc->channels; i; i = i->next) {
+    Channel *ch = i->data;
+    if (ch->expires > now && ch->number == number)
+      return ch;
+  }
+  return NULL;
+}
+
+static Channel *
+priv_find_channel_by_peer (Allocation *alloc, const XiceAddress *peer,
+    gint64 now)
+{
+  GList *i;
+
+  for (i = alloc->channels; i; i = i->next) {
+    Channel *ch = i->data;
+    if (ch->expires > now && xice_address_equal (&ch->peer, peer))
+      return ch;
+  }
+  return NULL;
+}
+
+/* Data from a peer to the relayed address: a ChannelData message if the
+ * peer has a channel, a Data indication otherwise. */
+static gboolean
+priv_relay_cb (XiceSocket *sock, XiceSocketCondition condition,
+    gpointer data, gchar *buf, guint len, XiceAddress *from)
+{
+  Allocation *alloc = data;
+  XiceTurnServer *server = alloc->server;
+  gint64 now;
+  Channel *ch;
+  uint8_t out[STUN_MAX_MESSAGE_SIZE];
+
+  if (condition != XICE_SOCKET_READABLE)
+    return TRUE;
+
+  now = priv_now (server);
+  if (priv_find_permission (alloc, from, now) == NULL ||
+      len + 36 > sizeof (out)) {
+    server->stats.packets_dropped++;
+    return TRUE;
+  }
+
+  ch = priv_find_channel_by_peer (alloc, from, now);
+  if (ch != NULL) {
+    guint out_len = 4 + len;
+
+    out[0] = ch->number >> 8;
+    out[1] = ch->number & 0xff;
+    out[2] = len >> 8;
+    out[3] = len & 0xff;
+    memcpy (out + 4, buf, len);
+    /* padded to 4 bytes over streams only */
+    if (alloc->conn != NULL) {
+      while (out_len % 4)
+        out[out_len++] = 0;
+    }
+    priv_send (server, alloc->conn, &alloc->client, (gchar *) out, out_len);
+    server->stats.channel_data_from_peers++;
+  } else {
+    StunMessage msg;
+
+    stun_agent_init_indication (&server->agent, &msg, out, sizeof (out),
+        STUN_IND_DATA);
+    priv_append_addr (&msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS, from);
+    stun_message_append_bytes (&msg, STUN_ATTRIBUTE_DATA, buf, len);
+    priv_send_message (server, alloc->conn, &alloc->client, &msg);
+  }
+  server->stats.packets_from_peers++;
+  server->stats.bytes_from_peers += len;
+
+  return TRUE;
+}
+
+static Allocation *
+priv_allocation_new (XiceTurnServer *server, Connection *conn,
+    const XiceAddress *client, const StunTransactionId id)
+{
+  Allocation *alloc;
+  XiceAddress relay_addr = *xice_turn_server_get_address (server);
+  XiceSocket *relay;
+
+  xice_address_set_port (&relay_addr, 0);
+  relay = xice_create_udp_socket (server->ctx, &relay_addr);
+  if (relay == NULL)
+    return NULL;
+
+  alloc = g_slice_new0 (Allocation);
+  alloc->server = server;
+  alloc->conn = conn;
+  alloc->client = *client;
+  alloc->relay = relay;
+  memcpy (alloc->id, id, sizeof (StunTransactionId));
+  xice_socket_set_callback (relay, priv_relay_cb, alloc);
+
+  if (conn != NULL)
+    conn->allocation = alloc;
+  else
+    g_hash_table_insert (server->udp_allocations, &alloc->client, alloc);
+  server->stats.allocations++;
+
+  return alloc;
+}
+
+static void
+priv_allocation_free (Allocation *alloc)
+{
+  XiceTurnServer *server = alloc->server;
+  GList *i;
+
+  if (alloc->conn != NULL)
+    alloc->conn->allocation = NULL;
+  else
+    g_hash_table_remove (server->udp_allocations, &alloc->client);
+
+  xice_socket_free (alloc->relay);
+  for (i = alloc->permissions; i; i = i->next)
+    g_slice_free (Permission, i->data);
+  g_list_free (alloc->permissions);
+  for (i = alloc->channels; i; i = i->next)
+    g_slice_free (Channel, i->data);
+  g_list_free (alloc->channels);
+  server->stats.allocations--;
+
+  g_slice_free (Allocation, alloc);
+}
+
+/* The lifetime granted for the LIFETIME asked for, if any */
+static uint32_t
+priv_lifetime (StunMessage *msg)
+{
+  uint32_t lifetime;
+
+  if (stun_message_find32 (msg, STUN_ATTRIBUTE_LIFETIME, &lifetime) !=
+      STUN_MESSAGE_RETURN_SUCCESS || lifetime < TURN_DEFAULT_LIFETIME)
+    return TURN_DEFAULT_LIFETIME;
+  return MIN (lifetime, TURN_MAX_LIFETIME);
+}
+
+static int
+priv_handle_allocate (XiceTurnServer *server, Connection *conn,
+    const XiceAddress *from, Allocation *alloc, StunMessage *msg,
+    StunMessage *resp, gint64 now)
+{
+  StunTransactionId id;
+  uint32_t transport;
+
+  stun_message_id (msg, id);
+  if (alloc != NULL) {
+    /* a retransmission is answered again, anything else is a mismatch */
+    if (memcmp (id, alloc->id, sizeof (id)) != 0)
+      return STUN_ERROR_ALLOCATION_MISMATCH;
+  } else {
+    if (stun_message_find32 (msg, STUN_ATTRIBUTE_REQUESTED_TRANSPORT,
+            &transport) != STUN_MESSAGE_RETURN_SUCCESS)
+      return STUN_ERROR_BAD_REQUEST;
+    if ((transport >> 24) != TURN_TRANSPORT_UDP)
+      return STUN_ERROR_UNSUPPORTED_TRANSPORT;
+
+    alloc = priv_allocation_new (server, conn, from, id);
+    if (alloc == NULL)
+      return STUN_ERROR_INSUFFICIENT_CAPACITY;
+    alloc->expires = now + (gint64) priv_lifetime (msg) * G_USEC_PER_SEC;
+    priv_schedule_sweep (server);
+  }
+
+  priv_append_addr (resp, STUN_ATTRIBUTE_XOR_RELAYED_ADDRESS,
+      &alloc->relay->addr);
+  priv_append_addr (resp, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, from);
+  stun_message_append32 (resp, STUN_ATTRIBUTE_LIFETIME,
+      (alloc->expires - now) / G_USEC_PER_SEC);
+
+  return 0;
+}
+
+static int
+priv_handle_refresh (XiceTurnServer *server, Allocation *alloc,
+    StunMessage *msg, StunMessage *resp, gint64 now)
+{
+  uint32_t lifetime;
+
+  if (alloc == NULL)
+    return STUN_ERROR_ALLOCATION_MISMATCH;
+
+  if (stun_message_find32 (msg, STUN_ATTRIBUTE_LIFETIME, &lifetime) ==
+      STUN_MESSAGE_RETURN_SUCCESS && lifetime == 0) {
+    priv_allocation_free (alloc);
+  } else {
+    lifetime = priv_lifetime (msg);
+    alloc->expires = now + (gint64) lifetime * G_USEC_PER_SEC;
+  }
+  priv_schedule_sweep (server);
+  stun_message_append32 (resp, STUN_ATTRIBUTE_LIFETIME, lifetime);
+
+  return 0;
+}
+
+static int
+priv_handle_create_permission (Allocation *alloc, StunMessage *msg,
+    gint64 now)
+{
+  XiceAddress peer;
+  size_t offset;
+
+  if (alloc == NULL)
+    return STUN_ERROR_ALLOCATION_MISMATCH;
+
+  offset = priv_next_peer (msg, STUN_MESSAGE_ATTRIBUTES_POS, &peer);
+  if (offset == 0)
+    return STUN_ERROR_BAD_REQUEST;
+  for (; offset != 0; offset = priv_next_peer (msg, offset, &peer))
+    priv_add_permission (alloc, &peer, now);
+
+  return 0;
+}
+
+static int
+priv_handle_channel_bind (Allocation *alloc, StunMessage *msg, gint64 now)
+{
+  XiceAddress peer;
+  uint32_t value;
+  uint16_t number;
+  Channel *by_number, *by_peer;
+
+  if (alloc == NULL)
+    return STUN_ERROR_ALLOCATION_MISMATCH;
+
+  if (stun_message_find32 (msg, STUN_ATTRIBUTE_CHANNEL_NUMBER, &value) !=
+      STUN_MESSAGE_RETURN_SUCCESS ||
+      priv_next_peer (msg, STUN_MESSAGE_ATTRIBUTES_POS, &peer) == 0)
+    return STUN_ERROR_BAD_REQUEST;
+
+  number = value >> 16;
+  if (number < TURN_CHANNEL_MIN || number > TURN_CHANNEL_MAX)
+    return STUN_ERROR_BAD_REQUEST;
+
+  /* a channel is bound to one peer, and a peer to one channel */
+  by_number = priv_find_channel_by_number (alloc, number, now);
+  by_peer = priv_find_channel_by_peer (alloc, &peer, now);
+  if (by_number != by_peer)
+    return STUN_ERROR_BAD_REQUEST;
+
+  if (by_number == NULL) {
+    by_number = g_slice_new0 (Channel);
+    by_number->number = number;
+    by_number->peer = peer;
+    alloc->channels = g_list_prepend (alloc->channels, by_number);
+  }
+  by_number->expires = now + (gint64) TURN_CHANNEL_LIFETIME * G_USEC_PER_SEC;
+  priv_add_permission (alloc, &peer, now);
+  alloc->server->stats.channel_binds++;
+
+  return 0;
+}
+
+static void
+priv_handle_send (XiceTurnServer *server, Allocation *alloc,
+    StunMessage *msg, gint64 now)
+{
+  XiceAddress peer;
+  const void *data;
+  uint16_t data_len;
+
+  if (alloc == NULL ||
+      priv_next_peer (msg, STUN_MESSAGE_ATTRIBUTES_POS, &peer) == 0 ||
+      (data = stun_message_find (msg, STUN_ATTRIBUTE_DATA, &data_len)) ==
+      NULL ||
+      priv_find_permission (alloc, &peer, now) == NULL) {
+    server->stats.packets_dropped++;
+    return;
+  }
+
+  (void) xice_socket_send (alloc->relay, &peer, data_len, data);
+  server->stats.packets_to_peers++;
+  server->stats.bytes_to_peers += data_len;
+}
+
+static void
+priv_handle_channel_data (XiceTurnServer *server, Allocation *alloc,
+    const gchar *buf, guint len, gint64 now)
+{
+  const guint8 *header = (const guint8 *) buf;
+  uint16_t number = (header[0] << 8) | header[1];
+  uint16_t data_len = (header[2] << 8) | header[3];
+  Channel *ch;
+
+  if (alloc == NULL || data_len + 4 > len ||
+      (ch = priv_find_channel_by_number (alloc, number, now)) == NULL) {
+    server->stats.packets_dropped++;
+    return;
+  }
+
+  (void) xice_socket_send (alloc->relay, &ch->peer, data_len, buf + 4);
+  server->stats.packets_to_peers++;
+  server->stats.bytes_to_peers += data_len;
+  server->stats.channel_data_to_peers++;
+}
+
+static bool
+priv_validater (StunAgent *agent, StunMessage *message,
+    uint8_t *username, uint16_t username_len,
+    uint8_t **password, size_t *password_len, void *user_data)
+{
+  XiceTurnServer *server = user_data;
+  gchar *name = g_strndup ((const gchar *) username, username_len);
+  gchar *pass = g_hash_table_lookup (server->users, name);
+
+  g_free (name);
+  if (pass == NULL)
+    return false;
+
+  *password = (uint8_t *) pass;
+  *password_len = strlen (pass);
+  return true;
+}
+
+/* A 401, or a 438 for a request signed with another realm or nonce */
+static void
+priv_send_challenge (XiceTurnServer *server, Connection *conn,
+    const XiceAddress *to, StunMessage *msg, StunError code)
+{
+  StunMessage resp;
+  uint8_t out[STUN_MAX_MESSAGE_SIZE_IPV6];
+
+  stun_agent_init_error (&server->agent, &resp, out, sizeof (out), msg, code);
+  stun_message_append_string (&resp, STUN_ATTRIBUTE_REALM, server->realm);
+  stun_message_append_string (&resp, STUN_ATTRIBUTE_NONCE, server->nonce);
+  priv_send_message (server, conn, to, &resp);
+  server->stats.challenges++;
+}
+
+static gboolean
+priv_check_string (StunMessage *msg, StunAttribute type, const gchar *value)
+{
+  const void *attr;
+  uint16_t len;
+
+  attr = stun_message_find (msg, type, &len);
+  return attr != NULL && len == strlen (value) &&
+      memcmp (attr, value, len) == 0;
+}
+
+static void
+priv_hold (XiceTurnServer *server, Connection *conn, const XiceAddress *from,
+    const gchar *buf, guint len)
+{
+  Held *held = g_slice_new (Held);
+
+  held->conn = conn;
+  held->from = *from;
+  held->buf = g_memdup (buf, len);
+  held->len = len;
+  g_queue_push_tail (&server->held, held);
+}
+
+static void
+priv_held_free (Held *held)
+{
+  g_free (held->buf);
+  g_slice_free (Held, held);
+}
+
+/* Forgets the requests held for @conn */
+static void
+priv_drop_held (XiceTurnServer *server, Connection *conn)
+{
+  GList *i, *next;
+
+  for (i = server->held.head; i; i = next) {
+    Held *held = i->data;
+
+    next = i->next;
+    if (held->conn == conn) {
+      priv_held_free (held);
+      g_queue_delete_link (&server->held, i);
+    }
+  }
+}
+
+/* @held: the request was held, and is not to be filtered again */
+static void
+priv_handle_stun (XiceTurnServer *server, Connection *conn,
+    const XiceAddress *from, gchar *buf, guint len, gboolean held)
+{
+  StunMessage msg, resp;
+  StunValidationStatus status;
+  uint8_t out[STUN_MAX_MESSAGE_SIZE_IPV6];
+  Allocation *alloc;
+  gint64 now = priv_now (server);
+  StunMethod method;
+  int error = 0;
+
+  status = stun_agent_validate (&server->agent, &msg, (uint8_t *) buf, len,
+      priv_validater, server);
+  if (status != STUN_VALIDATION_SUCCESS &&
+      status != STUN_VALIDATION_UNAUTHORIZED_BAD_REQUEST &&
+      status != STUN_VALIDATION_UNAUTHORIZED &&
+      status != STUN_VALIDATION_UNKNOWN_REQUEST_ATTRIBUTE)
+    return;
+
+  if (conn != NULL)
+    alloc = conn->allocation;
+  else
+    alloc = g_hash_table_lookup (server->udp_allocations, from);
+  method = stun_message_get_method (&msg);
+
+  /* indications are not authenticated */
+  if (stun_message_get_class (&msg) == STUN_INDICATION) {
+    if (method == STUN_IND_SEND)
+      priv_handle_send (server, alloc, &msg, now);
+    return;
+  }
+  if (stun_message_get_class (&msg) != STUN_REQUEST)
+    return;
+
+  if (status == STUN_VALIDATION_UNKNOWN_REQUEST_ATTRIBUTE) {
+    size_t out_len = stun_agent_build_unknown_attributes_error (
+        &server->agent, &resp, out, sizeof (out), &msg);
+    if (out_len > 0)
+      priv_send (server, conn, from, (gchar *) out, out_len);
+    server->stats.errors++;
+    return;
+  }
+
+  if (method != STUN_BINDING) {
+    if (status != STUN_VALIDATION_SUCCESS) {
+      priv_send_challenge (server, conn, from, &msg,
+          STUN_ERROR_UNAUTHORIZED);
+      return;
+    }
+    if (!priv_check_string (&msg, STUN_ATTRIBUTE_REALM, server->realm) ||
+        !priv_check_string (&msg, STUN_ATTRIBUTE_NONCE, server->nonce)) {
+      priv_send_challenge (server, conn, from, &msg, server->stale_error);
+      return;
+    }
+  }
+
+  if (server->filter != NULL && !held) {
+    switch (server->filter (server, from, conn != NULL, &msg,
+            server->filter_data)) {
+      case XICE_TURN_SERVER_ANSWER:
+        break;
+      case XICE_TURN_SERVER_REFUSE:
+        stun_agent_init_error (&server->agent, &resp, out, sizeof (out), &msg,
+            STUN_ERROR_ALLOCATION_QUOTA_REACHED);
+        server->stats.errors++;
+        priv_send_message (server, conn, from, &resp);
+        return;
+      case XICE_TURN_SERVER_HOLD:
+        priv_hold (server, conn, from, buf, len);
+        return;
+      case XICE_TURN_SERVER_DROP:
+        return;
+    }
+  }
+
+  stun_agent_init_response (&server->agent, &resp, out, sizeof (out), &msg);
+  switch (method) {
+    case STUN_BINDING:
+      priv_append_addr (&resp, STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, from);
+      break;
+    case STUN_ALLOCATE:
+      error = priv_handle_allocate (server, conn, from, alloc, &msg, &resp,
+          now);
+      break;
+    case STUN_REFRESH:
+      error = priv_handle_refresh (server, alloc, &msg, &resp, now);
+      break;
+    case STUN_CREATEPERMISSION:
+      error = priv_handle_create_permission (alloc, &msg, now);
+      break;
+    case STUN_CHANNELBIND:
+      error = priv_handle_channel_bind (alloc, &msg, now);
+      break;
+    default:
+      error = STUN_ERROR_BAD_REQUEST;
+      break;
+  }
+
+  if (error != 0) {
+    stun_agent_init_error (&server->agent, &resp, out, sizeof (out), &msg,
+        error);
+    server->stats.errors++;
+  } else {
+    server->stats.requests++;
+  }
+  priv_send_message (server, conn, from, &resp);
+}
+
+static void
+priv_handle_message (XiceTurnServer *server, Connection *conn,
+    const XiceAddress *from, gchar *buf, guint len)
+{
+  if (len >= 4 && (buf[0] & 0xC0) == 0x40) {
+    Allocation *alloc;
+
+    if (conn != NULL)
+      alloc = conn->allocation;
+    else
+      alloc = g_hash_table_lookup (server->udp_allocations, from);
+    priv_handle_channel_data (server, alloc, buf, len, priv_now (server));
+  } else {
+    priv_handle_stun (server, conn, from, buf, len, FALSE);
+  }
+}
+
+static gboolean
+priv_udp_cb (XiceSocket *sock, XiceSocketCondition condition,
+    gpointer data, gchar *buf, guint len, XiceAddress *from)
+{
+  if (condition == XICE_SOCKET_READABLE)
+    priv_handle_message (data, NULL, from, buf, len);
+  return TRUE;
+}
+
+/* The size of the frame starting with @header: ChannelData messages are
+ * padded to 4 bytes on streams, STUN messages always are. */
+static guint
+priv_frame_size (const guint8 *header)
+{
+  guint len = (header[2] << 8) | header[3];
+
+  if ((header[0] & 0xC0) == 0x40)
+    return (4 + len + 3) & ~3;
+  return 20 + len;
+}
+
+/* Handles the whole frames at the start of @buf in place, and returns the
+ * number of bytes they took */
+static guint
+priv_read_frames (Connection *conn, gchar *buf, guint len)
+{
+  guint done = 0, frame;
+
+  while (len - done >= 4 &&
+      (frame = priv_frame_size ((guint8 *) buf + done)) <= len - done) {
+    priv_handle_message (conn->server, conn, &conn->client, buf + done,
+        frame);
+    done += frame;
+  }
+  return done;
+}
+
+static gboolean
+priv_tcp_cb (XiceSocket *sock, XiceSocketCondition condition,
+    gpointer data, gchar *buf, guint len, XiceAddress *from)
+{
+  Connection *conn = data;
+  guint done;
+
+  if (conn->closed)
+    return TRUE;
+
+  if (condition == XICE_SOCKET_CLOSE || condition == XICE_SOCKET_ERROR) {
+    /* the socket is freed on the next sweep, out of its callback */
+    conn->closed = TRUE;
+    conn->server->stats.tcp_clients--;
+    conn->server->stats.tcp_closed++;
+    priv_drop_held (conn->server, conn);
+    if (conn->allocation != NULL)
+      priv_allocation_free (conn->allocation);
+    priv_schedule_sweep (conn->server);
+    return TRUE;
+  }
+  if (condition != XICE_SOCKET_READABLE)
+    return TRUE;
+
+  if (!xice_address_is_valid (&conn->client))
+    conn->client = *from;
+
+  if (conn->partial->len == 0) {
+    done = priv_read_frames (conn, buf, len);
+    if (done < len)
+      g_byte_array_append (conn->partial, (guint8 *) buf + done, len - done);
+  } else {
+    g_byte_array_append (conn->partial, (guint8 *) buf, len);
+    done = priv_read_frames (conn, (gchar *) conn->partial->data,
+        conn->partial->len);
+    g_byte_array_remove_range (conn->partial, 0, done);
+  }
+
+  return TRUE;
+}
+
+static void
+priv_connection_free (Connection *conn)
+{
+  if (!conn->closed) {
+    conn->server->stats.tcp_clients--;
+    priv_drop_held (conn->server, conn);
+  }
+  if (conn->allocation != NULL)
+    priv_allocation_free (conn->allocation);
+  xice_socket_free (conn->sock);
+  g_byte_array_free (conn->partial, TRUE);
+  g_slice_free (Connection, conn);
+}
+
+static GList *
+priv_prune_permissions (GList *permissions, gint64 now)
+{
+  GList *i, *next;
+
+  for (i = permissions; i; i = next) {
+    Permission *perm = i->data;
+
+    next = i->next;
+    if (perm->expires <= now) {
+      g_slice_free (Permission, perm);
+      permissions = g_list_delete_link (permissions, i);
+    }
+  }
+  return permissions;
+}
+
+static GList *
+priv_prune_channels (GList *channels, gint64 now)
+{
+  GList *i, *next;
+
+  for (i = channels; i; i = next) {
+    Channel *ch = i->data;
+
+    next = i->next;
+    if (ch->expires <= now) {
+      g_slice_free (Channel, ch);
+      channels = g_list_delete_link (channels, i);
+    }
+  }
+  return channels;
+}
+
+/* Drops what has expired, and the connections closed since the last sweep.
+ * Due when the first allocation expires, or soon after a connection was
+ * closed. Permissions and channels are looked up by their expiry time, and
+ * only pruned along. */
+static gboolean
+priv_sweep (XiceTimer *timer, gpointer data)
+{
+  XiceTurnServer *server = data;
+  gint64 now = priv_now (server);
+  GHashTableIter iter;
+  GSList *expired = NULL, *s;
+  GList *i, *next;
+  Allocation *alloc;
+
+  server->sweep_at = 0;
+  g_hash_table_iter_init (&iter, server->udp_allocations);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &alloc)) {
+    if (alloc->expires <= now)
+      expired = g_slist_prepend (expired, alloc);
+  }
+  for (i = server->connections; i; i = next) {
+    Connection *conn = i->data;
+
+    next = i->next;
+    if (conn->closed) {
+      priv_connection_free (conn);
+      server->connections = g_list_delete_link (server->connections, i);
+    } else if (conn->allocation != NULL && conn->allocation->expires <= now) {
+      expired = g_slist_prepend (expired, conn->allocation);
+    }
+  }
+  for (s = expired; s; s = s->next)
+    priv_allocation_free (s->data);
+  g_slist_free (expired);
+
+  g_hash_table_iter_init (&iter, server->udp_allocations);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &alloc)) {
+    alloc->permissions = priv_prune_permissions (alloc->permissions, now);
+    alloc->channels = priv_prune_channels (alloc->channels, now);
+  }
+  for (i = server->connections; i; i = i->next) {
+    alloc = ((Connection *) i->data)->allocation;
+    if (alloc != NULL) {
+      alloc->permissions = priv_prune_permissions (alloc->permissions, now);
+      alloc->channels = priv_prune_channels (alloc->channels, now);
+    }
+  }
+
+  priv_schedule_sweep (server);
+  return FALSE;
+}
+
+/* Makes the next sweep due when it is needed, if at all */
+static void
+priv_schedule_sweep (XiceTurnServer *server)
+{
+  gint64 now = priv_now (server), next = G_MAXINT64;
+  GHashTableIter iter;
+  Allocation *alloc;
+  GList *i;
+
+  g_hash_table_iter_init (&iter, server->udp_allocations);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &alloc))
+    next = MIN (next, alloc->expires);
+  for (i = server->connections; i; i = i->next) {
+    Connection *conn = i->data;
+
+    if (conn->closed)
+      next = MIN (next, now + TURN_SWEEP_INTERVAL * 1000);
+    else if (conn->allocation != NULL)
+      next = MIN (next, conn->allocation->expires);
+  }
+
+  if (next == server->sweep_at)
+    return;
+  if (server->timer == NULL)
+    server->timer = xice_create_timer (server->ctx, TURN_SWEEP_INTERVAL,
+        priv_sweep, server);
+  /* libuv timers ignore the return value of their callback */
+  xice_timer_stop (server->timer);
+  if (next == G_MAXINT64) {
+    server->sweep_at = 0;
+    return;
+  }
+  server->sweep_at = next;
+  server->timer->interval = next > now ? (next - now + 999) / 1000 : 0;
+  xice_timer_start (server->timer);
+}
+
+static void
+priv_collect (gpointer key, gpointer value, gpointer data)
+{
+  GSList **list = data;
+
+  *list = g_slist_prepend (*list, value);
+}
+
+XiceTurnServer *
+xice_turn_server_new (XiceContext *ctx, const XiceAddress *addr,
+    const gchar *realm)
+{
+  XiceTurnServer *server;
+  XiceAddress local = *addr;
+  XiceSocket *udp = xice_create_udp_socket (ctx, &local);
+
+  if (udp == NULL)
+    return NULL;
+
+  server = g_slice_new0 (XiceTurnServer);
+  server->ctx = ctx;
+  server->udp = udp;
+  server->realm = g_strdup (realm);
+  g_snprintf (server->nonce, sizeof (server->nonce), "%08x%08x",
+      g_random_int (), g_random_int ());
+  server->stale_error = STUN_ERROR_STALE_NONCE;
+  server->users = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      g_free);
+  /* the allocations own the addresses used as keys */
+  server->udp_allocations = g_hash_table_new ((GHashFunc) xice_address_hash,
+      (GEqualFunc) xice_address_equal);
+  stun_agent_init (&server->agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+  xice_socket_set_callback (udp, priv_udp_cb, server);
+
+  return server;
+}
+
+void
+xice_turn_server_add_user (XiceTurnServer *server, const gchar *username,
+    const gchar *password)
+{
+  g_hash_table_replace (server->users, g_strdup (username),
+      g_strdup (password));
+}
+
+const XiceAddress *
+xice_turn_server_get_address (XiceTurnServer *server)
+{
+  return &server->udp->addr;
+}
+
+void
+xice_turn_server_add_tcp_client (XiceTurnServer *server, XiceSocket *sock)
+{
+  Connection *conn = g_slice_new0 (Connection);
+
+  conn->server = server;
+  conn->sock = sock;
+  xice_address_init (&conn->client);
+  conn->partial = g_byte_array_new ();
+  server->connections = g_list_prepend (server->connections, conn);
+  server->stats.tcp_clients++;
+  xice_socket_set_callback (sock, priv_tcp_cb, conn);
+}
+
+static void
+priv_accept_cb (XiceSocket *listener, XiceSocket *sock, gpointer data)
+{
+  xice_turn_server_add_tcp_client (data, sock);
+}
+
+gboolean
+xice_turn_server_listen_tcp (XiceTurnServer *server)
+{
+  XiceAddress addr = server->udp->addr;
+
+  if (server->listener == NULL)
+    server->listener = xice_create_tcp_listener (server->ctx, &addr,
+        priv_accept_cb, server);
+  return server->listener != NULL;
+}
+
+void
+xice_turn_server_renew_nonce (XiceTurnServer *server, StunError stale_error)
+{
+  g_snprintf (server->nonce, sizeof (server->nonce), "%08x%08x",
+      g_random_int (), g_random_int ());
+  server->stale_error = stale_error;
+}
+
+void
+xice_turn_server_get_stats (XiceTurnServer *server,
+    XiceTurnServerStats *stats)
+{
+  *stats = server->stats;
+}
+
+void
+xice_turn_server_set_filter (XiceTurnServer *server,
+    XiceTurnServerFilterFunc func, gpointer data)
+{
+  server->filter = func;
+  server->filter_data = data;
+}
+
+void
+xice_turn_server_answer_held (XiceTurnServer *server)
+{
+  GQueue held = server->held;
+  Held *h;
+
+  g_queue_init (&server->held);
+  while ((h = g_queue_pop_head (&held)) != NULL) {
+    priv_handle_stun (server, h->conn,
+        h->conn != NULL ? &h->conn->client : &h->from, h->buf, h->len, TRUE);
+    priv_held_free (h);
+  }
+}
+
+void
+xice_turn_server_free (XiceTurnServer *server)
+{
+  GSList *values = NULL, *s;
+  GList *i;
+
+  if (server->timer != NULL)
+    xice_timer_destroy (server->timer);
+  if (server->listener != NULL)
+    xice_socket_free (server->listener);
+  g_queue_foreach (&server->held, (GFunc) priv_held_free, NULL);
+  g_queue_clear (&server->held);
+  for (i = server->connections; i; i = i->next)
+    priv_connection_free (i->data);
+  g_list_free (server->connections);
+  g_hash_table_foreach (server->udp_allocations, priv_collect, &values);
+  for (s = values; s; s = s->next)
+    priv_allocation_free (s->data);
+  g_slist_free (values);
+  g_hash_table_destroy (server->udp_allocations);
+  g_hash_table_destroy (server->users);
+  xice_socket_free (server->udp);
+  g_free (server->realm);
+  g_slice_free (XiceTurnServer, server);
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef _TURN_SERVER_H
+#define _TURN_SERVER_H
+
+/* A TURN server (RFC 5766) running on a XiceContext, so that the TURN
+ * sockets, the agent's relays and their data paths can be tested and
+ * measured without an external server, on the simulated network or on
+ * loopback. It takes UDP clients on its address and TCP clients on the
+ * same port or on the connections it is handed, authenticates their
+ * requests with long-term credentials, and relays over UDP through
+ * Allocate, Refresh, CreatePermission, ChannelBind, Send and Data,
+ * keeping allocations, permissions and channels for their lifetimes. Its
+ * nonce is renewed on demand, after which requests signed with the old one
+ * are refused with a 438 or a 401. Binding requests are answered without
+ * credentials. */
+
+#include "contexts/xicecontext.h"
+#include "contexts/xicesocket.h"
+#include "stun/stunmessage.h"
+
+G_BEGIN_DECLS
+
+typedef struct _XiceTurnServer XiceTurnServer;
+
+typedef struct {
+  guint allocations;            /* current */
+  guint64 requests;             /* authenticated requests answered */
+  guint64 challenges;           /* requests answered with a 401 */
+  guint64 errors;               /* other error responses */
+  guint64 permissions;          /* peers given a permission */
+  guint64 channel_binds;        /* successful ChannelBind requests */
+  guint64 packets_to_peers;
+  guint64 bytes_to_peers;
+  guint64 channel_data_to_peers; /* of the packets to peers */
+  guint64 packets_from_peers;
+  guint64 bytes_from_peers;
+  guint64 channel_data_from_peers; /* of the packets from peers */
+  guint64 packets_dropped;      /* no allocation, permission or channel */
+  guint tcp_clients;            /* current */
+  guint64 tcp_closed;           /* connections closed by their clients */
+} XiceTurnServerStats;
+
+/* What becomes of a request, as a XiceTurnServerFilterFunc decides */
+typedef enum {
+  XICE_TURN_SERVER_ANSWER,      /* answered as usual */
+  XICE_TURN_SERVER_REFUSE,      /* answered with a 486 (Allocation Quota
+                                 * Reached) */
+  XICE_TURN_SERVER_HOLD,        /* answered by xice_turn_server_answer_held() */
+  XICE_TURN_SERVER_DROP         /* never answered */
+} XiceTurnServerVerdict;
+
+/* Sees each request about to be answered, authenticated unless it is a
+ * Binding request, from @client over TCP if @tcp. Lets tests follow what
+ * the clients ask for, and make the server refuse, hold or drop some of
+ * it. */
+typedef XiceTurnServerVerdict (*XiceTurnServerFilterFunc) (
+    XiceTurnServer *server, const XiceAddress *client, gboolean tcp,
+    StunMessage *msg, gpointer data);
+
+/* Listens for UDP clients on @addr, any port if its port is 0. Relayed
+ * addresses are taken on the IP of @addr. */
+XiceTurnServer *
+xice_turn_server_new (XiceContext *ctx, const XiceAddress *addr,
+    const gchar *realm);
+
+void
+xice_turn_server_add_user (XiceTurnServer *server, const gchar *username,
+    const gchar *password);
+
+/* The address UDP clients send to */
+const XiceAddress *
+xice_turn_server_get_address (XiceTurnServer *server);
+
+/* Serves the client of an accepted TCP connection, e.g. from the accept
+ * callback of xice_sim_network_listen(). The server owns @sock. */
+void
+xice_turn_server_add_tcp_client (XiceTurnServer *server, XiceSocket *sock);
+
+/* Accepts TCP clients on the port UDP clients send to. FALSE if the port
+ * is taken for TCP, or the context cannot listen. */
+gboolean
+xice_turn_server_listen_tcp (XiceTurnServer *server);
+
+/* Takes a new nonce; requests signed with an older one are refused with
+ * @stale_error, a 438 as RFC 5389 asks or a 401 as some servers send */
+void
+xice_turn_server_renew_nonce (XiceTurnServer *server, StunError stale_error);
+
+void
+xice_turn_server_get_stats (XiceTurnServer *server,
+    XiceTurnServerStats *stats);
+
+/* NULL to answer every request */
+void
+xice_turn_server_set_filter (XiceTurnServer *server,
+    XiceTurnServerFilterFunc func, gpointer data);
+
+/* Answers the requests held so far, in the order they came, as if they
+ * had just arrived but without filtering them again. Those of a TCP client
+ * gone meanwhile are dropped. */
+void
+xice_turn_server_answer_held (XiceTurnServer *server);
+
+/* Drops the allocations and the TCP clients */
+void
+xice_turn_server_free (XiceTurnServer *server);
+
+G_END_DECLS
+
+#endif /* _TURN_SERVER_H */
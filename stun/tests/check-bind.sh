@@ -45,4 +45,16 @@ grep -e "^Mapped address: 127.0.0.1" stunc4.log || exit 4
 if test -f stund6.fail; then exit 77; fi
 grep -e "^Mapped address: ::1" stunc6.log || exit 6
 
+# Same with the threaded daemon
+rm -f stund?.fail stund?.pid stunc?.log
+(($SHELL -c "echo \$\$ > stund4.pid ; exec $STUND -4 -t 2 $PORT") || \
+	touch stund4.fail) &
+sleep 1
+$STUNC -4 127.0.0.1 $PORT > stunc4.log || test -f stund4.fail
+kill -INT $(cat stund4.pid) || true
+wait
+
+if test -f stund4.fail; then exit 77; fi
+grep -e "^Mapped address: 127.0.0.1" stunc4.log || exit 4
+
 rm -f stund?.fail stund?.pid stunc?.log
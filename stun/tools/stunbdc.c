@@ -50,6 +50,7 @@
 #include <sys/types.h>
 #include "stun/stunagent.h"
 #include "stun/usages/bind.h"
+#include "stun/usages/ice.h"
 
 #include <unistd.h>
 #include <getopt.h>
@@ -58,8 +59,33 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifndef _WIN32
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <time.h>
+#endif
+
 static int ai_flags = 0;
 
+/* Load generator mode, when rate is not 0 */
+typedef struct
+{
+  unsigned rate;
+  unsigned duration;
+  unsigned sockets;
+  unsigned window;
+  unsigned timeout;
+  bool conncheck;
+  const char *username;
+  const char *password;
+} LoadParams;
+
+#ifndef _WIN32
+static int run_load (const LoadParams *params, const struct sockaddr *addr,
+    socklen_t addrlen);
+#endif
+
 static void
 printaddr (const char *str, const struct sockaddr *addr, socklen_t addrlen)
 {
@@ -76,7 +102,8 @@ printaddr (const char *str, const struct sockaddr *addr, socklen_t addrlen)
 
 
 
-static int run (int family, const char *hostname, const char *service)
+static int run (int family, const char *hostname, const char *service,
+    const LoadParams *params)
 {
   struct addrinfo hints, *res;
   const struct addrinfo *ptr;
@@ -105,6 +132,14 @@ static int run (int family, const char *hostname, const char *service)
 
     printaddr ("Server address", ptr->ai_addr, ptr->ai_addrlen);
 
+#ifndef _WIN32
+    if (params->rate > 0)
+    {
+      ret = run_load (params, ptr->ai_addr, ptr->ai_addrlen);
+      break;
+    }
+#endif
+
     val = stun_usage_bind_run (ptr->ai_addr, ptr->ai_addrlen,
                          (struct sockaddr *)&addr, &addrlen);
     if (val)
@@ -121,6 +156,413 @@ static int run (int family, const char *hostname, const char *service)
 }
 
 
+#ifndef _WIN32
+
+/*
+ * Load generator: sends Binding requests or ICE connectivity checks at a
+ * steady rate over a number of sockets for a while, matches the responses
+ * to their transactions and reports the round-trip times and the loss.
+ * Every transaction is sent once; it is lost if no response came within the
+ * timeout.
+ */
+
+typedef struct
+{
+  StunTransactionId id;
+  uint64_t sent;
+  bool in_use;
+} LoadTransaction;
+
+typedef struct
+{
+  const LoadParams *params;
+  int *fds;
+  struct pollfd *pfds;
+  StunAgent *agents;
+  LoadTransaction *txns;
+  /* transaction by ID, linear probing, -1 when empty */
+  int *table;
+  unsigned mask;
+  uint64_t tie;
+  /* oldest transaction that may be outstanding, and next to send */
+  uint64_t oldest;
+  uint64_t next;
+  /* when the last one was sent, in microseconds */
+  uint64_t last_sent;
+  /* requests sent late as the window was full, up to which one */
+  uint64_t deferred;
+  uint64_t deferred_upto;
+  /* round-trip times of the answered transactions, in microseconds */
+  uint32_t *rtts;
+  size_t n_rtts;
+  size_t rtts_size;
+  uint64_t send_errors;
+  uint64_t responses;
+  uint64_t error_responses;
+  uint64_t invalid;
+  uint64_t unmatched;
+  uint64_t lost;
+} Load;
+
+static uint64_t now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned load_hash (const Load *load, const uint8_t *id)
+{
+  uint32_t h;
+
+  /* after the cookie, the ID is random */
+  memcpy (&h, id + 8, sizeof (h));
+  return h & load->mask;
+}
+
+static void load_table_add (Load *load, int slot)
+{
+  unsigned i = load_hash (load, load->txns[slot].id);
+
+  while (load->table[i] != -1)
+    i = (i + 1) & load->mask;
+  load->table[i] = slot;
+}
+
+static int load_table_find (Load *load, const uint8_t *id, unsigned *pos)
+{
+  unsigned i;
+
+  for (i = load_hash (load, id); load->table[i] != -1;
+       i = (i + 1) & load->mask)
+  {
+    if (memcmp (load->txns[load->table[i]].id, id,
+            sizeof (StunTransactionId)) == 0)
+    {
+      *pos = i;
+      return load->table[i];
+    }
+  }
+  return -1;
+}
+
+static void load_table_remove (Load *load, unsigned i)
+{
+  unsigned j = i;
+
+  /* shift back the entries that probed past the removed one */
+  for (;;)
+  {
+    unsigned k;
+
+    j = (j + 1) & load->mask;
+    if (load->table[j] == -1)
+      break;
+    k = load_hash (load, load->txns[load->table[j]].id);
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    load->table[i] = load->table[j];
+    i = j;
+  }
+  load->table[i] = -1;
+}
+
+static StunAgent *load_agent (Load *load, int slot)
+{
+  /* each agent remembers so many transactions */
+  return &load->agents[slot / STUN_AGENT_MAX_SAVED_IDS];
+}
+
+static void load_forget (Load *load, int slot)
+{
+  unsigned pos;
+
+  if (load_table_find (load, load->txns[slot].id, &pos) == slot)
+    load_table_remove (load, pos);
+  stun_agent_forget_transaction (load_agent (load, slot),
+      load->txns[slot].id);
+  load->txns[slot].in_use = false;
+}
+
+/* Returns false if the window is full */
+static bool load_send (Load *load, const struct sockaddr *addr,
+    socklen_t addrlen)
+{
+  const LoadParams *params = load->params;
+  int slot = load->next % params->window;
+  LoadTransaction *txn = &load->txns[slot];
+  StunAgent *agent = load_agent (load, slot);
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+  StunMessage msg;
+  size_t len;
+  ssize_t val;
+
+  if (txn->in_use || load->next - load->oldest >= params->window)
+    return false;
+
+  if (params->conncheck)
+  {
+    len = stun_usage_ice_conncheck_create (agent, &msg, buf, sizeof (buf),
+        (const uint8_t *)params->username, strlen (params->username),
+        (const uint8_t *)params->password, strlen (params->password),
+        false, true, 0x6e0001ff, load->tie, NULL,
+        STUN_USAGE_ICE_COMPATIBILITY_RFC5245);
+  }
+  else if (params->password != NULL)
+  {
+    stun_agent_init_request (agent, &msg, buf, sizeof (buf), STUN_BINDING);
+    if (params->username != NULL)
+      stun_message_append_string (&msg, STUN_ATTRIBUTE_USERNAME,
+          params->username);
+    len = stun_agent_finish_message (agent, &msg,
+        (const uint8_t *)params->password, strlen (params->password));
+  }
+  else
+    len = stun_usage_bind_create (agent, &msg, buf, sizeof (buf));
+
+  load->next++;
+  if (len == 0)
+  {
+    load->send_errors++;
+    return true;
+  }
+
+  stun_message_id (&msg, txn->id);
+  txn->sent = load->last_sent = now_us ();
+  val = sendto (load->fds[slot % params->sockets], buf, len, 0, addr,
+      addrlen);
+  if (val < (ssize_t)len)
+  {
+    stun_agent_forget_transaction (agent, txn->id);
+    load->send_errors++;
+    return true;
+  }
+
+  txn->in_use = true;
+  load_table_add (load, slot);
+  return true;
+}
+
+static void load_receive (Load *load, int fd)
+{
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+  StunTransactionId id;
+  StunMessage msg;
+  unsigned pos;
+  ssize_t len;
+  int slot;
+
+  while ((len = recv (fd, buf, sizeof (buf), 0)) >= 0)
+  {
+    uint64_t now = now_us ();
+
+    if (stun_message_validate_buffer_length (buf, len, true) != len)
+    {
+      load->invalid++;
+      continue;
+    }
+
+    memcpy (id, buf + STUN_MESSAGE_TRANS_ID_POS, sizeof (id));
+    slot = load_table_find (load, id, &pos);
+    if (slot == -1)
+    {
+      /* late, or not ours */
+      load->unmatched++;
+      continue;
+    }
+
+    if (stun_agent_validate (load_agent (load, slot), &msg, buf, len, NULL,
+            NULL) != STUN_VALIDATION_SUCCESS)
+      load->invalid++;
+    else if (stun_message_get_class (&msg) == STUN_ERROR)
+      load->error_responses++;
+    else
+    {
+      if (load->n_rtts == load->rtts_size)
+      {
+        size_t size = load->rtts_size ? 2 * load->rtts_size : 4096;
+        uint32_t *rtts = realloc (load->rtts, size * sizeof (*rtts));
+
+        /* out of memory, the round-trip times are those kept so far */
+        if (rtts != NULL)
+        {
+          load->rtts = rtts;
+          load->rtts_size = size;
+        }
+      }
+      if (load->n_rtts < load->rtts_size)
+        load->rtts[load->n_rtts++] = now - load->txns[slot].sent;
+      load->responses++;
+    }
+    load_forget (load, slot);
+  }
+}
+
+static void load_expire (Load *load, uint64_t now)
+{
+  const LoadParams *params = load->params;
+
+  while (load->oldest < load->next)
+  {
+    LoadTransaction *txn = &load->txns[load->oldest % params->window];
+
+    if (txn->in_use)
+    {
+      if (now - txn->sent < (uint64_t)params->timeout * 1000)
+        break;
+      load->lost++;
+      load_forget (load, load->oldest % params->window);
+    }
+    load->oldest++;
+  }
+}
+
+static int compare_rtt (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void load_report (Load *load, uint64_t elapsed)
+{
+  static const unsigned percentiles[] = { 500, 900, 990, 999 };
+  uint64_t sent = load->next - load->send_errors;
+  unsigned i;
+
+  printf ("Sent: %llu requests in %.3f s (%.0f/s), %llu send errors, "
+      "%llu deferred by the window\n",
+      (unsigned long long)sent, elapsed / 1e6,
+      elapsed ? sent * 1e6 / elapsed : 0.0,
+      (unsigned long long)load->send_errors,
+      (unsigned long long)load->deferred);
+  printf ("Received: %llu responses, %llu error responses, "
+      "%llu invalid, %llu unmatched\n",
+      (unsigned long long)load->responses,
+      (unsigned long long)load->error_responses,
+      (unsigned long long)load->invalid, (unsigned long long)load->unmatched);
+  printf ("Lost: %llu (%.2f%%)\n", (unsigned long long)load->lost,
+      sent ? load->lost * 100.0 / sent : 0.0);
+
+  if (load->n_rtts == 0)
+    return;
+
+  qsort (load->rtts, load->n_rtts, sizeof (*load->rtts), compare_rtt);
+  printf ("Round-trip time (us): min %u", load->rtts[0]);
+  for (i = 0; i < sizeof (percentiles) / sizeof (percentiles[0]); i++)
+    printf (", p%g %u", percentiles[i] / 10.0,
+        load->rtts[(load->n_rtts - 1) * percentiles[i] / 1000]);
+  printf (", max %u\n", load->rtts[load->n_rtts - 1]);
+}
+
+static int run_load (const LoadParams *params, const struct sockaddr *addr,
+    socklen_t addrlen)
+{
+  Load load;
+  unsigned n_agents, size, i;
+  uint64_t start, now = 0;
+  uint64_t end = (uint64_t)params->duration * 1000000;
+  uint64_t total = (uint64_t)params->rate * params->duration;
+  int rcvbuf = 1 << 20;
+  int ret = -1;
+
+  memset (&load, 0, sizeof (load));
+  load.params = params;
+
+  for (size = 2; size < 2 * params->window; size *= 2);
+  load.mask = size - 1;
+  n_agents = (params->window + STUN_AGENT_MAX_SAVED_IDS - 1) /
+      STUN_AGENT_MAX_SAVED_IDS;
+
+  load.fds = malloc (params->sockets * sizeof (*load.fds));
+  load.pfds = malloc (params->sockets * sizeof (*load.pfds));
+  load.agents = malloc (n_agents * sizeof (*load.agents));
+  load.txns = calloc (params->window, sizeof (*load.txns));
+  load.table = malloc (size * sizeof (*load.table));
+  if (!load.fds || !load.pfds || !load.agents || !load.txns || !load.table)
+    goto out;
+
+  memset (load.table, -1, size * sizeof (*load.table));
+  for (i = 0; i < n_agents; i++)
+    stun_agent_init (&load.agents[i], STUN_ALL_KNOWN_ATTRIBUTES,
+        STUN_COMPATIBILITY_RFC5389,
+        STUN_AGENT_USAGE_USE_FINGERPRINT | (params->password ?
+            STUN_AGENT_USAGE_SHORT_TERM_CREDENTIALS : 0));
+  load.tie = ((uint64_t)getpid () << 32) | (uint32_t)now_us ();
+
+  for (i = 0; i < params->sockets; i++)
+    load.fds[i] = -1;
+  for (i = 0; i < params->sockets; i++)
+  {
+    int fd = socket (addr->sa_family, SOCK_DGRAM, 0);
+
+    if (fd == -1)
+    {
+      fprintf (stderr, "Socket %u of %u: %s\n", i + 1, params->sockets,
+          strerror (errno));
+      goto out;
+    }
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    /* room for the responses that come in while sending */
+    setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+    load.fds[i] = fd;
+    load.pfds[i].fd = fd;
+    load.pfds[i].events = POLLIN;
+  }
+
+  start = now_us ();
+  for (;;)
+  {
+    load_expire (&load, now_us ());
+    now = now_us () - start;
+
+    if (load.next < total)
+    {
+      uint64_t due = ((now < end) ? now : end) * params->rate / 1000000 + 1;
+
+      if (due > total)
+        due = total;
+      while (load.next < due && load_send (&load, addr, addrlen));
+      if (load.next < due && due > load.deferred_upto)
+      {
+        /* the window is full: count each late request once */
+        load.deferred += due - ((load.next > load.deferred_upto) ?
+            load.next : load.deferred_upto);
+        load.deferred_upto = due;
+      }
+    }
+    else if (load.oldest == load.next)
+      break;
+
+    if (poll (load.pfds, params->sockets, 1) > 0)
+    {
+      for (i = 0; i < params->sockets; i++)
+        if (load.pfds[i].revents & POLLIN)
+          load_receive (&load, load.fds[i]);
+    }
+  }
+
+  load_report (&load, load.last_sent > start ? load.last_sent - start : 0);
+  ret = 0;
+
+out:
+  if (load.fds)
+    for (i = 0; i < params->sockets; i++)
+      if (load.fds[i] != -1)
+        close (load.fds[i]);
+  free (load.fds);
+  free (load.pfds);
+  free (load.agents);
+  free (load.txns);
+  free (load.table);
+  free (load.rtts);
+  return ret;
+}
+
+#endif
+
+
 int main (int argc, char *argv[])
 {
   static const struct option opts[] =
@@ -130,14 +572,24 @@ int main (int argc, char *argv[])
     { "help",    no_argument, NULL, 'h' },
     { "numeric", no_argument, NULL, 'n' },
     { "version", no_argument, NULL, 'V' },
+    { "rate",      required_argument, NULL, 'r' },
+    { "duration",  required_argument, NULL, 'd' },
+    { "sockets",   required_argument, NULL, 's' },
+    { "window",    required_argument, NULL, 'w' },
+    { "timeout",   required_argument, NULL, 't' },
+    { "conncheck", no_argument,       NULL, 'c' },
+    { "username",  required_argument, NULL, 'u' },
+    { "password",  required_argument, NULL, 'p' },
     { NULL,      0,           NULL, 0   }
   };
   const char *server = NULL, *port = NULL;
   int family = AF_UNSPEC;
+  LoadParams params = { 0, 10, 1, 4096, 1000, false, NULL, NULL };
 
   for (;;)
   {
-    int val = getopt_long (argc, argv, "46hnV", opts, NULL);
+    int val = getopt_long (argc, argv, "46hnVr:d:s:w:t:cu:p:", opts,
+        NULL);
     if (val == EOF)
       break;
 
@@ -152,12 +604,26 @@ int main (int argc, char *argv[])
         break;
 
       case 'h':
-        printf ("Usage: %s [-4|-6] <server> [port number]\n"
-                "Performs STUN Binding Discovery\n"
+        printf ("Usage: %s [-4|-6] [-r rate [options]] <server> [port number]\n"
+                "Performs STUN Binding Discovery, or sends requests at a\n"
+                "given rate and reports the round-trip times and the loss\n"
                 "\n"
                 "  -4, --ipv4    Force IP version 4\n"
                 "  -6, --ipv6    Force IP version 6\n"
                 "  -n, --numeric Server in numeric form\n"
+                "\n"
+                "  -r, --rate=N      Send N requests per second\n"
+                "  -d, --duration=S  Send for S seconds (default 10)\n"
+                "  -s, --sockets=N   Send from N sockets in turn (default 1)\n"
+                "  -w, --window=N    Have at most N requests outstanding\n"
+                "                    (default 4096)\n"
+                "  -t, --timeout=MS  Count a request lost after MS\n"
+                "                    milliseconds (default 1000)\n"
+                "  -c, --conncheck   Send ICE connectivity checks rather\n"
+                "                    than Binding requests\n"
+                "  -u, --username=U  USERNAME of the requests\n"
+                "  -p, --password=P  Short-term password of the\n"
+                "                    MESSAGE-INTEGRITY of the requests\n"
             "\n", argv[0]);
         return 0;
 
@@ -170,11 +636,66 @@ int main (int argc, char *argv[])
                 PACKAGE, VERSION);
         return 0;
 
+      case 'r':
+        params.rate = atoi (optarg);
+        break;
+
+      case 'd':
+        params.duration = atoi (optarg);
+        break;
+
+      case 's':
+        params.sockets = atoi (optarg);
+        break;
+
+      case 'w':
+        params.window = atoi (optarg);
+        break;
+
+      case 't':
+        params.timeout = atoi (optarg);
+        break;
+
+      case 'c':
+        params.conncheck = true;
+        break;
+
+      case 'u':
+        params.username = optarg;
+        break;
+
+      case 'p':
+        params.password = optarg;
+        break;
+
       default:
         return 2;
     }
   }
 
+  if (params.rate > 0 && (params.duration == 0 || params.sockets == 0 ||
+          params.window == 0))
+  {
+    fprintf (stderr, "%s: duration, sockets and window must not be 0\n",
+        argv[0]);
+    return 2;
+  }
+#ifdef _WIN32
+  if (params.rate > 0)
+  {
+    fprintf (stderr, "%s: the load generator is not available on this "
+        "system\n", argv[0]);
+    return 2;
+  }
+#endif
+  if (params.conncheck && (params.username == NULL ||
+          params.password == NULL))
+  {
+    fprintf (stderr, "%s: connectivity checks need a username and a "
+        "password\n", argv[0]);
+    return 2;
+  }
+
   if (optind < argc)
     server = argv[optind++];
   if (optind < argc)
@@ -185,5 +706,5 @@ int main (int argc, char *argv[])
     return 2;
   }
 
-  return run (family, server, port) ? 1 : 0;
+  return run (family, server, port, &params) ? 1 : 0;
 }
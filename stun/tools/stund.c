@@ -40,6 +40,11 @@
 # include <config.h>
 #endif
 
+/* recvmmsg() and sendmmsg() */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
+
 #ifdef __sun
 #define _XPG4_2 1
 #endif
@@ -62,6 +67,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
 
 #ifndef SOL_IP
 # define SOL_IP IPPROTO_IP
@@ -80,16 +87,24 @@
 #define IPPORT_STUN  3478
 
 #include "stun/stunagent.h"
+#include "stun/stun5389.h"
 #include "stund.h"
 
+/** Datagrams received and answered with one system call in threaded mode */
+#define STUND_BATCH 64
+/** Most worker threads */
+#define STUND_MAX_THREADS 64
+
 static const uint16_t known_attributes[] =  {
   0
 };
 
 /*
- * Creates a listening socket
+ * Creates a listening socket, which may share its port with others when
+ * reuse_port is set and the system allows it
  */
-int listen_socket (int fam, int type, int proto, unsigned int port)
+static int bind_socket (int fam, int type, int proto, unsigned int port,
+    int reuse_port)
 {
   int yes = 1;
   int fd = socket (fam, type, proto);
@@ -107,6 +122,16 @@ int listen_socket (int fam, int type, int proto, unsigned int port)
   if (fd < 3)
     goto error;
 
+  if (reuse_port)
+  {
+#ifdef SO_REUSEPORT
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof (yes)))
+      goto error;
+#else
+    goto error;
+#endif
+  }
+
   memset (&addr, 0, sizeof (addr));
   addr.storage.ss_family = fam;
 #ifdef HAVE_SA_LEN
@@ -127,7 +152,8 @@ int listen_socket (int fam, int type, int proto, unsigned int port)
       break;
   }
 
-  if (bind (fd, (struct sockaddr *)&addr, sizeof (struct sockaddr)))
+  if (bind (fd, (struct sockaddr *)&addr, (fam == AF_INET6) ?
+          sizeof (addr.in6) : sizeof (addr.in)))
   {
     perror ("Error opening IP port");
     goto error;
@@ -166,24 +192,24 @@ error:
   return -1;
 }
 
-static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
+int listen_socket (int fam, int type, int proto, unsigned int port)
+{
+  return bind_socket (fam, type, proto, port, 0);
+}
+
+/*
+ * Builds the answer to a datagram in out, returns its length or 0 if there
+ * is none
+ */
+static size_t process_request (StunAgent *oldagent, StunAgent *newagent,
+    uint8_t *buf, size_t len, const struct sockaddr *addr, socklen_t addr_len,
+    uint8_t *out, size_t out_size)
 {
-  struct sockaddr_storage addr;
-  socklen_t addr_len;
-  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
-  size_t buf_len = 0;
-  size_t len = 0;
   StunMessage request;
   StunMessage response;
   StunValidationStatus validation;
   StunAgent *agent = NULL;
 
-  addr_len = sizeof (struct sockaddr_in);
-  len = recvfrom (sock, buf, sizeof(buf), 0,
-      (struct sockaddr *)&addr, &addr_len);
-  if (len == (size_t)-1)
-    return -1;
-
   validation = stun_agent_validate (newagent, &request, buf, len, NULL, 0);
 
   if (validation == STUN_VALIDATION_SUCCESS) {
@@ -197,39 +223,58 @@ static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
   /* Unknown attributes */
   if (validation == STUN_VALIDATION_UNKNOWN_REQUEST_ATTRIBUTE)
   {
-    buf_len = stun_agent_build_unknown_attributes_error (agent, &response, buf,
-        sizeof (buf), &request);
-    goto send_buf;
+    return stun_agent_build_unknown_attributes_error (agent, &response, out,
+        out_size, &request);
   }
 
   /* Mal-formatted packets */
   if (validation != STUN_VALIDATION_SUCCESS ||
       stun_message_get_class (&request) != STUN_REQUEST) {
-    return -1;
+    return 0;
   }
 
   switch (stun_message_get_method (&request))
   {
     case STUN_BINDING:
-      stun_agent_init_response (agent, &response, buf, sizeof (buf), &request);
+      stun_agent_init_response (agent, &response, out, out_size, &request);
       if (stun_message_has_cookie (&request))
         stun_message_append_xor_addr (&response,
-            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS,
-            (struct sockaddr *)&addr, addr_len);
+            STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS, addr, addr_len);
       else
          stun_message_append_addr (&response, STUN_ATTRIBUTE_MAPPED_ADDRESS,
-             (struct sockaddr *)&addr, addr_len);
+             addr, addr_len);
       break;
 
     default:
-      if (!stun_agent_init_error (agent, &response, buf, sizeof (buf),
+      if (!stun_agent_init_error (agent, &response, out, out_size,
               &request, STUN_ERROR_BAD_REQUEST))
-        return -1;
+        return 0;
   }
 
-  buf_len = stun_agent_finish_message (agent, &response, NULL, 0);
-send_buf:
-  len = sendto (sock, buf, buf_len, 0,
+  return stun_agent_finish_message (agent, &response, NULL, 0);
+}
+
+static int dgram_process (int sock, StunAgent *oldagent, StunAgent *newagent)
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  uint8_t out[STUN_MAX_MESSAGE_SIZE];
+  size_t buf_len = 0;
+  size_t len = 0;
+
+  addr_len = sizeof (addr);
+  len = recvfrom (sock, buf, sizeof(buf), 0,
+      (struct sockaddr *)&addr, &addr_len);
+  if (len == (size_t)-1)
+    return -1;
+
+  buf_len = process_request (oldagent, newagent, buf, len,
+      (struct sockaddr *)&addr, addr_len, out, sizeof (out));
+  if (buf_len == 0)
+    return -1;
+
+  len = sendto (sock, out, buf_len, 0,
       (struct sockaddr *)&addr, addr_len);
   return (len < buf_len) ? -1 : 0;
 }
@@ -253,6 +298,322 @@ static int run (int family, int protocol, unsigned port)
 }
 
 
+/*
+ * Threaded mode: each worker has its own socket on the port where the
+ * system balances datagrams over them (SO_REUSEPORT), or else shares the
+ * first one. Datagrams are taken and answered in batches, and the usual
+ * answer, a Binding response with XOR-MAPPED-ADDRESS and FINGERPRINT, is
+ * filled in from a template rather than built.
+ */
+
+/** Offsets in the Binding response template */
+#define TEMPLATE_ID_POS 4
+#define TEMPLATE_ADDR_POS (STUN_MESSAGE_HEADER_LENGTH + 4)
+
+typedef struct
+{
+  pthread_t thread;
+  int fd;
+  int family;
+  StunAgent oldagent;
+  StunAgent newagent;
+  /* XOR-MAPPED-ADDRESS of the family, then FINGERPRINT */
+  uint8_t template[STUN_MESSAGE_HEADER_LENGTH + 4 + 20 + 8];
+  size_t template_len;
+  /* read by the main thread */
+  uint64_t requests;
+  uint64_t responses;
+} Worker;
+
+static void worker_init_template (Worker *w)
+{
+  size_t addr_len = (w->family == AF_INET6) ? 20 : 8;
+  uint8_t *t = w->template;
+
+  memset (t, 0, sizeof (w->template));
+  w->template_len = STUN_MESSAGE_HEADER_LENGTH + 4 + addr_len + 8;
+
+  /* Binding success response, its ID is the request's */
+  t[0] = 0x01;
+  t[1] = 0x01;
+  t[2] = 0;
+  t[3] = w->template_len - STUN_MESSAGE_HEADER_LENGTH;
+
+  t += STUN_MESSAGE_HEADER_LENGTH;
+  t[0] = STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS >> 8;
+  t[1] = STUN_ATTRIBUTE_XOR_MAPPED_ADDRESS & 0xff;
+  t[3] = addr_len;
+  t[5] = (w->family == AF_INET6) ? 2 : 1;
+
+  t += 4 + addr_len;
+  t[0] = STUN_ATTRIBUTE_FINGERPRINT >> 8;
+  t[1] = STUN_ATTRIBUTE_FINGERPRINT & 0xff;
+  t[3] = 4;
+}
+
+/*
+ * Fills in the template for a validated Binding request of RFC 5389 from
+ * addr, returns the length of the response or 0 if the template does not
+ * apply
+ */
+static size_t worker_fill_template (Worker *w, const uint8_t *req,
+    const struct sockaddr *addr, uint8_t *out)
+{
+  uint8_t *value = out + TEMPLATE_ADDR_POS;
+  uint32_t fpr;
+  size_t i;
+
+  if (addr->sa_family != w->family)
+    return 0;
+
+  memcpy (out, w->template, w->template_len);
+  memcpy (out + TEMPLATE_ID_POS, req + TEMPLATE_ID_POS,
+      STUN_MESSAGE_TRANS_ID_POS + STUN_MESSAGE_TRANS_ID_LEN - TEMPLATE_ID_POS);
+
+  /* the port and address are XOR'ed with the cookie, and the address of
+   * IPv6 with the transaction ID after it */
+  if (w->family == AF_INET6)
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    memcpy (value + 2, &in6->sin6_port, 2);
+    memcpy (value + 4, &in6->sin6_addr, 16);
+    for (i = 0; i < 16; i++)
+      value[4 + i] ^= out[TEMPLATE_ID_POS + i];
+  }
+  else
+  {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    memcpy (value + 2, &in->sin_port, 2);
+    memcpy (value + 4, &in->sin_addr, 4);
+    for (i = 0; i < 4; i++)
+      value[4 + i] ^= out[TEMPLATE_ID_POS + i];
+  }
+  value[2] ^= out[TEMPLATE_ID_POS];
+  value[3] ^= out[TEMPLATE_ID_POS + 1];
+
+  fpr = stun_fingerprint (out, w->template_len, false);
+  memcpy (out + w->template_len - 4, &fpr, sizeof (fpr));
+
+  return w->template_len;
+}
+
+static size_t worker_answer (Worker *w, uint8_t *buf, size_t len,
+    const struct sockaddr *addr, socklen_t addr_len, uint8_t *out)
+{
+  StunMessage request;
+
+  /* only plain Binding requests take the template */
+  if (len >= STUN_MESSAGE_HEADER_LENGTH && buf[0] == 0x00 && buf[1] == 0x01 &&
+      stun_agent_validate (&w->newagent, &request, buf, len, NULL, 0) ==
+      STUN_VALIDATION_SUCCESS)
+  {
+    size_t out_len = worker_fill_template (w, buf, addr, out);
+    if (out_len > 0)
+      return out_len;
+  }
+
+  return process_request (&w->oldagent, &w->newagent, buf, len, addr,
+      addr_len, out, STUN_MAX_MESSAGE_SIZE_IPV6);
+}
+
+typedef struct
+{
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE_IPV6];
+  uint8_t out[STUN_MAX_MESSAGE_SIZE_IPV6];
+  struct sockaddr_storage addr;
+  struct iovec in_iov;
+  struct iovec out_iov;
+} Slot;
+
+/*
+ * One datagram of a batch: a struct mmsghdr where the system has one, the
+ * same fields over a plain struct msghdr where it does not
+ */
+#if defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)
+typedef struct mmsghdr BatchMsg;
+#else
+typedef struct
+{
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} BatchMsg;
+#endif
+
+static int recv_batch (int fd, BatchMsg *msgs, unsigned n)
+{
+#ifdef HAVE_RECVMMSG
+  return recvmmsg (fd, msgs, n, MSG_WAITFORONE, NULL);
+#else
+  ssize_t len = recvmsg (fd, &msgs[0].msg_hdr, 0);
+  if (len < 0)
+    return -1;
+  msgs[0].msg_len = len;
+  return 1;
+#endif
+}
+
+static void send_batch (int fd, BatchMsg *msgs, unsigned n)
+{
+#ifdef HAVE_SENDMMSG
+  unsigned sent = 0;
+
+  while (sent < n)
+  {
+    int val = sendmmsg (fd, msgs + sent, n - sent, 0);
+    if (val <= 0)
+      return;
+    sent += val;
+  }
+#else
+  unsigned i;
+
+  for (i = 0; i < n; i++)
+    sendmsg (fd, &msgs[i].msg_hdr, 0);
+#endif
+}
+
+static void *worker_run (void *data)
+{
+  Worker *w = data;
+  Slot *slots = calloc (STUND_BATCH, sizeof (Slot));
+  BatchMsg in[STUND_BATCH];
+  BatchMsg out[STUND_BATCH];
+  unsigned i;
+
+  if (slots == NULL)
+    return NULL;
+
+  memset (in, 0, sizeof (in));
+  for (i = 0; i < STUND_BATCH; i++)
+  {
+    slots[i].in_iov.iov_base = slots[i].buf;
+    slots[i].in_iov.iov_len = sizeof (slots[i].buf);
+    in[i].msg_hdr.msg_iov = &slots[i].in_iov;
+    in[i].msg_hdr.msg_iovlen = 1;
+    in[i].msg_hdr.msg_name = &slots[i].addr;
+  }
+
+  for (;;)
+  {
+    unsigned n_out = 0;
+    int n;
+
+    for (i = 0; i < STUND_BATCH; i++)
+      in[i].msg_hdr.msg_namelen = sizeof (slots[i].addr);
+
+    n = recv_batch (w->fd, in, STUND_BATCH);
+    if (n <= 0)
+    {
+      if (n < 0 && errno != EINTR && errno != EAGAIN)
+        perror ("Error receiving");
+      continue;
+    }
+
+    for (i = 0; i < (unsigned)n; i++)
+    {
+      Slot *slot = &slots[i];
+      size_t len = worker_answer (w, slot->buf, in[i].msg_len,
+          (struct sockaddr *)&slot->addr, in[i].msg_hdr.msg_namelen,
+          slot->out);
+      if (len == 0)
+        continue;
+
+      memset (&out[n_out], 0, sizeof (out[n_out]));
+      slot->out_iov.iov_base = slot->out;
+      slot->out_iov.iov_len = len;
+      out[n_out].msg_hdr.msg_iov = &slot->out_iov;
+      out[n_out].msg_hdr.msg_iovlen = 1;
+      out[n_out].msg_hdr.msg_name = &slot->addr;
+      out[n_out].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+      n_out++;
+    }
+    send_batch (w->fd, out, n_out);
+
+    __sync_fetch_and_add (&w->requests, n);
+    __sync_fetch_and_add (&w->responses, n_out);
+  }
+
+  return NULL;
+}
+
+static double now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_threaded (int family, int protocol, unsigned port,
+    unsigned n_threads, unsigned interval)
+{
+  static Worker workers[STUND_MAX_THREADS];
+  uint64_t last_requests = 0;
+  double last = now_seconds ();
+  unsigned i;
+
+  for (i = 0; i < n_threads; i++)
+  {
+    Worker *w = &workers[i];
+
+    w->family = family;
+    w->fd = bind_socket (family, SOCK_DGRAM, protocol, port, 1);
+    if (w->fd == -1)
+    {
+      if (i == 0)
+      {
+        /* no SO_REUSEPORT, the workers share one socket */
+        w->fd = listen_socket (family, SOCK_DGRAM, protocol, port);
+        if (w->fd == -1)
+          return -1;
+      }
+      else
+        w->fd = workers[0].fd;
+    }
+    stun_agent_init (&w->oldagent, known_attributes,
+        STUN_COMPATIBILITY_RFC3489, 0);
+    stun_agent_init (&w->newagent, known_attributes,
+        STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_USE_FINGERPRINT);
+    worker_init_template (w);
+  }
+
+  for (i = 0; i < n_threads; i++)
+  {
+    if (pthread_create (&workers[i].thread, NULL, worker_run, &workers[i]))
+    {
+      perror ("Error starting worker");
+      return -1;
+    }
+  }
+
+  if (interval == 0)
+  {
+    pthread_join (workers[0].thread, NULL);
+    return 0;
+  }
+
+  for (;;)
+  {
+    uint64_t requests = 0, responses = 0;
+    double now;
+
+    sleep (interval);
+    for (i = 0; i < n_threads; i++)
+    {
+      requests += __sync_fetch_and_add (&workers[i].requests, 0);
+      responses += __sync_fetch_and_add (&workers[i].responses, 0);
+    }
+    now = now_seconds ();
+    printf ("%.0f requests/s, %llu requests, %llu responses\n",
+        (requests - last_requests) / (now - last),
+        (unsigned long long)requests, (unsigned long long)responses);
+    fflush (stdout);
+    last_requests = requests;
+    last = now;
+  }
+}
+
+
 /* Pretty useless dummy signal handler...
  * But calling exit() is needed for gcov to work properly. */
 static void exit_handler (int signum)
@@ -266,10 +627,12 @@ int main (int argc, char *argv[])
 {
   int family = AF_INET;
   unsigned port = IPPORT_STUN;
+  unsigned n_threads = 0;
+  unsigned interval = 0;
 
   for (;;)
   {
-    int c = getopt (argc, argv, "46");
+    int c = getopt (argc, argv, "46t:i:");
     if (c == EOF)
       break;
 
@@ -282,14 +645,42 @@ int main (int argc, char *argv[])
       case '6':
         family = AF_INET6;
         break;
+
+      case 't':
+        n_threads = atoi (optarg);
+        if (n_threads < 1 || n_threads > STUND_MAX_THREADS)
+        {
+          fprintf (stderr, "Threads must be between 1 and %d\n",
+              STUND_MAX_THREADS);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'i':
+        interval = atoi (optarg);
+        break;
+
+      default:
+        fprintf (stderr, "Usage: %s [-4|-6] [-t threads [-i seconds]] "
+            "[port]\n", argv[0]);
+        return EXIT_FAILURE;
     }
   }
 
+  if (interval > 0 && n_threads == 0)
+  {
+    fprintf (stderr, "The report interval (-i) needs worker threads (-t)\n");
+    return EXIT_FAILURE;
+  }
+
   if (optind < argc)
     port = atoi (argv[optind++]);
 
   signal (SIGINT, exit_handler);
   signal (SIGTERM, exit_handler);
+  if (n_threads > 0)
+    return run_threaded (family, IPPROTO_UDP, port, n_threads, interval) ?
+        EXIT_FAILURE : EXIT_SUCCESS;
   return run (family, IPPROTO_UDP, port) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
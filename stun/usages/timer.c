@@ -55,8 +55,12 @@
  * Clock used throughout the STUN code.
  * STUN requires a monotonic 1kHz clock to operate properly.
  */
-static void stun_gettime (struct timeval *now)
+static void stun_gettime (const StunTimer *timer, struct timeval *now)
 {
+  if (timer->clock != NULL) {
+    timer->clock (now, timer->clock_data);
+    return;
+  }
 #ifdef _WIN32
   FILETIME ft;
   unsigned long long *time64 = (unsigned long long *) &ft;
@@ -103,7 +107,18 @@ static void add_delay (struct timeval *ts, unsigned delay)
 void stun_timer_start (StunTimer *timer, unsigned int initial_timeout,
     unsigned int max_retransmissions)
 {
-  stun_gettime (&timer->deadline);
+  stun_timer_start_with_clock (timer, initial_timeout, max_retransmissions,
+      NULL, NULL);
+}
+
+
+void stun_timer_start_with_clock (StunTimer *timer,
+    unsigned int initial_timeout, unsigned int max_retransmissions,
+    StunTimerClockFunc func, void *user_data)
+{
+  timer->clock = func;
+  timer->clock_data = user_data;
+  stun_gettime (timer, &timer->deadline);
   timer->retransmissions = 0;
   timer->delay = initial_timeout;
   timer->max_retransmissions = max_retransmissions;
@@ -123,7 +138,7 @@ unsigned stun_timer_remainder (const StunTimer *timer)
   unsigned delay;
   struct timeval now;
 
-  stun_gettime (&now);
+  stun_gettime (timer, &now);
   if (now.tv_sec > timer->deadline.tv_sec)
     return 0;
 
@@ -118,11 +118,22 @@
  */
 typedef struct stun_timer_s StunTimer;
 
+/**
+ * StunTimerClockFunc:
+ * @now: The <type>struct timeval</type> to fill with the current time
+ * @user_data: The user data given with the clock
+ *
+ * Callback used to read the current time of a #StunTimer
+ */
+typedef void (*StunTimerClockFunc) (struct timeval *now, void *user_data);
+
 struct stun_timer_s {
   struct timeval deadline;
   unsigned delay;
   unsigned retransmissions;
   unsigned max_retransmissions;
+  StunTimerClockFunc clock;
+  void *clock_data;
 };
 
 
@@ -207,6 +218,24 @@ void stun_timer_start (StunTimer *timer, unsigned int initial_timeout,
  */
 void stun_timer_start_reliable (StunTimer *timer, unsigned int initial_timeout);
 
+/**
+ * stun_timer_start_with_clock:
+ * @timer: The #StunTimer to start
+ * @initial_timeout: The initial timeout to use before the first retransmission
+ * @max_retransmissions: The maximum number of transmissions before the
+ * #StunTimer times out, 0 for a reliable transport
+ * @func: The clock of the timer, or %NULL for the default clock
+ * @user_data: The user data to pass to @func
+ *
+ * Starts a STUN transaction retransmission timer like stun_timer_start(),
+ * but reading the time from @func until the timer is started again, for
+ * example from the cached clock of an event loop or from a virtual clock.
+ * The clock must be monotonic and have a millisecond resolution.
+ */
+void stun_timer_start_with_clock (StunTimer *timer,
+    unsigned int initial_timeout, unsigned int max_retransmissions,
+    StunTimerClockFunc func, void *user_data);
+
 /**
  * stun_timer_refresh:
  * @timer: The #StunTimer to refresh
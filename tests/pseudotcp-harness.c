@@ -0,0 +1,219 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "pseudotcp-harness.h"
+
+#define PERIOD 251
+
+PseudoTcpSocket *harness_left;
+PseudoTcpSocket *harness_right;
+guint32 harness_now = 1;
+guint harness_received;
+
+static const HarnessLink *current;
+static GQueue packets = G_QUEUE_INIT;
+static guint written;
+
+static guint32 clock_cb (PseudoTcpSocket *sock, gpointer data)
+{
+  return harness_now;
+}
+
+static void fill (PseudoTcpSocket *sock)
+{
+  gchar buf[4096 + PERIOD];
+  guint i;
+
+  for (i = 0; i < sizeof(buf); i++)
+    buf[i] = i % PERIOD;
+
+  while (written < current->total) {
+    gint len = pseudo_tcp_socket_send (sock, buf + written % PERIOD,
+        MIN (4096, current->total - written));
+    if (len <= 0)
+      break;
+    written += len;
+  }
+}
+
+static void opened (PseudoTcpSocket *sock, gpointer data)
+{
+  if (sock == harness_left)
+    fill (sock);
+}
+
+static void writable (PseudoTcpSocket *sock, gpointer data)
+{
+  if (sock == harness_left)
+    fill (sock);
+}
+
+static void readable (PseudoTcpSocket *sock, gpointer data)
+{
+  gchar buf[4096];
+  gint len;
+
+  if (current->read)
+    return;
+
+  while ((len = pseudo_tcp_socket_recv (sock, buf, sizeof(buf))) > 0)
+    harness_check (buf, len);
+}
+
+static void closed (PseudoTcpSocket *sock, guint32 err, gpointer data)
+{
+  g_error ("Socket %p closed : %d", sock, err);
+}
+
+static PseudoTcpWriteResult write_packet (PseudoTcpSocket *sock,
+    const gchar *buffer, guint32 len, gpointer data)
+{
+  HarnessPacket *packet;
+  PseudoTcpWriteResult res = WR_SUCCESS;
+
+  packet = g_malloc (sizeof(HarnessPacket) + len);
+  packet->to = sock == harness_left ? harness_right : harness_left;
+  packet->time = harness_now + current->delay;
+  packet->lost = FALSE;
+  packet->len = len;
+  memcpy (packet->data, buffer, len);
+
+  if (current->send)
+    res = current->send (sock, packet);
+  if (res == WR_SUCCESS && !packet->lost)
+    g_queue_push_tail (&packets, packet);
+  else
+    g_free (packet);
+
+  return res;
+}
+
+static guint32 next_clock (PseudoTcpSocket *sock)
+{
+  long timeout;
+
+  if (!pseudo_tcp_socket_get_next_clock (sock, &timeout))
+    return G_MAXUINT32;
+  return harness_now + MAX (timeout, 0);
+}
+
+/* A send hook can delay the packets of one side only, so the queue is not
+ * always sorted by delivery time */
+static HarnessPacket *next_packet (void)
+{
+  GList *iter, *first = NULL;
+
+  for (iter = packets.head; iter; iter = iter->next) {
+    if (first == NULL || ((HarnessPacket *) iter->data)->time <
+        ((HarnessPacket *) first->data)->time)
+      first = iter;
+  }
+  return first ? first->data : NULL;
+}
+
+void harness_open (const HarnessLink *link)
+{
+  PseudoTcpCallbacks cbs = {NULL, opened, readable, writable, closed,
+                            write_packet};
+
+  current = link;
+  harness_left = pseudo_tcp_socket_new (0, &cbs);
+  harness_right = pseudo_tcp_socket_new (0, &cbs);
+  pseudo_tcp_socket_set_clock (harness_left, clock_cb, NULL);
+  pseudo_tcp_socket_set_clock (harness_right, clock_cb, NULL);
+  pseudo_tcp_socket_notify_mtu (harness_left, 1400);
+  pseudo_tcp_socket_notify_mtu (harness_right, 1400);
+}
+
+guint32 harness_run (void)
+{
+  guint32 start = harness_now;
+
+  written = harness_received = 0;
+  pseudo_tcp_socket_connect (harness_left);
+
+  while (harness_received < current->total) {
+    HarnessPacket *packet = next_packet ();
+    guint32 lclock = next_clock (harness_left);
+    guint32 rclock = next_clock (harness_right);
+    guint32 next = MIN (lclock, rclock);
+
+    g_assert (harness_now - start < 600 * 1000);
+
+    if (current->read)
+      current->read (harness_right);
+
+    if (packet != NULL && packet->time <= next) {
+      harness_now = MAX (harness_now, packet->time);
+      g_queue_remove (&packets, packet);
+      if (current->deliver)
+        current->deliver (packet);
+      else
+        pseudo_tcp_socket_notify_packet (packet->to, packet->data,
+            packet->len);
+      g_free (packet);
+    } else {
+      harness_now = MAX (harness_now, next);
+      if (lclock <= harness_now)
+        pseudo_tcp_socket_notify_clock (harness_left);
+      if (rclock <= harness_now)
+        pseudo_tcp_socket_notify_clock (harness_right);
+    }
+  }
+
+  return harness_now - start;
+}
+
+void harness_close (void)
+{
+  while (!g_queue_is_empty (&packets))
+    g_free (g_queue_pop_head (&packets));
+  g_object_unref (harness_left);
+  g_object_unref (harness_right);
+  harness_left = harness_right = NULL;
+  current = NULL;
+}
+
+void harness_check (const gchar *buf, gsize len)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    g_assert ((guchar) buf[i] == (harness_received + i) % PERIOD);
+  harness_received += len;
+}
+
+void harness_blank_options (HarnessPacket *packet)
+{
+  if ((packet->data[13] & 0x02) && packet->len > 25)
+    memset (packet->data + 25, 1, packet->len - 25);
+}
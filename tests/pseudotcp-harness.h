@@ -0,0 +1,78 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifndef _PSEUDOTCP_HARNESS_H
+#define _PSEUDOTCP_HARNESS_H
+
+/* Two PseudoTcpSockets connected by a link with a fixed delay, run on a
+ * virtual clock so that the results only depend on the protocol. The left
+ * socket sends a byte pattern that the right socket checks as it reads it.
+ * Each test shapes the link through the hooks of its HarnessLink. */
+
+#include "pseudotcp.h"
+
+typedef struct {
+  PseudoTcpSocket *to;
+  guint32 time;         /* of delivery, milliseconds */
+  gboolean lost;
+  guint32 len;
+  gchar data[0];
+} HarnessPacket;
+
+typedef struct {
+  guint32 delay;        /* one-way, milliseconds */
+  guint total;          /* bytes to transfer */
+
+  /* Sees each packet as it is written, and may change its delivery time or
+   * its contents, or lose it. Any other result than WR_SUCCESS refuses the
+   * packet. */
+  PseudoTcpWriteResult (*send) (PseudoTcpSocket *sock, HarnessPacket *packet);
+  /* Delivers a packet instead of pseudo_tcp_socket_notify_packet() */
+  void (*deliver) (HarnessPacket *packet);
+  /* Reads from the receiver once per event, instead of draining it each
+   * time it becomes readable */
+  void (*read) (PseudoTcpSocket *sock);
+} HarnessLink;
+
+extern PseudoTcpSocket *harness_left;
+extern PseudoTcpSocket *harness_right;
+extern guint32 harness_now;
+extern guint harness_received;
+
+/* Creates both sockets, with an MTU of 1400 */
+void harness_open (const HarnessLink *link);
+/* Runs the transfer and returns how long it took in milliseconds */
+guint32 harness_run (void);
+void harness_close (void);
+
+/* Checks the next bytes received against the pattern */
+void harness_check (const gchar *buf, gsize len);
+/* A peer that predates the connect options ignores anything after the
+ * control code. Blanking the options with no-op options makes the sender of
+ * the packet look like such a peer. */
+void harness_blank_options (HarnessPacket *packet);
+
+#endif /* _PSEUDOTCP_HARNESS_H */
@@ -71,6 +71,7 @@ test_ipv4 (void)
   xice_address_to_string (&addr, str);
   xice_address_to_string (&other, str);
   g_assert (TRUE == xice_address_equal (&addr, &other));
+  g_assert (xice_address_hash (&addr) == xice_address_hash (&other));
 
   /* different IP */
   xice_address_set_ipv4 (&other, 0x01020305);
@@ -124,6 +125,7 @@ test_ipv6 (void)
   xice_address_copy_to_sockaddr (&other, (struct sockaddr*)&sin2);
   xice_address_copy_to_sockaddr (&addr, (struct sockaddr*)&sin);
   g_assert (xice_address_equal (&addr, &other) == TRUE);
+  g_assert (xice_address_hash (&addr) == xice_address_hash (&other));
   xice_address_to_string (&addr, str);
   xice_address_to_string (&other, str);
 
@@ -0,0 +1,131 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "pseudotcp-harness.h"
+
+/* The data goes through a bottleneck with a bandwidth of one byte per
+ * microsecond. The link queues without limit, so a window larger than the
+ * bandwidth-delay product only makes the round trip time grow. */
+
+#define DELAY 50                /* one-way, milliseconds */
+#define TOTAL (2 * 1024 * 1024)
+#define BUFFER (256 * 1024)
+
+static guint64 link_free;       /* microseconds */
+static guint drop_every;
+static guint data_segments;
+static guint64 srtt_sum;
+static guint srtt_samples;
+
+static PseudoTcpWriteResult send_packet (PseudoTcpSocket *sock,
+    HarnessPacket *packet)
+{
+  if (sock == harness_left) {
+    link_free = MAX (link_free, (guint64) harness_now * 1000) + packet->len;
+    packet->time = link_free / 1000 + DELAY;
+    if (packet->len > 24 && drop_every > 0 &&
+        ++data_segments % drop_every == 0)
+      packet->lost = TRUE;
+  }
+
+  return WR_SUCCESS;
+}
+
+static void deliver_packet (HarnessPacket *packet)
+{
+  PseudoTcpStats stats;
+
+  pseudo_tcp_socket_notify_packet (packet->to, packet->data, packet->len);
+  if (packet->to == harness_left) {
+    pseudo_tcp_socket_get_stats (harness_left, &stats);
+    srtt_sum += stats.smoothed_rtt;
+    srtt_samples++;
+  }
+}
+
+static const HarnessLink test_link = { DELAY, TOTAL, send_packet,
+                                       deliver_packet, NULL };
+
+/* Runs the transfer and returns how long it took in milliseconds */
+static guint32 transfer (PseudoTcpCongestionControl cc, guint loss,
+    guint32 *avg_rtt)
+{
+  guint value;
+  guint32 elapsed;
+
+  harness_open (&test_link);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_SNDBUF, BUFFER);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_RCVBUF, BUFFER);
+  pseudo_tcp_socket_set_option (harness_right, PSEUDO_TCP_OPT_RCVBUF, BUFFER);
+
+  g_object_get (harness_left, "congestion-control", &value, NULL);
+  g_assert (value == PSEUDO_TCP_CC_RENO);
+  g_object_set (harness_left, "congestion-control", cc, NULL);
+  g_object_get (harness_left, "congestion-control", &value, NULL);
+  g_assert (value == cc);
+
+  drop_every = loss;
+  data_segments = 0;
+  srtt_sum = srtt_samples = 0;
+  elapsed = harness_run ();
+  *avg_rtt = srtt_sum / MAX (srtt_samples, 1);
+  harness_close ();
+
+  return elapsed;
+}
+
+int main (int argc, char *argv[])
+{
+  guint32 reno, cubic, bbr;
+  guint32 reno_rtt, cubic_rtt, bbr_rtt;
+
+  g_type_init ();
+
+  /* Loss based algorithms fill the queue, BBR keeps it short */
+  reno = transfer (PSEUDO_TCP_CC_RENO, 0, &reno_rtt);
+  cubic = transfer (PSEUDO_TCP_CC_CUBIC, 0, &cubic_rtt);
+  bbr = transfer (PSEUDO_TCP_CC_BBR, 0, &bbr_rtt);
+  g_debug ("no loss: reno %u ms (rtt %u), cubic %u ms (rtt %u), "
+      "bbr %u ms (rtt %u)", reno, reno_rtt, cubic, cubic_rtt, bbr, bbr_rtt);
+  g_assert (bbr_rtt < reno_rtt / 2);
+  g_assert (bbr < reno * 11 / 10);
+
+  /* With random losses CUBIC regrows faster than Reno, and BBR does not
+   * take them as a congestion signal */
+  reno = transfer (PSEUDO_TCP_CC_RENO, 100, &reno_rtt);
+  cubic = transfer (PSEUDO_TCP_CC_CUBIC, 100, &cubic_rtt);
+  bbr = transfer (PSEUDO_TCP_CC_BBR, 100, &bbr_rtt);
+  g_debug ("1%% loss: reno %u ms (rtt %u), cubic %u ms (rtt %u), "
+      "bbr %u ms (rtt %u)", reno, reno_rtt, cubic, cubic_rtt, bbr, bbr_rtt);
+  g_assert (cubic < reno);
+  g_assert (bbr < cubic);
+
+  return 0;
+}
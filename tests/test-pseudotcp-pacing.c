@@ -0,0 +1,114 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "pseudotcp-harness.h"
+
+/* The data goes through a bottleneck with a bandwidth of one byte per
+ * microsecond. After a loss, BBR restores its window at once, which without
+ * pacing is sent as a single burst. */
+
+#define DELAY 50                /* one-way, milliseconds */
+#define TOTAL (2 * 1024 * 1024)
+#define BUFFER (256 * 1024)
+#define DROP_EVERY 100
+
+static guint64 link_free;       /* microseconds */
+static guint data_segments;
+static guint32 burst_time;
+static guint burst;
+static guint burst_max;
+
+static PseudoTcpWriteResult send_packet (PseudoTcpSocket *sock,
+    HarnessPacket *packet)
+{
+  if (sock == harness_left && packet->len > 24) {
+    /* data segments sent in the same millisecond */
+    if (harness_now != burst_time) {
+      burst_time = harness_now;
+      burst = 0;
+    }
+    burst_max = MAX (burst_max, ++burst);
+
+    link_free = MAX (link_free, (guint64) harness_now * 1000) + packet->len;
+    packet->time = link_free / 1000 + DELAY;
+    if (++data_segments % DROP_EVERY == 0)
+      packet->lost = TRUE;
+  }
+
+  return WR_SUCCESS;
+}
+
+static const HarnessLink test_link = { DELAY, TOTAL, send_packet, NULL, NULL };
+
+/* Runs the transfer and returns how long it took in milliseconds */
+static guint32 transfer (gboolean pacing)
+{
+  guint32 elapsed;
+
+  harness_open (&test_link);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_SNDBUF, BUFFER);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_RCVBUF, BUFFER);
+  pseudo_tcp_socket_set_option (harness_right, PSEUDO_TCP_OPT_RCVBUF, BUFFER);
+  g_object_set (harness_left, "congestion-control", PSEUDO_TCP_CC_BBR, NULL);
+
+  g_assert (pseudo_tcp_socket_get_option (harness_left,
+          PSEUDO_TCP_OPT_PACING) == 0);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_PACING, pacing);
+  g_assert (pseudo_tcp_socket_get_option (harness_left,
+          PSEUDO_TCP_OPT_PACING) == (guint32) pacing);
+
+  data_segments = 0;
+  burst = burst_max = 0;
+  elapsed = harness_run ();
+  harness_close ();
+
+  return elapsed;
+}
+
+int main (int argc, char *argv[])
+{
+  guint32 bursty, paced;
+  guint bursty_max, paced_max;
+
+  g_type_init ();
+
+  bursty = transfer (FALSE);
+  bursty_max = burst_max;
+  paced = transfer (TRUE);
+  paced_max = burst_max;
+  g_debug ("without pacing %u ms (burst %u), with pacing %u ms (burst %u)",
+      bursty, bursty_max, paced, paced_max);
+
+  /* The bursts shrink to a few segments, at no cost */
+  g_assert (paced_max * 3 < bursty_max);
+  g_assert (paced < bursty * 11 / 10);
+
+  return 0;
+}
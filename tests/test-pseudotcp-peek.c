@@ -0,0 +1,128 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+
+#include "pseudotcp-harness.h"
+
+/* The receiver reads the data in place, one small piece between two events,
+ * so that packets keep arriving while it holds on to unconsumed data and
+ * the data wraps around its receive buffer. */
+
+#define DELAY 10                /* one-way, milliseconds */
+#define TOTAL (1024 * 1024)
+#define RCVBUF 16384
+#define PIECE 1000
+
+static guint wraps;
+static guint held;
+static const gchar *last;
+
+static void read_piece (PseudoTcpSocket *sock)
+{
+  const gchar *buf;
+  gsize len, i, piece;
+
+  buf = pseudo_tcp_socket_peek (sock, &len);
+  if (buf == NULL) {
+    g_assert (pseudo_tcp_socket_get_error (sock) == EWOULDBLOCK ||
+        pseudo_tcp_socket_get_error (sock) == ENOTCONN);
+    return;
+  }
+
+  g_assert (len > 0);
+  /* Peeking again gives the same data */
+  g_assert (pseudo_tcp_socket_peek (sock, &i) == buf && i == len);
+  piece = MIN (len, PIECE);
+  harness_check (buf, piece);
+  if (last != NULL && buf < last)
+    wraps++;
+  last = buf;
+
+  g_assert (pseudo_tcp_socket_consume (sock, piece) == (gint) piece);
+}
+
+/* Delivers a packet to the receiver while it holds on to unconsumed data,
+ * which must stay where it is */
+static void deliver_held (HarnessPacket *packet)
+{
+  const gchar *held_data, *buf;
+  gsize held_len, len;
+  gchar *copy;
+
+  held_data = NULL;
+  if (packet->to == harness_right)
+    held_data = pseudo_tcp_socket_peek (harness_right, &held_len);
+  if (held_data == NULL) {
+    pseudo_tcp_socket_notify_packet (packet->to, packet->data, packet->len);
+    return;
+  }
+
+  copy = g_memdup (held_data, held_len);
+  pseudo_tcp_socket_notify_packet (harness_right, packet->data, packet->len);
+  buf = pseudo_tcp_socket_peek (harness_right, &len);
+  g_assert (buf == held_data && len >= held_len);
+  g_assert (memcmp (held_data, copy, held_len) == 0);
+  g_free (copy);
+  held++;
+}
+
+static const HarnessLink test_link = { DELAY, TOTAL, NULL, deliver_held,
+                                       read_piece };
+
+int main (int argc, char *argv[])
+{
+  gsize len;
+
+  g_type_init ();
+
+  harness_open (&test_link);
+  pseudo_tcp_socket_set_option (harness_right, PSEUDO_TCP_OPT_RCVBUF, RCVBUF);
+  pseudo_tcp_socket_notify_mtu (harness_left, 1496);
+  pseudo_tcp_socket_notify_mtu (harness_right, 1496);
+
+  /* Nothing to read before the socket is connected */
+  g_assert (pseudo_tcp_socket_peek (harness_right, &len) == NULL && len == 0);
+  g_assert (pseudo_tcp_socket_get_error (harness_right) == ENOTCONN);
+  g_assert (pseudo_tcp_socket_consume (harness_right, 0) == -1);
+
+  harness_run ();
+
+  g_debug ("%u bytes read in place, wrapping around %u times, %u packets "
+      "received while holding data", harness_received, wraps, held);
+  g_assert (harness_received == TOTAL);
+  g_assert (wraps >= TOTAL / RCVBUF / 2);
+  g_assert (held > 0);
+
+  harness_close ();
+
+  return 0;
+}
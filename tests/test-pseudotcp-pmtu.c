@@ -0,0 +1,122 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "pseudotcp-harness.h"
+
+/* The link drops the packets larger than its MTU. The sender starts from a
+ * smaller MTU and probes for a larger one. */
+
+#define DELAY 20                /* one-way, milliseconds */
+#define TOTAL (2 * 1024 * 1024)
+#define OVERHEAD 28             /* IPv4 and UDP */
+#define BASE_MTU 1280
+
+static guint link_mtu;
+static guint host_mtu;
+static guint data_packets;
+
+static PseudoTcpWriteResult send_packet (PseudoTcpSocket *sock,
+    HarnessPacket *packet)
+{
+  /* the host knows the MTU of its own interface */
+  if (host_mtu > 0 && packet->len + OVERHEAD > host_mtu)
+    return WR_TOO_LARGE;
+  if (sock == harness_left && packet->len > 24)
+    data_packets++;
+  /* but not where the path drops larger packets */
+  if (packet->len + OVERHEAD > link_mtu)
+    packet->lost = TRUE;
+
+  return WR_SUCCESS;
+}
+
+static const HarnessLink test_link = { DELAY, TOTAL, send_packet, NULL, NULL };
+
+/* Runs the transfer and returns the MTU the sender ended up with */
+static guint transfer (guint path, guint host, guint max_mtu)
+{
+  guint32 elapsed;
+  guint mtu;
+
+  harness_open (&test_link);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_OVERHEAD,
+      OVERHEAD);
+  pseudo_tcp_socket_set_option (harness_right, PSEUDO_TCP_OPT_OVERHEAD,
+      OVERHEAD);
+  pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_MAX_MTU, max_mtu);
+  g_assert (pseudo_tcp_socket_get_option (harness_left,
+          PSEUDO_TCP_OPT_MAX_MTU) == max_mtu);
+  pseudo_tcp_socket_notify_mtu (harness_left, BASE_MTU);
+  pseudo_tcp_socket_notify_mtu (harness_right, BASE_MTU);
+  g_assert (pseudo_tcp_socket_get_option (harness_left, PSEUDO_TCP_OPT_MTU) ==
+      0);
+
+  link_mtu = path;
+  host_mtu = host;
+  data_packets = 0;
+  elapsed = harness_run ();
+
+  mtu = pseudo_tcp_socket_get_option (harness_left, PSEUDO_TCP_OPT_MTU);
+  g_debug ("path %u, host %u, probing up to %u: mtu %u, %u data packets "
+      "in %u ms", path, host, max_mtu, mtu, data_packets, elapsed);
+  harness_close ();
+
+  return mtu;
+}
+
+int main (int argc, char *argv[])
+{
+  guint mtu;
+  guint base_packets;
+
+  g_type_init ();
+
+  /* Without probing, the MTU given is used as is */
+  mtu = transfer (1500, 0, 0);
+  g_assert (mtu == BASE_MTU);
+  base_packets = data_packets;
+
+  /* The largest MTU asked for is tried first */
+  mtu = transfer (1500, 0, 1500);
+  g_assert (mtu == 1500);
+  g_assert (data_packets < base_packets);
+
+  /* Then the path is searched by bisection, losing the probes that are too
+   * large, and not a byte of data */
+  mtu = transfer (1500, 0, 9000);
+  g_assert (mtu <= 1500 && mtu > 1500 - 16);
+  g_assert (data_packets < base_packets);
+
+  /* Packets the host refuses to send are not waited for */
+  mtu = transfer (9000, 1400, 9000);
+  g_assert (mtu <= 1400 && mtu > 1400 - 16);
+
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "pseudotcp-harness.h"
+
+/* A few data segments of the same window are dropped once, which SACK
+ * recovers from in a single round trip. */
+
+#define DELAY 50                /* one-way, milliseconds */
+#define TOTAL (1024 * 1024)
+#define N_DROPS 4
+
+/* indices of the data segments to drop, among those sent by the left side */
+static const guint drops[N_DROPS] = { 300, 303, 307, 310 };
+
+static gboolean legacy;
+static guint data_segments;
+static guint sack_packets;
+
+static PseudoTcpWriteResult send_packet (PseudoTcpSocket *sock,
+    HarnessPacket *packet)
+{
+  guint i;
+
+  /* the control byte gives the length of the header options */
+  if (packet->data[12] != 0) {
+    g_assert (!legacy);
+    sack_packets++;
+  }
+
+  if (sock == harness_left && packet->len > 24 &&
+      (packet->data[13] & 0x02) == 0) {
+    data_segments++;
+    for (i = 0; i < N_DROPS; i++) {
+      if (data_segments == drops[i])
+        packet->lost = TRUE;
+    }
+  }
+
+  if (legacy)
+    harness_blank_options (packet);
+
+  return WR_SUCCESS;
+}
+
+static const HarnessLink test_link = { DELAY, TOTAL, send_packet, NULL, NULL };
+
+/* Runs the transfer and returns how long it took in milliseconds */
+static guint32 transfer (gboolean sack, gboolean old_peer,
+    PseudoTcpStats *stats)
+{
+  guint32 elapsed;
+
+  harness_open (&test_link);
+  g_assert (pseudo_tcp_socket_get_option (harness_right, PSEUDO_TCP_OPT_SACK));
+  /* one side is enough to disable it */
+  if (!sack) {
+    pseudo_tcp_socket_set_option (harness_right, PSEUDO_TCP_OPT_SACK, 0);
+    g_assert (!pseudo_tcp_socket_get_option (harness_right,
+            PSEUDO_TCP_OPT_SACK));
+  }
+
+  legacy = old_peer;
+  data_segments = sack_packets = 0;
+  elapsed = harness_run ();
+  pseudo_tcp_socket_get_stats (harness_left, stats);
+  harness_close ();
+
+  return elapsed;
+}
+
+int main (int argc, char *argv[])
+{
+  PseudoTcpStats stats;
+  guint32 with_sack, without_sack, old;
+
+  g_type_init ();
+
+  /* only the dropped segments are resent, without waiting for a timeout */
+  with_sack = transfer (TRUE, FALSE, &stats);
+  g_debug ("SACK: %u ms, %" G_GUINT64_FORMAT " retransmits", with_sack,
+      stats.retransmits);
+  g_assert (sack_packets > 0);
+  g_assert (stats.retransmits == N_DROPS);
+  g_assert (stats.timeouts == 0);
+
+  /* NewReno resends one segment per round trip */
+  without_sack = transfer (FALSE, FALSE, &stats);
+  g_debug ("no SACK: %u ms, %" G_GUINT64_FORMAT " retransmits", without_sack,
+      stats.retransmits);
+  g_assert (sack_packets == 0);
+  g_assert (with_sack < without_sack);
+
+  /* a peer without options never gets any */
+  old = transfer (TRUE, TRUE, &stats);
+  g_debug ("legacy peer: %u ms", old);
+  g_assert (sack_packets == 0);
+
+  return 0;
+}
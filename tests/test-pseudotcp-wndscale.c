@@ -0,0 +1,102 @@
+/*
+ * This file is part of the Xice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Xice GLib ICE library.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "pseudotcp-harness.h"
+
+#define DELAY 50                /* one-way, milliseconds */
+#define TOTAL (4 * 1024 * 1024)
+#define BUFFER_SIZE (1024 * 1024)
+
+static gboolean legacy;
+
+static PseudoTcpWriteResult send_packet (PseudoTcpSocket *sock,
+    HarnessPacket *packet)
+{
+  /* Blanking the options of both sides makes each side look like a legacy
+   * peer to the other */
+  if (legacy)
+    harness_blank_options (packet);
+
+  return WR_SUCCESS;
+}
+
+static const HarnessLink test_link = { DELAY, TOTAL, send_packet, NULL, NULL };
+
+/* Runs the transfer and returns how long it took in milliseconds */
+static guint32 transfer (guint32 rcvbuf, guint32 sndbuf, gboolean old_peer)
+{
+  guint32 elapsed;
+
+  harness_open (&test_link);
+  if (rcvbuf) {
+    pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_RCVBUF, rcvbuf);
+    pseudo_tcp_socket_set_option (harness_right, PSEUDO_TCP_OPT_RCVBUF,
+        rcvbuf);
+    g_assert (pseudo_tcp_socket_get_option (harness_right,
+            PSEUDO_TCP_OPT_RCVBUF) == rcvbuf);
+  }
+  if (sndbuf) {
+    pseudo_tcp_socket_set_option (harness_left, PSEUDO_TCP_OPT_SNDBUF, sndbuf);
+    g_assert (pseudo_tcp_socket_get_option (harness_left,
+            PSEUDO_TCP_OPT_SNDBUF) == sndbuf);
+  }
+
+  legacy = old_peer;
+  elapsed = harness_run ();
+  harness_close ();
+
+  return elapsed;
+}
+
+int main (int argc, char *argv[])
+{
+  guint32 small, large, old;
+  /* a 64 KB window allows at most this much per round trip */
+  guint32 window_limited = (guint64) TOTAL * 2 * DELAY / 0xFFFF;
+
+  g_type_init ();
+
+  small = transfer (0, 0, FALSE);
+  g_debug ("default buffers: %u ms", small);
+  g_assert (small >= window_limited);
+
+  /* both sides scale their windows */
+  large = transfer (BUFFER_SIZE, BUFFER_SIZE + BUFFER_SIZE / 2, FALSE);
+  g_debug ("%u byte buffers: %u ms", BUFFER_SIZE, large);
+  g_assert (large < window_limited / 2);
+
+  /* without the option the windows must stay below 64 KB, the transfer
+   * still completes intact */
+  old = transfer (BUFFER_SIZE, BUFFER_SIZE + BUFFER_SIZE / 2, TRUE);
+  g_debug ("%u byte buffers, legacy peer: %u ms", BUFFER_SIZE, old);
+  g_assert (old >= window_limited);
+
+  return 0;
+}
@@ -0,0 +1,261 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+
+/* Two reliable agents send the same amount of data over the component and
+ * over two channels of it, while the receiver leaves channel 1 unread. The
+ * other two must not wait for it. Then the channels are closed. */
+
+#define TOTAL (256 * 1024)
+#define PERIOD 251
+#define CHANNELS 3		/* the component itself, then channels 1 and 2 */
+
+static XiceSimNetwork *net;
+static XiceAgent *lagent;
+static XiceAgent *ragent;
+static guint sent[CHANNELS];
+static guint received[CHANNELS];
+static guint ready;
+static XiceAgent *closed_agent;
+static guint closed_channel;
+static guint closed_error;
+
+static void
+check_done(void)
+{
+	if (received[0] == TOTAL && received[2] == TOTAL &&
+		(received[1] == TOTAL || received[1] == 0))
+		xice_sim_network_stop(net);
+}
+
+static void
+fill(guint channel)
+{
+	gchar buf[4096 + PERIOD];
+	guint i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = (i + channel) % PERIOD;
+
+	while (sent[channel] < TOTAL) {
+		guint len = MIN(4096, TOTAL - sent[channel]);
+		const gchar *data = buf + sent[channel] % PERIOD;
+		gint ret;
+
+		if (channel == 0)
+			ret = xice_agent_send(lagent, 1, 1, len, data);
+		else
+			ret = xice_agent_send_channel(lagent, 1, 1, channel, len, data);
+		if (ret <= 0)
+			break;
+		sent[channel] += ret;
+	}
+}
+
+static void
+cb_transport_writable(XiceAgent *agent, guint stream_id,
+	guint component_id, gpointer data)
+{
+	if (agent == lagent)
+		fill(0);
+}
+
+static void
+cb_channel_writable(XiceAgent *agent, guint stream_id,
+	guint component_id, guint channel_id, gpointer data)
+{
+	g_assert(channel_id == 1 || channel_id == 2);
+	if (agent == lagent)
+		fill(channel_id);
+}
+
+static void
+cb_channel_closed(XiceAgent *agent, guint stream_id, guint component_id,
+	guint channel_id, guint error, gpointer data)
+{
+	g_assert(closed_agent == NULL);
+	closed_agent = agent;
+	closed_channel = channel_id;
+	closed_error = error;
+}
+
+static void
+cb_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+	guint channel = GPOINTER_TO_UINT(data);
+	guint i;
+
+	if (agent == lagent)
+		g_error("unexpected data on the sending agent");
+	for (i = 0; i < len; i++)
+		g_assert((guchar)buf[i] == (received[channel] + i + channel) % PERIOD);
+	received[channel] += len;
+	check_done();
+}
+
+static void
+cb_component_state_changed(XiceAgent *agent, guint stream_id,
+	guint component_id, guint state, gpointer data)
+{
+	if (state == XICE_COMPONENT_STATE_READY && ++ready == 2)
+		/* the channel is connected once the peer adds it too */
+		g_assert(xice_agent_add_reliable_channel(ragent, 1, 1, 2));
+}
+
+static void
+set_ip(XiceAddress *addr, guint32 ip)
+{
+	xice_address_init(addr);
+	xice_address_set_ipv4(addr, ip);
+}
+
+static void
+exchange(XiceAgent *from, XiceAgent *to)
+{
+	gchar *ufrag = NULL, *pwd = NULL;
+	GSList *cands;
+
+	xice_agent_get_local_credentials(from, 1, &ufrag, &pwd);
+	xice_agent_set_remote_credentials(to, 1, ufrag, pwd);
+	g_free(ufrag);
+	g_free(pwd);
+
+	cands = xice_agent_get_local_candidates(from, 1, 1);
+	xice_agent_set_remote_candidates(to, 1, 1, cands);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+}
+
+static XiceAgent *
+agent_new(XiceContext *ctx, guint32 ip, gboolean controlling)
+{
+	XiceAgent *agent = xice_agent_new_reliable(ctx, XICE_COMPATIBILITY_RFC5245);
+	XiceAddress addr;
+
+	g_object_set(G_OBJECT(agent), "controlling-mode", controlling, NULL);
+	g_signal_connect(G_OBJECT(agent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), NULL);
+	g_signal_connect(G_OBJECT(agent), "reliable-transport-writable",
+		G_CALLBACK(cb_transport_writable), NULL);
+	g_signal_connect(G_OBJECT(agent), "reliable-channel-writable",
+		G_CALLBACK(cb_channel_writable), NULL);
+	g_signal_connect(G_OBJECT(agent), "reliable-channel-closed",
+		G_CALLBACK(cb_channel_closed), NULL);
+
+	set_ip(&addr, ip);
+	xice_agent_add_local_address(agent, &addr);
+	xice_agent_add_stream(agent, 1);
+	xice_agent_gather_candidates(agent, 1);
+
+	return agent;
+}
+
+int
+main(void)
+{
+	XiceContext *lctx, *rctx;
+	XiceSimLinkParams params = { 20, 0, 0.01, 0, 0 };
+
+	g_type_init();
+
+	net = xice_sim_network_new(3);
+	xice_sim_network_set_default_link(net, &params);
+	lctx = xice_context_create("sim", net);
+	rctx = xice_context_create("sim", net);
+	lagent = agent_new(lctx, 0x0a000001, TRUE);
+	ragent = agent_new(rctx, 0x0a000002, FALSE);
+
+	/* channel 0 is the component itself */
+	g_assert(!xice_agent_add_reliable_channel(lagent, 1, 1, 0));
+	g_assert(xice_agent_add_reliable_channel(lagent, 1, 1, 1));
+	g_assert(!xice_agent_add_reliable_channel(lagent, 1, 1, 1));
+	g_assert(xice_agent_add_reliable_channel(lagent, 1, 1, 2));
+	g_assert(xice_agent_add_reliable_channel(ragent, 1, 1, 1));
+	g_assert(xice_agent_send_channel(lagent, 1, 1, 1, 1, "x") == -1);
+	g_assert(xice_agent_send_channel(lagent, 1, 1, 3, 1, "x") == -2);
+
+	xice_agent_attach_recv(lagent, 1, 1, cb_recv, NULL);
+	xice_agent_attach_recv(ragent, 1, 1, cb_recv, GUINT_TO_POINTER(0));
+	g_assert(!xice_agent_attach_channel_recv(ragent, 1, 1, 2, cb_recv,
+		GUINT_TO_POINTER(2)));
+
+	exchange(lagent, ragent);
+	exchange(ragent, lagent);
+
+	/* channel 2 only exists on the right once ICE is done */
+	xice_sim_network_run_for(net, 60000);
+	g_assert(ready == 2);
+	g_assert(xice_agent_attach_channel_recv(ragent, 1, 1, 2, cb_recv,
+		GUINT_TO_POINTER(2)));
+	xice_sim_network_run_for(net, 60000);
+
+	/* the unread channel filled its window and nothing more */
+	g_assert(received[0] == TOTAL);
+	g_assert(received[2] == TOTAL);
+	g_assert(received[1] == 0);
+	g_assert(sent[1] < TOTAL);
+
+	/* until it is read */
+	g_assert(xice_agent_attach_channel_recv(ragent, 1, 1, 1, cb_recv,
+		GUINT_TO_POINTER(1)));
+	xice_sim_network_run_for(net, 60000);
+	g_assert(received[1] == TOTAL);
+
+	/* a removed channel tells the peer, which can tell it from an error */
+	g_assert(xice_agent_remove_reliable_channel(lagent, 1, 1, 1));
+	g_assert(!xice_agent_remove_reliable_channel(lagent, 1, 1, 1));
+	g_assert(xice_agent_send_channel(lagent, 1, 1, 1, 1, "x") == -2);
+	xice_sim_network_run_for(net, 1000);
+	g_assert(closed_agent == ragent);
+	g_assert(closed_channel == 1);
+	g_assert(closed_error == 0);
+	g_assert(xice_agent_send_channel(ragent, 1, 1, 1, 1, "x") == -2);
+	g_assert(xice_agent_remove_reliable_channel(ragent, 1, 1, 1));
+
+	/* a channel the peer never adds gives up */
+	closed_agent = NULL;
+	g_assert(xice_agent_add_reliable_channel(lagent, 1, 1, 3));
+	xice_sim_network_run_for(net, 600000);
+	g_assert(closed_agent == lagent);
+	g_assert(closed_channel == 3);
+	g_assert(closed_error != 0);
+	g_assert(xice_agent_send_channel(lagent, 1, 1, 3, 1, "x") == -2);
+	g_assert(xice_agent_remove_reliable_channel(lagent, 1, 1, 3));
+
+	g_object_unref(lagent);
+	g_object_unref(ragent);
+	xice_context_destroy(lctx);
+	xice_context_destroy(rctx);
+	xice_sim_network_free(net);
+
+	return 0;
+}
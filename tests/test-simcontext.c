@@ -0,0 +1,416 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+
+#define PACKETS 200
+
+static gint64 arrivals[PACKETS];
+static guint received;
+static guint accepted_bytes;
+static gboolean peer_closed;
+static guint ready;
+
+static gboolean
+udp_cb(
+	XiceSocket *sock,
+	XiceSocketCondition condition,
+	gpointer data,
+	gchar *buf,
+	guint len,
+	XiceAddress *from)
+{
+	XiceSimNetwork *net = data;
+	guint index;
+
+	g_assert(condition == XICE_SOCKET_READABLE);
+	g_assert(len >= sizeof(index));
+	memcpy(&index, buf, sizeof(index));
+	g_assert(index < PACKETS);
+	arrivals[index] = xice_sim_network_get_time(net);
+	received++;
+	return TRUE;
+}
+
+static void
+set_ip(XiceAddress *addr, guint32 ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_ipv4(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+/* Sends PACKETS numbered datagrams over a lossy, jittery link and returns
+ * a digest of when each one arrived */
+static guint64
+run_udp(guint32 seed, XiceSimStats *stats)
+{
+	XiceSimNetwork *net = xice_sim_network_new(seed);
+	XiceContext *ctx = xice_context_create("sim", net);
+	XiceSimLinkParams params = { 40, 10, 0.2, 0.1, 0 };
+	XiceAddress a, b;
+	XiceSocket *sa, *sb;
+	guint64 digest = 0;
+	guint i;
+
+	xice_sim_network_set_default_link(net, &params);
+	set_ip(&a, 0x0a000001, 0);
+	set_ip(&b, 0x0a000002, 5000);
+
+	sa = xice_create_udp_socket(ctx, &a);
+	sb = xice_create_udp_socket(ctx, &b);
+	g_assert(sa != NULL && sb != NULL);
+	g_assert(xice_address_get_port(&sa->addr) != 0);
+	g_assert(xice_create_udp_socket(ctx, &b) == NULL);
+	xice_socket_set_callback(sb, udp_cb, net);
+
+	memset(arrivals, 0, sizeof(arrivals));
+	received = 0;
+	for (i = 0; i < PACKETS; i++)
+		g_assert(xice_socket_send(sa, &b, sizeof(i), (gchar *)&i));
+
+	xice_sim_network_run_for(net, 1000);
+	xice_sim_network_get_stats(net, stats);
+	g_assert(stats->packets_sent == PACKETS);
+	g_assert(stats->packets_delivered == received);
+	g_assert(stats->packets_delivered + stats->packets_lost == PACKETS);
+
+	for (i = 0; i < PACKETS; i++) {
+		if (arrivals[i] != 0) {
+			g_assert(arrivals[i] >= G_USEC_PER_SEC + 40000);
+			digest = digest * 31 + (guint64)arrivals[i] + i;
+		}
+	}
+
+	xice_socket_free(sa);
+	xice_socket_free(sb);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+
+	return digest;
+}
+
+static void
+test_udp(void)
+{
+	XiceSimStats s1, s2, s3;
+	guint64 d1 = run_udp(42, &s1);
+	guint64 d2 = run_udp(42, &s2);
+	guint64 d3 = run_udp(43, &s3);
+
+	/* same seed, same run; another seed, another run */
+	g_assert(d1 == d2);
+	g_assert(s1.packets_lost == s2.packets_lost);
+	g_assert(d1 != d3);
+	g_assert(s1.packets_lost > 0 && s1.packets_lost < PACKETS);
+}
+
+static void
+test_bandwidth(void)
+{
+	XiceSimNetwork *net = xice_sim_network_new(1);
+	XiceContext *ctx = xice_context_create("sim", net);
+	XiceSimLinkParams params = { 10, 0, 0, 0, 1000 };
+	XiceAddress a, b;
+	XiceSocket *sa, *sb;
+	gchar buf[1250];
+	gint64 start = xice_sim_network_get_time(net);
+	guint i;
+
+	xice_sim_network_set_default_link(net, &params);
+	set_ip(&a, 0x0a000001, 4000);
+	set_ip(&b, 0x0a000002, 5000);
+	sa = xice_create_udp_socket(ctx, &a);
+	sb = xice_create_udp_socket(ctx, &b);
+	xice_socket_set_callback(sb, udp_cb, net);
+
+	/* 1250 bytes at 1 Mbit/s take 10 ms each on the wire */
+	memset(buf, 0, sizeof(buf));
+	memset(arrivals, 0, sizeof(arrivals));
+	for (i = 0; i < 10; i++) {
+		memcpy(buf, &i, sizeof(i));
+		xice_socket_send(sa, &b, sizeof(buf), buf);
+	}
+	xice_sim_network_run_for(net, 1000);
+
+	for (i = 0; i < 10; i++)
+		g_assert(arrivals[i] == start + (i + 1) * 10000 + 10000);
+
+	xice_socket_free(sa);
+	xice_socket_free(sb);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+}
+
+static gboolean
+timer_cb(XiceTimer *timer, gpointer data)
+{
+	guint *count = data;
+	return ++(*count) < 3;
+}
+
+static void
+test_timer(void)
+{
+	XiceSimNetwork *net = xice_sim_network_new(1);
+	XiceContext *ctx = xice_context_create("sim", net);
+	gint64 start = xice_context_get_time(ctx);
+	XiceTimer *timer;
+	guint count = 0;
+
+	timer = xice_create_timer(ctx, 20, timer_cb, &count);
+	xice_timer_start(timer);
+
+	xice_sim_network_run_for(net, 59);
+	g_assert(count == 2);
+	g_assert(xice_context_get_time(ctx) == start + 59000);
+	xice_sim_network_run_for(net, 1000);
+	g_assert(count == 3);
+	g_assert(!xice_sim_network_step(net));
+
+	xice_timer_destroy(timer);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+}
+
+static gint64
+fixed_clock(gpointer data)
+{
+	return *(gint64 *)data;
+}
+
+/* a STUN timer follows the clock of the context it was started on, even
+ * once another context got a clock of its own */
+static void
+test_stun_clock(void)
+{
+	XiceSimNetwork *net = xice_sim_network_new(1);
+	XiceContext *sim = xice_context_create("sim", net);
+	XiceContext *fixed = xice_context_create("sim", net);
+	gint64 now = 1000000;
+	StunTimer a, b;
+
+	xice_context_start_stun_timer(sim, &a, 100, 0);
+	xice_context_set_clock(fixed, fixed_clock, &now);
+	xice_context_start_stun_timer(fixed, &b, 100, 0);
+
+	xice_sim_network_run_for(net, 60);
+	g_assert(stun_timer_remainder(&a) == 40);
+	g_assert(stun_timer_remainder(&b) == 100);
+
+	now += 100000;
+	g_assert(stun_timer_remainder(&a) == 40);
+	g_assert(stun_timer_remainder(&b) == 0);
+
+	xice_context_destroy(fixed);
+	xice_sim_network_run_for(net, 40);
+	g_assert(stun_timer_remainder(&a) == 0);
+
+	xice_context_destroy(sim);
+	xice_sim_network_free(net);
+}
+
+static gboolean
+tcp_cb(
+	XiceSocket *sock,
+	XiceSocketCondition condition,
+	gpointer data,
+	gchar *buf,
+	guint len,
+	XiceAddress *from)
+{
+	if (condition == XICE_SOCKET_CLOSE) {
+		peer_closed = TRUE;
+		return FALSE;
+	}
+	g_assert(condition == XICE_SOCKET_READABLE);
+	g_assert(len == 4);
+	g_assert(memcmp(buf, "ping", 4) == 0);
+	accepted_bytes += len;
+	return TRUE;
+}
+
+static void
+accept_cb(XiceSimNetwork *net, XiceSocket *sock, gpointer data)
+{
+	XiceSocket **server = data;
+
+	g_assert(xice_socket_is_reliable(sock));
+	xice_socket_set_callback(sock, tcp_cb, NULL);
+	*server = sock;
+}
+
+static void
+test_tcp(void)
+{
+	XiceSimNetwork *net = xice_sim_network_new(1);
+	XiceContext *ctx = xice_context_create("sim", net);
+	XiceSimLinkParams params = { 30, 0, 0.5, 0, 0 };
+	XiceAddress server_addr;
+	XiceSocket *client, *server = NULL;
+	guint i;
+
+	xice_sim_network_set_default_link(net, &params);
+	set_ip(&server_addr, 0x0a000003, 3478);
+
+	g_assert(xice_create_tcp_socket(ctx, &server_addr) == NULL);
+	g_assert(xice_sim_network_listen(net, &server_addr, accept_cb, &server));
+
+	client = xice_create_tcp_socket(ctx, &server_addr);
+	g_assert(client != NULL);
+	/* reliable transport: nothing is lost despite the lossy link */
+	for (i = 0; i < 10; i++)
+		g_assert(xice_socket_send(client, &server_addr, 4, "ping"));
+
+	xice_sim_network_run_for(net, 29);
+	g_assert(server == NULL);
+	xice_sim_network_run_for(net, 100);
+	g_assert(server != NULL);
+	g_assert(accepted_bytes == 40);
+
+	xice_socket_free(client);
+	g_assert(!peer_closed);
+	xice_sim_network_run_for(net, 100);
+	g_assert(peer_closed);
+
+	xice_socket_free(server);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+}
+
+static void
+cb_component_state_changed(XiceAgent *agent, guint stream_id,
+	guint component_id, guint state, gpointer data)
+{
+	if (state == XICE_COMPONENT_STATE_READY)
+		ready++;
+	if (ready == 2)
+		xice_sim_network_stop(data);
+}
+
+static void
+cb_xice_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+}
+
+static void
+exchange(XiceAgent *from, XiceAgent *to)
+{
+	gchar *ufrag = NULL, *pwd = NULL;
+	GSList *cands;
+
+	xice_agent_get_local_credentials(from, 1, &ufrag, &pwd);
+	xice_agent_set_remote_credentials(to, 1, ufrag, pwd);
+	g_free(ufrag);
+	g_free(pwd);
+
+	cands = xice_agent_get_local_candidates(from, 1, 1);
+	xice_agent_set_remote_candidates(to, 1, 1, cands);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+}
+
+/* Two agents with a 50 ms one way delay, returns the virtual time it took
+ * for both of them to reach READY */
+static gint64
+run_ice(guint32 seed)
+{
+	XiceSimNetwork *net = xice_sim_network_new(seed);
+	XiceContext *lctx = xice_context_create("sim", net);
+	XiceContext *rctx = xice_context_create("sim", net);
+	XiceSimLinkParams params = { 50, 5, 0.05, 0, 0 };
+	XiceAgent *lagent, *ragent;
+	XiceAddress laddr, raddr;
+	gint64 start, elapsed;
+
+	xice_sim_network_set_default_link(net, &params);
+
+	lagent = xice_agent_new(lctx, XICE_COMPATIBILITY_RFC5245);
+	ragent = xice_agent_new(rctx, XICE_COMPATIBILITY_RFC5245);
+	g_object_set(G_OBJECT(lagent), "controlling-mode", TRUE, NULL);
+	g_object_set(G_OBJECT(ragent), "controlling-mode", FALSE, NULL);
+	g_signal_connect(G_OBJECT(lagent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), net);
+	g_signal_connect(G_OBJECT(ragent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), net);
+
+	set_ip(&laddr, 0x0a000001, 0);
+	set_ip(&raddr, 0x0a000002, 0);
+	xice_agent_add_local_address(lagent, &laddr);
+	xice_agent_add_local_address(ragent, &raddr);
+	xice_agent_add_stream(lagent, 1);
+	xice_agent_add_stream(ragent, 1);
+	xice_agent_gather_candidates(lagent, 1);
+	xice_agent_gather_candidates(ragent, 1);
+	xice_agent_attach_recv(lagent, 1, 1, cb_xice_recv, NULL);
+	xice_agent_attach_recv(ragent, 1, 1, cb_xice_recv, NULL);
+
+	exchange(lagent, ragent);
+	exchange(ragent, lagent);
+
+	/* another network coming and going leaves the clock of this one */
+	xice_sim_network_free(xice_sim_network_new(seed + 1));
+
+	ready = 0;
+	start = xice_sim_network_get_time(net);
+	xice_sim_network_run_for(net, 30000);
+	g_assert(ready == 2);
+	elapsed = xice_sim_network_get_time(net) - start;
+
+	g_object_unref(lagent);
+	g_object_unref(ragent);
+	xice_context_destroy(lctx);
+	xice_context_destroy(rctx);
+	xice_sim_network_free(net);
+
+	return elapsed;
+}
+
+int
+main(void)
+{
+	gint64 t1, t2;
+
+	g_type_init();
+
+	test_udp();
+	test_bandwidth();
+	test_timer();
+	test_stun_clock();
+	test_tcp();
+
+	t1 = run_ice(7);
+	t2 = run_ice(7);
+	g_assert(t1 == t2);
+	g_assert(t1 >= 100000);
+
+	return 0;
+}
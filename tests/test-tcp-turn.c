@@ -0,0 +1,206 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "socket/tcp-turn.h"
+
+/* Random STUN messages and ChannelData are framed by a TCP TURN socket into
+ * a stream, which is then read back cut at random places, many times over.
+ * Every message must come out whole, once and in order, however the reads
+ * split the frames. Garbage streams must not crash the parser. */
+
+#define MESSAGES 200
+#define ROUNDS 200
+#define MAX_READ 3000
+
+static GByteArray *stream;
+static GPtrArray *expected;
+static guint next;
+
+static gboolean
+stream_send(XiceSocket *sock, const XiceAddress *to, guint len,
+	const gchar *buf)
+{
+	g_byte_array_append(stream, (const guint8 *)buf, len);
+	return TRUE;
+}
+
+static gboolean
+stream_is_reliable(XiceSocket *sock)
+{
+	return TRUE;
+}
+
+static void
+stream_close(XiceSocket *sock)
+{
+}
+
+static XiceSocket *
+stream_socket_new(void)
+{
+	XiceSocket *sock = g_slice_new0(XiceSocket);
+
+	sock->send = stream_send;
+	sock->is_reliable = stream_is_reliable;
+	sock->close = stream_close;
+	return sock;
+}
+
+static gboolean
+frame_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	GByteArray *message;
+
+	g_assert(condition == XICE_SOCKET_READABLE);
+	if (data == NULL)
+		return TRUE;
+
+	g_assert(next < expected->len);
+	message = g_ptr_array_index(expected, next++);
+	g_assert(len == message->len);
+	g_assert(memcmp(buf, message->data, len) == 0);
+	return TRUE;
+}
+
+/* a STUN message or some ChannelData, and what the parser should hand on
+ * for it: the padding is kept for RFC 5766, as it arrives */
+static void
+add_message(XiceSocket *sock, XiceTurnSocketCompatibility compatibility)
+{
+	GByteArray *message = g_byte_array_new();
+	guint8 header[4];
+	guint i, len;
+	gboolean stun = g_random_boolean();
+
+	if (g_random_int_range(0, 8) == 0)
+		len = g_random_int_range(0, 65535 - 20);
+	else
+		len = g_random_int_range(0, 1500);
+	if (stun) {
+		len &= ~3;
+		header[0] = 0x01;
+		header[1] = 0x01;
+	} else {
+		header[0] = 0x40 | g_random_int_range(0, 0x3f);
+		header[1] = g_random_int_range(0, 256);
+	}
+	header[2] = len >> 8;
+	header[3] = len & 0xff;
+	g_byte_array_append(message, header, 4);
+	for (i = 0; i < len + (stun ? 16 : 0); i++) {
+		guint8 byte = g_random_int_range(0, 256);
+		g_byte_array_append(message, &byte, 1);
+	}
+	g_assert(xice_socket_send(sock, NULL, message->len,
+		(const gchar *)message->data));
+
+	if (compatibility != XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
+		guint8 zero = 0;
+		while (message->len % 4)
+			g_byte_array_append(message, &zero, 1);
+	}
+	g_ptr_array_add(expected, message);
+}
+
+static void
+read_stream(XiceSocket *base, const guint8 *data, guint len)
+{
+	XiceAddress from;
+	gchar *buf = g_malloc(MAX_READ);
+	guint pos = 0;
+
+	xice_address_init(&from);
+	while (pos < len) {
+		guint read = g_random_int_range(1, g_random_boolean() ? 8 : MAX_READ);
+
+		read = MIN(read, len - pos);
+
+		/* a fresh buffer each time, so nothing is kept pointing into it */
+		memcpy(buf, data + pos, read);
+		base->callback(base, XICE_SOCKET_READABLE, base->data, buf, read,
+			&from);
+		memset(buf, 0xaa, read);
+		pos += read;
+	}
+	g_free(buf);
+}
+
+static void
+test_framing(XiceTurnSocketCompatibility compatibility)
+{
+	XiceSocket *base = stream_socket_new();
+	XiceSocket *sock = xice_tcp_turn_socket_new(base, compatibility);
+	guint i;
+
+	stream = g_byte_array_new();
+	expected = g_ptr_array_new();
+	xice_socket_set_callback(sock, frame_cb, expected);
+
+	for (i = 0; i < MESSAGES; i++)
+		add_message(sock, compatibility);
+
+	for (i = 0; i < ROUNDS; i++) {
+		next = 0;
+		read_stream(base, stream->data, stream->len);
+		g_assert(next == expected->len);
+	}
+
+	/* garbage: only the parser's own checks apply */
+	xice_socket_set_callback(sock, frame_cb, NULL);
+	for (i = 0; i < ROUNDS; i++) {
+		guint j, len = g_random_int_range(1, 100000);
+
+		g_byte_array_set_size(stream, len);
+		for (j = 0; j < len; j++)
+			stream->data[j] = g_random_int_range(0, 256);
+		read_stream(base, stream->data, stream->len);
+	}
+
+	for (i = 0; i < expected->len; i++)
+		g_byte_array_free(g_ptr_array_index(expected, i), TRUE);
+	g_ptr_array_free(expected, TRUE);
+	g_byte_array_free(stream, TRUE);
+	xice_socket_free(sock);
+}
+
+int
+main(void)
+{
+	g_type_init();
+	g_random_set_seed(0x7c9e7);
+
+	test_framing(XICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+	test_framing(XICE_TURN_SOCKET_COMPATIBILITY_GOOGLE);
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "socket/turnserver.h"
+#include "stun/stunagent.h"
+
+/* A TURN server, which challenges the Allocate requests and then grants
+ * them, and answers the refreshes. A pool keeps its allocations
+ * ready and refreshed; an agent with the same server and credentials has
+ * its relayed candidate as soon as it starts gathering, and refreshes it
+ * from then on, while the pool makes another. An agent with other
+ * credentials gathers its relayed candidate as usual. */
+
+#define POOL_SIZE 2
+#define LIFETIME 600            /* s, as the server grants */
+#define MAX_ALLOCATIONS 16
+
+typedef struct {
+	XiceAddress client;
+	guint refreshes;
+	gboolean released;
+} Allocation;
+
+static XiceSimNetwork *net;
+static Allocation allocations[MAX_ALLOCATIONS];
+static guint n_allocations;
+
+static Allocation *
+find_allocation(const XiceAddress *client)
+{
+	guint i;
+
+	for (i = 0; i < n_allocations; i++)
+		if (xice_address_equal(&allocations[i].client, client))
+			return &allocations[i];
+	return NULL;
+}
+
+/* follows the allocations of each client */
+static XiceTurnServerVerdict
+filter(XiceTurnServer *server, const XiceAddress *client, gboolean tcp,
+	StunMessage *msg, gpointer data)
+{
+	Allocation *alloc = find_allocation(client);
+
+	if (stun_message_get_method(msg) == STUN_ALLOCATE) {
+		if (alloc == NULL) {
+			g_assert(n_allocations < MAX_ALLOCATIONS);
+			alloc = &allocations[n_allocations++];
+			alloc->client = *client;
+		}
+	} else if (stun_message_get_method(msg) == STUN_REFRESH) {
+		uint32_t lifetime = LIFETIME;
+
+		g_assert(alloc != NULL);
+		stun_message_find32(msg, STUN_ATTRIBUTE_LIFETIME, &lifetime);
+		if (lifetime == 0)
+			alloc->released = TRUE;
+		else
+			alloc->refreshes++;
+	}
+
+	return XICE_TURN_SERVER_ANSWER;
+}
+
+static void
+set_address(XiceAddress *addr, const gchar *ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_from_string(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+static XiceCandidate *
+find_candidate(GSList *cands, XiceCandidateType type)
+{
+	GSList *i;
+
+	for (i = cands; i; i = i->next) {
+		XiceCandidate *cand = i->data;
+		if (cand->type == type)
+			return cand;
+	}
+	return NULL;
+}
+
+static void
+cb_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+}
+
+static XiceAgent *
+agent_new(XiceContext *ctx, XiceTurnPool *pool, const gchar *ip,
+	const gchar *username, const gchar *password)
+{
+	XiceAgent *agent = xice_agent_new(ctx, XICE_COMPATIBILITY_RFC5245);
+	XiceAddress addr;
+
+	set_address(&addr, ip, 0);
+	xice_agent_add_local_address(agent, &addr);
+	xice_agent_add_stream(agent, 1);
+	xice_agent_attach_recv(agent, 1, 1, cb_recv, NULL);
+	xice_agent_set_relay_info(agent, 1, 1, "10.0.0.100", 3478, username,
+		password, XICE_RELAY_TYPE_TURN_UDP);
+	xice_agent_set_turn_pool(agent, pool);
+	xice_agent_gather_candidates(agent, 1);
+
+	return agent;
+}
+
+int
+main(void)
+{
+	XiceSimLinkParams params = { 10, 0, 0, 0, 0 };
+	XiceContext *ctx;
+	XiceTurnServer *server;
+	XiceTurnServerStats stats;
+	XiceTurnPool *pool;
+	XiceAgent *agent, *other;
+	XiceAddress addr;
+	XiceCandidate *relay;
+	Allocation *taken;
+	GSList *cands;
+	guint i;
+
+	g_type_init();
+
+	net = xice_sim_network_new(1);
+	xice_sim_network_set_default_link(net, &params);
+	ctx = xice_context_create("sim", net);
+
+	set_address(&addr, "10.0.0.100", 3478);
+	server = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(server != NULL);
+	xice_turn_server_add_user(server, "user", "pass");
+	xice_turn_server_add_user(server, "other", "word");
+	xice_turn_server_set_filter(server, filter, NULL);
+
+	/* the pool fills itself */
+	g_assert(xice_turn_pool_new(ctx, "not an address") == NULL);
+	pool = xice_turn_pool_new(ctx, "10.0.0.1");
+	g_assert(xice_turn_pool_add_server(pool, "10.0.0.100", 3478, "user",
+		"pass", POOL_SIZE));
+	g_assert(xice_turn_pool_get_ready(pool) == 0);
+	xice_sim_network_run_for(net, 1000);
+	g_assert(xice_turn_pool_get_ready(pool) == POOL_SIZE);
+	g_assert(n_allocations == POOL_SIZE);
+	xice_turn_server_get_stats(server, &stats);
+	g_assert(stats.allocations == POOL_SIZE);
+	g_assert(stats.challenges == POOL_SIZE);
+
+	/* the relayed candidate is there at once, and replaced in the pool */
+	agent = agent_new(ctx, pool, "10.0.0.1", "user", "pass");
+	cands = xice_agent_get_local_candidates(agent, 1, 1);
+	relay = find_candidate(cands, XICE_CANDIDATE_TYPE_RELAYED);
+	g_assert(relay != NULL);
+	g_assert(find_candidate(cands, XICE_CANDIDATE_TYPE_SERVER_REFLEXIVE));
+	for (taken = NULL, i = 0; i < n_allocations; i++)
+		if (xice_address_equal(&relay->base_addr, &allocations[i].client))
+			taken = &allocations[i];
+	g_assert(taken != NULL);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+	g_assert(xice_turn_pool_get_ready(pool) == POOL_SIZE - 1);
+	xice_sim_network_run_for(net, 1000);
+	g_assert(xice_turn_pool_get_ready(pool) == POOL_SIZE);
+	g_assert(n_allocations == POOL_SIZE + 1);
+
+	/* other credentials are not served from the pool */
+	other = agent_new(ctx, pool, "10.0.0.2", "other", "word");
+	cands = xice_agent_get_local_candidates(other, 1, 1);
+	g_assert(find_candidate(cands, XICE_CANDIDATE_TYPE_RELAYED) == NULL);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+	g_assert(xice_turn_pool_get_ready(pool) == POOL_SIZE);
+	xice_sim_network_run_for(net, 1000);
+	cands = xice_agent_get_local_candidates(other, 1, 1);
+	g_assert(find_candidate(cands, XICE_CANDIDATE_TYPE_RELAYED) != NULL);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+	g_assert(n_allocations == POOL_SIZE + 2);
+
+	/* the pool keeps its allocations, the agents refresh theirs */
+	xice_sim_network_run_for(net, 2 * LIFETIME * 1000);
+	for (i = 0; i < n_allocations; i++) {
+		if (&allocations[i] == taken || i == n_allocations - 1) {
+			g_assert(allocations[i].refreshes >= 1);
+		} else {
+			g_assert(allocations[i].refreshes >= 2);
+			g_assert(!allocations[i].released);
+		}
+	}
+	g_assert(xice_turn_pool_get_ready(pool) == POOL_SIZE);
+
+	/* the agent releases its allocation, the pool the others */
+	g_object_unref(agent);
+	g_object_unref(other);
+	xice_sim_network_run_for(net, 1000);
+	g_assert(taken->released);
+	xice_turn_pool_free(pool);
+	xice_sim_network_run_for(net, 1000);
+	for (i = 0; i < n_allocations; i++)
+		g_assert(allocations[i].released);
+	xice_turn_server_get_stats(server, &stats);
+	g_assert(stats.allocations == 0);
+
+	xice_turn_server_free(server);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+
+	return 0;
+}
@@ -0,0 +1,421 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "socket/turn.h"
+#include "socket/turnserver.h"
+#include "stun/stunagent.h"
+#include "stun/usages/turn.h"
+
+/* A TURN server that sits on CreatePermission requests until told to
+ * answer them. The data sent meanwhile must stay within the queue size,
+ * dropping the newest or the oldest packets, and what was kept must reach
+ * the peer once the permission is there. An agent whose relay installs
+ * its permission again, far from the server, must refuse a burst and emit
+ * "transport-writable" once the queue has drained. */
+
+#define QUEUE_SIZE 1000
+#define PAYLOAD 200
+#define PACKETS 10
+
+static XiceSimNetwork *net;
+static XiceTurnServer *server;
+static XiceSocket *turn;
+static guint n_held;
+static GArray *delivered;
+static uint8_t answer[STUN_MAX_MESSAGE_SIZE];
+static guint answer_len;
+static guint writable;
+static XiceAddress writable_peer;
+static guint ready;
+static guint transport_writable;
+
+static XiceTurnServerVerdict
+filter(XiceTurnServer *server, const XiceAddress *client, gboolean tcp,
+	StunMessage *msg, gpointer data)
+{
+	if (stun_message_get_method(msg) != STUN_CREATEPERMISSION)
+		return XICE_TURN_SERVER_ANSWER;
+	n_held++;
+	return XICE_TURN_SERVER_HOLD;
+}
+
+static void
+answer_permissions(void)
+{
+	xice_turn_server_answer_held(server);
+	n_held = 0;
+}
+
+static gboolean
+peer_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	if (condition == XICE_SOCKET_READABLE) {
+		g_assert(len == PAYLOAD);
+		g_array_append_val(delivered, buf[0]);
+	}
+	return TRUE;
+}
+
+static gboolean
+answer_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	if (condition == XICE_SOCKET_READABLE && len <= sizeof(answer)) {
+		memcpy(answer, buf, len);
+		answer_len = len;
+	}
+	return TRUE;
+}
+
+/* like the agent does for packets from its TURN servers */
+static gboolean
+base_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	XiceSocket *from_sock = sock;
+
+	if (condition == XICE_SOCKET_READABLE)
+		xice_turn_socket_parse_recv(turn, &from_sock, from, len, buf, from,
+			buf, len);
+	return TRUE;
+}
+
+static gboolean
+turn_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	if (condition == XICE_SOCKET_WRITABLE) {
+		writable++;
+		writable_peer = *from;
+	}
+	return TRUE;
+}
+
+/* Allocates from @base as the agent does, and returns the TURN socket
+ * over the allocation, with the realm and nonce of the challenge so that
+ * the server need not challenge its requests */
+static XiceSocket *
+allocate(XiceContext *ctx, XiceSocket *base, const XiceAddress *server_addr)
+{
+	StunDefaultValidaterData creds[] = {
+		{ (uint8_t *)"user", 4, (uint8_t *)"pass", 4 },
+		{ NULL, 0, NULL, 0 }
+	};
+	StunAgent agent;
+	StunMessage req, challenge, resp;
+	uint8_t buf[STUN_MAX_MESSAGE_SIZE], chal_buf[STUN_MAX_MESSAGE_SIZE];
+	struct sockaddr_storage relayed, mapped, alternate;
+	socklen_t relayed_len = sizeof(relayed), mapped_len = sizeof(mapped);
+	socklen_t alternate_len = sizeof(alternate);
+	uint32_t bandwidth, lifetime;
+	XiceAddress relayed_addr, turn_addr = *server_addr;
+	XiceSocket *sock;
+	size_t len;
+
+	stun_agent_init(&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+		STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+	xice_socket_set_callback(base, answer_cb, NULL);
+
+	len = stun_usage_turn_create(&agent, &req, buf, sizeof(buf), NULL,
+		STUN_USAGE_TURN_REQUEST_PORT_NORMAL, -1, -1,
+		(uint8_t *)"user", 4, (uint8_t *)"pass", 4,
+		STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+	answer_len = 0;
+	xice_socket_send(base, server_addr, len, (gchar *)buf);
+	xice_sim_network_run_for(net, 100);
+	memcpy(chal_buf, answer, answer_len);
+	g_assert(stun_agent_validate(&agent, &challenge, chal_buf, answer_len,
+		stun_agent_default_validater, creds) == STUN_VALIDATION_SUCCESS);
+
+	len = stun_usage_turn_create(&agent, &req, buf, sizeof(buf), &challenge,
+		STUN_USAGE_TURN_REQUEST_PORT_NORMAL, -1, -1,
+		(uint8_t *)"user", 4, (uint8_t *)"pass", 4,
+		STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+	answer_len = 0;
+	xice_socket_send(base, server_addr, len, (gchar *)buf);
+	xice_sim_network_run_for(net, 100);
+	g_assert(stun_agent_validate(&agent, &resp, answer, answer_len,
+		stun_agent_default_validater, creds) == STUN_VALIDATION_SUCCESS);
+	g_assert(stun_usage_turn_process(&resp,
+		(struct sockaddr *)&relayed, &relayed_len,
+		(struct sockaddr *)&mapped, &mapped_len,
+		(struct sockaddr *)&alternate, &alternate_len,
+		&bandwidth, &lifetime, STUN_USAGE_TURN_COMPATIBILITY_RFC5766) ==
+		STUN_USAGE_TURN_RETURN_MAPPED_SUCCESS);
+
+	xice_address_init(&relayed_addr);
+	xice_address_set_from_sockaddr(&relayed_addr, (struct sockaddr *)&relayed);
+	sock = xice_turn_socket_new(ctx, &relayed_addr, base, &turn_addr,
+		"user", "pass", XICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+	xice_turn_socket_set_realm_nonce(sock, &challenge);
+
+	return sock;
+}
+
+static void
+set_address(XiceAddress *addr, const gchar *ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_from_string(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+/* sends PACKETS packets numbered from 0, returns how many were taken */
+static guint
+send_packets(const XiceAddress *peer)
+{
+	gchar buf[PAYLOAD];
+	guint i, taken = 0;
+
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < PACKETS; i++) {
+		buf[0] = i;
+		if (xice_socket_send(turn, peer, sizeof(buf), buf))
+			taken++;
+	}
+	return taken;
+}
+
+static void
+cb_component_state_changed(XiceAgent *agent, guint stream_id,
+	guint component_id, guint state, gpointer data)
+{
+	if (state == XICE_COMPONENT_STATE_READY)
+		ready++;
+}
+
+static void
+cb_transport_writable(XiceAgent *agent, guint stream_id, guint component_id,
+	gpointer data)
+{
+	transport_writable++;
+}
+
+static void
+cb_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+}
+
+static void
+exchange(XiceAgent *from, XiceAgent *to)
+{
+	gchar *ufrag = NULL, *pwd = NULL;
+	GSList *cands;
+
+	xice_agent_get_local_credentials(from, 1, &ufrag, &pwd);
+	xice_agent_set_remote_credentials(to, 1, ufrag, pwd);
+	g_free(ufrag);
+	g_free(pwd);
+
+	cands = xice_agent_get_local_candidates(from, 1, 1);
+	xice_agent_set_remote_candidates(to, 1, 1, cands);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+}
+
+static XiceAgent *
+agent_new(XiceContext *ctx, const gchar *ip, gboolean relay)
+{
+	XiceAgent *agent = xice_agent_new(ctx, XICE_COMPATIBILITY_RFC5245);
+	XiceAddress addr;
+
+	g_object_set(G_OBJECT(agent), "controlling-mode", relay,
+		"turn-queue-size", QUEUE_SIZE, NULL);
+	g_signal_connect(G_OBJECT(agent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), NULL);
+	g_signal_connect(G_OBJECT(agent), "transport-writable",
+		G_CALLBACK(cb_transport_writable), NULL);
+
+	set_address(&addr, ip, 0);
+	xice_agent_add_local_address(agent, &addr);
+	xice_agent_add_stream(agent, 1);
+	xice_agent_attach_recv(agent, 1, 1, cb_recv, NULL);
+	if (relay)
+		xice_agent_set_relay_info(agent, 1, 1, "10.0.0.100", 3478, "user",
+			"pass", XICE_RELAY_TYPE_TURN_UDP);
+	xice_agent_gather_candidates(agent, 1);
+
+	return agent;
+}
+
+/* The left agent only reaches the right one through its relay. Once the
+ * relay is a second away and installs its permission again, four minutes
+ * on, a burst fills the queue. */
+static void
+agent_backpressure(XiceContext *ctx)
+{
+	XiceSimLinkParams blocked = { 10, 0, 1.0, 0, 0 };
+	XiceSimLinkParams slow = { 500, 0, 0, 0, 0 };
+	XiceTurnServer *relay;
+	XiceTurnQueueStats stats;
+	XiceAgent *lagent, *ragent;
+	XiceAddress addr, left, right;
+	gchar buf[PAYLOAD];
+	guint i, refused = 0;
+
+	set_address(&addr, "10.0.0.100", 3478);
+	relay = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(relay != NULL);
+	xice_turn_server_add_user(relay, "user", "pass");
+
+	set_address(&left, "10.0.0.1", 0);
+	set_address(&right, "10.0.0.2", 0);
+	xice_sim_network_set_link(net, &left, &right, &blocked);
+	xice_sim_network_set_link(net, &right, &left, &blocked);
+
+	lagent = agent_new(ctx, "10.0.0.1", TRUE);
+	ragent = agent_new(ctx, "10.0.0.2", FALSE);
+	xice_sim_network_run_for(net, 5000);
+	exchange(lagent, ragent);
+	exchange(ragent, lagent);
+	xice_sim_network_run_for(net, 30000);
+	g_assert(ready == 2);
+
+	xice_sim_network_set_link(net, &left, &addr, &slow);
+	xice_sim_network_set_link(net, &addr, &left, &slow);
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < 300000 / 20 && transport_writable == 0; i++) {
+		if (xice_agent_send(lagent, 1, 1, sizeof(buf), buf) < 0)
+			refused++;
+		xice_sim_network_run_for(net, 20);
+	}
+	g_assert(refused > 0);
+	g_assert(transport_writable == 1);
+	g_assert(xice_agent_send(lagent, 1, 1, sizeof(buf), buf) ==
+		sizeof(buf));
+
+	g_assert(xice_agent_get_turn_queue_stats(lagent, 1, 1, &stats));
+	g_assert(stats.packets_dropped == refused);
+	g_assert(stats.bytes_pending == 0);
+
+	g_object_unref(lagent);
+	g_object_unref(ragent);
+	xice_turn_server_free(relay);
+}
+
+int
+main(void)
+{
+	XiceSimLinkParams params = { 10, 0, 0, 0, 0 };
+	XiceContext *ctx;
+	XiceSocket *base, *sock_a, *sock_b;
+	XiceAddress addr, peer_a, peer_b;
+	guint64 queued, dropped, pending;
+	guint per_packet;
+
+	g_type_init();
+
+	net = xice_sim_network_new(1);
+	xice_sim_network_set_default_link(net, &params);
+	ctx = xice_context_create("sim", net);
+	delivered = g_array_new(FALSE, FALSE, sizeof(guint8));
+
+	set_address(&addr, "10.0.0.100", 3478);
+	server = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(server != NULL);
+	xice_turn_server_add_user(server, "user", "pass");
+	xice_turn_server_set_filter(server, filter, NULL);
+
+	set_address(&addr, "10.0.0.1", 0);
+	base = xice_create_udp_socket(ctx, &addr);
+	turn = allocate(ctx, base, xice_turn_server_get_address(server));
+	xice_socket_set_callback(base, base_cb, NULL);
+	xice_socket_set_callback(turn, turn_cb, NULL);
+	set_address(&peer_a, "10.1.0.1", 40000);
+	set_address(&peer_b, "10.1.0.2", 40000);
+	sock_a = xice_create_udp_socket(ctx, &peer_a);
+	sock_b = xice_create_udp_socket(ctx, &peer_b);
+	xice_socket_set_callback(sock_a, peer_cb, NULL);
+	xice_socket_set_callback(sock_b, peer_cb, NULL);
+
+	/* the newest packets are refused once the queue is full */
+	xice_turn_socket_set_queue_size(turn, QUEUE_SIZE,
+		XICE_TURN_SOCKET_DROP_NEWEST);
+	g_assert(send_packets(&peer_a) == 4);
+	xice_turn_socket_get_queue_stats(turn, &queued, &dropped, &pending);
+	g_assert(queued == 4 && dropped == PACKETS - 4);
+	g_assert(pending > 0 && pending <= QUEUE_SIZE);
+	per_packet = pending / 4;
+
+	xice_sim_network_run_for(net, 100);
+	g_assert(n_held == 1);
+	g_assert(delivered->len == 0);
+	g_assert(writable == 0);
+
+	answer_permissions();
+	xice_sim_network_run_for(net, 100);
+	g_assert(delivered->len == 4);
+	g_assert(g_array_index(delivered, guint8, 0) == 0);
+	g_assert(g_array_index(delivered, guint8, 3) == 3);
+	g_assert(writable == 1);
+	g_assert(xice_address_equal(&writable_peer, &peer_a));
+	xice_turn_socket_get_queue_stats(turn, &queued, &dropped, &pending);
+	g_assert(pending == 0);
+
+	/* no queueing once the permission is installed */
+	g_assert(send_packets(&peer_a) == PACKETS);
+	xice_sim_network_run_for(net, 100);
+	g_assert(delivered->len == 4 + PACKETS);
+	g_array_set_size(delivered, 0);
+
+	/* the oldest packets make room for the new ones */
+	xice_turn_socket_set_queue_size(turn, QUEUE_SIZE,
+		XICE_TURN_SOCKET_DROP_OLDEST);
+	g_assert(send_packets(&peer_b) == PACKETS);
+	xice_turn_socket_get_queue_stats(turn, &queued, &dropped, &pending);
+	g_assert(queued == 4 + PACKETS);
+	g_assert(dropped == 2 * (PACKETS - 4));
+	g_assert(pending == 4 * per_packet);
+
+	xice_sim_network_run_for(net, 100);
+	answer_permissions();
+	xice_sim_network_run_for(net, 100);
+	g_assert(delivered->len == 4);
+	g_assert(g_array_index(delivered, guint8, 0) == PACKETS - 4);
+	g_assert(g_array_index(delivered, guint8, 3) == PACKETS - 1);
+	g_assert(writable == 2);
+	g_assert(xice_address_equal(&writable_peer, &peer_b));
+
+	xice_socket_free(turn);
+	xice_socket_free(base);
+	xice_socket_free(sock_a);
+	xice_socket_free(sock_b);
+	xice_turn_server_free(server);
+	g_array_free(delivered, TRUE);
+
+	agent_backpressure(ctx);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "socket/turnserver.h"
+#include "stun/stunagent.h"
+
+/* A TURN server listening on UDP and TCP, whose UDP side answers, stays
+ * silent, refuses the allocations or answers late. The TCP connections
+ * come from the unspecified address in the simulation, so that the links
+ * of each agent only slow down or block UDP. An agent racing
+ * its relays must get the UDP one without ever trying TCP when UDP works,
+ * and the TCP one soon after its head start, or at once once UDP failed,
+ * when it does not. A late UDP relay still comes, above the TCP one. The
+ * TCP connections of a lost race are closed, and an allocation got on one
+ * after the race was won is released. */
+
+#define RACE_DELAY 200
+#define HOLD_MS 300
+
+typedef enum {
+	UDP_ANSWER,
+	UDP_SILENT,
+	UDP_REFUSE,
+	UDP_HOLD
+} UdpMode;
+
+static XiceSimNetwork *net;
+static XiceContext *ctx;
+static XiceTurnServer *server;
+static UdpMode udp_mode;
+static guint tcp_requests;
+static guint tcp_released;
+static guint64 tcp_closed;      /* before the agent */
+static gboolean tcp_hold;
+static gint64 start, relay_time, done_time;
+
+static gboolean
+held_cb(XiceTimer *timer, gpointer data)
+{
+	xice_turn_server_answer_held(server);
+	xice_timer_destroy(timer);
+	return FALSE;
+}
+
+/* counts the TCP allocations, refuses the UDP ones or holds the TCP ones
+ * as the agent asks */
+static XiceTurnServerVerdict
+filter(XiceTurnServer *server, const XiceAddress *client, gboolean tcp,
+	StunMessage *msg, gpointer data)
+{
+	XiceTimer *timer;
+	uint32_t lifetime;
+
+	if (tcp && stun_message_get_method(msg) == STUN_REFRESH &&
+		stun_message_find32(msg, STUN_ATTRIBUTE_LIFETIME, &lifetime) ==
+		STUN_MESSAGE_RETURN_SUCCESS && lifetime == 0)
+		tcp_released++;
+	if (stun_message_get_method(msg) != STUN_ALLOCATE)
+		return XICE_TURN_SERVER_ANSWER;
+	if (!tcp)
+		return udp_mode == UDP_REFUSE ? XICE_TURN_SERVER_REFUSE :
+			XICE_TURN_SERVER_ANSWER;
+
+	tcp_requests++;
+	if (!tcp_hold)
+		return XICE_TURN_SERVER_ANSWER;
+	timer = xice_create_timer(ctx, 2 * HOLD_MS, held_cb, NULL);
+	xice_timer_start(timer);
+	return XICE_TURN_SERVER_HOLD;
+}
+
+static guint64
+tcp_closed_since(void)
+{
+	XiceTurnServerStats stats;
+
+	xice_turn_server_get_stats(server, &stats);
+	return stats.tcp_closed - tcp_closed;
+}
+
+static void
+set_address(XiceAddress *addr, const gchar *ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_from_string(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+static GSList *
+find_relays(XiceAgent *agent, XiceRelayType type)
+{
+	GSList *cands = xice_agent_get_local_candidates(agent, 1, 1);
+	GSList *i, *relays = NULL;
+
+	for (i = cands; i; i = i->next) {
+		XiceCandidate *cand = i->data;
+
+		if (cand->type == XICE_CANDIDATE_TYPE_RELAYED &&
+			cand->turn->type == type)
+			relays = g_slist_prepend(relays, xice_candidate_copy(cand));
+	}
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+
+	return relays;
+}
+
+static void
+cb_new_candidate(XiceAgent *agent, guint stream_id, guint component_id,
+	gchar *foundation, gpointer data)
+{
+	GSList *cands = xice_agent_get_local_candidates(agent, 1, 1);
+	GSList *i;
+
+	for (i = cands; i; i = i->next) {
+		XiceCandidate *cand = i->data;
+
+		if (cand->type == XICE_CANDIDATE_TYPE_RELAYED && relay_time == 0)
+			relay_time = xice_sim_network_get_time(net) - start;
+	}
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+}
+
+static void
+cb_gathering_done(XiceAgent *agent, guint stream_id, gpointer data)
+{
+	done_time = xice_sim_network_get_time(net) - start;
+}
+
+static void
+cb_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+}
+
+static XiceAgent *
+agent_new(const gchar *ip, UdpMode mode, gboolean hold, guint race_delay)
+{
+	XiceSimLinkParams blocked = { 10, 0, 1.0, 0, 0 };
+	XiceSimLinkParams slow = { HOLD_MS, 0, 0, 0, 0 };
+	XiceAgent *agent = xice_agent_new(ctx, XICE_COMPATIBILITY_RFC5245);
+	XiceTurnServerStats stats;
+	XiceAddress addr;
+
+	/* the previous agent released its allocations on the way out */
+	xice_sim_network_run_for(net, 100);
+
+	set_address(&addr, ip, 0);
+	if (mode == UDP_SILENT)
+		xice_sim_network_set_link(net, &addr,
+			xice_turn_server_get_address(server), &blocked);
+	else if (mode == UDP_HOLD)
+		xice_sim_network_set_link(net, xice_turn_server_get_address(server),
+			&addr, &slow);
+
+	udp_mode = mode;
+	tcp_hold = hold;
+	tcp_requests = tcp_released = 0;
+	xice_turn_server_get_stats(server, &stats);
+	tcp_closed = stats.tcp_closed;
+	relay_time = done_time = 0;
+	start = xice_sim_network_get_time(net);
+
+	g_object_set(G_OBJECT(agent), "turn-race-delay", race_delay, NULL);
+	g_signal_connect(G_OBJECT(agent), "new-candidate",
+		G_CALLBACK(cb_new_candidate), NULL);
+	g_signal_connect(G_OBJECT(agent), "candidate-gathering-done",
+		G_CALLBACK(cb_gathering_done), NULL);
+
+	xice_agent_add_local_address(agent, &addr);
+	xice_agent_add_stream(agent, 1);
+	xice_agent_attach_recv(agent, 1, 1, cb_recv, NULL);
+	/* listed TCP first: the order does not matter when racing */
+	xice_agent_set_relay_info(agent, 1, 1, "10.0.0.100", 3478, "user",
+		"pass", XICE_RELAY_TYPE_TURN_TCP);
+	xice_agent_set_relay_info(agent, 1, 1, "10.0.0.100", 3478, "user",
+		"pass", XICE_RELAY_TYPE_TURN_UDP);
+	xice_agent_gather_candidates(agent, 1);
+
+	return agent;
+}
+
+static guint
+count_relays(XiceAgent *agent, XiceRelayType type)
+{
+	GSList *relays = find_relays(agent, type);
+	guint n = g_slist_length(relays);
+
+	g_slist_free_full(relays, (GDestroyNotify)xice_candidate_free);
+	return n;
+}
+
+int
+main(void)
+{
+	XiceSimLinkParams params = { 10, 0, 0, 0, 0 };
+	XiceAgent *agent;
+	XiceAddress addr;
+	GSList *udp, *tcp;
+
+	g_type_init();
+
+	net = xice_sim_network_new(1);
+	xice_sim_network_set_default_link(net, &params);
+	ctx = xice_context_create("sim", net);
+
+	set_address(&addr, "10.0.0.100", 3478);
+	server = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(server != NULL);
+	xice_turn_server_add_user(server, "user", "pass");
+	xice_turn_server_set_filter(server, filter, NULL);
+	g_assert(xice_turn_server_listen_tcp(server));
+
+	/* UDP works: TCP is never tried, and the gathering is over at once */
+	agent = agent_new("10.0.0.1", UDP_ANSWER, FALSE, RACE_DELAY);
+	xice_sim_network_run_for(net, 10000);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_UDP) == 1);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_TCP) == 0);
+	g_assert(tcp_requests == 0);
+	g_assert(tcp_closed_since() == 1);
+	g_assert(relay_time > 0 && relay_time < RACE_DELAY * 1000);
+	g_assert(done_time > 0 && done_time < RACE_DELAY * 1000);
+	g_object_unref(agent);
+
+	/* UDP is blocked: TCP takes over after its head start */
+	agent = agent_new("10.0.0.2", UDP_SILENT, FALSE, RACE_DELAY);
+	xice_sim_network_run_for(net, 10000);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_UDP) == 0);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_TCP) == 1);
+	g_assert(relay_time >= RACE_DELAY * 1000);
+	g_assert(relay_time < (RACE_DELAY + 200) * 1000);
+	g_assert(done_time > 0);
+	g_object_unref(agent);
+
+	/* UDP is refused: TCP starts without waiting */
+	agent = agent_new("10.0.0.3", UDP_REFUSE, FALSE, 10 * RACE_DELAY);
+	xice_sim_network_run_for(net, 10000);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_UDP) == 0);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_TCP) == 1);
+	g_assert(relay_time > 0 && relay_time < RACE_DELAY * 1000);
+	g_object_unref(agent);
+
+	/* UDP is slow: TCP comes first, and UDP still comes, above it */
+	agent = agent_new("10.0.0.4", UDP_HOLD, FALSE, RACE_DELAY);
+	xice_sim_network_run_for(net, 10000);
+	udp = find_relays(agent, XICE_RELAY_TYPE_TURN_UDP);
+	tcp = find_relays(agent, XICE_RELAY_TYPE_TURN_TCP);
+	g_assert(g_slist_length(udp) == 1 && g_slist_length(tcp) == 1);
+	g_assert(relay_time < 2 * HOLD_MS * 1000);
+	g_assert(((XiceCandidate *)udp->data)->priority >
+		((XiceCandidate *)tcp->data)->priority);
+	g_slist_free_full(udp, (GDestroyNotify)xice_candidate_free);
+	g_slist_free_full(tcp, (GDestroyNotify)xice_candidate_free);
+	g_object_unref(agent);
+
+	/* UDP wins while the TCP allocation is on its way: it is released */
+	agent = agent_new("10.0.0.5", UDP_HOLD, TRUE, RACE_DELAY);
+	xice_sim_network_run_for(net, 10000);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_UDP) == 1);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_TCP) == 0);
+	g_assert(tcp_requests == 1);
+	g_assert(tcp_released == 1);
+	g_assert(tcp_closed_since() == 1);
+	g_assert(done_time > 0);
+	g_object_unref(agent);
+
+	/* without racing both are gathered, as listed */
+	agent = agent_new("10.0.0.6", UDP_ANSWER, FALSE, 0);
+	xice_sim_network_run_for(net, 10000);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_UDP) == 1);
+	g_assert(count_relays(agent, XICE_RELAY_TYPE_TURN_TCP) == 1);
+	g_assert(tcp_requests > 0);
+	g_assert(tcp_closed_since() == 0);
+	g_object_unref(agent);
+
+	xice_sim_network_run_for(net, 1000);
+	xice_turn_server_free(server);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "socket/turn.h"
+#include "socket/turnserver.h"
+#include "stun/stunagent.h"
+#include "stun/usages/turn.h"
+
+/* A TURN server that grants all the Refresh, ChannelBind and
+ * CreatePermission requests. The bindings made together on a relay must be
+ * renewed before they expire, all at once and along with the allocation,
+ * and the permissions installed again once they have timed out, without a
+ * timer per binding waking the socket up. The allocation is released when
+ * the socket is freed. */
+
+#define PEERS 100
+#define BIND_INTERVAL 20        /* ms between two new bindings */
+#define BINDING_LIFETIME 600    /* s */
+#define PERMISSION_LIFETIME 300 /* s */
+
+static XiceSimNetwork *net;
+static XiceTurnServer *server;
+static XiceSocket *turn;
+static uint8_t answer[STUN_MAX_MESSAGE_SIZE];
+static guint answer_len;
+static XiceAddress peers[PEERS];
+static guint binds[PEERS];
+static gint64 last_bind[PEERS];
+static gint64 first_renewal, last_renewal;
+static guint permissions;
+static guint refreshes;
+static gboolean released;
+
+static gint
+find_peer(const XiceAddress *peer)
+{
+	guint i;
+
+	for (i = 0; i < PEERS; i++)
+		if (xice_address_equal(&peers[i], peer))
+			return i;
+	return -1;
+}
+
+/* follows the requests the server is about to answer */
+static XiceTurnServerVerdict
+filter(XiceTurnServer *server, const XiceAddress *client, gboolean tcp,
+	StunMessage *msg, gpointer data)
+{
+	struct sockaddr_storage sa;
+	socklen_t sa_len = sizeof(sa);
+	XiceAddress peer;
+	gint64 now = xice_sim_network_get_time(net);
+	uint32_t lifetime = BINDING_LIFETIME;
+	gint i;
+
+	if (stun_message_get_method(msg) == STUN_CHANNELBIND) {
+		g_assert(stun_message_find_xor_addr(msg, STUN_ATTRIBUTE_PEER_ADDRESS,
+			(struct sockaddr *)&sa, &sa_len) == STUN_MESSAGE_RETURN_SUCCESS);
+		xice_address_set_from_sockaddr(&peer, (struct sockaddr *)&sa);
+		i = find_peer(&peer);
+		g_assert(i >= 0);
+
+		/* the binding is renewed before it expires */
+		if (binds[i] > 0)
+			g_assert(now - last_bind[i] < BINDING_LIFETIME * G_USEC_PER_SEC);
+		if (binds[i] == 1) {
+			if (first_renewal == 0)
+				first_renewal = now;
+			last_renewal = MAX(last_renewal, now);
+		}
+		binds[i]++;
+		last_bind[i] = now;
+	} else if (stun_message_get_method(msg) == STUN_CREATEPERMISSION) {
+		permissions++;
+	} else if (stun_message_get_method(msg) == STUN_REFRESH) {
+		stun_message_find32(msg, STUN_ATTRIBUTE_LIFETIME, &lifetime);
+		if (lifetime == 0)
+			released = TRUE;
+		else
+			refreshes++;
+	}
+
+	return XICE_TURN_SERVER_ANSWER;
+}
+
+/* like the agent does for packets from its TURN servers */
+static gboolean
+base_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	XiceSocket *from_sock = sock;
+
+	if (condition == XICE_SOCKET_READABLE)
+		xice_turn_socket_parse_recv(turn, &from_sock, from, len, buf, from,
+			buf, len);
+	return TRUE;
+}
+
+static gboolean
+answer_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	if (condition == XICE_SOCKET_READABLE && len <= sizeof(answer)) {
+		memcpy(answer, buf, len);
+		answer_len = len;
+	}
+	return TRUE;
+}
+
+/* Allocates from @base as the agent does, and returns the TURN socket
+ * over the allocation, with the realm and nonce of the challenge so that
+ * the server need not challenge its requests */
+static XiceSocket *
+allocate(XiceContext *ctx, XiceSocket *base, const XiceAddress *server_addr)
+{
+	StunDefaultValidaterData creds[] = {
+		{ (uint8_t *)"user", 4, (uint8_t *)"pass", 4 },
+		{ NULL, 0, NULL, 0 }
+	};
+	StunAgent agent;
+	StunMessage req, challenge, resp;
+	uint8_t buf[STUN_MAX_MESSAGE_SIZE], chal_buf[STUN_MAX_MESSAGE_SIZE];
+	struct sockaddr_storage relayed, mapped, alternate;
+	socklen_t relayed_len = sizeof(relayed), mapped_len = sizeof(mapped);
+	socklen_t alternate_len = sizeof(alternate);
+	uint32_t bandwidth, lifetime;
+	XiceAddress relayed_addr, turn_addr = *server_addr;
+	XiceSocket *sock;
+	size_t len;
+
+	stun_agent_init(&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+		STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+	xice_socket_set_callback(base, answer_cb, NULL);
+
+	len = stun_usage_turn_create(&agent, &req, buf, sizeof(buf), NULL,
+		STUN_USAGE_TURN_REQUEST_PORT_NORMAL, -1, -1,
+		(uint8_t *)"user", 4, (uint8_t *)"pass", 4,
+		STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+	answer_len = 0;
+	xice_socket_send(base, server_addr, len, (gchar *)buf);
+	xice_sim_network_run_for(net, 100);
+	memcpy(chal_buf, answer, answer_len);
+	g_assert(stun_agent_validate(&agent, &challenge, chal_buf, answer_len,
+		stun_agent_default_validater, creds) == STUN_VALIDATION_SUCCESS);
+
+	len = stun_usage_turn_create(&agent, &req, buf, sizeof(buf), &challenge,
+		STUN_USAGE_TURN_REQUEST_PORT_NORMAL, -1, -1,
+		(uint8_t *)"user", 4, (uint8_t *)"pass", 4,
+		STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+	answer_len = 0;
+	xice_socket_send(base, server_addr, len, (gchar *)buf);
+	xice_sim_network_run_for(net, 100);
+	g_assert(stun_agent_validate(&agent, &resp, answer, answer_len,
+		stun_agent_default_validater, creds) == STUN_VALIDATION_SUCCESS);
+	g_assert(stun_usage_turn_process(&resp,
+		(struct sockaddr *)&relayed, &relayed_len,
+		(struct sockaddr *)&mapped, &mapped_len,
+		(struct sockaddr *)&alternate, &alternate_len,
+		&bandwidth, &lifetime, STUN_USAGE_TURN_COMPATIBILITY_RFC5766) ==
+		STUN_USAGE_TURN_RETURN_MAPPED_SUCCESS);
+
+	xice_address_init(&relayed_addr);
+	xice_address_set_from_sockaddr(&relayed_addr, (struct sockaddr *)&relayed);
+	sock = xice_turn_socket_new(ctx, &relayed_addr, base, &turn_addr,
+		"user", "pass", XICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+	xice_turn_socket_set_realm_nonce(sock, &challenge);
+
+	return sock;
+}
+
+static void
+set_address(XiceAddress *addr, const gchar *ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_from_string(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+static guint64
+timers_fired(void)
+{
+	XiceSimStats stats;
+
+	xice_sim_network_get_stats(net, &stats);
+	return stats.timers_fired;
+}
+
+int
+main(void)
+{
+	XiceSimLinkParams params = { 10, 0, 0, 0, 0 };
+	XiceContext *ctx;
+	XiceSocket *base;
+	XiceTurnServerStats stats;
+	XiceAddress addr, other;
+	guint64 fired;
+	gchar ip[32];
+	guint i;
+
+	g_type_init();
+
+	net = xice_sim_network_new(1);
+	xice_sim_network_set_default_link(net, &params);
+	ctx = xice_context_create("sim", net);
+
+	set_address(&addr, "10.0.0.100", 3478);
+	server = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(server != NULL);
+	xice_turn_server_add_user(server, "user", "pass");
+	xice_turn_server_set_filter(server, filter, NULL);
+
+	set_address(&addr, "10.0.0.1", 0);
+	base = xice_create_udp_socket(ctx, &addr);
+	turn = allocate(ctx, base, xice_turn_server_get_address(server));
+	xice_socket_set_callback(base, base_cb, NULL);
+	xice_turn_socket_refresh_allocation(turn, NULL, BINDING_LIFETIME);
+
+	/* the bindings are made a little apart */
+	for (i = 0; i < PEERS; i++) {
+		g_snprintf(ip, sizeof(ip), "10.1.%u.%u", i / 200, i % 200 + 1);
+		set_address(&peers[i], ip, 40000);
+		g_assert(xice_turn_socket_set_peer(turn, &peers[i]));
+		xice_sim_network_run_for(net, BIND_INTERVAL);
+	}
+	xice_sim_network_run_for(net, 1000);
+	for (i = 0; i < PEERS; i++)
+		g_assert(binds[i] == 1);
+
+	/* a peer without a binding needs a permission */
+	set_address(&other, "10.2.0.1", 40000);
+	g_assert(xice_socket_send(turn, &other, 4, "data"));
+	xice_sim_network_run_for(net, 1000);
+	g_assert(permissions == 1);
+
+	/* the bindings are renewed together with the allocation, twice, and
+	 * the permission is installed again once it has timed out */
+	fired = timers_fired();
+	xice_sim_network_run_for(net, (2 * BINDING_LIFETIME - 60) * 1000);
+	g_assert(xice_socket_send(turn, &other, 4, "data"));
+	xice_sim_network_run_for(net, 1000);
+	for (i = 0; i < PEERS; i++)
+		g_assert(binds[i] == 3);
+	/* made over two seconds, renewed at once */
+	g_assert(last_renewal - first_renewal < BIND_INTERVAL * 1000);
+	g_assert(permissions == 2);
+	g_assert(refreshes == 2);
+	g_assert(timers_fired() - fired < 10);
+
+	xice_socket_free(turn);
+	xice_sim_network_run_for(net, 1000);
+	g_assert(released);
+	xice_turn_server_get_stats(server, &stats);
+	g_assert(stats.allocations == 0);
+	xice_socket_free(base);
+	xice_turn_server_free(server);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+
+	return 0;
+}
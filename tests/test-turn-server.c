@@ -0,0 +1,283 @@
+/*
+* This file is part of the Xice GLib ICE library.
+*
+* The contents of this file are subject to the Mozilla Public License Version
+* 1.1 (the "License"); you may not use this file except in compliance with
+* the License. You may obtain a copy of the License at
+* http://www.mozilla.org/MPL/
+*
+* Software distributed under the License is distributed on an "AS IS" basis,
+* WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+* for the specific language governing rights and limitations under the
+* License.
+*
+* The Original Code is the Xice GLib ICE library.
+*
+* Alternatively, the contents of this file may be used under the terms of the
+* the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+* case the provisions of LGPL are applicable instead of those above. If you
+* wish to allow use of your version of this file only under the terms of the
+* LGPL and not to allow others to use your version of this file under the
+* MPL, indicate your decision by deleting the provisions above and replace
+* them with the notice and other provisions required by the LGPL. If you do
+* not delete the provisions above, a recipient may use your version of this
+* file under either the MPL or the LGPL.
+*/
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <xice/xice.h>
+#include "contexts/simcontext.h"
+#include "socket/turnserver.h"
+#include "stun/usages/bind.h"
+
+/* Two agents which cannot reach each other directly, one relaying through
+ * the in-process TURN server over UDP and the other over TCP, must connect
+ * and exchange data through their relays. The server challenges them,
+ * refuses a wrong password, binds channels, and drops the allocations once
+ * the agents are gone. When the server refuses a stale nonce with a 401
+ * rather than a 438, the allocations, permissions and channels are still
+ * refreshed. On a real context the server accepts TCP clients itself. */
+
+#define PACKETS 100
+
+static XiceSimNetwork *net;
+static guint ready;
+static guint received;
+
+static void
+set_address(XiceAddress *addr, const gchar *ip, guint port)
+{
+	xice_address_init(addr);
+	xice_address_set_from_string(addr, ip);
+	xice_address_set_port(addr, port);
+}
+
+static guint
+count_relays(XiceAgent *agent)
+{
+	GSList *cands = xice_agent_get_local_candidates(agent, 1, 1);
+	GSList *i;
+	guint n = 0;
+
+	for (i = cands; i; i = i->next)
+		if (((XiceCandidate *)i->data)->type == XICE_CANDIDATE_TYPE_RELAYED)
+			n++;
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+
+	return n;
+}
+
+static void
+cb_component_state_changed(XiceAgent *agent, guint stream_id,
+	guint component_id, guint state, gpointer data)
+{
+	if (state == XICE_COMPONENT_STATE_READY)
+		ready++;
+}
+
+static void
+cb_recv(XiceAgent *agent, guint stream_id, guint component_id,
+	guint len, gchar *buf, gpointer data)
+{
+	if (len == 16 && memcmp(buf, "1234567812345678", 16) == 0)
+		received++;
+}
+
+static void
+exchange(XiceAgent *from, XiceAgent *to)
+{
+	gchar *ufrag = NULL, *pwd = NULL;
+	GSList *cands;
+
+	xice_agent_get_local_credentials(from, 1, &ufrag, &pwd);
+	xice_agent_set_remote_credentials(to, 1, ufrag, pwd);
+	g_free(ufrag);
+	g_free(pwd);
+
+	cands = xice_agent_get_local_candidates(from, 1, 1);
+	xice_agent_set_remote_candidates(to, 1, 1, cands);
+	g_slist_free_full(cands, (GDestroyNotify)xice_candidate_free);
+}
+
+typedef struct {
+	StunAgent agent;
+	gboolean answered;
+} LoopbackClient;
+
+static gboolean
+loopback_cb(XiceSocket *sock, XiceSocketCondition condition, gpointer data,
+	gchar *buf, guint len, XiceAddress *from)
+{
+	LoopbackClient *client = data;
+	StunMessage msg;
+
+	if (condition == XICE_SOCKET_READABLE &&
+		stun_agent_validate(&client->agent, &msg, (uint8_t *)buf, len,
+			NULL, NULL) == STUN_VALIDATION_SUCCESS &&
+		stun_message_get_class(&msg) == STUN_RESPONSE &&
+		stun_message_get_method(&msg) == STUN_BINDING)
+		client->answered = TRUE;
+	return TRUE;
+}
+
+/* A Binding request over a loopback TCP connection to a server listening
+ * on a GIO context is answered */
+static void
+loopback_tcp(void)
+{
+	GMainContext *main_ctx = g_main_context_new();
+	XiceContext *ctx = xice_context_create("gio", main_ctx);
+	XiceTurnServer *server;
+	XiceSocket *sock;
+	XiceAddress addr;
+	LoopbackClient client = { { 0 }, FALSE };
+	StunMessage msg;
+	uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+	size_t len;
+	gint64 deadline = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+
+	set_address(&addr, "127.0.0.1", 0);
+	server = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(server != NULL);
+	g_assert(xice_turn_server_listen_tcp(server));
+
+	addr = *xice_turn_server_get_address(server);
+	sock = xice_create_tcp_socket(ctx, &addr);
+	g_assert(sock != NULL);
+	xice_socket_set_callback(sock, loopback_cb, &client);
+
+	stun_agent_init(&client.agent, STUN_ALL_KNOWN_ATTRIBUTES,
+		STUN_COMPATIBILITY_RFC5389, 0);
+	len = stun_usage_bind_create(&client.agent, &msg, buf, sizeof(buf));
+	g_assert(xice_socket_send(sock, &addr, len, (gchar *)buf));
+
+	while (!client.answered && g_get_monotonic_time() < deadline) {
+		if (!g_main_context_iteration(main_ctx, FALSE))
+			g_usleep(1000);
+	}
+	g_assert(client.answered);
+
+	xice_socket_free(sock);
+	xice_turn_server_free(server);
+	xice_context_destroy(ctx);
+	g_main_context_unref(main_ctx);
+}
+
+static XiceAgent *
+agent_new(XiceContext *ctx, const gchar *ip, const gchar *password,
+	XiceRelayType type, gboolean controlling)
+{
+	XiceAgent *agent = xice_agent_new(ctx, XICE_COMPATIBILITY_RFC5245);
+	XiceAddress addr;
+
+	g_object_set(G_OBJECT(agent), "controlling-mode", controlling, NULL);
+	g_signal_connect(G_OBJECT(agent), "component-state-changed",
+		G_CALLBACK(cb_component_state_changed), NULL);
+
+	set_address(&addr, ip, 0);
+	xice_agent_add_local_address(agent, &addr);
+	xice_agent_add_stream(agent, 1);
+	xice_agent_attach_recv(agent, 1, 1, cb_recv, NULL);
+	xice_agent_set_relay_info(agent, 1, 1, "10.0.0.100", 3478, "user",
+		password, type);
+	xice_agent_gather_candidates(agent, 1);
+
+	return agent;
+}
+
+int
+main(void)
+{
+	XiceSimLinkParams params = { 10, 0, 0, 0, 0 };
+	XiceSimLinkParams blocked = { 10, 0, 1.0, 0, 0 };
+	XiceContext *ctx;
+	XiceTurnServer *server;
+	XiceTurnServerStats stats;
+	XiceAgent *lagent, *ragent, *wrong;
+	XiceAddress addr, left, right;
+	guint i;
+
+	g_type_init();
+
+	loopback_tcp();
+
+	net = xice_sim_network_new(1);
+	xice_sim_network_set_default_link(net, &params);
+	ctx = xice_context_create("sim", net);
+
+	set_address(&addr, "10.0.0.100", 3478);
+	server = xice_turn_server_new(ctx, &addr, "test");
+	g_assert(server != NULL);
+	g_assert(xice_address_equal(xice_turn_server_get_address(server), &addr));
+	xice_turn_server_add_user(server, "user", "pass");
+	g_assert(xice_turn_server_listen_tcp(server));
+
+	/* the agents only see each other through the server */
+	set_address(&left, "10.0.0.1", 0);
+	set_address(&right, "10.0.0.2", 0);
+	xice_sim_network_set_link(net, &left, &right, &blocked);
+	xice_sim_network_set_link(net, &right, &left, &blocked);
+
+	lagent = agent_new(ctx, "10.0.0.1", "pass", XICE_RELAY_TYPE_TURN_UDP,
+		TRUE);
+	ragent = agent_new(ctx, "10.0.0.2", "pass", XICE_RELAY_TYPE_TURN_TCP,
+		FALSE);
+	wrong = agent_new(ctx, "10.0.0.3", "word", XICE_RELAY_TYPE_TURN_UDP,
+		FALSE);
+	xice_sim_network_run_for(net, 5000);
+	g_assert(count_relays(lagent) == 1);
+	g_assert(count_relays(ragent) == 1);
+	g_assert(count_relays(wrong) == 0);
+	xice_turn_server_get_stats(server, &stats);
+	g_assert(stats.allocations == 2);
+	g_assert(stats.challenges >= 3);
+	g_object_unref(wrong);
+
+	exchange(lagent, ragent);
+	exchange(ragent, lagent);
+	xice_sim_network_run_for(net, 30000);
+	g_assert(ready >= 2);
+
+	for (i = 0; i < PACKETS; i++) {
+		g_assert(xice_agent_send(lagent, 1, 1, 16, "1234567812345678") == 16);
+		g_assert(xice_agent_send(ragent, 1, 1, 16, "1234567812345678") == 16);
+		xice_sim_network_run_for(net, 20);
+	}
+	xice_sim_network_run_for(net, 1000);
+	g_assert(received == 2 * PACKETS);
+
+	xice_turn_server_get_stats(server, &stats);
+	g_assert(stats.permissions > 0);
+	g_assert(stats.channel_binds > 0);
+	/* each packet went through a relay at least once */
+	g_assert(stats.packets_to_peers + stats.packets_from_peers >=
+		2 * PACKETS);
+	g_assert(stats.channel_data_to_peers > 0);
+	g_assert(stats.channel_data_from_peers > 0);
+
+	/* the refreshes carry the cached nonce and are refused once */
+	xice_turn_server_renew_nonce(server, STUN_ERROR_UNAUTHORIZED);
+	received = 0;
+	for (i = 0; i < 20; i++) {
+		g_assert(xice_agent_send(lagent, 1, 1, 16, "1234567812345678") == 16);
+		g_assert(xice_agent_send(ragent, 1, 1, 16, "1234567812345678") == 16);
+		xice_sim_network_run_for(net, 60000);
+	}
+	g_assert(received == 40);
+
+	/* the UDP allocation is released, the TCP one goes with its connection */
+	g_object_unref(lagent);
+	g_object_unref(ragent);
+	xice_sim_network_run_for(net, 2000);
+	xice_turn_server_get_stats(server, &stats);
+	g_assert(stats.allocations == 0);
+
+	xice_turn_server_free(server);
+	xice_context_destroy(ctx);
+	xice_sim_network_free(net);
+
+	return 0;
+}